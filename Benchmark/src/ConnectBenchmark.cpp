@@ -0,0 +1,415 @@
+/*++
+
+Module Name:
+
+    ConnectBenchmark.cpp
+
+Abstract:
+
+    Measures the latency of the control path from an application through
+    SlimeSocket to SlimeRouter. Launches a router on a temporary unix socket,
+    then runs this binary again with SlimeSocket.so preloaded to set up
+    loopback client/server pairs, timing socket, bind, listen, connect and
+    accept individually.
+
+--*/
+
+//
+// ---------------------------------------------------------------------- Includes
+//
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Error.h"
+
+//
+// ---------------------------------------------------------------------- Definitions
+//
+
+#define BENCHMARK_DEFAULT_ITERATIONS 2000
+#define BENCHMARK_WARMUP_ITERATIONS 50
+#define BENCHMARK_ROUTER_STARTUP_TIMEOUT std::chrono::seconds(10)
+#define BENCHMARK_WORKER_FLAG "--worker"
+#define BENCHMARK_VIRTUAL_NETWORK 0x7F010000 // 127.1.0.0
+
+// Must match the variables read by SlimeRouter and SlimeSocket
+#define ROUTER_PATH_VARIABLE "SLIME_ROUTER_PATH"
+#define MAPPING_TABLE_PATH_VARIABLE "SLIME_MAPPING_TABLE_PATH"
+#define MAPPING_STORE_PATH_VARIABLE "SLIME_MAPPING_STORE_PATH"
+
+using Clock = std::chrono::steady_clock;
+
+enum Operation
+{
+    OPERATION_SOCKET,
+    OPERATION_BIND,
+    OPERATION_LISTEN,
+    OPERATION_CONNECT,
+    OPERATION_ACCEPT,
+    OPERATION_MAX
+};
+
+static const char* OperationNames[OPERATION_MAX] =
+{
+    "socket",
+    "bind",
+    "listen",
+    "connect",
+    "accept"
+};
+
+//
+// ---------------------------------------------------------------------- Functions
+//
+
+static
+double
+Percentile(const std::vector<double>& SortedSamples,
+           double Fraction)
+{
+    size_t rank = (size_t)std::ceil(Fraction * SortedSamples.size());
+
+    return SortedSamples[std::min(SortedSamples.size() - 1, rank == 0 ? 0 : rank - 1)];
+}
+
+template<typename Function>
+static
+int
+Measure(std::vector<double>& Samples,
+        bool ShouldRecord,
+        Function Call)
+{
+    Clock::time_point start = Clock::now();
+    int result = Call();
+
+    if (ShouldRecord)
+    {
+        Samples.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+    }
+
+    return result;
+}
+
+static
+int
+RunWorker(int Iterations)
+/*++
+
+Routine Description:
+
+    Runs inside the process SlimeSocket is preloaded into. Every iteration
+sets up a listener and a connection to it over loopback, checks that a byte
+makes it across, and tears everything down again.
+
+--*/
+{
+    std::vector<double> samples[OPERATION_MAX];
+    struct sockaddr_in address;
+    socklen_t addressLength = 0;
+    Clock::time_point start;
+    double elapsed = 0;
+    int failures = 0;
+    char byte = 'x';
+
+    for (auto& operationSamples : samples)
+    {
+        operationSamples.reserve(Iterations);
+    }
+
+    for (int i = -BENCHMARK_WARMUP_ITERATIONS; i < Iterations; i++)
+    {
+        const bool shouldRecord = i >= 0;
+        int listener = -1;
+        int client = -1;
+        int server = -1;
+
+        if (i == 0)
+        {
+            start = Clock::now();
+        }
+
+        // Mappings outlive the sockets that created them, so every listener
+        // gets a virtual address of its own within 127.0.0.0/8
+        std::memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(BENCHMARK_VIRTUAL_NETWORK + BENCHMARK_WARMUP_ITERATIONS + i);
+        address.sin_port = 0;
+
+        listener = Measure(samples[OPERATION_SOCKET], shouldRecord, [&] {
+            return socket(AF_INET, SOCK_STREAM, 0);
+        });
+
+        if (listener < 0 ||
+            Measure(samples[OPERATION_BIND], shouldRecord, [&] {
+                return bind(listener, (struct sockaddr*)&address, sizeof(address));
+            }) != 0 ||
+            Measure(samples[OPERATION_LISTEN], shouldRecord, [&] {
+                return listen(listener, 16);
+            }) != 0)
+        {
+            LOG("Failed to set up listener! 0x%x\n", errno);
+            failures++;
+            goto Next;
+        }
+
+        // bind reports the virtual address the application bound to
+        addressLength = sizeof(address);
+        getsockname(listener, (struct sockaddr*)&address, &addressLength);
+
+        client = socket(AF_INET, SOCK_STREAM, 0);
+
+        if (client < 0 ||
+            Measure(samples[OPERATION_CONNECT], shouldRecord, [&] {
+                return connect(client, (struct sockaddr*)&address, sizeof(address));
+            }) != 0)
+        {
+            LOG("Failed to connect! 0x%x\n", errno);
+            failures++;
+            goto Next;
+        }
+
+        server = Measure(samples[OPERATION_ACCEPT], shouldRecord, [&] {
+            return accept(listener, NULL, NULL);
+        });
+
+        if (server < 0 ||
+            write(client, &byte, 1) != 1 ||
+            read(server, &byte, 1) != 1)
+        {
+            LOG("Failed to accept or exchange data! 0x%x\n", errno);
+            failures++;
+        }
+
+Next:
+        for (int fd : { server, client, listener })
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+        }
+    }
+
+    elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+    printf("%-8s %10s %10s %10s %12s\n", "op", "p50 (us)", "p99 (us)", "p999 (us)", "ops/s");
+
+    for (int operation = 0; operation < OPERATION_MAX; operation++)
+    {
+        std::vector<double>& operationSamples = samples[operation];
+        double total = 0;
+
+        if (operationSamples.empty())
+        {
+            continue;
+        }
+
+        std::sort(operationSamples.begin(), operationSamples.end());
+
+        for (double sample : operationSamples)
+        {
+            total += sample;
+        }
+
+        printf("%-8s %10.1f %10.1f %10.1f %12.0f\n",
+               OperationNames[operation],
+               Percentile(operationSamples, 0.50),
+               Percentile(operationSamples, 0.99),
+               Percentile(operationSamples, 0.999),
+               operationSamples.size() / (total / 1e6));
+    }
+
+    printf("%d connection setups in %.2f s (%.0f/s), %d failed\n",
+           Iterations,
+           elapsed,
+           Iterations / elapsed,
+           failures);
+
+    return failures == 0 ? 0 : 1;
+}
+
+static
+pid_t
+Spawn(const std::vector<std::string>& Arguments,
+      const std::string& LogPath,
+      bool ShouldLogOutput)
+{
+    std::vector<char*> argv;
+    pid_t pid = 0;
+    int logFd = -1;
+
+    for (const std::string& argument : Arguments)
+    {
+        argv.push_back(const_cast<char*>(argument.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    pid = fork();
+
+    if (pid == 0)
+    {
+        // Keep the log output of the router and SlimeSocket out of the results
+        logFd = open(LogPath.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (logFd >= 0)
+        {
+            dup2(logFd, STDERR_FILENO);
+
+            if (ShouldLogOutput)
+            {
+                dup2(logFd, STDOUT_FILENO);
+            }
+        }
+
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+
+    return pid;
+}
+
+static
+bool
+WaitForRouter(pid_t Router,
+              const std::string& RouterPath)
+{
+    Clock::time_point deadline = Clock::now() + BENCHMARK_ROUTER_STARTUP_TIMEOUT;
+    struct stat fileStat;
+    int status = 0;
+
+    while (Clock::now() < deadline)
+    {
+        if (waitpid(Router, &status, WNOHANG) == Router)
+        {
+            return false;
+        }
+
+        if (stat(RouterPath.c_str(), &fileStat) == 0 && S_ISSOCK(fileStat.st_mode))
+        {
+            return true;
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    return false;
+}
+
+static
+std::string
+GetAbsolutePath(const char* Path)
+{
+    char absolutePath[PATH_MAX];
+
+    return realpath(Path, absolutePath) != nullptr ? absolutePath : Path;
+}
+
+int
+main(int argc, char** argv)
+{
+    char directoryTemplate[] = "/tmp/slime-bench-XXXXXX";
+    std::string directory;
+    std::string routerPath;
+    std::string mappingTablePath;
+    std::string mappingStorePath;
+    std::string logPath;
+    std::string self;
+    std::string iterations;
+    pid_t router = -1;
+    pid_t worker = -1;
+    int status = 0;
+    int exitCode = 1;
+
+    if (argc >= 2 && std::strcmp(argv[1], BENCHMARK_WORKER_FLAG) == 0)
+    {
+        return RunWorker(argc >= 3 ? std::atoi(argv[2]) : BENCHMARK_DEFAULT_ITERATIONS);
+    }
+
+    if (argc < 3)
+    {
+        fprintf(stderr, "Usage: %s <SlimeRouter> <SlimeSocket.so> [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    iterations = argc >= 4 ? argv[3] : std::to_string(BENCHMARK_DEFAULT_ITERATIONS);
+
+    if (mkdtemp(directoryTemplate) == nullptr)
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    directory = directoryTemplate;
+    routerPath = directory + "/SlimeRouter.sock";
+    mappingTablePath = directory + "/SlimeRouter.map";
+    mappingStorePath = directory + "/SlimeRouter.store";
+    logPath = directory + "/benchmark.log";
+    self = GetAbsolutePath("/proc/self/exe");
+
+    setenv(ROUTER_PATH_VARIABLE, routerPath.c_str(), 1);
+    setenv(MAPPING_TABLE_PATH_VARIABLE, mappingTablePath.c_str(), 1);
+    setenv(MAPPING_STORE_PATH_VARIABLE, mappingStorePath.c_str(), 1);
+
+    router = Spawn({ GetAbsolutePath(argv[1]) }, logPath, true);
+    if (router < 0 || !WaitForRouter(router, routerPath))
+    {
+        fprintf(stderr, "SlimeRouter failed to start, see %s\n", logPath.c_str());
+        goto Cleanup;
+    }
+
+    setenv("LD_PRELOAD", GetAbsolutePath(argv[2]).c_str(), 1);
+    worker = Spawn({ self, BENCHMARK_WORKER_FLAG, iterations }, logPath, false);
+    unsetenv("LD_PRELOAD");
+
+    if (worker < 0 || waitpid(worker, &status, 0) != worker)
+    {
+        fprintf(stderr, "Failed to run the benchmark client!\n");
+        goto Cleanup;
+    }
+
+    if (WIFEXITED(status))
+    {
+        exitCode = WEXITSTATUS(status);
+    }
+
+Cleanup:
+    if (router > 0)
+    {
+        kill(router, SIGTERM);
+        waitpid(router, &status, 0);
+    }
+
+    if (exitCode == 0)
+    {
+        unlink(routerPath.c_str());
+        unlink(mappingTablePath.c_str());
+        unlink((mappingStorePath + ".snapshot").c_str());
+        unlink((mappingStorePath + ".log").c_str());
+        unlink((mappingStorePath + ".log.old").c_str());
+        unlink(logPath.c_str());
+        rmdir(directory.c_str());
+    }
+    else
+    {
+        fprintf(stderr, "Benchmark failed, logs are in %s\n", directory.c_str());
+    }
+
+    return exitCode;
+}
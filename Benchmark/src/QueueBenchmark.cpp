@@ -0,0 +1,241 @@
+/*++
+
+Module Name:
+
+    QueueBenchmark.cpp
+
+Abstract:
+
+    Measures the throughput of BlockingQueue between producer threads and a
+    single consumer, as used between the UDP listener and the gossip
+    protocol. Compares the original queue (copying push, one item per pop)
+    against move push, batched pops, a bounded queue and the lock-free
+    RingQueue.
+
+--*/
+
+//
+// ---------------------------------------------------------------------- Includes
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+
+#include "Error.h"
+#include "Message.h"
+#include "BlockingQueue.h"
+#include "RingQueue.h"
+
+//
+// ---------------------------------------------------------------------- Definitions
+//
+
+#define BENCHMARK_ITEM_COUNT 2000000
+#define BENCHMARK_BODY_SIZE 64
+#define BENCHMARK_BATCH_SIZE 64
+#define BENCHMARK_CAPACITY 1024
+
+using Clock = std::chrono::steady_clock;
+
+// Pushes the given number of fresh messages
+using ProduceFunction = std::function<void(size_t Count)>;
+
+// Pops at least one message, returning how many were popped
+using ConsumeFunction = std::function<size_t()>;
+
+//
+// ---------------------------------------------------------------------- Classes
+//
+
+// BlockingQueue as it was before it could move, batch, bound or shut down
+template<typename T>
+class LegacyBlockingQueue
+{
+public:
+    void
+    Push(const T& Item)
+    {
+        {
+            std::unique_lock<std::mutex> lck(m_Mutex);
+            m_Queue.push(Item);
+        }
+
+        m_CanPop.notify_one();
+    }
+
+    T
+    Pop()
+    {
+        std::unique_lock<std::mutex> lck(m_Mutex);
+
+        m_CanPop.wait(lck, [=] { return !m_Queue.empty(); });
+
+        T item = std::move(m_Queue.front());
+
+        m_Queue.pop();
+
+        return item;
+    }
+
+private:
+    std::mutex m_Mutex;
+    std::condition_variable m_CanPop;
+    std::queue<T> m_Queue;
+};
+
+//
+// ---------------------------------------------------------------------- Functions
+//
+
+static
+Message
+CreateMessage()
+{
+    Message message;
+
+    message.Header.Size = BENCHMARK_BODY_SIZE;
+    message.Body.assign(BENCHMARK_BODY_SIZE, 0xAB);
+
+    return message;
+}
+
+static
+double
+RunBenchmark(int ProducerCount,
+             const ProduceFunction& Produce,
+             const ConsumeFunction& Consume)
+/*++
+
+Routine Description:
+
+    Splits BENCHMARK_ITEM_COUNT messages across the producers and consumes
+them on the calling thread.
+
+Return Value:
+
+    The number of messages per second that made it through the queue.
+
+--*/
+{
+    std::vector<std::thread> producers;
+    Clock::time_point start = Clock::now();
+    size_t consumed = 0;
+
+    for (int i = 0; i < ProducerCount; i++)
+    {
+        producers.emplace_back([&, i] {
+            Produce(BENCHMARK_ITEM_COUNT / ProducerCount + (i < BENCHMARK_ITEM_COUNT % ProducerCount));
+        });
+    }
+
+    while (consumed < BENCHMARK_ITEM_COUNT)
+    {
+        consumed += Consume();
+    }
+
+    for (std::thread& producer : producers)
+    {
+        producer.join();
+    }
+
+    return consumed / std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static
+double
+RunLegacyBenchmark(int ProducerCount)
+{
+    LegacyBlockingQueue<Message> queue;
+
+    return RunBenchmark(ProducerCount,
+                        [&](size_t Count) {
+                            for (size_t i = 0; i < Count; i++)
+                            {
+                                Message message = CreateMessage();
+                                queue.Push(message);
+                            }
+                        },
+                        [&] {
+                            Message message = queue.Pop();
+                            return (size_t)1;
+                        });
+}
+
+static
+double
+RunQueueBenchmark(int ProducerCount,
+                  size_t Capacity,
+                  bool ShouldBatch)
+{
+    BlockingQueue<Message> queue(Capacity, QUEUE_FULL_BLOCK);
+    std::vector<Message> batch;
+    Message message;
+
+    batch.reserve(BENCHMARK_BATCH_SIZE);
+
+    return RunBenchmark(ProducerCount,
+                        [&](size_t Count) {
+                            for (size_t i = 0; i < Count; i++)
+                            {
+                                queue.Push(CreateMessage());
+                            }
+                        },
+                        [&] {
+                            if (!ShouldBatch)
+                            {
+                                return (size_t)SUCCEEDED(queue.Pop(&message));
+                            }
+
+                            batch.clear();
+                            queue.PopBatch(&batch, BENCHMARK_BATCH_SIZE);
+                            return batch.size();
+                        });
+}
+
+template<RingQueueProducers Producers>
+static
+double
+RunRingBenchmark(int ProducerCount)
+{
+    RingQueue<Message, Producers> queue(BENCHMARK_CAPACITY, QUEUE_FULL_BLOCK);
+    Message message;
+
+    return RunBenchmark(ProducerCount,
+                        [&](size_t Count) {
+                            for (size_t i = 0; i < Count; i++)
+                            {
+                                queue.Push(CreateMessage());
+                            }
+                        },
+                        [&] {
+                            return (size_t)SUCCEEDED(queue.Pop(&message));
+                        });
+}
+
+int
+main()
+{
+    printf("%d messages of %d bytes, one consumer\n", BENCHMARK_ITEM_COUNT, BENCHMARK_BODY_SIZE);
+    printf("%-10s %14s %14s %14s %14s %14s\n", "producers", "legacy", "move", "move+batch", "bounded+batch", "ring");
+
+    for (int producers : { 1, 4 })
+    {
+        printf("%-10d %14.0f %14.0f %14.0f %14.0f %14.0f\n",
+               producers,
+               RunLegacyBenchmark(producers),
+               RunQueueBenchmark(producers, BLOCKING_QUEUE_UNBOUNDED, false),
+               RunQueueBenchmark(producers, BLOCKING_QUEUE_UNBOUNDED, true),
+               RunQueueBenchmark(producers, BENCHMARK_CAPACITY, true),
+               producers == 1 ? RunRingBenchmark<RING_QUEUE_SINGLE_PRODUCER>(producers)
+                              : RunRingBenchmark<RING_QUEUE_MULTI_PRODUCER>(producers));
+    }
+
+    return 0;
+}
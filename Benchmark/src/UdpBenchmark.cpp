@@ -0,0 +1,329 @@
+/*++
+
+Module Name:
+
+    UdpBenchmark.cpp
+
+Abstract:
+
+    Measures the packet rate of the gossip transport over loopback, comparing
+    one system call per datagram (recvfrom/sendto, the original transport)
+    against the batched UdpServer/UdpClient (recvmmsg/sendmmsg).
+
+--*/
+
+//
+// ---------------------------------------------------------------------- Includes
+//
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Error.h"
+#include "Message.h"
+#include "BlockingQueue.h"
+#include "UdpServer.h"
+#include "UdpClient.h"
+
+//
+// ---------------------------------------------------------------------- Definitions
+//
+
+#define BENCHMARK_ADDRESS "127.0.0.1"
+#define BENCHMARK_PORT 9191
+#define BENCHMARK_DATAGRAM_COUNT 1000000
+#define BENCHMARK_BATCH_SIZE 64
+#define BENCHMARK_BODY_SIZE 64
+#define BENCHMARK_BUFFER_SIZE 2048
+#define BENCHMARK_WINDOW 256
+#define BENCHMARK_STOP_ID -1
+
+using Clock = std::chrono::steady_clock;
+
+// Blocks the sender until fewer than BENCHMARK_WINDOW datagrams are in flight
+using ThrottleFunction = std::function<void(size_t Sent)>;
+using SendFunction = std::function<size_t(const ThrottleFunction& Throttle)>;
+
+struct BenchmarkResult
+{
+    size_t Sent;
+    size_t Received;
+    double Seconds;
+};
+
+//
+// ---------------------------------------------------------------------- Functions
+//
+
+static
+int
+CreateSocket(uint16_t Port)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in address;
+
+    if (fd < 0)
+    {
+        return fd;
+    }
+
+    if (Port != 0)
+    {
+        std::memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = INADDR_ANY;
+        address.sin_port = htons(Port);
+
+        if (bind(fd, (const struct sockaddr*)&address, sizeof(address)) != 0)
+        {
+            close(fd);
+            return -1;
+        }
+    }
+
+    return fd;
+}
+
+static
+Message
+CreateMessage(int Id)
+{
+    Message message;
+
+    message.Header.Id = Id;
+    message.Header.Size = Id == BENCHMARK_STOP_ID ? 0 : BENCHMARK_BODY_SIZE;
+    message.Body.assign(message.Header.Size, 0xAB);
+
+    return message;
+}
+
+template<typename ReceiveFunction>
+static
+BenchmarkResult
+RunBenchmark(ReceiveFunction Receive,
+             const SendFunction& Send,
+             const SendFunction& SendStop)
+/*++
+
+Routine Description:
+
+    Runs a sender against a consumer that counts delivered messages until it
+sees the stop message. The sender keeps at most BENCHMARK_WINDOW datagrams in
+flight so that the socket buffer does not overflow; datagrams lost anyway are
+reported rather than retransmitted, so the rate is that of delivered messages.
+
+--*/
+{
+    BenchmarkResult result = { 0, 0, 0 };
+    std::atomic<size_t> received(0);
+    std::atomic<bool> consumerDone(false);
+    ThrottleFunction throttle = [&](size_t Sent) {
+        while (Sent > received.load(std::memory_order_relaxed) + BENCHMARK_WINDOW && !consumerDone)
+        {
+            std::this_thread::yield();
+        }
+    };
+    ThrottleFunction noThrottle = [](size_t) {};
+    Clock::time_point start;
+    Clock::time_point lastReceive;
+    Message message;
+
+    std::thread consumer([&] {
+        while (true)
+        {
+            Receive(&message);
+
+            if (message.Header.Id == BENCHMARK_STOP_ID)
+            {
+                break;
+            }
+
+            received.fetch_add(1, std::memory_order_relaxed);
+            lastReceive = Clock::now();
+        }
+
+        consumerDone = true;
+    });
+
+    start = Clock::now();
+    result.Sent = Send(throttle);
+
+    // Lost datagrams never drain the window, so give up on them after a while
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    // The stop message can be dropped like any other datagram
+    while (!consumerDone)
+    {
+        SendStop(noThrottle);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    consumer.join();
+
+    result.Received = received;
+
+    result.Seconds = std::chrono::duration<double>(lastReceive - start).count();
+
+    return result;
+}
+
+static
+BenchmarkResult
+RunPerDatagramBenchmark()
+{
+    int serverSocket = CreateSocket(BENCHMARK_PORT);
+    int clientSocket = CreateSocket(0);
+    BlockingQueue<Message> incomingMessages;
+    struct sockaddr_in serverAddress;
+    Message dataMessage = CreateMessage(0);
+    Message stopMessage = CreateMessage(BENCHMARK_STOP_ID);
+    BenchmarkResult result;
+
+    std::memset(&serverAddress, 0, sizeof(serverAddress));
+    serverAddress.sin_family = AF_INET;
+    serverAddress.sin_port = htons(BENCHMARK_PORT);
+    inet_pton(AF_INET, BENCHMARK_ADDRESS, &serverAddress.sin_addr);
+
+    // One recvfrom per datagram into a stack buffer, as the original UdpServer
+    std::thread listener([&] {
+        char rawMessage[BENCHMARK_BUFFER_SIZE];
+        Message message;
+
+        while (recvfrom(serverSocket, rawMessage, sizeof(rawMessage), 0, NULL, NULL) > 0)
+        {
+            std::memcpy(&message.Header, rawMessage, sizeof(message.Header));
+            message.Body.resize(message.Header.Size);
+            std::memcpy(message.Body.data(),
+                        rawMessage + sizeof(message.Header),
+                        message.Header.Size);
+
+            incomingMessages.Push(message);
+        }
+    });
+
+    // One sendto per datagram through a stack buffer, as the original UdpClient
+    auto send = [&](const Message& Message) {
+        char rawMessage[BENCHMARK_BUFFER_SIZE];
+
+        std::memcpy(rawMessage, &Message.Header, sizeof(Message.Header));
+        std::memcpy(rawMessage + sizeof(Message.Header), Message.Body.data(), Message.Header.Size);
+
+        return sendto(clientSocket,
+                      rawMessage,
+                      sizeof(Message.Header) + Message.Header.Size,
+                      0,
+                      (const struct sockaddr*)&serverAddress,
+                      sizeof(serverAddress)) > 0;
+    };
+
+    SendFunction sendAll = [&](const ThrottleFunction& Throttle) {
+        size_t sent = 0;
+
+        for (size_t i = 0; i < BENCHMARK_DATAGRAM_COUNT; i++)
+        {
+            Throttle(i);
+            sent += send(dataMessage);
+        }
+
+        return sent;
+    };
+
+    SendFunction sendStop = [&](const ThrottleFunction&) {
+        return (size_t)send(stopMessage);
+    };
+
+    result = RunBenchmark([&](Message* Message) { incomingMessages.Pop(Message); },
+                          sendAll,
+                          sendStop);
+
+    shutdown(serverSocket, SHUT_RD);
+    listener.join();
+    close(serverSocket);
+    close(clientSocket);
+
+    return result;
+}
+
+static
+BenchmarkResult
+RunBatchedBenchmark()
+{
+    UdpServer server(BENCHMARK_PORT + 1);
+    UdpClient client;
+    std::vector<Message> batch(BENCHMARK_BATCH_SIZE, CreateMessage(0));
+    std::vector<Message> stopBatch(1, CreateMessage(BENCHMARK_STOP_ID));
+    std::vector<std::string> destinations(1, BENCHMARK_ADDRESS);
+    BenchmarkResult result = { 0, 0, 0 };
+
+    if (FAILED(server.Init()) || FAILED(client.Init()) || FAILED(server.Start()))
+    {
+        LOG("Failed to initialize the UDP server or client!\n");
+        return result;
+    }
+
+    SendFunction sendAll = [&](const ThrottleFunction& Throttle) {
+        size_t sent = 0;
+
+        for (size_t i = 0; i < BENCHMARK_DATAGRAM_COUNT; i += BENCHMARK_BATCH_SIZE)
+        {
+            Throttle(i + BENCHMARK_BATCH_SIZE);
+
+            if (SUCCEEDED(client.Send(batch, destinations, BENCHMARK_PORT + 1)))
+            {
+                sent += batch.size();
+            }
+        }
+
+        return sent;
+    };
+
+    SendFunction sendStop = [&](const ThrottleFunction&) {
+        return (size_t)SUCCEEDED(client.Send(stopBatch, destinations, BENCHMARK_PORT + 1));
+    };
+
+    result = RunBenchmark([&](Message* Message) { server.GetNextIncomingMessage(Message); },
+                          sendAll,
+                          sendStop);
+
+    server.Stop();
+
+    return result;
+}
+
+static
+void
+PrintResult(const char* Name,
+            const BenchmarkResult& Result)
+{
+    printf("%-14s sent %9zu  received %9zu  lost %5.2f%%  %10.0f pps\n",
+           Name,
+           Result.Sent,
+           Result.Received,
+           Result.Sent == 0 ? 0.0 : 100.0 * (Result.Sent - Result.Received) / Result.Sent,
+           Result.Seconds > 0 ? Result.Received / Result.Seconds : 0.0);
+}
+
+int
+main()
+{
+    printf("UDP loopback, %d datagrams of %zu bytes\n",
+           BENCHMARK_DATAGRAM_COUNT,
+           sizeof(MessageHeader) + BENCHMARK_BODY_SIZE);
+
+    PrintResult("per-datagram", RunPerDatagramBenchmark());
+    PrintResult("batched", RunBatchedBenchmark());
+
+    return 0;
+}
@@ -8,6 +8,7 @@
 #define E_FAIL -1
 #define E_INVALIDARG -2
 #define E_OUTOFMEMORY -3
+#define E_ABORT -4
 
 #define UNREFERENCED_PARAMETER(p) ((void)(p))
 #define SUCCEEDED(e) ((e) >= S_OK)
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "Error.h"
+
+// Memory layout of the mapping table. SlimeRouter publishes the table in a
+// file-backed shared mapping with this layout and SlimeSocket maps the same
+// file read-only, so both sides must agree on everything in this header.
+
+#define MAPPING_TABLE_MAGIC 0x50414D454D494C53ULL // "SLIMEMAP"
+#define MAPPING_TABLE_VERSION 1
+
+#define MAPPING_TABLE_SLOTS_OFFSET 64
+#define MAPPING_TABLE_MAX_READ_RETRIES (1 << 20)
+
+#define MAPPING_TABLE_EMPTY_KEY 0ULL
+#define MAPPING_TABLE_TOMBSTONE_KEY (~0ULL)
+
+#define CREATE_ADDRESS(address, ip, port) address = (uint64_t)(port) << 32 | (ip)
+
+#define GET_IP_ADDRESS(address) (uint32_t)((address) & 0xFFFFFFFF)
+#define GET_PORT(address) (uint16_t)(((address) >> 32) & 0xFFFF)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX() __builtin_ia32_pause()
+#else
+#define CPU_RELAX() std::atomic_signal_fence(std::memory_order_seq_cst)
+#endif
+
+struct MappingTableSlot
+{
+    // The virtual address, or one of the reserved keys above
+    std::atomic<uint64_t> Key;
+
+    // The host address, packed with CREATE_ADDRESS
+    std::atomic<uint64_t> Value;
+};
+
+struct MappingTableHeader
+{
+    // Sequence lock. Odd while a writer is modifying the table. Also serves
+    // as the version of the table since it advances on every modification.
+    std::atomic<uint64_t> Sequence;
+
+    // MAPPING_TABLE_MAGIC once the table is initialized
+    uint64_t Magic;
+
+    // MAPPING_TABLE_VERSION of the writer
+    uint32_t Version;
+
+    // The number of slots in the table. Always a power of two.
+    uint32_t Capacity;
+
+    // The number of live mappings
+    uint32_t Count;
+
+    // The number of deleted slots that still continue probe sequences
+    uint32_t Tombstones;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "The mapping table requires lock-free 64-bit atomics");
+
+static_assert(sizeof(MappingTableHeader) <= MAPPING_TABLE_SLOTS_OFFSET,
+              "The mapping table header must fit before the slots");
+
+static
+inline
+uint64_t
+MappingTableHash(uint64_t VirtualAddress)
+{
+    // splitmix64 finalizer
+    VirtualAddress ^= VirtualAddress >> 30;
+    VirtualAddress *= 0xBF58476D1CE4E5B9ULL;
+    VirtualAddress ^= VirtualAddress >> 27;
+    VirtualAddress *= 0x94D049BB133111EBULL;
+    VirtualAddress ^= VirtualAddress >> 31;
+
+    return VirtualAddress;
+}
+
+static
+inline
+MappingTableSlot*
+MappingTableSlots(const MappingTableHeader* Header)
+{
+    return (MappingTableSlot*)((uint8_t*)Header + MAPPING_TABLE_SLOTS_OFFSET);
+}
+
+// Looks up a virtual address without blocking. Returns S_OK and the packed
+// host address if found, S_FALSE if not, and E_FAIL if a writer kept the table
+// locked for too long.
+static
+inline
+ERROR_CODE
+MappingTableLookup(const MappingTableHeader* Header,
+                   uint64_t VirtualAddress,
+                   uint64_t* HostAddress)
+{
+    const MappingTableSlot* slots = MappingTableSlots(Header);
+    const uint32_t capacity = Header->Capacity;
+    const uint32_t mask = capacity - 1;
+    uint64_t startSequence = 0;
+    uint64_t key = 0;
+    uint64_t value = 0;
+    uint32_t index = 0;
+    bool found = false;
+
+    for (uint32_t retries = 0; retries < MAPPING_TABLE_MAX_READ_RETRIES; retries++)
+    {
+        startSequence = Header->Sequence.load(std::memory_order_acquire);
+
+        if (startSequence & 1)
+        {
+            CPU_RELAX();
+            continue;
+        }
+
+        found = false;
+        index = MappingTableHash(VirtualAddress) & mask;
+
+        for (uint32_t i = 0; i < capacity; i++)
+        {
+            key = slots[index].Key.load(std::memory_order_relaxed);
+
+            if (key == VirtualAddress)
+            {
+                value = slots[index].Value.load(std::memory_order_relaxed);
+                found = true;
+                break;
+            }
+
+            if (key == MAPPING_TABLE_EMPTY_KEY)
+            {
+                break;
+            }
+
+            index = (index + 1) & mask;
+        }
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        if (Header->Sequence.load(std::memory_order_relaxed) == startSequence)
+        {
+            if (!found)
+            {
+                return S_FALSE;
+            }
+
+            *HostAddress = value;
+            return S_OK;
+        }
+    }
+
+    return E_FAIL;
+}
@@ -3,16 +3,35 @@
 #include <cstdint>
 #include <vector>
 
+#include "MessageBuffer.h"
+
+// Bumped whenever the layout of MessageHeader or of a message body changes.
+// Peers drop messages of any other version.
+#define MESSAGE_VERSION 4
+
+// Set on the responses of the router to SlimeSocket requests
+#define MESSAGE_FLAG_RESPONSE 0x1
+
 struct MessageHeader
 {
-    int Id;
-    uint32_t Size;
+    uint16_t Version = MESSAGE_VERSION;
+    uint16_t Flags = 0;
+
+    // The request or message type
+    int Id = 0;
+
+    // The size of the body following the header
+    uint32_t Size = 0;
+
+    // Chosen by the client and echoed in the response, so that requests can
+    // be answered in any order
+    uint32_t RequestId = 0;
 };
 
 struct Message
 {
     MessageHeader Header;
-    std::vector<uint8_t> Body;
+    MessageBuffer Body;
 };
 
 // Application Messages
@@ -29,23 +48,26 @@ struct SocketResponse
     int Status;
 };
 
-struct BindRequest
+// Asks for up to Count host sockets (AF_INET, SOCK_STREAM) at once. The
+// descriptors arrive in the same message as the response.
+struct SocketPoolRequest
 {
-    uint32_t VirtualIpAddress;
-    uint16_t VirtualPort;
+    uint32_t Count;
 };
 
-struct BindResponse
+struct SocketPoolResponse
 {
     int Status;
+    uint32_t Count;
 };
 
-struct AcceptRequest
+struct BindRequest
 {
-    int Flags;
+    uint32_t VirtualIpAddress;
+    uint16_t VirtualPort;
 };
 
-struct AcceptResponse
+struct BindResponse
 {
     int Status;
 };
@@ -59,20 +81,36 @@ struct ConnectRequest
 struct ConnectResponse
 {
     int Status;
+
+    // Where the virtual address resolved to, valid unless Status is
+    // -ENETUNREACH or the lookup failed
+    uint32_t HostIpAddress;
+    uint16_t HostPort;
+
+    // The version of the mapping table the lookup was answered from. It
+    // changes whenever any mapping does, so clients caching resolutions drop
+    // them when it moves.
+    uint64_t MappingVersion;
+
+    // Chosen at random when the router starts. A restarted router counts
+    // versions from scratch, so they only compare within the same epoch.
+    uint64_t RouterEpoch;
 };
 
 enum MessageType
 {
     MESSAGE_TYPE_NEW_MAPPING = 0,
-    MESSAGE_TYPE_DELETE_MAPPING = 1
+    MESSAGE_TYPE_DELETE_MAPPING = 1,
+    MESSAGE_TYPE_MAPPING_BATCH = 2
 };
 
 enum RequestType
 {
     REQUEST_TYPE_SOCKET = 0,
     REQUEST_TYPE_BIND = 1,
-    REQUEST_TYPE_ACCEPT = 2,
+    // 2 was REQUEST_TYPE_ACCEPT; SlimeSocket accepts on the host socket itself
     REQUEST_TYPE_CONNECT = 3,
+    REQUEST_TYPE_SOCKET_POOL = 4,
     REQUEST_TYPE_MAX
 };
 
@@ -84,6 +122,26 @@ struct AddressMapping
     uint16_t HostPort;
 };
 
+// Orders the writes to a mapping. Timestamp is a hybrid logical clock
+// reading of the node that made the write and Origin its IP address, which
+// breaks ties between nodes writing in the same tick.
+struct RecordVersion
+{
+    uint64_t Timestamp;
+    uint32_t Origin;
+};
+
+// A mapping batch carries one or more records back to back. Type is either
+// MESSAGE_TYPE_NEW_MAPPING or MESSAGE_TYPE_DELETE_MAPPING; a deleted record
+// is a tombstone, kept so that older writes cannot bring the mapping back.
+// The record with the greater version wins.
+struct MappingRecord
+{
+    uint32_t Type;
+    AddressMapping Mapping;
+    RecordVersion Version;
+};
+
 struct Address
 {
     uint32_t IpAddress;
@@ -92,13 +150,149 @@ struct Address
 
 // Gossip Messages
 
-/* struct GossipHeader */
-/* { */
-/*     uint16_t PushGossipCount; */
-/*     std::vector<PushGossip> PushGossips; */
-/*     uint16_t PullGossipCount; */
-/*     std::vector<PullGossip> PullGossips; */
-/* }; */
+enum GossipMessageType
+{
+    GOSSIP_MESSAGE_TYPE_PUSH = 16,
+    GOSSIP_MESSAGE_TYPE_PULL = 17
+};
+
+// A push carries one or more rumors, each a RumorHeader followed by the body
+// of the gossiped message.
+struct RumorHeader
+{
+    uint64_t MessageId;
+    uint32_t HopCount;
+    MessageHeader Header;
+};
+
+// A pull carries the IDs of the rumors the sender already has, so the
+// receiver only pushes back the ones it is missing.
+struct PullRequest
+{
+    uint32_t IpAddress;
+    uint16_t Port;
+    uint16_t Count;
+};
+
+// Membership Messages
+
+// Every membership message starts with a SwimHeader followed by UpdateCount
+// piggybacked SwimUpdates. They share the UDP port with gossip.
+enum SwimMessageType
+{
+    SWIM_MESSAGE_TYPE_PING = 32,
+    SWIM_MESSAGE_TYPE_PING_REQUEST = 33,
+    SWIM_MESSAGE_TYPE_ACK = 34
+};
+
+#define IS_MEMBERSHIP_MESSAGE(Id) ((Id) >= SWIM_MESSAGE_TYPE_PING && (Id) <= SWIM_MESSAGE_TYPE_ACK)
+
+enum SwimMemberState
+{
+    SWIM_MEMBER_ALIVE = 0,
+    SWIM_MEMBER_SUSPECT = 1,
+    SWIM_MEMBER_DEAD = 2
+};
+
+struct SwimHeader
+{
+    // The sender, which is implicitly alive at this incarnation
+    uint32_t SourceIpAddress;
+    uint32_t SourceIncarnation;
+
+    // Chosen by the prober and echoed in the ack, including relayed ones
+    uint32_t SequenceNumber;
+
+    // The node to probe in a ping request; the node that answered in an ack
+    uint32_t TargetIpAddress;
+
+    uint32_t UpdateCount;
+};
+
+struct SwimUpdate
+{
+    uint32_t IpAddress;
+    uint32_t Incarnation;
+    uint32_t State;
+};
+
+// Anti-Entropy Messages
+
+// Sent directly to a peer, outside of gossip. A node compares its mapping
+// table with a random peer by sending the root of its digest tree; each side
+// answers digests that differ from its own with its digests one level down,
+// and digests of buckets that differ with the mappings of those buckets.
+enum AntiEntropyMessageType
+{
+    ANTI_ENTROPY_MESSAGE_TYPE_DIGESTS = 48,
+    ANTI_ENTROPY_MESSAGE_TYPE_BUCKETS = 49
+};
+
+#define IS_ANTI_ENTROPY_MESSAGE(Id) ((Id) == ANTI_ENTROPY_MESSAGE_TYPE_DIGESTS || (Id) == ANTI_ENTROPY_MESSAGE_TYPE_BUCKETS)
+
+// Set on buckets that the receiver should answer with its own mappings of
+// the same buckets
+#define ANTI_ENTROPY_FLAG_REPLY 0x1
+
+// Followed by Count DigestEntries, all from the same level of the tree
+struct DigestHeader
+{
+    uint32_t SourceIpAddress;
+
+    // The number of buckets of the sender, which only tables of the same
+    // shape can compare
+    uint32_t BucketCount;
+
+    uint32_t Level;
+    uint32_t Count;
+};
+
+struct DigestEntry
+{
+    uint64_t Digest;
+    uint32_t Index;
+};
+
+// Followed by BucketCount bucket indices, then by RecordCount
+// MappingRecords: every record the sender holds in those buckets, tombstones
+// included
+struct BucketHeader
+{
+    uint32_t SourceIpAddress;
+    uint32_t Flags;
+    uint32_t BucketCount;
+    uint32_t RecordCount;
+};
+
+// Snapshot Messages
+
+// A joining node connects to a peer over TCP, sends a request and receives a
+// SnapshotHeader followed by ChunkCount chunks, each a SnapshotChunk followed
+// by RecordCount MappingRecords. All are framed by a MessageHeader.
+enum SnapshotMessageType
+{
+    SNAPSHOT_MESSAGE_TYPE_REQUEST = 64,
+    SNAPSHOT_MESSAGE_TYPE_HEADER = 65,
+    SNAPSHOT_MESSAGE_TYPE_CHUNK = 66
+};
+
+struct SnapshotHeader
+{
+    // The version of the mapping table of the sender the snapshot was taken at
+    uint64_t Version;
+
+    uint32_t RecordCount;
+    uint32_t ChunkCount;
+};
+
+struct SnapshotChunk
+{
+    // FNV-1a of the records of the chunk
+    uint64_t Checksum;
+
+    uint32_t Index;
+    uint32_t RecordCount;
+};
 
 enum class EventType
 {
@@ -0,0 +1,152 @@
+/*++
+
+Module Name:
+
+    MessageBuffer.h
+
+Abstract:
+
+    Class definition for the body of a message.
+
+    Bodies up to MESSAGE_BUFFER_INLINE_SIZE bytes, which covers every fixed
+    size request, live inside the buffer itself. Larger
+    ones live in reference counted blocks carved out of slabs that are never
+    returned to the heap, so once the pool is warm no message allocates.
+    Copies share the block; the first write through a shared buffer gives it
+    a block of its own.
+
+    The interface mirrors the parts of std::vector<uint8_t> that messages
+    use, which is what it replaces.
+
+--*/
+
+#pragma once
+
+//
+// ---------------------------------------------------------------------- Includes
+//
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+//
+// ---------------------------------------------------------------------- Definitions
+//
+
+// Large enough for every request. Mapping records travel in batches, which
+// come from the blocks like any other large body.
+#define MESSAGE_BUFFER_INLINE_SIZE 24
+
+// Blocks come in a few sizes, header included. The largest holds any
+// gossip datagram; anything beyond it comes from the heap.
+#define MESSAGE_BUFFER_SIZE_CLASSES { 128, 512, 2048 }
+#define MESSAGE_BUFFER_SIZE_CLASS_COUNT 3
+
+// Allocated from the heap at once when the pool of a size class runs dry
+#define MESSAGE_BUFFER_SLAB_SIZE (32 * 1024)
+
+// The size class of blocks that come from the heap
+#define MESSAGE_BUFFER_HEAP_CLASS 0xFF
+
+struct MessageBlock
+{
+    std::atomic<uint32_t> References;
+
+    // The number of bytes following the header
+    uint32_t Capacity;
+
+    // Links free blocks; unused while the block is referenced
+    MessageBlock* Next;
+
+    // The pool the block goes back to, or MESSAGE_BUFFER_HEAP_CLASS
+    uint8_t SizeClass;
+};
+
+//
+// ---------------------------------------------------------------------- Classes
+//
+
+class MessageBuffer
+{
+public:
+    // Constructor
+    MessageBuffer();
+
+    MessageBuffer(const MessageBuffer& Other);
+
+    MessageBuffer(MessageBuffer&& Other) noexcept;
+
+    // Destructor
+    ~MessageBuffer();
+
+    MessageBuffer&
+    operator=(const MessageBuffer& Other);
+
+    MessageBuffer&
+    operator=(MessageBuffer&& Other) noexcept;
+
+    //
+    // Public Methods
+    //
+
+    size_t
+    size() const
+    {
+        return m_Size;
+    }
+
+    bool
+    empty() const
+    {
+        return m_Size == 0;
+    }
+
+    const uint8_t*
+    data() const
+    {
+        return m_Block == nullptr ? m_Inline : reinterpret_cast<const uint8_t*>(m_Block + 1);
+    }
+
+    // Gives the buffer a block of its own first if it shares one
+    uint8_t*
+    data();
+
+    // Keeps the first Size bytes; bytes past the old size are zeroed
+    void
+    resize(size_t Size);
+
+    void
+    assign(const void* Data,
+           size_t Size);
+
+    void
+    assign(size_t Size,
+           uint8_t Value);
+
+    void
+    clear();
+
+private:
+
+    // Makes room for Size bytes, keeping the first Preserve of them
+    void
+    Reserve(size_t Size,
+            size_t Preserve);
+
+    void
+    Release();
+
+    uint8_t*
+    Storage()
+    {
+        return m_Block == nullptr ? m_Inline : reinterpret_cast<uint8_t*>(m_Block + 1);
+    }
+
+    uint32_t m_Size;
+
+    // The block holding the bytes, or nullptr if they are inline
+    MessageBlock* m_Block;
+
+    alignas(8) uint8_t m_Inline[MESSAGE_BUFFER_INLINE_SIZE];
+};
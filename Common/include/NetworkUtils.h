@@ -9,6 +9,7 @@
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <iostream>
 #include <arpa/inet.h>
 
@@ -26,14 +27,34 @@ namespace NetworkUtils
                       void* Data,
                       size_t Count);
 
+    // Sends the concatenation of Vectors in a single sendmsg when possible,
+    // with the file descriptors attached to the first byte.
     ERROR_CODE
-    ReadFileDescriptorFromUnixSocket(int Socket,
-                                     int* FileDescriptor);
+    WriteToUnixSocket(int Socket,
+                      const struct iovec* Vectors,
+                      size_t VectorCount,
+                      const int* FileDescriptors,
+                      size_t FileDescriptorCount);
 
+    // Fills every one of Vectors, in a single recvmsg when possible, along
+    // with up to MaximumFileDescriptorCount file descriptors sent by
+    // WriteToUnixSocket.
     ERROR_CODE
-    WriteFileDescriptorToUnixSocket(int Socket,
-                                    int FileDescriptor);
+    ReadFromUnixSocket(int Socket,
+                       const struct iovec* Vectors,
+                       size_t VectorCount,
+                       int* FileDescriptors,
+                       size_t MaximumFileDescriptorCount,
+                       size_t* FileDescriptorCount,
+                       int Flags);
 
+    // Returns the IPv4 address of the preferred interface, or of the first
+    // non-loopback interface that is up. Cached and kept current through
+    // netlink, so it is cheap enough to call on every bind.
     ERROR_CODE
     GetIpAddress(uint32_t* IpAddress);
+
+    // Selects the interface GetIpAddress reports. NULL or "" restores the default.
+    void
+    SetPreferredInterface(const char* InterfaceName);
 }
@@ -0,0 +1,668 @@
+/*++
+
+Module Name:
+
+    MessageBuffer.cpp
+
+Abstract:
+
+    Class implementation for the body of a message, and the pool its blocks
+    come from.
+
+    Each thread keeps a small cache of free blocks and only takes the global
+    lock to exchange a batch of them with the shared free list. This matters
+    because blocks are usually allocated by the thread receiving a message
+    and freed by the one consuming it.
+
+--*/
+
+//
+// ---------------------------------------------------------------------- Includes
+//
+
+#include <cstring>
+#include <mutex>
+#include <new>
+
+#include "MessageBuffer.h"
+
+//
+// ---------------------------------------------------------------------- Definitions
+//
+
+// Free blocks of a size class a thread keeps before handing half of them back
+#define MESSAGE_BUFFER_LOCAL_CACHE_LIMIT(SizeClass) (2 * BlocksPerSlab(SizeClass))
+
+struct LocalBlockCache
+{
+    MessageBlock* Heads[MESSAGE_BUFFER_SIZE_CLASS_COUNT] = {};
+    size_t Counts[MESSAGE_BUFFER_SIZE_CLASS_COUNT] = {};
+
+    ~LocalBlockCache();
+};
+
+static const size_t g_BlockSizes[MESSAGE_BUFFER_SIZE_CLASS_COUNT] = MESSAGE_BUFFER_SIZE_CLASSES;
+
+static std::mutex g_PoolMutex;
+static MessageBlock* g_FreeBlocks[MESSAGE_BUFFER_SIZE_CLASS_COUNT] = {};
+
+static thread_local LocalBlockCache t_LocalBlocks;
+
+//
+// ---------------------------------------------------------------------- Functions
+//
+
+static
+size_t
+BlocksPerSlab(uint8_t SizeClass)
+/*++
+
+Routine Description:
+
+    Returns how many blocks of a size class one slab holds.
+
+Arguments:
+
+    SizeClass - The size class.
+
+Return Value:
+
+    The number of blocks.
+
+--*/
+{
+    return MESSAGE_BUFFER_SLAB_SIZE / g_BlockSizes[SizeClass];
+}
+
+static
+void
+ReturnBlocks(uint8_t SizeClass,
+             size_t Count)
+/*++
+
+Routine Description:
+
+    Moves blocks of a size class from the cache of this thread to the shared
+free list.
+
+Arguments:
+
+    SizeClass - The size class of the blocks.
+
+    Count - The number of blocks to move.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    MessageBlock* first = t_LocalBlocks.Heads[SizeClass];
+    MessageBlock* last = first;
+
+    if (Count == 0 || first == nullptr)
+    {
+        return;
+    }
+
+    for (size_t i = 1; i < Count && last->Next != nullptr; i++)
+    {
+        last = last->Next;
+        t_LocalBlocks.Counts[SizeClass]--;
+    }
+
+    t_LocalBlocks.Counts[SizeClass]--;
+    t_LocalBlocks.Heads[SizeClass] = last->Next;
+
+    std::lock_guard<std::mutex> lock(g_PoolMutex);
+    last->Next = g_FreeBlocks[SizeClass];
+    g_FreeBlocks[SizeClass] = first;
+}
+
+LocalBlockCache::~LocalBlockCache()
+{
+    for (uint8_t sizeClass = 0; sizeClass < MESSAGE_BUFFER_SIZE_CLASS_COUNT; sizeClass++)
+    {
+        ReturnBlocks(sizeClass, Counts[sizeClass]);
+    }
+}
+
+static
+void
+RefillBlocks(uint8_t SizeClass)
+/*++
+
+Routine Description:
+
+    Fills the empty cache of this thread for a size class from the shared
+free list, or from a new slab if that is empty too.
+
+Arguments:
+
+    SizeClass - The size class to refill.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    const size_t blockSize = g_BlockSizes[SizeClass];
+    const size_t blockCount = BlocksPerSlab(SizeClass);
+    MessageBlock*& head = t_LocalBlocks.Heads[SizeClass];
+    size_t& count = t_LocalBlocks.Counts[SizeClass];
+    uint8_t* slab = nullptr;
+    MessageBlock* block = nullptr;
+
+    {
+        std::lock_guard<std::mutex> lock(g_PoolMutex);
+
+        while (g_FreeBlocks[SizeClass] != nullptr && count < blockCount)
+        {
+            block = g_FreeBlocks[SizeClass];
+            g_FreeBlocks[SizeClass] = block->Next;
+            block->Next = head;
+            head = block;
+            count++;
+        }
+    }
+
+    if (count != 0)
+    {
+        return;
+    }
+
+    // Slabs are never freed; their blocks circulate between threads
+    slab = static_cast<uint8_t*>(::operator new(MESSAGE_BUFFER_SLAB_SIZE));
+
+    for (size_t i = 0; i < blockCount; i++)
+    {
+        block = new (slab + i * blockSize) MessageBlock();
+        block->Capacity = blockSize - sizeof(MessageBlock);
+        block->SizeClass = SizeClass;
+        block->Next = head;
+        head = block;
+        count++;
+    }
+}
+
+static
+MessageBlock*
+AllocateBlock(size_t Size)
+/*++
+
+Routine Description:
+
+    Takes a block with room for at least Size bytes from the smallest size
+class it fits, or from the heap if it fits none.
+
+Arguments:
+
+    Size - The number of bytes the block must hold.
+
+Return Value:
+
+    The block, referenced once.
+
+--*/
+{
+    MessageBlock* block = nullptr;
+    uint8_t sizeClass = 0;
+
+    while (sizeClass < MESSAGE_BUFFER_SIZE_CLASS_COUNT &&
+           g_BlockSizes[sizeClass] - sizeof(MessageBlock) < Size)
+    {
+        sizeClass++;
+    }
+
+    if (sizeClass == MESSAGE_BUFFER_SIZE_CLASS_COUNT)
+    {
+        block = new (::operator new(sizeof(MessageBlock) + Size)) MessageBlock();
+        block->Capacity = Size;
+        block->SizeClass = MESSAGE_BUFFER_HEAP_CLASS;
+    }
+    else
+    {
+        if (t_LocalBlocks.Heads[sizeClass] == nullptr)
+        {
+            RefillBlocks(sizeClass);
+        }
+
+        block = t_LocalBlocks.Heads[sizeClass];
+        t_LocalBlocks.Heads[sizeClass] = block->Next;
+        t_LocalBlocks.Counts[sizeClass]--;
+    }
+
+    block->Next = nullptr;
+    block->References.store(1, std::memory_order_relaxed);
+
+    return block;
+}
+
+static
+void
+FreeBlock(MessageBlock* Block)
+/*++
+
+Routine Description:
+
+    Returns a block that is no longer referenced to where it came from.
+
+Arguments:
+
+    Block - The block to free.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    const uint8_t sizeClass = Block->SizeClass;
+
+    if (sizeClass == MESSAGE_BUFFER_HEAP_CLASS)
+    {
+        Block->~MessageBlock();
+        ::operator delete(Block);
+        return;
+    }
+
+    Block->Next = t_LocalBlocks.Heads[sizeClass];
+    t_LocalBlocks.Heads[sizeClass] = Block;
+    t_LocalBlocks.Counts[sizeClass]++;
+
+    if (t_LocalBlocks.Counts[sizeClass] > MESSAGE_BUFFER_LOCAL_CACHE_LIMIT(sizeClass))
+    {
+        ReturnBlocks(sizeClass, MESSAGE_BUFFER_LOCAL_CACHE_LIMIT(sizeClass) / 2);
+    }
+}
+
+MessageBuffer::MessageBuffer()
+/*++
+
+Routine Description:
+
+    Constructor for MessageBuffer.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+    :
+    m_Size(0),
+    m_Block(nullptr)
+{
+}
+
+MessageBuffer::MessageBuffer(const MessageBuffer& Other)
+/*++
+
+Routine Description:
+
+    Copy constructor for MessageBuffer. Shares the block of the other buffer
+if it has one.
+
+Arguments:
+
+    Other - The buffer to copy.
+
+Return Value:
+
+    None.
+
+--*/
+    :
+    m_Size(Other.m_Size),
+    m_Block(Other.m_Block)
+{
+    if (m_Block != nullptr)
+    {
+        m_Block->References.fetch_add(1, std::memory_order_relaxed);
+    }
+    else
+    {
+        std::memcpy(m_Inline, Other.m_Inline, m_Size);
+    }
+}
+
+MessageBuffer::MessageBuffer(MessageBuffer&& Other) noexcept
+/*++
+
+Routine Description:
+
+    Move constructor for MessageBuffer. Leaves the other buffer empty.
+
+Arguments:
+
+    Other - The buffer to move from.
+
+Return Value:
+
+    None.
+
+--*/
+    :
+    m_Size(Other.m_Size),
+    m_Block(Other.m_Block)
+{
+    if (m_Block == nullptr)
+    {
+        std::memcpy(m_Inline, Other.m_Inline, m_Size);
+    }
+
+    Other.m_Size = 0;
+    Other.m_Block = nullptr;
+}
+
+MessageBuffer::~MessageBuffer()
+/*++
+
+Routine Description:
+
+    Destructor for MessageBuffer.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    Release();
+}
+
+MessageBuffer&
+MessageBuffer::operator=(const MessageBuffer& Other)
+/*++
+
+Routine Description:
+
+    Makes this buffer a copy of another, sharing its block if it has one.
+
+Arguments:
+
+    Other - The buffer to copy.
+
+Return Value:
+
+    This buffer.
+
+--*/
+{
+    if (this == &Other)
+    {
+        return *this;
+    }
+
+    if (Other.m_Block != nullptr)
+    {
+        Other.m_Block->References.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    Release();
+
+    m_Size = Other.m_Size;
+    m_Block = Other.m_Block;
+
+    if (m_Block == nullptr)
+    {
+        std::memcpy(m_Inline, Other.m_Inline, m_Size);
+    }
+
+    return *this;
+}
+
+MessageBuffer&
+MessageBuffer::operator=(MessageBuffer&& Other) noexcept
+/*++
+
+Routine Description:
+
+    Moves the contents of another buffer into this one, leaving the other
+buffer empty.
+
+Arguments:
+
+    Other - The buffer to move from.
+
+Return Value:
+
+    This buffer.
+
+--*/
+{
+    if (this == &Other)
+    {
+        return *this;
+    }
+
+    Release();
+
+    m_Size = Other.m_Size;
+    m_Block = Other.m_Block;
+
+    if (m_Block == nullptr)
+    {
+        std::memcpy(m_Inline, Other.m_Inline, m_Size);
+    }
+
+    Other.m_Size = 0;
+    Other.m_Block = nullptr;
+
+    return *this;
+}
+
+uint8_t*
+MessageBuffer::data()
+/*++
+
+Routine Description:
+
+    Returns the bytes of the buffer for writing. A block shared with other
+buffers is copied first, so that they do not see the write.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The bytes of the buffer.
+
+--*/
+{
+    Reserve(m_Size, m_Size);
+
+    return Storage();
+}
+
+void
+MessageBuffer::resize(size_t Size)
+/*++
+
+Routine Description:
+
+    Changes the size of the buffer, keeping its first bytes and zeroing any
+new ones.
+
+Arguments:
+
+    Size - The new size.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    size_t preserve = Size < m_Size ? Size : m_Size;
+
+    Reserve(Size, preserve);
+
+    if (Size > preserve)
+    {
+        std::memset(Storage() + preserve, 0, Size - preserve);
+    }
+
+    m_Size = Size;
+}
+
+void
+MessageBuffer::assign(const void* Data,
+                      size_t Size)
+/*++
+
+Routine Description:
+
+    Replaces the contents of the buffer with a copy of the given bytes.
+
+Arguments:
+
+    Data - The bytes to copy. Must not point into this buffer.
+
+    Size - The number of bytes.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    Reserve(Size, 0);
+    std::memcpy(Storage(), Data, Size);
+    m_Size = Size;
+}
+
+void
+MessageBuffer::assign(size_t Size,
+                      uint8_t Value)
+/*++
+
+Routine Description:
+
+    Replaces the contents of the buffer with Size copies of Value.
+
+Arguments:
+
+    Size - The number of bytes.
+
+    Value - The value of every byte.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    Reserve(Size, 0);
+    std::memset(Storage(), Value, Size);
+    m_Size = Size;
+}
+
+void
+MessageBuffer::clear()
+/*++
+
+Routine Description:
+
+    Empties the buffer, returning its block if it has one.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    Release();
+    m_Size = 0;
+}
+
+void
+MessageBuffer::Reserve(size_t Size,
+                       size_t Preserve)
+/*++
+
+Routine Description:
+
+    Makes sure the buffer has storage of its own for Size bytes, moving to
+inline storage, a new block or keeping the current block as appropriate.
+
+Arguments:
+
+    Size - The number of bytes the storage must hold.
+
+    Preserve - How many of the current bytes to keep. At most Size and the
+               current size.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    MessageBlock* block = nullptr;
+
+    if (Size <= MESSAGE_BUFFER_INLINE_SIZE)
+    {
+        if (m_Block != nullptr)
+        {
+            std::memcpy(m_Inline, reinterpret_cast<const uint8_t*>(m_Block + 1), Preserve);
+            Release();
+        }
+
+        return;
+    }
+
+    if (m_Block != nullptr &&
+        m_Block->Capacity >= Size &&
+        m_Block->References.load(std::memory_order_acquire) == 1)
+    {
+        return;
+    }
+
+    block = AllocateBlock(Size);
+    std::memcpy(reinterpret_cast<uint8_t*>(block + 1), Storage(), Preserve);
+
+    Release();
+    m_Block = block;
+}
+
+void
+MessageBuffer::Release()
+/*++
+
+Routine Description:
+
+    Drops the reference of this buffer to its block, freeing the block if it
+was the last one. The buffer is left with inline storage.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (m_Block != nullptr &&
+        m_Block->References.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        FreeBlock(m_Block);
+    }
+
+    m_Block = nullptr;
+}
@@ -1,3 +1,10 @@
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <ifaddrs.h>
+#include <mutex>
+#include <vector>
+
 #include "NetworkUtils.h"
 
 int NetworkUtils::WriteAllToSocket(int Socket, const void* Data, size_t Count)
@@ -54,122 +61,346 @@ int NetworkUtils::ReadAllFromSocket(int Socket, void* Data, size_t Count)
     return totalBytes;
 }
 
+// The host address is resolved from the interface list once and cached. A
+// netlink socket subscribed to IPv4 address changes marks the cache stale, so
+// the common case costs one non-blocking recv and never touches the resolver.
+static std::mutex s_HostAddressLock;
+// Plain storage only: SlimeSocket sets these from its constructor, possibly
+// before dynamic initializers in this file have run
+static char s_PreferredInterface[IF_NAMESIZE];
+static uint32_t s_HostAddress = 0;
+static bool s_IsHostAddressStale = true;
+static int s_AddressMonitor = -1;
+static pid_t s_AddressMonitorOwner = 0;
+
+static
+int
+OpenAddressMonitor()
+{
+    int monitor = -1;
+    struct sockaddr_nl address;
+
+    monitor = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (monitor < 0)
+    {
+        LOG("Failed to create netlink socket! 0x%x\n", errno);
+        return -1;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.nl_family = AF_NETLINK;
+    address.nl_groups = RTMGRP_IPV4_IFADDR;
+
+    if (bind(monitor, (struct sockaddr*)&address, sizeof(address)) != 0)
+    {
+        LOG("Failed to subscribe to address changes! 0x%x\n", errno);
+        close(monitor);
+        return -1;
+    }
+
+    return monitor;
+}
+
+static
+bool
+HasHostAddressChanged(int Monitor)
+{
+    alignas(struct nlmsghdr) char buffer[4096];
+    struct nlmsghdr* header = nullptr;
+    ssize_t bytesRead = 0;
+    bool hasChanged = false;
+
+    while (true)
+    {
+        bytesRead = recv(Monitor, buffer, sizeof(buffer), MSG_DONTWAIT);
+
+        if (bytesRead < 0)
+        {
+            // ENOBUFS means notifications were dropped, assume the worst
+            hasChanged |= errno == ENOBUFS;
+
+            if (errno == EINTR || errno == ENOBUFS)
+            {
+                continue;
+            }
+
+            break;
+        }
+
+        for (header = (struct nlmsghdr*)buffer;
+             NLMSG_OK(header, (size_t)bytesRead);
+             header = NLMSG_NEXT(header, bytesRead))
+        {
+            hasChanged |= header->nlmsg_type == RTM_NEWADDR || header->nlmsg_type == RTM_DELADDR;
+        }
+    }
+
+    return hasChanged;
+}
+
+static
 ERROR_CODE
-NetworkUtils::GetIpAddress(uint32_t* IpAddress)
+LoadHostAddress(const char* PreferredInterface,
+                uint32_t* IpAddress)
 {
-    int ec = 0;
-    char hostname_buffer[256];
-    struct hostent* host_entry;
+    ERROR_CODE ec = S_OK;
+    struct ifaddrs* interfaces = nullptr;
+    const struct ifaddrs* preferred = nullptr;
+    const struct ifaddrs* external = nullptr;
+    const struct ifaddrs* loopback = nullptr;
+    const struct ifaddrs* chosen = nullptr;
 
-    TRACE_IF_FAILED(gethostname(hostname_buffer, sizeof(hostname_buffer)),
+    TRACE_IF_FAILED(getifaddrs(&interfaces),
                     Cleanup,
-                    "Failed to get hostname! 0x%x\n", errno);
-    
-    host_entry = gethostbyname(hostname_buffer);
-    EXIT_IF_NULL(host_entry,
+                    "Failed to list interface addresses! 0x%x\n", errno);
+
+    for (const struct ifaddrs* it = interfaces; it != nullptr; it = it->ifa_next)
+    {
+        if (it->ifa_addr == nullptr || it->ifa_addr->sa_family != AF_INET || !(it->ifa_flags & IFF_UP))
+        {
+            continue;
+        }
+
+        if (preferred == nullptr && *PreferredInterface != '\0' && strcmp(PreferredInterface, it->ifa_name) == 0)
+        {
+            preferred = it;
+        }
+        else if (external == nullptr && !(it->ifa_flags & IFF_LOOPBACK))
+        {
+            external = it;
+        }
+        else if (loopback == nullptr && (it->ifa_flags & IFF_LOOPBACK))
+        {
+            loopback = it;
+        }
+    }
+
+    if (preferred == nullptr && *PreferredInterface != '\0')
+    {
+        LOG("Interface %s has no IPv4 address, using another one!\n", PreferredInterface);
+    }
+
+    chosen = preferred != nullptr ? preferred : external != nullptr ? external : loopback;
+    EXIT_IF_NULL(chosen,
                  E_FAIL,
                  Cleanup);
-    
-    *IpAddress = ((struct in_addr*)host_entry->h_addr_list[0])->s_addr;
-    
+
+    *IpAddress = ((const struct sockaddr_in*)chosen->ifa_addr)->sin_addr.s_addr;
+
 Cleanup:
+    if (interfaces != nullptr)
+    {
+        freeifaddrs(interfaces);
+    }
+
     return ec;
 }
 
+void
+NetworkUtils::SetPreferredInterface(const char* InterfaceName)
+{
+    std::lock_guard<std::mutex> lock(s_HostAddressLock);
+
+    snprintf(s_PreferredInterface,
+             sizeof(s_PreferredInterface),
+             "%s",
+             InterfaceName != nullptr ? InterfaceName : "");
+    s_IsHostAddressStale = true;
+}
+
 ERROR_CODE
-NetworkUtils::ReadFileDescriptorFromUnixSocket(int Socket, int* FileDescriptor)
+NetworkUtils::GetIpAddress(uint32_t* IpAddress)
 {
     ERROR_CODE ec = S_OK;
-    struct msghdr msg;
-    struct iovec iov;
-    union
-    {
-        struct cmsghdr cmsghdr;
-        char control[CMSG_SPACE(sizeof (int))];
-    } cmsgu;
-    struct cmsghdr* cmsg = {0};
-    char buf[2] = {0};
-
-    iov.iov_base = buf;
-    iov.iov_len = 2;
-
-    msg.msg_name = NULL;
-    msg.msg_namelen = 0;
-    msg.msg_iov = &iov;
-    msg.msg_iovlen = 1;
-    msg.msg_control = cmsgu.control;
-    msg.msg_controllen = sizeof(cmsgu.control);
-    
-    TRACE_IF_FAILED(recvmsg(Socket, &msg, 0),
-                    Cleanup,
-                    "Failed to receive control information! 0x%x\n", errno);
-    
-    cmsg = CMSG_FIRSTHDR(&msg);
-    
-    if (cmsg && cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+    std::lock_guard<std::mutex> lock(s_HostAddressLock);
+
+    // A forked child shares the monitor with its parent and would steal its
+    // notifications, so it subscribes on its own
+    if (s_AddressMonitorOwner != getpid())
     {
-        EXIT_IF_TRUE(cmsg->cmsg_level != SOL_SOCKET,
-                     E_FAIL,
-                     Cleanup);
-        
-        EXIT_IF_TRUE(cmsg->cmsg_type != SCM_RIGHTS,
-                     E_FAIL,
-                     Cleanup);
-        
-        *FileDescriptor = *(int*)CMSG_DATA(cmsg);
+        if (s_AddressMonitor >= 0)
+        {
+            close(s_AddressMonitor);
+        }
+
+        // Subscribe before listing the interfaces so no change slips through
+        s_AddressMonitor = OpenAddressMonitor();
+        s_AddressMonitorOwner = getpid();
+        s_IsHostAddressStale = true;
     }
-    else
+
+    // Without a monitor there is no way to tell the cache is current
+    if (s_AddressMonitor < 0 || HasHostAddressChanged(s_AddressMonitor))
     {
-        *FileDescriptor = -1;
+        s_IsHostAddressStale = true;
     }
 
+    if (s_IsHostAddressStale)
+    {
+        EXIT_IF_FAILED(LoadHostAddress(s_PreferredInterface, &s_HostAddress),
+                       Cleanup);
+        s_IsHostAddressStale = false;
+    }
+
+    *IpAddress = s_HostAddress;
+
 Cleanup:
     return ec;
 }
 
 ERROR_CODE
-NetworkUtils::WriteFileDescriptorToUnixSocket(int Socket, int FileDescriptor)
+NetworkUtils::WriteToUnixSocket(int Socket,
+                                const struct iovec* Vectors,
+                                size_t VectorCount,
+                                const int* FileDescriptors,
+                                size_t FileDescriptorCount)
 {
     ERROR_CODE ec = S_OK;
     struct msghdr msg;
-    struct iovec iov;
-    union
-    {
-        struct cmsghdr cmsghdr;
-        char control[CMSG_SPACE(sizeof(int))];
-    } cmsgu;
+    std::vector<struct iovec> iov(Vectors, Vectors + VectorCount);
+    std::vector<uint8_t> control(FileDescriptorCount != 0 ? CMSG_SPACE(FileDescriptorCount * sizeof(int)) : 0);
     struct cmsghdr* cmsg = nullptr;
-    char buf[2] = {0};
-
-    iov.iov_base = buf;
-    iov.iov_len = 2;
+    size_t first = 0;
+    ssize_t bytesWritten = 0;
 
-    msg.msg_name = NULL;
-    msg.msg_namelen = 0;
-    msg.msg_iov = &iov;
-    msg.msg_iovlen = 1;
+    memset(&msg, 0, sizeof(msg));
 
-    if (FileDescriptor != -1)
+    if (FileDescriptorCount != 0)
     {
-        msg.msg_control = cmsgu.control;
-        msg.msg_controllen = sizeof(cmsgu.control);
+        msg.msg_control = control.data();
+        msg.msg_controllen = control.size();
 
         cmsg = CMSG_FIRSTHDR(&msg);
-        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        cmsg->cmsg_len = CMSG_LEN(FileDescriptorCount * sizeof(int));
         cmsg->cmsg_level = SOL_SOCKET;
         cmsg->cmsg_type = SCM_RIGHTS;
-
-        *((int *)CMSG_DATA(cmsg)) = FileDescriptor;
+        memcpy(CMSG_DATA(cmsg), FileDescriptors, FileDescriptorCount * sizeof(int));
     }
-    else
+
+    while (first < iov.size())
     {
+        msg.msg_iov = &iov[first];
+        msg.msg_iovlen = iov.size() - first;
+
+        bytesWritten = sendmsg(Socket, &msg, MSG_NOSIGNAL);
+
+        if (bytesWritten < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        TRACE_IF_FAILED(bytesWritten,
+                        Cleanup,
+                        "Failed to send message! 0x%x\n", errno);
+
+        // The descriptors went out with the first byte
         msg.msg_control = NULL;
         msg.msg_controllen = 0;
+
+        while (first < iov.size() && (size_t)bytesWritten >= iov[first].iov_len)
+        {
+            bytesWritten -= iov[first].iov_len;
+            first++;
+        }
+
+        if (first < iov.size())
+        {
+            iov[first].iov_base = (uint8_t*)iov[first].iov_base + bytesWritten;
+            iov[first].iov_len -= bytesWritten;
+        }
     }
 
-    TRACE_IF_FAILED(sendmsg(Socket, &msg, 0),
+Cleanup:
+    return ec;
+}
+
+ERROR_CODE
+NetworkUtils::ReadFromUnixSocket(int Socket,
+                                 const struct iovec* Vectors,
+                                 size_t VectorCount,
+                                 int* FileDescriptors,
+                                 size_t MaximumFileDescriptorCount,
+                                 size_t* FileDescriptorCount,
+                                 int Flags)
+{
+    ERROR_CODE ec = S_OK;
+    struct msghdr msg;
+    std::vector<uint8_t> control(CMSG_SPACE(MaximumFileDescriptorCount * sizeof(int)));
+    struct cmsghdr* cmsg = nullptr;
+    size_t receivedCount = 0;
+    ssize_t bytesRead = 0;
+
+    *FileDescriptorCount = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec*)Vectors;
+    msg.msg_iovlen = VectorCount;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+
+    do
+    {
+        bytesRead = recvmsg(Socket, &msg, Flags);
+    } while (bytesRead < 0 && errno == EINTR);
+
+    TRACE_IF_FAILED(bytesRead,
                     Cleanup,
-                    "Failed to send control message! 0x%x\n", errno);
-Cleanup:    
+                    "Failed to receive message! 0x%x\n", errno);
+    EXIT_IF_TRUE(bytesRead == 0,
+                 E_FAIL,
+                 Cleanup);
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        {
+            continue;
+        }
+
+        receivedCount = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+        // Alignment padding can leave room for one descriptor more than asked
+        for (size_t i = MaximumFileDescriptorCount; i < receivedCount; i++)
+        {
+            close(((int*)CMSG_DATA(cmsg))[i]);
+        }
+
+        *FileDescriptorCount = receivedCount < MaximumFileDescriptorCount ? receivedCount : MaximumFileDescriptorCount;
+        memcpy(FileDescriptors, CMSG_DATA(cmsg), *FileDescriptorCount * sizeof(int));
+        break;
+    }
+
+    // The kernel discards the descriptors that did not fit
+    EXIT_IF_TRUE(msg.msg_flags & MSG_CTRUNC,
+                 E_FAIL,
+                 Cleanup);
+
+    // Descriptors only ever arrive with the first byte, read the rest plainly
+    for (size_t i = 0; i < VectorCount; i++)
+    {
+        if ((size_t)bytesRead >= Vectors[i].iov_len)
+        {
+            bytesRead -= Vectors[i].iov_len;
+            continue;
+        }
+
+        EXIT_IF_TRUE(ReadAllFromSocket(Socket,
+                                       (uint8_t*)Vectors[i].iov_base + bytesRead,
+                                       Vectors[i].iov_len - bytesRead) != (int)(Vectors[i].iov_len - bytesRead),
+                     E_FAIL,
+                     Cleanup);
+        bytesRead = 0;
+    }
+
+Cleanup:
+    if (FAILED(ec))
+    {
+        for (size_t i = 0; i < *FileDescriptorCount; i++)
+        {
+            close(FileDescriptors[i]);
+        }
+        *FileDescriptorCount = 0;
+    }
+
     return ec;
 }
@@ -0,0 +1,131 @@
+/*++
+
+Module Name:
+
+    AntiEntropyProtocol.h
+
+Abstract:
+
+    Class declaration of an anti-entropy protocol repairing the mapping
+    table.
+
+    Gossip is best effort, so a node that misses a datagram may never learn
+    a mapping. Every period, a node compares the digest tree of its mapping
+    table with that of a random peer and the two exchange the mappings of
+    the buckets that differ. A table in sync costs a single digest; repairs
+    cost in proportion to how far two tables diverged, not to their size.
+
+    Records are versioned, so conflicts are settled by the mapping table:
+    the newer record wins on both sides, and tombstones travel like any other
+    record so that a removal is repaired as well.
+
+--*/
+
+#pragma once
+
+//
+// ---------------------------------------------------------------------- Includes
+//
+
+#include <mutex>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unordered_set>
+#include <condition_variable>
+
+#include "Error.h"
+#include "Message.h"
+
+//
+// ---------------------------------------------------------------------- Definitions
+//
+
+
+
+//
+// ---------------------------------------------------------------------- Classes
+//
+
+class UdpClient;
+class MappingTable;
+
+class AntiEntropyProtocol
+{
+public:
+    // Constructor
+    AntiEntropyProtocol(std::unique_ptr<UdpClient> UdpClient);
+
+    // Destructor
+    ~AntiEntropyProtocol();
+
+    //
+    // Public Methods
+    //
+
+    ERROR_CODE
+    Init(MappingTable& MappingTable);
+
+    ERROR_CODE
+    Start();
+
+    ERROR_CODE
+    Stop();
+
+    ERROR_CODE
+    AddPeer(const std::string& IpAddress);
+
+    ERROR_CODE
+    RemovePeer(const std::string& IpAddress);
+
+    // Anti-entropy messages arrive with those delivered by the multicast
+    // protocol
+    ERROR_CODE
+    OnReceive(const Message& Message);
+
+private:
+
+    ERROR_CODE
+    PeriodicallySynchronize();
+
+    ERROR_CODE
+    OnDigests(const Message& Message);
+
+    ERROR_CODE
+    OnBuckets(const Message& Message);
+
+    ERROR_CODE
+    SendDigests(uint32_t Destination,
+                uint32_t Level,
+                const std::vector<DigestEntry>& Digests);
+
+    ERROR_CODE
+    SendBuckets(uint32_t Destination,
+                const std::vector<uint32_t>& Buckets,
+                uint32_t Flags);
+
+    void
+    MergeRecords(const std::vector<MappingRecord>& Records);
+
+    std::unique_ptr<UdpClient> m_UdpClient;
+
+    // The table to repair, owned by the mapping manager
+    MappingTable* m_MappingTable;
+
+    // The IP address of this node, in network byte order
+    uint32_t m_IpAddress;
+
+    // Protects the members below
+    std::mutex m_Mutex;
+
+    // The members to synchronize with
+    std::unordered_set<std::string> m_Peers;
+
+    std::mt19937 m_RandomEngine;
+
+    bool m_ShouldStop;
+    std::condition_variable m_StopCondition;
+    std::thread m_SynchronizeThread;
+};
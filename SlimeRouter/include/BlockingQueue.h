@@ -8,6 +8,11 @@ Abstract:
 
     Class definition for a thread-safe queue.
 
+    The queue is unbounded unless given a capacity, in which case a full
+    queue either blocks producers or drops the new item. Consumers can drain
+    several items under one lock acquisition. After RequestShutdown, pushes
+    fail and pops return what is left, then fail with E_ABORT.
+
 --*/
 
 #pragma once
@@ -18,6 +23,8 @@ Abstract:
 
 #include <thread>
 #include <queue>
+#include <vector>
+#include <chrono>
 #include <condition_variable>
 
 #include "Error.h"
@@ -26,6 +33,16 @@ Abstract:
 // ---------------------------------------------------------------------- Definitions
 //
 
+#define BLOCKING_QUEUE_UNBOUNDED 0
+
+enum QueueFullPolicy
+{
+    // Push waits until a consumer makes room
+    QUEUE_FULL_BLOCK = 0,
+
+    // Push discards the new item and returns S_FALSE
+    QUEUE_FULL_DROP = 1
+};
 
 //
 // ---------------------------------------------------------------------- Classes
@@ -36,7 +53,8 @@ class BlockingQueue
 {
 public:
     // Constructor
-    BlockingQueue();
+    BlockingQueue(size_t Capacity = BLOCKING_QUEUE_UNBOUNDED,
+                  QueueFullPolicy FullPolicy = QUEUE_FULL_BLOCK);
 
     // Destructor
     ~BlockingQueue();
@@ -44,21 +62,48 @@ public:
     //
     // Public Methods
     //
-    
+
     ERROR_CODE
     Push(const T& Item);
 
-    T
-    Pop();
-    
+    ERROR_CODE
+    Push(T&& Item);
+
+    ERROR_CODE
+    Pop(T* Item);
+
+    ERROR_CODE
+    PopFor(T* Item,
+           std::chrono::milliseconds Timeout);
+
+    ERROR_CODE
+    PopBatch(std::vector<T>* Items,
+             size_t MaxCount);
+
     ERROR_CODE
     RequestShutdown();
-    
+
 private:
-	std::mutex m_Mutex;
-	std::condition_variable m_CanPop;
-	std::queue<T> m_Queue;
-	bool m_ShouldShutdown;
+
+    template<typename U>
+    ERROR_CODE
+    Emplace(U&& Item);
+
+    ERROR_CODE
+    Take(T* Item);
+
+    std::mutex m_Mutex;
+    std::condition_variable m_CanPop;
+    std::condition_variable m_CanPush;
+    std::queue<T> m_Queue;
+
+    // The maximum number of queued items, or BLOCKING_QUEUE_UNBOUNDED
+    size_t m_Capacity;
+
+    // What Push does when the queue is at capacity
+    QueueFullPolicy m_FullPolicy;
+
+    bool m_ShouldShutdown;
 };
 
 #include "../src/BlockingQueue.tpp"
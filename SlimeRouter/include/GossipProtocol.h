@@ -17,10 +17,16 @@ Abstract:
 //
 
 #include <memory>
+#include <mutex>
+#include <chrono>
+#include <random>
+#include <vector>
 #include <unordered_set>
+#include <unordered_map>
+#include <condition_variable>
 
 #include "IMulticastProtocol.h"
-#include "BlockingQueue.h"
+#include "RingQueue.h"
 #include "Message.h"
 
 //
@@ -42,7 +48,7 @@ public:
     
     // Constructor
     GossipProtocol(std::unique_ptr<UdpClient> UdpClient,
-                   std::unique_ptr<UdpServer> UdpServer);
+                   std::shared_ptr<UdpServer> UdpServer);
     
     // Destructor
     ~GossipProtocol();
@@ -72,7 +78,24 @@ public:
     ERROR_CODE
     GetNextDeliveredMessage(Message* Message) override;
     
+    size_t
+    GetMaximumMessageSize() const override;
+    
 private:
+
+    // A message that is still being spread
+    struct Rumor
+    {
+        // The number of hops the message travelled before reaching this node
+        uint32_t HopCount;
+
+        // The number of gossip rounds left before the rumor is retired
+        uint32_t RoundsLeft;
+
+        // The gossiped message
+        Message Payload;
+    };
+
     ERROR_CODE
     HandleIncomingMessages();
     
@@ -83,22 +106,71 @@ private:
     OnReceive(const Message& Message);
     
     ERROR_CODE
-    InitiateGossip(const std::string& Payload);
-    
+    OnPush(const Message& Message);
+
+    ERROR_CODE
+    OnPull(const Message& Message);
+
     ERROR_CODE
     PeriodicallyGossip();
 
     ERROR_CODE
-    HandleEvents();
+    SendRumors(const std::vector<uint64_t>& MessageIds,
+               const std::vector<std::string>& Destinations,
+               uint16_t Port);
+
+    ERROR_CODE
+    SendPull(const std::string& Destination);
+
+    std::vector<std::string>
+    SelectGossipTargets(size_t Count);
+
+    uint32_t
+    GetRoundCount() const;
+
+    void
+    ExpireSeenMessages();
     
     // An owning pointer to a UDP client
     std::unique_ptr<UdpClient> m_UdpClient;
 
-    // An owning pointer to a UDP server
-    std::unique_ptr<UdpServer> m_UdpServer;
+    // The UDP server, shared with the membership protocol. Gossip starts
+    // and stops it.
+    std::shared_ptr<UdpServer> m_UdpServer;
     
+    // Protects the members below
+    std::mutex m_Mutex;
+
     // The set of members to multicast to
     std::unordered_set<std::string> m_MulticastGroup;
     
-    BlockingQueue<Message> m_DeliveredMessages;
+    // Rumors that are still being spread, keyed by message ID
+    std::unordered_map<uint64_t, Rumor> m_Rumors;
+
+    // IDs of messages already delivered, with the time they were first seen
+    std::unordered_map<uint64_t, std::chrono::steady_clock::time_point> m_SeenMessages;
+
+    // Source of randomness for gossip target selection
+    std::mt19937 m_RandomEngine;
+
+    // The IP address of this node, in network byte order
+    uint32_t m_IpAddress;
+
+    // The sequence number of the next message originating from this node
+    uint32_t m_NextSequenceNumber;
+
+    // Set when the gossip thread should exit
+    bool m_ShouldStop;
+    std::condition_variable m_StopCondition;
+    std::thread m_GossipThread;
+
+    // Receives datagrams from the UDP server until it stops
+    std::thread m_IncomingMessageThread;
+
+    // The number of messages dropped because the delivery queue was full.
+    // Only touched by the incoming message thread.
+    uint64_t m_DroppedMessageCount;
+    
+    // Bounded; messages are dropped when the mapping manager falls behind
+    RingQueue<Message, RING_QUEUE_MULTI_PRODUCER> m_DeliveredMessages;
 };
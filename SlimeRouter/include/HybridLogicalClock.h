@@ -0,0 +1,73 @@
+/*++
+
+Module Name:
+
+    HybridLogicalClock.h
+
+Abstract:
+
+    Class declaration of a hybrid logical clock versioning mapping records.
+
+    A reading packs the wall clock in milliseconds into the upper 48 bits and
+    a logical counter into the lower 16. Readings never go backwards and
+    always exceed every reading observed from other nodes, so a write is
+    ordered after every write its node had seen. Readings more than
+    HYBRID_LOGICAL_CLOCK_MAX_OFFSET ahead of the local wall clock are refused,
+    so that a single skewed or corrupt reading cannot drag the clock along.
+
+--*/
+
+#pragma once
+
+//
+// ---------------------------------------------------------------------- Includes
+//
+
+#include <cstdint>
+
+#include "Error.h"
+
+//
+// ---------------------------------------------------------------------- Definitions
+//
+
+#define HYBRID_LOGICAL_CLOCK_LOGICAL_BITS 16
+
+// How far, in milliseconds, another node's wall clock may run ahead of ours
+#define HYBRID_LOGICAL_CLOCK_MAX_OFFSET (60 * 1000)
+
+//
+// ---------------------------------------------------------------------- Classes
+//
+
+class HybridLogicalClock
+{
+public:
+    // Constructor
+    HybridLogicalClock();
+
+    // Destructor
+    ~HybridLogicalClock();
+
+    //
+    // Public Methods
+    //
+
+    // Not thread-safe; the owner serializes every call
+    uint64_t
+    Now();
+
+    ERROR_CODE
+    Observe(uint64_t Timestamp);
+
+    static uint64_t
+    GetPhysicalTime(uint64_t Timestamp);
+
+    static uint64_t
+    ReadWallClock();
+
+private:
+
+    // The last reading handed out or observed
+    uint64_t m_Last;
+};
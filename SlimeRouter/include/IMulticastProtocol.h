@@ -64,4 +64,9 @@ public:
     virtual
     ERROR_CODE
     GetNextDeliveredMessage(Message* Message) = 0;
+    
+    // The largest message body that can be multicast in a single datagram
+    virtual
+    size_t
+    GetMaximumMessageSize() const = 0;
 };
@@ -10,6 +10,12 @@ Abstract:
     the <Virtual IP, Virtual Port> to <Host IP, Host Port> mappings
     and responding to lookup requests.
 
+    Mapping updates to multicast are coalesced: records queued within the
+    flush deadline are packed into as few datagrams as possible. Updates
+    that multicast fails to deliver are repaired by anti-entropy. A node
+    that joins fetches a snapshot of the table from a peer first, after
+    restoring whatever it had persisted before restarting.
+
 --*/
 
 #pragma once
@@ -18,13 +24,18 @@ Abstract:
 // ---------------------------------------------------------------------- Includes
 //
 
-#include <unordered_map>
 #include <thread>
 #include <memory>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
 
 #include "Message.h"
 #include "Error.h"
 #include "IMembershipManager.h"
+#include "MappingTable.h"
 
 //
 // ---------------------------------------------------------------------- Definitions
@@ -38,13 +49,21 @@ Abstract:
 
 class IMembershipProtocol;
 class IMulticastProtocol;
+class AntiEntropyProtocol;
+class SnapshotProtocol;
+class MappingStore;
 
 class MappingManager : public IMembershipManager
 {
 public:
     // Constructor
     MappingManager(std::unique_ptr<IMembershipProtocol> MembershipProtocol,
-                   std::unique_ptr<IMulticastProtocol> MulticastProtocol);
+                   std::unique_ptr<IMulticastProtocol> MulticastProtocol,
+                   std::unique_ptr<AntiEntropyProtocol> AntiEntropyProtocol,
+                   std::unique_ptr<SnapshotProtocol> SnapshotProtocol,
+                   std::unique_ptr<MappingStore> MappingStore,
+                   std::string MappingTablePath,
+                   std::chrono::milliseconds FlushDeadline);
 
     // Destructor
     ~MappingManager();
@@ -74,6 +93,9 @@ public:
                   uint16_t VirtualPort,
                   uint32_t* HostAddress,
                   uint16_t* HostPort) const;
+
+    uint64_t
+    GetMappingVersion() const;
     
     ERROR_CODE
     OnJoin(const std::string& IpAddress) override;
@@ -89,8 +111,20 @@ private:
     ERROR_CODE
     ProcessIncomingMessage(const Message& Message);
     
-    // Hash table storing the mappings
-    std::unordered_map<uint64_t, AddressMapping> m_AddressLookup;
+    ERROR_CODE
+    ProcessMappingRecords(const Message& Message);
+    
+    ERROR_CODE
+    QueueMappingRecord(const MappingRecord& Record);
+    
+    ERROR_CODE
+    FlushMappingRecords();
+    
+    ERROR_CODE
+    MulticastMappingRecords(const std::vector<MappingRecord>& Records);
+    
+    // Lock-free table storing the mappings
+    MappingTable m_AddressLookup;
     
     // Owning pointer to a MembershipProtocol
     std::unique_ptr<IMembershipProtocol> m_MembershipProtocol;
@@ -98,5 +132,32 @@ private:
     // Owning pointer to a MulticastProtocol
     std::unique_ptr<IMulticastProtocol> m_MulticastProtocol;
 
+    // Repairs the mapping table with peers, or nullptr
+    std::unique_ptr<AntiEntropyProtocol> m_AntiEntropyProtocol;
+
+    // Serves the mapping table to joining peers and bootstraps it, or nullptr
+    std::unique_ptr<SnapshotProtocol> m_SnapshotProtocol;
+
+    // Persists the mapping table across restarts, or nullptr
+    std::unique_ptr<MappingStore> m_MappingStore;
+
+    // The IP address of this node, in network byte order, which versions
+    // the writes it makes
+    uint32_t m_IpAddress;
+
     std::thread m_IncomingMessageThread;
+
+    // Records waiting to be multicast, oldest first
+    std::mutex m_PendingLock;
+    std::condition_variable m_PendingCondition;
+    std::vector<MappingRecord> m_PendingRecords;
+
+    // When the oldest pending record must be sent by
+    std::chrono::steady_clock::time_point m_FlushTime;
+
+    // How long a record may wait for others to share its datagram
+    std::chrono::milliseconds m_FlushDeadline;
+
+    bool m_ShouldStop;
+    std::thread m_FlushThread;
 };
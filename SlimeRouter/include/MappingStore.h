@@ -0,0 +1,141 @@
+/*++
+
+Module Name:
+
+    MappingStore.h
+
+Abstract:
+
+    Class declaration of a persistent store of the mapping table, so that a
+    restarted router serves its mappings right away instead of waiting for
+    peers to send them again.
+
+    The store is a snapshot of every record of the table plus an append-only
+    log of the records applied since. A restart maps the snapshot, merges it
+    and replays the log. Records merge idempotently, so replaying a record
+    the snapshot already holds is harmless, and a checkpoint never has to
+    stop writers: it starts a new log, snapshots the table, and only then
+    deletes the old log.
+
+    Appends are not synced. A crashed router loses nothing; a crashed host
+    may lose the latest records, which peers then repair.
+
+--*/
+
+#pragma once
+
+//
+// ---------------------------------------------------------------------- Includes
+//
+
+#include <mutex>
+#include <string>
+#include <thread>
+#include <cstdint>
+#include <condition_variable>
+
+#include "Error.h"
+#include "Message.h"
+
+//
+// ---------------------------------------------------------------------- Definitions
+//
+
+#define MAPPING_STORE_MAGIC 0x4F5453454D494C53ULL // "SLIMESTO"
+#define MAPPING_STORE_VERSION 1
+
+// The snapshot file starts with a header, followed by RecordCount records
+struct MappingStoreHeader
+{
+    uint64_t Magic;
+    uint32_t Version;
+    uint32_t RecordCount;
+
+    // FNV-1a of the records
+    uint64_t Checksum;
+};
+
+// The log is a sequence of entries. A torn entry can only be the last one.
+struct MappingStoreEntry
+{
+    MappingRecord Record;
+
+    // FNV-1a of the record
+    uint64_t Checksum;
+};
+
+//
+// ---------------------------------------------------------------------- Classes
+//
+
+class MappingTable;
+
+class MappingStore
+{
+public:
+    // Constructor
+    MappingStore(std::string Path);
+
+    // Destructor
+    ~MappingStore();
+
+    //
+    // Public Methods
+    //
+
+    // Loads the stored records into the table, then logs its writes
+    ERROR_CODE
+    Init(MappingTable& MappingTable);
+
+    ERROR_CODE
+    Start();
+
+    ERROR_CODE
+    Stop();
+
+    // Called by the table with its writer lock held
+    ERROR_CODE
+    Append(const MappingRecord& Record);
+
+    ERROR_CODE
+    Checkpoint();
+
+private:
+
+    ERROR_CODE
+    LoadSnapshot(uint32_t* RecordCount);
+
+    ERROR_CODE
+    ReplayLog(const std::string& Path,
+              bool ShouldRepair,
+              uint32_t* RecordCount);
+
+    ERROR_CODE
+    WriteSnapshot();
+
+    ERROR_CODE
+    OpenLog();
+
+    ERROR_CODE
+    PeriodicallyCheckpoint();
+
+    // The table to persist, owned by the mapping manager
+    MappingTable* m_MappingTable;
+
+    // The files of the store
+    std::string m_SnapshotPath;
+    std::string m_LogPath;
+    std::string m_OldLogPath;
+
+    // Protects the members below
+    std::mutex m_Mutex;
+
+    int m_LogFd;
+
+    // The number of records logged since the last checkpoint
+    uint32_t m_LogCount;
+
+    bool m_ShouldStop;
+    std::condition_variable m_Condition;
+    std::thread m_CheckpointThread;
+};
@@ -0,0 +1,207 @@
+/*++
+
+Module Name:
+
+    MappingTable.h
+
+Abstract:
+
+    Class declaration of a concurrent, read-optimized mapping table. The table
+    is an open-addressing array keyed on the 64-bit virtual address and is
+    protected by a sequence lock: writers are serialized and bump the sequence
+    around every mutation, while readers never block and simply retry if the
+    sequence changed under them.
+
+    When given a path, the table is published in a file-backed shared mapping
+    (see MappingTableLayout.h) that SlimeSocket maps read-only to resolve
+    virtual addresses without a round trip to the router.
+
+    Behind the shared slots, the router keeps the versioned record of every
+    mapping, tombstones of removed mappings included. A write only applies if
+    its version is greater than that of the record held, so replicas converge
+    whatever order writes arrive in and however often. Tombstones are dropped
+    once they outlive MAPPING_TABLE_TOMBSTONE_LIFETIME; a write older than
+    that is assumed to have reached every replica already.
+
+--*/
+
+#pragma once
+
+//
+// ---------------------------------------------------------------------- Includes
+//
+
+#include <atomic>
+#include <mutex>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Error.h"
+#include "Message.h"
+#include "MappingTableLayout.h"
+#include "HybridLogicalClock.h"
+
+//
+// ---------------------------------------------------------------------- Definitions
+//
+
+// The number of consecutive home slots that make up a bucket
+#define MAPPING_TABLE_BUCKET_SLOTS 16
+
+// The number of children of every inner node of the digest tree
+#define MAPPING_TABLE_DIGEST_FANOUT 16
+
+// How long the tombstone of a removed mapping is kept, in milliseconds
+#define MAPPING_TABLE_TOMBSTONE_LIFETIME (5 * 60 * 1000)
+
+//
+// ---------------------------------------------------------------------- Classes
+//
+
+class MappingStore;
+
+class MappingTable
+{
+public:
+    // Constructor
+    MappingTable(uint32_t Capacity,
+                 std::string Path);
+
+    // Destructor
+    ~MappingTable();
+
+    //
+    // Public Methods
+    //
+
+    ERROR_CODE
+    Init();
+
+    // Writes made by this node, stamped with a new version and returned as
+    // the record to replicate
+    ERROR_CODE
+    Insert(uint64_t VirtualAddress,
+           const AddressMapping& AddressMapping,
+           uint32_t Origin,
+           MappingRecord* Record);
+
+    ERROR_CODE
+    Remove(uint64_t VirtualAddress,
+           const AddressMapping& AddressMapping,
+           uint32_t Origin,
+           MappingRecord* Record);
+
+    // Writes replicated from any node, including this one
+    ERROR_CODE
+    Merge(const MappingRecord& Record);
+
+    ERROR_CODE
+    ExpireTombstones();
+
+    ERROR_CODE
+    Lookup(uint64_t VirtualAddress,
+           AddressMapping* AddressMapping) const;
+
+    uint64_t
+    GetVersion() const;
+
+    // Level 0 holds the root; the last level holds one digest per bucket
+    uint32_t
+    GetDigestLevelCount() const;
+
+    uint32_t
+    GetDigestCount(uint32_t Level) const;
+
+    ERROR_CODE
+    GetDigest(uint32_t Level,
+              uint32_t Index,
+              uint64_t* Digest);
+
+    ERROR_CODE
+    GetBucket(uint32_t Bucket,
+              std::vector<MappingRecord>* Records);
+
+    ERROR_CODE
+    GetRecords(std::vector<MappingRecord>* Records,
+               uint64_t* Version);
+
+    // Logs every record applied from now on, or stops logging if nullptr
+    void
+    SetStore(MappingStore* Store);
+
+private:
+
+    ERROR_CODE
+    MapPublishedTable(void** Region);
+
+    void
+    Reset();
+
+    uint64_t
+    BeginWrite();
+
+    void
+    EndWrite(uint64_t Sequence);
+
+    uint32_t
+    FindSlot(uint64_t VirtualAddress) const;
+
+    MappingRecord*
+    FindRecord(uint64_t VirtualAddress);
+
+    ERROR_CODE
+    ApplyRecord(uint64_t VirtualAddress,
+                const MappingRecord& Record);
+
+    ERROR_CODE
+    StoreSlot(uint64_t VirtualAddress,
+              uint64_t HostAddress);
+
+    void
+    ClearSlot(uint64_t VirtualAddress);
+
+    void
+    Compact();
+
+    uint32_t
+    GetBucketIndex(uint64_t VirtualAddress) const;
+
+    void
+    UpdateDigests(uint64_t VirtualAddress,
+                  const MappingRecord& Record);
+
+    // The shared header of the table, followed in memory by the slots
+    MappingTableHeader* m_Header;
+
+    // The slots of the table
+    MappingTableSlot* m_Slots;
+
+    // The requested number of slots
+    uint32_t m_Capacity;
+
+    // The file to publish the table in, or empty for a private table
+    std::string m_Path;
+
+    // The size of the mapped region
+    size_t m_RegionSize;
+
+    // Serializes writers. Readers never take it.
+    std::mutex m_WriterLock;
+
+    // The number of home slots per bucket
+    uint32_t m_BucketSlots;
+
+    // The digest tree, root first. Protected by the writer lock.
+    std::vector<std::vector<uint64_t>> m_Digests;
+
+    // The records of every bucket, live and deleted. Protected by the writer
+    // lock.
+    std::vector<std::vector<MappingRecord>> m_Records;
+
+    // Versions the writes of this node. Protected by the writer lock.
+    HybridLogicalClock m_Clock;
+
+    // Persists the applied records, or nullptr. Protected by the writer lock.
+    MappingStore* m_Store;
+};
@@ -0,0 +1,137 @@
+/*++
+
+Module Name:
+
+    RingQueue.h
+
+Abstract:
+
+    Class definition for a bounded, lock-free ring queue with a single
+    consumer and either one or many producers.
+
+    Every slot carries a sequence number that tells producers and the
+    consumer whose turn it is, so neither side takes a lock. The producer
+    and consumer positions live on cache lines of their own. Threads only
+    sleep, on a futex, when the ring is empty or, under QUEUE_FULL_BLOCK,
+    full; the other side issues a wake-up only if someone is asleep.
+
+--*/
+
+#pragma once
+
+//
+// ---------------------------------------------------------------------- Includes
+//
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+#include "Error.h"
+#include "BlockingQueue.h"
+
+//
+// ---------------------------------------------------------------------- Definitions
+//
+
+#define RING_QUEUE_CACHE_LINE_SIZE 64
+
+// How often an empty or full ring is checked again before going to sleep.
+// Uniprocessors go to sleep right away, as nobody can make progress meanwhile.
+#define RING_QUEUE_SPIN_COUNT 64
+
+enum RingQueueProducers
+{
+    // Only one thread ever pushes
+    RING_QUEUE_SINGLE_PRODUCER = 0,
+
+    // Any number of threads push concurrently
+    RING_QUEUE_MULTI_PRODUCER = 1
+};
+
+//
+// ---------------------------------------------------------------------- Classes
+//
+
+template<typename T, RingQueueProducers Producers>
+class RingQueue
+{
+public:
+    // Constructor
+    RingQueue(size_t Capacity,
+              QueueFullPolicy FullPolicy = QUEUE_FULL_BLOCK);
+
+    // Destructor
+    ~RingQueue();
+
+    //
+    // Public Methods
+    //
+
+    ERROR_CODE
+    Push(const T& Item);
+
+    ERROR_CODE
+    Push(T&& Item);
+
+    ERROR_CODE
+    Pop(T* Item);
+
+    ERROR_CODE
+    RequestShutdown();
+
+private:
+
+    struct alignas(RING_QUEUE_CACHE_LINE_SIZE) Slot
+    {
+        // Equal to the position of a producer when the slot is free for it,
+        // one past it once the item is published
+        std::atomic<uint64_t> Sequence;
+        T Item;
+    };
+
+    template<typename U>
+    ERROR_CODE
+    Emplace(U&& Item);
+
+    bool
+    TryPush(uint64_t* Position);
+
+    bool
+    TryPop(T* Item);
+
+    static
+    void
+    FutexWait(std::atomic<uint32_t>* Epoch,
+              uint32_t Observed);
+
+    static
+    void
+    FutexWake(std::atomic<uint32_t>* Epoch,
+              int Count);
+
+    std::unique_ptr<Slot[]> m_Slots;
+    uint64_t m_Mask;
+    QueueFullPolicy m_FullPolicy;
+    uint32_t m_SpinCount;
+
+    // The next position producers write, shared among them
+    alignas(RING_QUEUE_CACHE_LINE_SIZE) std::atomic<uint64_t> m_Tail;
+
+    // Bumped after items are pushed while the consumer sleeps. The waiting
+    // flag is cleared by whoever issues the wake-up, so that one is issued
+    // per sleep rather than per push.
+    alignas(RING_QUEUE_CACHE_LINE_SIZE) std::atomic<uint32_t> m_PushEpoch;
+    std::atomic<uint32_t> m_ConsumerWaiting;
+
+    // Bumped after items are popped while producers sleep on a full ring
+    alignas(RING_QUEUE_CACHE_LINE_SIZE) std::atomic<uint32_t> m_PopEpoch;
+    std::atomic<uint32_t> m_ProducersWaiting;
+
+    // The next position the consumer reads. Only the consumer touches it.
+    alignas(RING_QUEUE_CACHE_LINE_SIZE) uint64_t m_Head;
+
+    std::atomic<bool> m_ShouldShutdown;
+};
+
+#include "../src/RingQueue.tpp"
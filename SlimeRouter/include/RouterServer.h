@@ -17,6 +17,11 @@ Abstract:
 //
 
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <unordered_map>
+#include <condition_variable>
 
 #include "UnixServer.h"
 #include "Message.h"
@@ -62,25 +67,52 @@ protected:
     
     ERROR_CODE
     OnMessage(int ClientSocket,
-              const Message& Message) override;
+              const Message& Message,
+              const std::vector<int>& FileDescriptors) override;
+
+    void
+    OnDisconnect(int ClientSocket) override;
 private:
     
     ERROR_CODE
     ProcessSocketRequest(int ClientSocket,
+                         const MessageHeader& RequestHeader,
                          const SocketRequest& SocketRequest);
 
     ERROR_CODE
-    ProcessBindRequest(int ClientSocket,
-                       const BindRequest& BindRequest);
+    ProcessSocketPoolRequest(int ClientSocket,
+                             const MessageHeader& RequestHeader,
+                             const SocketPoolRequest& SocketPoolRequest);
 
     ERROR_CODE
-    ProcessAcceptRequest(int ClientSocket,
-                         const AcceptRequest& AcceptRequest);
+    ProcessBindRequest(int ClientSocket,
+                       const MessageHeader& RequestHeader,
+                       const BindRequest& BindRequest,
+                       int HostSocket);
 
     ERROR_CODE
     ProcessConnectRequest(int ClientSocket,
-                          const ConnectRequest& ConnectRequest);
+                          const MessageHeader& RequestHeader,
+                          const ConnectRequest& ConnectRequest,
+                          int HostSocket);
+    
+    ERROR_CODE
+    RefillSocketPools();
     
     // Owning pointer to a MappingManager
     std::unique_ptr<MappingManager> m_MappingManager;
+
+    // Sent with every resolution, see ConnectResponse
+    uint64_t m_Epoch;
+
+    // Host sockets created ahead of time for each client, keyed by client socket
+    std::mutex m_SocketPoolsLock;
+    std::condition_variable m_RefillCondition;
+    std::unordered_map<int, std::vector<int>> m_SocketPools;
+
+    // Clients whose pools were drawn from since the last refill
+    std::vector<int> m_PendingRefills;
+
+    bool m_ShouldStop;
+    std::thread m_RefillThread;
 };
@@ -0,0 +1,120 @@
+/*++
+
+Module Name:
+
+    SnapshotProtocol.h
+
+Abstract:
+
+    Class declaration of a snapshot protocol bootstrapping the mapping table
+    of a joining node.
+
+    Every node serves a snapshot of its mapping table over TCP. A node that
+    starts with an empty table fetches a snapshot from the first member it
+    learns about, trying the others in turn if that fails, and stops once
+    one transfer succeeds. The snapshot is streamed in checksummed chunks,
+    so a corrupted transfer is abandoned rather than applied.
+
+    Gossip runs while the snapshot is in flight. Snapshot records are merged
+    like any other, so whichever of the two carries the newer record of a
+    mapping wins regardless of which arrives first.
+
+--*/
+
+#pragma once
+
+//
+// ---------------------------------------------------------------------- Includes
+//
+
+#include <mutex>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+
+#include "Error.h"
+#include "Message.h"
+
+//
+// ---------------------------------------------------------------------- Definitions
+//
+
+
+
+//
+// ---------------------------------------------------------------------- Classes
+//
+
+class MappingTable;
+
+class SnapshotProtocol
+{
+public:
+    // Constructor
+    SnapshotProtocol(uint16_t Port);
+
+    // Destructor
+    ~SnapshotProtocol();
+
+    //
+    // Public Methods
+    //
+
+    ERROR_CODE
+    Init(MappingTable& MappingTable);
+
+    ERROR_CODE
+    Start();
+
+    ERROR_CODE
+    Stop();
+
+    // Offers a member to bootstrap from until a snapshot has been applied
+    ERROR_CODE
+    AddPeer(const std::string& IpAddress);
+
+private:
+
+    ERROR_CODE
+    ServeSnapshots();
+
+    ERROR_CODE
+    SendSnapshot(int Socket);
+
+    ERROR_CODE
+    Bootstrap();
+
+    ERROR_CODE
+    ReceiveSnapshot(const std::string& IpAddress);
+
+    ERROR_CODE
+    ReceiveMessage(int Socket,
+                   int Id,
+                   void* Data,
+                   size_t MaximumSize,
+                   size_t* Size);
+
+    // The table to serve and bootstrap, owned by the mapping manager
+    MappingTable* m_MappingTable;
+
+    // The TCP port snapshots are served on, by this node and its peers
+    uint16_t m_Port;
+    int m_ServerSocket;
+
+    // Protects the members below
+    std::mutex m_Mutex;
+
+    // Members not tried yet, oldest first
+    std::vector<std::string> m_Peers;
+
+    // Set once a snapshot has been applied
+    bool m_IsBootstrapped;
+
+    bool m_ShouldStop;
+    std::condition_variable m_Condition;
+
+    std::thread m_ServerThread;
+    std::thread m_BootstrapThread;
+};
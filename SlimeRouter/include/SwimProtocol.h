@@ -0,0 +1,218 @@
+/*++
+
+Module Name:
+
+    SwimProtocol.h
+
+Abstract:
+
+    Class declaration of a SWIM membership protocol.
+
+    Every protocol period each node pings one member, taken in a shuffled
+    round-robin order. If no ack arrives in time, a few other members are
+    asked to ping it on the node's behalf. A member no one can reach is
+    suspected, and declared dead unless it refutes the suspicion, by raising
+    its incarnation number, before the suspicion times out. Membership
+    updates ride on the pings and acks themselves, each sent a number of
+    times that grows with the logarithm of the cluster size, so the load per
+    node stays constant however large the cluster grows.
+
+    Members are seeded by another membership protocol, such as the Docker
+    plugin, and by a list of addresses given up front.
+
+--*/
+
+#pragma once
+
+//
+// ---------------------------------------------------------------------- Includes
+//
+
+#include <mutex>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <unordered_map>
+#include <condition_variable>
+
+#include "IMembershipProtocol.h"
+#include "IMembershipManager.h"
+#include "Message.h"
+
+//
+// ---------------------------------------------------------------------- Definitions
+//
+
+
+
+//
+// ---------------------------------------------------------------------- Classes
+//
+
+class UdpClient;
+class UdpServer;
+
+class SwimProtocol final : public IMembershipProtocol, public IMembershipManager
+{
+public:
+    // Constructor
+    SwimProtocol(std::unique_ptr<UdpClient> UdpClient,
+                 std::shared_ptr<UdpServer> UdpServer,
+                 std::unique_ptr<IMembershipProtocol> SeedProtocol,
+                 std::vector<std::string> SeedNodes);
+
+    // Destructor
+    ~SwimProtocol();
+
+    //
+    // Public Methods
+    //
+
+    ERROR_CODE
+    Init(IMembershipManager& MembershipManager) override;
+
+    ERROR_CODE
+    Start() override;
+
+    ERROR_CODE
+    Stop() override;
+
+    // Called by the seed protocol
+    ERROR_CODE
+    OnJoin(const std::string& IpAddress) override;
+
+    ERROR_CODE
+    OnLeave(const std::string& IpAddress) override;
+
+private:
+
+    struct Member
+    {
+        uint32_t Incarnation;
+        SwimMemberState State;
+
+        // When the member entered its current state
+        std::chrono::steady_clock::time_point StateChangeTime;
+    };
+
+    // An update waiting to be piggybacked
+    struct Dissemination
+    {
+        SwimUpdate Update;
+        uint32_t TransmissionsLeft;
+    };
+
+    // A ping sent on behalf of another node
+    struct Relay
+    {
+        uint32_t RequesterIpAddress;
+        uint32_t SequenceNumber;
+        std::chrono::steady_clock::time_point Expiry;
+    };
+
+    // A change to report to the membership manager
+    struct MembershipChange
+    {
+        uint32_t IpAddress;
+        bool IsMember;
+    };
+
+    ERROR_CODE
+    HandleIncomingMessages();
+
+    ERROR_CODE
+    OnReceive(const Message& Message);
+
+    ERROR_CODE
+    ProbeMembers();
+
+    ERROR_CODE
+    ProbeMember(uint32_t Target,
+                std::chrono::steady_clock::time_point Deadline);
+
+    ERROR_CODE
+    SendMessage(SwimMessageType Type,
+                uint32_t Destination,
+                uint32_t SequenceNumber,
+                uint32_t Target);
+
+    void
+    ApplyUpdate(const SwimUpdate& Update,
+                std::vector<MembershipChange>* Changes);
+
+    void
+    SetMemberState(uint32_t IpAddress,
+                   uint32_t Incarnation,
+                   SwimMemberState State,
+                   std::vector<MembershipChange>* Changes);
+
+    void
+    QueueUpdate(uint32_t IpAddress,
+                uint32_t Incarnation,
+                SwimMemberState State);
+
+    void
+    ExpireMembers(std::vector<MembershipChange>* Changes);
+
+    bool
+    SelectProbeTarget(uint32_t* Target);
+
+    std::vector<uint32_t>
+    SelectRandomMembers(size_t Count,
+                        uint32_t Excluded);
+
+    uint32_t
+    GetClusterLogarithm() const;
+
+    void
+    ReportChanges(const std::vector<MembershipChange>& Changes);
+
+    std::unique_ptr<UdpClient> m_UdpClient;
+
+    // Shared with the multicast protocol, which starts and stops it
+    std::shared_ptr<UdpServer> m_UdpServer;
+
+    // Tells this protocol about nodes to probe
+    std::unique_ptr<IMembershipProtocol> m_SeedProtocol;
+    std::vector<std::string> m_SeedNodes;
+
+    IMembershipManager* m_MembershipManager;
+
+    // Protects the members below
+    std::mutex m_Mutex;
+
+    // Every other node known, including dead ones until they are forgotten
+    std::unordered_map<uint32_t, Member> m_Members;
+
+    // Updates still to be piggybacked, at most one per node
+    std::unordered_map<uint32_t, Dissemination> m_Updates;
+
+    // Pings sent on behalf of other nodes, keyed by our sequence number
+    std::unordered_map<uint32_t, Relay> m_Relays;
+
+    // The shuffled order members are probed in, and the next to probe
+    std::vector<uint32_t> m_ProbeOrder;
+    size_t m_ProbeIndex;
+
+    // The IP address of this node, in network byte order
+    uint32_t m_IpAddress;
+    uint32_t m_Incarnation;
+
+    uint32_t m_NextSequenceNumber;
+
+    // The probe in flight, and whether it has been answered
+    uint32_t m_ProbeSequenceNumber;
+    bool m_IsProbeAcked;
+
+    std::mt19937 m_RandomEngine;
+
+    // Signalled on acks and when the protocol stops
+    std::condition_variable m_Condition;
+    bool m_ShouldStop;
+
+    std::thread m_ProbeThread;
+    std::thread m_IncomingMessageThread;
+};
@@ -17,6 +17,7 @@ Abstract:
 //
 
 #include <string>
+#include <vector>
 
 #include "Message.h"
 #include "Error.h"
@@ -54,6 +55,11 @@ public:
          const std::string& IpAddress,
          const uint16_t Port);
     
+    ERROR_CODE
+    Send(const std::vector<Message>& Messages,
+         const std::vector<std::string>& IpAddresses,
+         const uint16_t Port);
+    
 private:
     int m_ClientSocket;
 // BlockingQueue<std::string> m_OutgoingMessages;
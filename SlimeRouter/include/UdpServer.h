@@ -17,8 +17,11 @@ Abstract:
 //
 
 #include <thread>
+#include <atomic>
+#include <vector>
+#include <sys/socket.h>
 
-#include "BlockingQueue.h"
+#include "RingQueue.h"
 
 //
 // ---------------------------------------------------------------------- Definitions
@@ -57,6 +60,9 @@ public:
     ERROR_CODE
     GetNextIncomingMessage(Message* Message);
 
+    ERROR_CODE
+    GetNextMembershipMessage(Message* Message);
+
 private:
 
     ERROR_CODE
@@ -65,5 +71,18 @@ private:
     int m_ServerSocket;
     uint16_t m_Port;
     std::thread m_ServerThread;
-    BlockingQueue<Message> m_IncomingMessages;
+    std::atomic<bool> m_ShouldStop;
+
+    // Filled by the listener thread only; datagrams arriving while it is
+    // full are dropped
+    RingQueue<Message, RING_QUEUE_SINGLE_PRODUCER> m_IncomingMessages;
+
+    // Failure detection is timing sensitive, so its messages skip the
+    // backlog of gossip
+    RingQueue<Message, RING_QUEUE_SINGLE_PRODUCER> m_MembershipMessages;
+
+    // Receive buffer ring, one slot per datagram of a batch
+    std::vector<uint8_t> m_ReceiveBuffers;
+    std::vector<struct iovec> m_ReceiveVectors;
+    std::vector<struct mmsghdr> m_ReceiveHeaders;
 };
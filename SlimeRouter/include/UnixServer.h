@@ -18,6 +18,10 @@ Abstract:
 
 #include <thread>
 #include <string>
+#include <vector>
+#include <mutex>
+#include <memory>
+#include <unordered_map>
 
 #include "Error.h"
 #include "Message.h"
@@ -44,10 +48,10 @@ public:
     //
     // Public Methods
     //
-    
+
     ERROR_CODE
     Init();
-    
+
     ERROR_CODE
     Start();
 
@@ -55,21 +59,85 @@ public:
     Stop();
 
 protected:
-    
+
+    // FileDescriptors are those sent along with the message. They are closed
+    // once the handler returns. Several messages of the same client may be
+    // handled at once; answer each with SendResponse.
     virtual
     ERROR_CODE
     OnMessage(int ClientSocket,
-              const Message& Message) = 0;
-    
+              const Message& Message,
+              const std::vector<int>& FileDescriptors) = 0;
+
+    ERROR_CODE
+    SendResponse(int ClientSocket,
+                 const MessageHeader& RequestHeader,
+                 const void* Body,
+                 size_t Size,
+                 const int* FileDescriptors,
+                 size_t FileDescriptorCount);
+
+    virtual
+    void
+    OnDisconnect(int ClientSocket);
+
 private:
-    
+
+    // Framing state of a single client connection
+    struct Connection
+    {
+        // The socket used to communicate with the SlimeSocket client
+        int Socket = -1;
+
+        // The message currently being read
+        Message CurrentMessage;
+
+        // The number of bytes of the current message (header and body) read so far
+        size_t BytesRead = 0;
+
+        // File descriptors received with the current message
+        std::vector<int> FileDescriptors;
+
+        // Serializes responses, which several workers may be writing at once
+        std::mutex WriteLock;
+
+        // Workers using the connection, and whether it is to be closed once
+        // the last of them is done. Guarded by m_ConnectionsLock.
+        size_t References = 0;
+        bool IsClosing = false;
+    };
+
+    ERROR_CODE
+    ProcessEvents();
+
     ERROR_CODE
-    Listen();
+    AcceptConnections();
 
     ERROR_CODE
     HandleIncomingConnection(int ClientSocket);
-    
+
+    ERROR_CODE
+    ReadMessage(Connection& Connection);
+
+    void
+    CloseFileDescriptors(Connection& Connection);
+
+    Connection*
+    AcquireConnection(int ClientSocket);
+
+    void
+    ReleaseConnection(Connection* Connection);
+
+    void
+    CloseConnection(Connection& Connection);
+
     std::string m_Path;
     int m_ServerSocket;
-    std::thread m_ServerThread;
+    int m_EpollFd;
+    int m_StopEvent;
+    std::vector<std::thread> m_WorkerThreads;
+
+    // Connections currently registered with the epoll instance, keyed by socket
+    std::mutex m_ConnectionsLock;
+    std::unordered_map<int, std::unique_ptr<Connection>> m_Connections;
 };
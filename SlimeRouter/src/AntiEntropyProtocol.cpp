@@ -0,0 +1,729 @@
+/*++
+
+Module Name:
+
+    AntiEntropyProtocol.cpp
+
+Abstract:
+
+    Class implementation of an anti-entropy protocol repairing the mapping
+    table.
+
+    The exchange is stateless: every message is answered on its own, so a
+    lost datagram only cuts a round short and the next one picks up the
+    remaining differences. Each answer is capped, which bounds the traffic
+    of a round however far two tables diverged.
+
+--*/
+
+//
+// ---------------------------------------------------------------------- Includes
+//
+
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+#include <iterator>
+
+#include "AntiEntropyProtocol.h"
+#include "MappingTable.h"
+#include "UdpClient.h"
+#include "NetworkUtils.h"
+
+//
+// ---------------------------------------------------------------------- Definitions
+//
+
+#define UDP_PORT 8080
+
+#define ANTI_ENTROPY_PERIOD std::chrono::seconds(1)
+#define ANTI_ENTROPY_MAX_DATAGRAM_SIZE 1472 // Ethernet MTU minus the IPv4 and UDP headers
+
+// The most digests and buckets sent in answer to a single message
+#define ANTI_ENTROPY_MAX_DIGESTS 256
+#define ANTI_ENTROPY_MAX_BUCKETS 64
+
+//
+// ---------------------------------------------------------------------- Functions
+//
+
+static
+std::string
+FormatIpAddress(uint32_t IpAddress)
+{
+    char ipAddress[INET_ADDRSTRLEN] = {};
+
+    inet_ntop(AF_INET, &IpAddress, ipAddress, sizeof(ipAddress));
+
+    return ipAddress;
+}
+
+static
+Message
+CreateBucketMessage(uint32_t Source,
+                    uint32_t Flags,
+                    const std::vector<uint32_t>& Buckets,
+                    const std::vector<MappingRecord>& Records)
+{
+    Message message;
+    BucketHeader bucketHeader;
+    size_t offset = 0;
+
+    bucketHeader.SourceIpAddress = Source;
+    bucketHeader.Flags = Flags;
+    bucketHeader.BucketCount = Buckets.size();
+    bucketHeader.RecordCount = Records.size();
+
+    message.Header.Id = ANTI_ENTROPY_MESSAGE_TYPE_BUCKETS;
+    message.Header.Size = sizeof(bucketHeader) +
+                          Buckets.size() * sizeof(uint32_t) +
+                          Records.size() * sizeof(MappingRecord);
+    message.Body.resize(message.Header.Size);
+
+    std::memcpy(message.Body.data(), &bucketHeader, sizeof(bucketHeader));
+    offset = sizeof(bucketHeader);
+
+    std::memcpy(message.Body.data() + offset, Buckets.data(), Buckets.size() * sizeof(uint32_t));
+    offset += Buckets.size() * sizeof(uint32_t);
+
+    std::memcpy(message.Body.data() + offset, Records.data(), Records.size() * sizeof(MappingRecord));
+
+    return message;
+}
+
+AntiEntropyProtocol::AntiEntropyProtocol(std::unique_ptr<UdpClient> UdpClient)
+/*++
+
+Routine Description:
+
+    Constructor for AntiEntropyProtocol.
+
+Arguments:
+
+    UdpClient - The client to send anti-entropy messages with.
+
+Return Value:
+
+    None.
+
+--*/
+    :
+    m_UdpClient(std::move(UdpClient)),
+    m_MappingTable(nullptr),
+    m_IpAddress(0),
+    m_RandomEngine(std::random_device{}()),
+    m_ShouldStop(false)
+{
+}
+
+AntiEntropyProtocol::~AntiEntropyProtocol()
+/*++
+
+Routine Description:
+
+    Destructor for AntiEntropyProtocol.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    Stop();
+}
+
+ERROR_CODE
+AntiEntropyProtocol::Init(MappingTable& MappingTable)
+/*++
+
+Routine Description:
+
+    Initializes the AntiEntropyProtocol instance.
+
+Arguments:
+
+    MappingTable - The mapping table to keep in sync with peers.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+
+    m_MappingTable = &MappingTable;
+
+    TRACE_IF_FAILED(NetworkUtils::GetIpAddress(&m_IpAddress),
+                    Cleanup,
+                    "Failed to get IP address! 0x%x\n", ec);
+
+    TRACE_IF_FAILED(m_UdpClient->Init(),
+                    Cleanup,
+                    "Failed to initialize UDP client! 0x%x\n", ec);
+
+Cleanup:
+    return ec;
+}
+
+ERROR_CODE
+AntiEntropyProtocol::Start()
+/*++
+
+Routine Description:
+
+    Starts synchronizing with peers.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+
+    m_SynchronizeThread = std::thread([=] { PeriodicallySynchronize(); });
+
+    return ec;
+}
+
+ERROR_CODE
+AntiEntropyProtocol::Stop()
+/*++
+
+Routine Description:
+
+    Stops synchronizing with peers.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+
+    {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        m_ShouldStop = true;
+    }
+
+    m_StopCondition.notify_all();
+
+    if (m_SynchronizeThread.joinable())
+    {
+        m_SynchronizeThread.join();
+    }
+
+    return ec;
+}
+
+ERROR_CODE
+AntiEntropyProtocol::AddPeer(const std::string& IpAddress)
+/*++
+
+Routine Description:
+
+    Adds a member to synchronize with.
+
+Arguments:
+
+    IpAddress - The IP address of the member.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    m_Peers.insert(IpAddress);
+
+    return ec;
+}
+
+ERROR_CODE
+AntiEntropyProtocol::RemovePeer(const std::string& IpAddress)
+/*++
+
+Routine Description:
+
+    Stops synchronizing with a member.
+
+Arguments:
+
+    IpAddress - The IP address of the member.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    m_Peers.erase(IpAddress);
+
+    return ec;
+}
+
+ERROR_CODE
+AntiEntropyProtocol::OnReceive(const Message& Message)
+/*++
+
+Routine Description:
+
+    Handles an anti-entropy message from a peer.
+
+Arguments:
+
+    Message - The received message.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+
+    switch (Message.Header.Id)
+    {
+    case ANTI_ENTROPY_MESSAGE_TYPE_DIGESTS:
+        TRACE_IF_FAILED(OnDigests(Message),
+                        Cleanup,
+                        "Failed to handle digests! 0x%x\n", ec);
+        break;
+    case ANTI_ENTROPY_MESSAGE_TYPE_BUCKETS:
+        TRACE_IF_FAILED(OnBuckets(Message),
+                        Cleanup,
+                        "Failed to handle buckets! 0x%x\n", ec);
+        break;
+    default:
+        EXIT_IF_FAILED(E_INVALIDARG, Cleanup);
+        break;
+    }
+
+Cleanup:
+    return ec;
+}
+
+ERROR_CODE
+AntiEntropyProtocol::PeriodicallySynchronize()
+/*++
+
+Routine Description:
+
+    Sends the root digest of the table to a random peer every
+ANTI_ENTROPY_PERIOD. The peer takes it from there if its root differs.
+Expired tombstones are dropped first, so that tables compare without them.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    std::vector<std::string> peers;
+    DigestEntry root = {};
+    uint32_t peer = 0;
+
+    while (!m_StopCondition.wait_for(lock, ANTI_ENTROPY_PERIOD, [=] { return m_ShouldStop; }))
+    {
+        m_MappingTable->ExpireTombstones();
+
+        peers.clear();
+        std::sample(m_Peers.begin(),
+                    m_Peers.end(),
+                    std::back_inserter(peers),
+                    1,
+                    m_RandomEngine);
+
+        if (peers.empty() || inet_pton(AF_INET, peers[0].c_str(), &peer) != 1)
+        {
+            continue;
+        }
+
+        lock.unlock();
+
+        if (SUCCEEDED(m_MappingTable->GetDigest(0, 0, &root.Digest)))
+        {
+            SendDigests(peer, 0, {root});
+        }
+
+        lock.lock();
+    }
+
+    return ec;
+}
+
+ERROR_CODE
+AntiEntropyProtocol::OnDigests(const Message& Message)
+/*++
+
+Routine Description:
+
+    Handles digests from a peer. Answers the digests of inner nodes that
+differ from ours with our digests of their children, and those of buckets
+that differ with our records of those buckets.
+
+Arguments:
+
+    Message - The received digests.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    const uint32_t bucketLevel = m_MappingTable->GetDigestLevelCount() - 1;
+    DigestHeader digestHeader;
+    DigestEntry entry;
+    std::vector<uint32_t> mismatches;
+    std::vector<DigestEntry> children;
+    uint64_t digest = 0;
+    uint32_t childCount = 0;
+
+    EXIT_IF_TRUE(Message.Body.size() < sizeof(digestHeader),
+                 E_INVALIDARG,
+                 Cleanup);
+
+    std::memcpy(&digestHeader, Message.Body.data(), sizeof(digestHeader));
+
+    EXIT_IF_TRUE(Message.Body.size() < sizeof(digestHeader) + (size_t)digestHeader.Count * sizeof(DigestEntry),
+                 E_INVALIDARG,
+                 Cleanup);
+
+    if (digestHeader.BucketCount != m_MappingTable->GetDigestCount(bucketLevel))
+    {
+        LOG("Peer %s has a mapping table of a different shape!\n",
+            FormatIpAddress(digestHeader.SourceIpAddress).c_str());
+        EXIT_IF_FAILED(E_INVALIDARG, Cleanup);
+    }
+
+    EXIT_IF_TRUE(digestHeader.Level > bucketLevel,
+                 E_INVALIDARG,
+                 Cleanup);
+
+    for (uint32_t i = 0; i < digestHeader.Count; i++)
+    {
+        std::memcpy(&entry,
+                    Message.Body.data() + sizeof(digestHeader) + i * sizeof(DigestEntry),
+                    sizeof(entry));
+
+        EXIT_IF_FAILED(m_MappingTable->GetDigest(digestHeader.Level, entry.Index, &digest),
+                       Cleanup);
+
+        if (digest != entry.Digest)
+        {
+            mismatches.push_back(entry.Index);
+        }
+    }
+
+    EXIT_IF_TRUE(mismatches.empty(),
+                 S_OK,
+                 Cleanup);
+
+    if (digestHeader.Level == bucketLevel)
+    {
+        if (mismatches.size() > ANTI_ENTROPY_MAX_BUCKETS)
+        {
+            mismatches.resize(ANTI_ENTROPY_MAX_BUCKETS);
+        }
+
+        EXIT_IF_FAILED(SendBuckets(digestHeader.SourceIpAddress, mismatches, ANTI_ENTROPY_FLAG_REPLY),
+                       Cleanup);
+        goto Cleanup;
+    }
+
+    childCount = m_MappingTable->GetDigestCount(digestHeader.Level + 1);
+
+    for (uint32_t mismatch : mismatches)
+    {
+        for (uint32_t child = mismatch * MAPPING_TABLE_DIGEST_FANOUT;
+             child < std::min<uint64_t>(((uint64_t)mismatch + 1) * MAPPING_TABLE_DIGEST_FANOUT, childCount) &&
+             children.size() < ANTI_ENTROPY_MAX_DIGESTS;
+             child++)
+        {
+            EXIT_IF_FAILED(m_MappingTable->GetDigest(digestHeader.Level + 1, child, &entry.Digest),
+                           Cleanup);
+            entry.Index = child;
+            children.push_back(entry);
+        }
+    }
+
+    EXIT_IF_FAILED(SendDigests(digestHeader.SourceIpAddress, digestHeader.Level + 1, children),
+                   Cleanup);
+
+Cleanup:
+    return ec;
+}
+
+ERROR_CODE
+AntiEntropyProtocol::OnBuckets(const Message& Message)
+/*++
+
+Routine Description:
+
+    Handles the records of buckets from a peer. Merges them into the table
+and answers with our own records of the same buckets if asked to.
+
+Arguments:
+
+    Message - The received buckets.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    BucketHeader bucketHeader;
+    std::vector<uint32_t> buckets;
+    std::vector<MappingRecord> records;
+    size_t offset = 0;
+
+    EXIT_IF_TRUE(Message.Body.size() < sizeof(bucketHeader),
+                 E_INVALIDARG,
+                 Cleanup);
+
+    std::memcpy(&bucketHeader, Message.Body.data(), sizeof(bucketHeader));
+    offset = sizeof(bucketHeader);
+
+    EXIT_IF_TRUE(Message.Body.size() != offset +
+                                        (size_t)bucketHeader.BucketCount * sizeof(uint32_t) +
+                                        (size_t)bucketHeader.RecordCount * sizeof(MappingRecord),
+                 E_INVALIDARG,
+                 Cleanup);
+
+    buckets.resize(bucketHeader.BucketCount);
+    std::memcpy(buckets.data(), Message.Body.data() + offset, buckets.size() * sizeof(uint32_t));
+    offset += buckets.size() * sizeof(uint32_t);
+
+    records.resize(bucketHeader.RecordCount);
+    std::memcpy(records.data(), Message.Body.data() + offset, records.size() * sizeof(MappingRecord));
+
+    MergeRecords(records);
+
+    if (bucketHeader.Flags & ANTI_ENTROPY_FLAG_REPLY)
+    {
+        EXIT_IF_FAILED(SendBuckets(bucketHeader.SourceIpAddress, buckets, 0),
+                       Cleanup);
+    }
+
+Cleanup:
+    return ec;
+}
+
+ERROR_CODE
+AntiEntropyProtocol::SendDigests(uint32_t Destination,
+                                 uint32_t Level,
+                                 const std::vector<DigestEntry>& Digests)
+/*++
+
+Routine Description:
+
+    Sends digests of one level of the tree to a peer, as many per datagram
+as fit.
+
+Arguments:
+
+    Destination - The IP address of the peer.
+
+    Level - The level the digests are on.
+
+    Digests - The digests to send.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    const size_t digestsPerMessage = (ANTI_ENTROPY_MAX_DATAGRAM_SIZE - sizeof(MessageHeader) - sizeof(DigestHeader)) / sizeof(DigestEntry);
+    const uint32_t bucketLevel = m_MappingTable->GetDigestLevelCount() - 1;
+    std::vector<Message> messages;
+    DigestHeader digestHeader;
+    Message message;
+
+    digestHeader.SourceIpAddress = m_IpAddress;
+    digestHeader.BucketCount = m_MappingTable->GetDigestCount(bucketLevel);
+    digestHeader.Level = Level;
+
+    message.Header.Id = ANTI_ENTROPY_MESSAGE_TYPE_DIGESTS;
+
+    for (size_t i = 0; i < Digests.size(); i += digestHeader.Count)
+    {
+        digestHeader.Count = std::min(digestsPerMessage, Digests.size() - i);
+
+        message.Header.Size = sizeof(digestHeader) + digestHeader.Count * sizeof(DigestEntry);
+        message.Body.resize(message.Header.Size);
+        std::memcpy(message.Body.data(), &digestHeader, sizeof(digestHeader));
+        std::memcpy(message.Body.data() + sizeof(digestHeader),
+                    &Digests[i],
+                    digestHeader.Count * sizeof(DigestEntry));
+
+        messages.push_back(message);
+    }
+
+    EXIT_IF_TRUE(messages.empty(),
+                 S_OK,
+                 Cleanup);
+
+    TRACE_IF_FAILED(m_UdpClient->Send(messages, {FormatIpAddress(Destination)}, UDP_PORT),
+                    Cleanup,
+                    "Failed to send digests! 0x%x\n", ec);
+
+Cleanup:
+    return ec;
+}
+
+ERROR_CODE
+AntiEntropyProtocol::SendBuckets(uint32_t Destination,
+                                 const std::vector<uint32_t>& Buckets,
+                                 uint32_t Flags)
+/*++
+
+Routine Description:
+
+    Sends our records of some buckets to a peer, packing as many buckets per
+datagram as fit. A bucket too large for one datagram is spread over several;
+only the first names the bucket, so the peer answers it once. Records merge
+on their own, so a peer missing some of the datagrams still applies the rest.
+
+Arguments:
+
+    Destination - The IP address of the peer.
+
+    Buckets - The buckets to send.
+
+    Flags - ANTI_ENTROPY_FLAG_REPLY if the peer should answer with its own
+            records of the buckets.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    const size_t maximumBodySize = ANTI_ENTROPY_MAX_DATAGRAM_SIZE - sizeof(MessageHeader) - sizeof(BucketHeader);
+    std::vector<Message> messages;
+    std::vector<uint32_t> messageBuckets;
+    std::vector<MappingRecord> messageRecords;
+    std::vector<MappingRecord> bucketRecords;
+    size_t recordCount = 0;
+
+    for (uint32_t bucket : Buckets)
+    {
+        bucketRecords.clear();
+        EXIT_IF_FAILED(m_MappingTable->GetBucket(bucket, &bucketRecords),
+                       Cleanup);
+
+        if ((messageBuckets.size() + 1) * sizeof(uint32_t) +
+            (messageRecords.size() + bucketRecords.size()) * sizeof(MappingRecord) > maximumBodySize &&
+            !messageBuckets.empty())
+        {
+            messages.push_back(CreateBucketMessage(m_IpAddress, Flags, messageBuckets, messageRecords));
+            messageBuckets.clear();
+            messageRecords.clear();
+        }
+
+        if (sizeof(uint32_t) + bucketRecords.size() * sizeof(MappingRecord) > maximumBodySize)
+        {
+            // The message was sent above, so the bucket starts a new one
+            messageBuckets.push_back(bucket);
+
+            for (size_t i = 0; i < bucketRecords.size(); i += recordCount)
+            {
+                recordCount = std::min((maximumBodySize - messageBuckets.size() * sizeof(uint32_t)) / sizeof(MappingRecord),
+                                       bucketRecords.size() - i);
+
+                messageRecords.assign(bucketRecords.begin() + i, bucketRecords.begin() + i + recordCount);
+                messages.push_back(CreateBucketMessage(m_IpAddress, Flags, messageBuckets, messageRecords));
+                messageBuckets.clear();
+            }
+
+            messageRecords.clear();
+            continue;
+        }
+
+        messageBuckets.push_back(bucket);
+        messageRecords.insert(messageRecords.end(), bucketRecords.begin(), bucketRecords.end());
+    }
+
+    if (!messageBuckets.empty())
+    {
+        messages.push_back(CreateBucketMessage(m_IpAddress, Flags, messageBuckets, messageRecords));
+    }
+
+    EXIT_IF_TRUE(messages.empty(),
+                 S_OK,
+                 Cleanup);
+
+    TRACE_IF_FAILED(m_UdpClient->Send(messages, {FormatIpAddress(Destination)}, UDP_PORT),
+                    Cleanup,
+                    "Failed to send buckets! 0x%x\n", ec);
+
+Cleanup:
+    return ec;
+}
+
+void
+AntiEntropyProtocol::MergeRecords(const std::vector<MappingRecord>& Records)
+/*++
+
+Routine Description:
+
+    Merges the records a peer holds in some buckets into the table. Records
+older than ours are ignored, so both sides of an exchange end up with the
+newer record of every mapping.
+
+Arguments:
+
+    Records - Every record the peer holds in the buckets.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    for (const MappingRecord& record : Records)
+    {
+        if (m_MappingTable->Merge(record) == S_OK)
+        {
+            LOG("Mapping <%u, %hu> -> <%u, %hu> repaired%s\n",
+                record.Mapping.VirtualIpAddress,
+                record.Mapping.VirtualPort,
+                record.Mapping.HostIpAddress,
+                record.Mapping.HostPort,
+                record.Type == MESSAGE_TYPE_DELETE_MAPPING ? " as removed" : "");
+        }
+    }
+}
@@ -27,7 +27,8 @@ Abstract:
 //
 
 template<typename T>
-BlockingQueue<T>::BlockingQueue()
+BlockingQueue<T>::BlockingQueue(size_t Capacity,
+                                QueueFullPolicy FullPolicy)
 /*++
 
 Routine Description:
@@ -36,7 +37,9 @@ Routine Description:
 
 Arguments:
 
-    None.
+    Capacity - The maximum number of queued items, or BLOCKING_QUEUE_UNBOUNDED.
+
+    FullPolicy - Whether Push blocks or drops the item when at capacity.
 
 Return Value:
 
@@ -44,6 +47,8 @@ Return Value:
 
 --*/
     :
+    m_Capacity(Capacity),
+    m_FullPolicy(FullPolicy),
     m_ShouldShutdown(false)
 {
 }
@@ -75,7 +80,7 @@ BlockingQueue<T>::Push(const T& Item)
 
 Routine Description:
 
-    Pushes an element of type T onto the queue.
+    Pushes a copy of an element of type T onto the queue.
 
 Arguments:
 
@@ -83,26 +88,118 @@ Arguments:
 
 Return Value:
 
-    S_OK on success, error otherwise.
+    S_OK on success,
+    S_FALSE if the queue was full and the item was dropped,
+    E_ABORT if the queue was shut down.
+
+--*/
+{
+    return Emplace(Item);
+}
+
+template<typename T>
+ERROR_CODE
+BlockingQueue<T>::Push(T&& Item)
+/*++
+
+Routine Description:
+
+    Moves an element of type T onto the queue.
+
+Arguments:
+
+    Item - The item to push onto the queue.
+
+Return Value:
+
+    S_OK on success,
+    S_FALSE if the queue was full and the item was dropped,
+    E_ABORT if the queue was shut down.
+
+--*/
+{
+    return Emplace(std::move(Item));
+}
+
+template<typename T>
+template<typename U>
+ERROR_CODE
+BlockingQueue<T>::Emplace(U&& Item)
+/*++
+
+Routine Description:
+
+    Adds an item to the back of the queue, applying the full policy if the
+queue is at capacity.
+
+Arguments:
+
+    Item - The item to add, copied or moved as given.
+
+Return Value:
+
+    S_OK on success,
+    S_FALSE if the queue was full and the item was dropped,
+    E_ABORT if the queue was shut down.
 
 --*/
 {
     ERROR_CODE ec = S_OK;
 
     {
-		std::unique_lock<std::mutex> lck(m_Mutex);
-		m_Queue.push(Item);
-	}
+        std::unique_lock<std::mutex> lock(m_Mutex);
+
+        if (m_Capacity != BLOCKING_QUEUE_UNBOUNDED && m_FullPolicy == QUEUE_FULL_BLOCK)
+        {
+            m_CanPush.wait(lock, [=] { return m_ShouldShutdown || m_Queue.size() < m_Capacity; });
+        }
+
+        EXIT_IF_TRUE(m_ShouldShutdown,
+                     E_ABORT,
+                     Cleanup);
+
+        EXIT_IF_TRUE(m_Capacity != BLOCKING_QUEUE_UNBOUNDED && m_Queue.size() >= m_Capacity,
+                     S_FALSE,
+                     Cleanup);
+
+        m_Queue.push(std::forward<U>(Item));
+    }
+
+    m_CanPop.notify_one();
 
-	m_CanPop.notify_one();
-    
+Cleanup:
     return ec;
 }
 
+template<typename T>
+ERROR_CODE
+BlockingQueue<T>::Take(T* Item)
+/*++
+
+Routine Description:
+
+    Removes the item at the front of the queue. Must be called with the
+lock held on a queue that is not empty.
+
+Arguments:
+
+    Item - Receives the item.
+
+Return Value:
+
+    S_OK.
+
+--*/
+{
+    *Item = std::move(m_Queue.front());
+    m_Queue.pop();
+
+    return S_OK;
+}
 
 template<typename T>
-T
-BlockingQueue<T>::Pop()
+ERROR_CODE
+BlockingQueue<T>::Pop(T* Item)
 /*++
 
 Routine Description:
@@ -111,25 +208,146 @@ Routine Description:
 
 Arguments:
 
-    None.
+    Item - Receives the element that was popped from the queue.
 
 Return Value:
 
-    The element that was popped from the queue.
+    S_OK on success,
+    E_ABORT if the queue was shut down and is empty.
 
 --*/
 {
-	std::unique_lock<std::mutex> lck(m_Mutex);
+    ERROR_CODE ec = S_OK;
+
+    {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+
+        m_CanPop.wait(lock, [=] { return m_ShouldShutdown || !m_Queue.empty(); });
 
-	m_CanPop.wait(lck, [=] { return !m_Queue.empty(); });
+        EXIT_IF_TRUE(m_Queue.empty(),
+                     E_ABORT,
+                     Cleanup);
 
-	T item = std::move(m_Queue.front());
-	
-	m_Queue.pop();
+        Take(Item);
+    }
 
-	return item;
+    m_CanPush.notify_one();
+
+Cleanup:
+    return ec;
 }
 
+template<typename T>
+ERROR_CODE
+BlockingQueue<T>::PopFor(T* Item,
+                         std::chrono::milliseconds Timeout)
+/*++
+
+Routine Description:
+
+    Pops an item from the queue, waiting at most the given time for one to
+arrive.
+
+Arguments:
+
+    Item - Receives the element that was popped from the queue.
+
+    Timeout - How long to wait for an item.
+
+Return Value:
+
+    S_OK on success,
+    S_FALSE if no item arrived in time,
+    E_ABORT if the queue was shut down and is empty.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+
+    {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+
+        m_CanPop.wait_for(lock, Timeout, [=] { return m_ShouldShutdown || !m_Queue.empty(); });
+
+        if (m_Queue.empty())
+        {
+            ec = m_ShouldShutdown ? E_ABORT : S_FALSE;
+            goto Cleanup;
+        }
+
+        Take(Item);
+    }
+
+    m_CanPush.notify_one();
+
+Cleanup:
+    return ec;
+}
+
+template<typename T>
+ERROR_CODE
+BlockingQueue<T>::PopBatch(std::vector<T>* Items,
+                           size_t MaxCount)
+/*++
+
+Routine Description:
+
+    Pops up to MaxCount items from the queue under a single lock acquisition.
+Blocks until at least one item is available, then takes whatever is queued
+without waiting for more.
+
+Arguments:
+
+    Items - The vector to append the popped items to, oldest first.
+
+    MaxCount - The maximum number of items to pop.
+
+Return Value:
+
+    S_OK on success,
+    E_INVALIDARG if MaxCount is zero,
+    E_ABORT if the queue was shut down and is empty.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    size_t count = 0;
+
+    EXIT_IF_TRUE(MaxCount == 0,
+                 E_INVALIDARG,
+                 Cleanup);
+
+    {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+
+        m_CanPop.wait(lock, [=] { return m_ShouldShutdown || !m_Queue.empty(); });
+
+        EXIT_IF_TRUE(m_Queue.empty(),
+                     E_ABORT,
+                     Cleanup);
+
+        count = std::min(MaxCount, m_Queue.size());
+        Items->reserve(Items->size() + count);
+
+        for (size_t i = 0; i < count; i++)
+        {
+            Items->push_back(std::move(m_Queue.front()));
+            m_Queue.pop();
+        }
+    }
+
+    if (count > 1)
+    {
+        m_CanPush.notify_all();
+    }
+    else
+    {
+        m_CanPush.notify_one();
+    }
+
+Cleanup:
+    return ec;
+}
 
 template<typename T>
 ERROR_CODE
@@ -138,7 +356,8 @@ BlockingQueue<T>::RequestShutdown()
 
 Routine Description:
 
-    Unblocks all currently blocked threads and performs cleanup.
+    Unblocks all currently blocked threads. Items already queued can still
+be popped; every push from now on fails.
 
 Arguments:
 
@@ -150,15 +369,15 @@ Return Value:
 
 --*/
 {
-    ERROR_CODE ec = 0;
-    
+    ERROR_CODE ec = S_OK;
+
     {
-		std::unique_lock<std::mutex> lock(m_Mutex);
-		m_ShouldShutdown = true;
-	}
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        m_ShouldShutdown = true;
+    }
+
+    m_CanPop.notify_all();
+    m_CanPush.notify_all();
 
-	m_CanPop.notify_all();
-    
-Cleanup:
     return ec;
 }
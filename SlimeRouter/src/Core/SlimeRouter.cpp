@@ -14,26 +14,83 @@ Abstract:
 // ---------------------------------------------------------------------- Includes
 //
 
+#include <cstdlib>
+
 #include "SlimeRouter.h"
 #include "MappingManager.h"
 #include "GossipProtocol.h"
+#include "SwimProtocol.h"
+#include "AntiEntropyProtocol.h"
+#include "SnapshotProtocol.h"
+#include "MappingStore.h"
 #include "UdpClient.h"
 #include "UdpServer.h"
 #include "DockerPlugin.h"
 #include "RouterServer.h"
 #include "httplib.h"
+#include "NetworkUtils.h"
 
 //
 // ---------------------------------------------------------------------- Definitions
 //
 
 #define UNIX_SERVER_PATH "/home/ombarki2/slime/SlimeRouter.sock"
+#define MAPPING_TABLE_PATH "/home/ombarki2/slime/SlimeRouter.map"
+#define MAPPING_STORE_PATH "/home/ombarki2/slime/SlimeRouter.store"
+
+// Environment variables overriding the paths above, shared with SlimeSocket
+#define UNIX_SERVER_PATH_VARIABLE "SLIME_ROUTER_PATH"
+#define MAPPING_TABLE_PATH_VARIABLE "SLIME_MAPPING_TABLE_PATH"
+#define MAPPING_STORE_PATH_VARIABLE "SLIME_MAPPING_STORE_PATH"
+
+// Interface whose address is advertised for host sockets, shared with SlimeSocket
+#define HOST_INTERFACE_VARIABLE "SLIME_HOST_INTERFACE"
+// Nodes probed from the start, besides those the Docker plugin discovers
+#define SEED_NODES "172.22.152.5,172.22.152.6"
+#define SEED_NODES_VARIABLE "SLIME_SEED_NODES"
+
 #define UDP_PORT 8080
+#define SNAPSHOT_PORT 8081
+#define MAPPING_FLUSH_DEADLINE std::chrono::milliseconds(5)
 
 //
 // ---------------------------------------------------------------------- Functions
 //
 
+static
+const char*
+GetEnvironmentOrDefault(const char* Name,
+                        const char* Default)
+{
+    const char* value = getenv(Name);
+
+    return value != nullptr && *value != '\0' ? value : Default;
+}
+
+static
+std::vector<std::string>
+SplitList(const std::string& List)
+{
+    std::vector<std::string> items;
+    size_t start = 0;
+    size_t end = 0;
+
+    while (start < List.size())
+    {
+        end = List.find(',', start);
+        end = end == std::string::npos ? List.size() : end;
+
+        if (end > start)
+        {
+            items.push_back(List.substr(start, end - start));
+        }
+
+        start = end + 1;
+    }
+
+    return items;
+}
+
 SlimeRouter::SlimeRouter()
 /*++
 
@@ -94,24 +151,43 @@ Return Value:
 {
     ERROR_CODE ec = S_OK;
     std::unique_ptr<GossipProtocol> gossipProtocol = nullptr;
+    std::unique_ptr<SwimProtocol> swimProtocol = nullptr;
+    std::unique_ptr<AntiEntropyProtocol> antiEntropyProtocol = nullptr;
+    std::unique_ptr<SnapshotProtocol> snapshotProtocol = nullptr;
+    std::unique_ptr<MappingStore> mappingStore = nullptr;
     std::unique_ptr<MappingManager> mappingManager = nullptr;
     std::unique_ptr<UdpClient> udpClient = nullptr;
-    std::unique_ptr<UdpServer> udpServer = nullptr;
+    std::unique_ptr<UdpClient> swimClient = nullptr;
+    std::unique_ptr<UdpClient> antiEntropyClient = nullptr;
+    std::shared_ptr<UdpServer> udpServer = nullptr;
     std::unique_ptr<DockerPlugin> dockerPlugin = nullptr;
     std::unique_ptr<httplib::Server> httpServer = nullptr;
     
+    NetworkUtils::SetPreferredInterface(GetEnvironmentOrDefault(HOST_INTERFACE_VARIABLE,
+                                                                ""));
+    
     udpClient = std::make_unique<UdpClient>();
     EXIT_IF_NULL(udpClient,
                  E_OUTOFMEMORY,
                  Cleanup);
     
-    udpServer = std::make_unique<UdpServer>(UDP_PORT);
+    swimClient = std::make_unique<UdpClient>();
+    EXIT_IF_NULL(swimClient,
+                 E_OUTOFMEMORY,
+                 Cleanup);
+    
+    antiEntropyClient = std::make_unique<UdpClient>();
+    EXIT_IF_NULL(antiEntropyClient,
+                 E_OUTOFMEMORY,
+                 Cleanup);
+    
+    udpServer = std::make_shared<UdpServer>(UDP_PORT);
     EXIT_IF_NULL(udpServer,
                  E_OUTOFMEMORY,
                  Cleanup);
     
     gossipProtocol = std::make_unique<GossipProtocol>(std::move(udpClient),
-                                                      std::move(udpServer));
+                                                      udpServer);
     EXIT_IF_NULL(gossipProtocol,
                  E_OUTOFMEMORY,
                  Cleanup);
@@ -126,13 +202,46 @@ Return Value:
                  E_OUTOFMEMORY,
                  Cleanup);
     
-    mappingManager = std::make_unique<MappingManager>(std::move(dockerPlugin),
-                                                      std::move(gossipProtocol));
+    // Docker discovery seeds SWIM, which decides who is actually alive
+    swimProtocol = std::make_unique<SwimProtocol>(std::move(swimClient),
+                                                  std::move(udpServer),
+                                                  std::move(dockerPlugin),
+                                                  SplitList(GetEnvironmentOrDefault(SEED_NODES_VARIABLE,
+                                                                                    SEED_NODES)));
+    EXIT_IF_NULL(swimProtocol,
+                 E_OUTOFMEMORY,
+                 Cleanup);
+    
+    antiEntropyProtocol = std::make_unique<AntiEntropyProtocol>(std::move(antiEntropyClient));
+    EXIT_IF_NULL(antiEntropyProtocol,
+                 E_OUTOFMEMORY,
+                 Cleanup);
+    
+    snapshotProtocol = std::make_unique<SnapshotProtocol>(SNAPSHOT_PORT);
+    EXIT_IF_NULL(snapshotProtocol,
+                 E_OUTOFMEMORY,
+                 Cleanup);
+    
+    mappingStore = std::make_unique<MappingStore>(GetEnvironmentOrDefault(MAPPING_STORE_PATH_VARIABLE,
+                                                                          MAPPING_STORE_PATH));
+    EXIT_IF_NULL(mappingStore,
+                 E_OUTOFMEMORY,
+                 Cleanup);
+    
+    mappingManager = std::make_unique<MappingManager>(std::move(swimProtocol),
+                                                      std::move(gossipProtocol),
+                                                      std::move(antiEntropyProtocol),
+                                                      std::move(snapshotProtocol),
+                                                      std::move(mappingStore),
+                                                      GetEnvironmentOrDefault(MAPPING_TABLE_PATH_VARIABLE,
+                                                                              MAPPING_TABLE_PATH),
+                                                      MAPPING_FLUSH_DEADLINE);
     EXIT_IF_NULL(mappingManager,
                  E_OUTOFMEMORY,
                  Cleanup);
     
-    m_RouterServer = std::make_unique<RouterServer>(UNIX_SERVER_PATH,
+    m_RouterServer = std::make_unique<RouterServer>(GetEnvironmentOrDefault(UNIX_SERVER_PATH_VARIABLE,
+                                                                            UNIX_SERVER_PATH),
                                                     std::move(mappingManager));
     EXIT_IF_NULL(m_RouterServer,
                  E_OUTOFMEMORY,
@@ -8,6 +8,16 @@ Abstract:
 
     Class implementation of a gossip protocol.
 
+    Messages are disseminated as rumors. Every rumor has a cluster-unique ID
+    made of the originating node's IP address and a sequence number. A node
+    that learns a new rumor delivers it once, forwards it to GOSSIP_FANOUT
+    random members right away and then keeps pushing it to GOSSIP_FANOUT
+    random members every GOSSIP_PERIOD for a number of rounds logarithmic in
+    the size of the group. Every few rounds a node also pulls from a random
+    member the rumors it has not seen yet. IDs of delivered rumors are kept in
+    a seen-set for GOSSIP_SEEN_EXPIRY to suppress duplicates, and rumors are
+    no longer forwarded once they travelled GOSSIP_MAX_HOPS hops.
+
 --*/
 
 //
@@ -16,25 +26,35 @@ Abstract:
 
 #include <chrono>
 #include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <iterator>
 
 #include "GossipProtocol.h"
 #include "UdpClient.h"
 #include "UdpServer.h"
+#include "NetworkUtils.h"
 
 //
 // ---------------------------------------------------------------------- Definitions
 //
 
 #define GOSSIP_FANOUT 2
-#define GOSSIP_PERIOD std::chrono::milliseconds(1000)
+#define GOSSIP_PERIOD std::chrono::milliseconds(200)
+#define GOSSIP_PULL_INTERVAL 5
+#define GOSSIP_ROUND_MULTIPLIER 2
+#define GOSSIP_MAX_HOPS 16
+#define GOSSIP_SEEN_EXPIRY std::chrono::seconds(60)
+#define GOSSIP_MAX_DATAGRAM_SIZE 1472 // Ethernet MTU minus the IPv4 and UDP headers
 #define UDP_PORT 8080
+#define GOSSIP_DELIVERED_QUEUE_CAPACITY 4096
 
 //
 // ---------------------------------------------------------------------- Functions
 //
 
 GossipProtocol::GossipProtocol(std::unique_ptr<UdpClient> UdpClient,
-                               std::unique_ptr<UdpServer> UdpServer)
+                               std::shared_ptr<UdpServer> UdpServer)
 /*++
 
 Routine Description:
@@ -52,7 +72,13 @@ Return Value:
 --*/
     :
     m_UdpClient(std::move(UdpClient)),
-    m_UdpServer(std::move(UdpServer))
+    m_UdpServer(std::move(UdpServer)),
+    m_RandomEngine(std::random_device{}()),
+    m_IpAddress(0),
+    m_NextSequenceNumber(0),
+    m_ShouldStop(false),
+    m_DroppedMessageCount(0),
+    m_DeliveredMessages(GOSSIP_DELIVERED_QUEUE_CAPACITY, QUEUE_FULL_DROP)
 {
 }
 
@@ -73,6 +99,7 @@ Return Value:
 
 --*/
 {
+    Stop();
 }
 
 ERROR_CODE
@@ -94,10 +121,15 @@ Return Value:
 --*/
 {
     ERROR_CODE ec = S_OK;
-    
-    // TODO: remove hardcode
-    m_MulticastGroup.insert("172.22.152.5");
-    m_MulticastGroup.insert("172.22.152.6");
+
+    TRACE_IF_FAILED(NetworkUtils::GetIpAddress(&m_IpAddress),
+                    Cleanup,
+                    "Failed to get IP address! 0x%x", ec);
+
+    // Start at a random sequence number so that IDs of a restarted node do
+    // not collide with the ones still remembered by its peers.
+    m_NextSequenceNumber = m_RandomEngine();
+
     TRACE_IF_FAILED(m_UdpClient->Init(),
                     Cleanup,
                     "Failed to initialize UDP client! 0x%x", ec);
@@ -127,14 +159,14 @@ Return Value:
 --*/
 {
     ERROR_CODE ec = S_OK;
-    std::thread t;
 
     TRACE_IF_FAILED(m_UdpServer->Start(),
                     Cleanup,
                     "Failed to start UDP server! 0x%x", ec);
 
-    t = std::thread([=] { HandleIncomingMessages(); });
-    t.detach();
+    m_IncomingMessageThread = std::thread([=] { HandleIncomingMessages(); });
+
+    m_GossipThread = std::thread([=] { PeriodicallyGossip(); });
 Cleanup:
     return ec;
 }
@@ -159,7 +191,33 @@ Return Value:
 {
     ERROR_CODE ec = S_OK;
 
-     
+    {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        m_ShouldStop = true;
+    }
+
+    m_StopCondition.notify_all();
+
+    if (m_GossipThread.joinable())
+    {
+        m_GossipThread.join();
+    }
+
+    // Consumers of delivered messages are waiting on this queue
+    m_DeliveredMessages.RequestShutdown();
+
+    // Stopping the server ends its queue, which lets the incoming message
+    // thread return
+    TRACE_IF_FAILED(m_UdpServer->Stop(),
+                    Cleanup,
+                    "Failed to stop UDP server! 0x%x", ec);
+
+    if (m_IncomingMessageThread.joinable())
+    {
+        m_IncomingMessageThread.join();
+    }
+
+Cleanup:
     return ec;
 }
 
@@ -187,7 +245,8 @@ Return Value:
     
     UNREFERENCED_PARAMETER(Port);
     
-    m_MulticastGroup.insert(std::move(IpAddress));
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    m_MulticastGroup.insert(IpAddress);
 
     return ec;
 }
@@ -216,6 +275,7 @@ Return Value:
 
     UNREFERENCED_PARAMETER(Port);
     
+    std::unique_lock<std::mutex> lock(m_Mutex);
     m_MulticastGroup.erase(IpAddress);
     
     return ec;
@@ -240,22 +300,55 @@ Return Value:
 --*/
 {
     ERROR_CODE ec = S_OK;
+    uint64_t messageId = 0;
+    std::vector<std::string> targets;
     
-    for (const std::string& ipAddress : m_MulticastGroup)
     {
-        m_UdpClient->Send(Message, ipAddress, UDP_PORT);
+        std::unique_lock<std::mutex> lock(m_Mutex);
+
+        messageId = (uint64_t)m_IpAddress << 32 | m_NextSequenceNumber++;
+        m_SeenMessages[messageId] = std::chrono::steady_clock::now();
+        m_Rumors[messageId] = Rumor{0, GetRoundCount(), Message};
+        targets = SelectGossipTargets(GOSSIP_FANOUT);
     }
+
+    TRACE_IF_FAILED(SendRumors({messageId}, targets, UDP_PORT),
+                    Cleanup,
+                    "Failed to send rumor! 0x%x\n", ec);
     
+Cleanup:
     return ec;
 }
 
+size_t
+GossipProtocol::GetMaximumMessageSize() const
+/*++
+
+Routine Description:
+
+    Gets the largest message body that fits in a single push datagram.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The maximum message body size in bytes.
+
+--*/
+{
+    return GOSSIP_MAX_DATAGRAM_SIZE - sizeof(MessageHeader) - sizeof(RumorHeader);
+}
+
 ERROR_CODE
 GossipProtocol::PeriodicallyGossip()
 /*++
 
 Routine Description:
 
-    Gossips to GOSSIP_FANOUT random neighbors every GOSSIP_PERIOD time units.
+    Gossips to GOSSIP_FANOUT random neighbors every GOSSIP_PERIOD time units,
+and pulls from a random neighbor every GOSSIP_PULL_INTERVAL rounds.
 
 Arguments:
 
@@ -268,27 +361,78 @@ Return Value:
 --*/
 {
     ERROR_CODE ec = S_OK;
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    std::vector<uint64_t> messageIds;
+    std::vector<std::string> targets;
+    std::vector<std::string> pullTargets;
+    uint64_t round = 0;
     
-    while (1)
+    while (!m_StopCondition.wait_for(lock, GOSSIP_PERIOD, [=] { return m_ShouldStop; }))
     {
-        std::this_thread::sleep_for(GOSSIP_PERIOD);
+        round++;
+
+        messageIds.clear();
+        for (const auto& rumor : m_Rumors)
+        {
+            messageIds.push_back(rumor.first);
+        }
+
+        targets = SelectGossipTargets(GOSSIP_FANOUT);
+        pullTargets.clear();
+
+        if (round % GOSSIP_PULL_INTERVAL == 0)
+        {
+            pullTargets = SelectGossipTargets(1);
+        }
+
+        ExpireSeenMessages();
+
+        lock.unlock();
+
+        if (!messageIds.empty())
+        {
+            SendRumors(messageIds, targets, UDP_PORT);
+        }
+
+        for (const std::string& pullTarget : pullTargets)
+        {
+            SendPull(pullTarget);
+        }
+
+        lock.lock();
+
+        for (uint64_t messageId : messageIds)
+        {
+            auto rumorIt = m_Rumors.find(messageId);
+
+            if (rumorIt != m_Rumors.end() && --rumorIt->second.RoundsLeft == 0)
+            {
+                m_Rumors.erase(rumorIt);
+            }
+        }
     }
     
-//Cleanup:
     return ec;
 }
 
 ERROR_CODE
-GossipProtocol::HandleEvents()
+GossipProtocol::SendRumors(const std::vector<uint64_t>& MessageIds,
+                           const std::vector<std::string>& Destinations,
+                           uint16_t Port)
 /*++
 
 Routine Description:
 
-    Handles events.
+    Pushes the specified rumors to every destination, packing as many rumors
+as fit into each datagram.
 
 Arguments:
 
-    None.
+    MessageIds - The IDs of the rumors to push. Retired rumors are skipped.
+
+    Destinations - The IP addresses to push to.
+
+    Port - The port to push to.
 
 Return Value:
 
@@ -297,39 +441,87 @@ Return Value:
 --*/
 {
     ERROR_CODE ec = S_OK;
-    // std::vector<std::string> membershipList;
-    
-//     while (m_EventQueue.Pop())
-//     {
-//         std::vector<int> destinations;
- 
-//         std::sample(membershipList.begin(),
-//                     membershipList.end(),
-//                     std::back_inserter(destinations),
-//                     GOSSIP_FANOUT,
-//                     std::mt19937{ std::random_device{}() });
-
-//         for (const int destination : destinations)
-//         {
-//             m_UdpClient->Send(destination, message);
-//         }
-//     }
-    
-// Cleanup:
-     return ec;
+    const size_t maximumBodySize = GOSSIP_MAX_DATAGRAM_SIZE - sizeof(MessageHeader);
+    std::vector<Message> datagrams;
+    Message datagram;
+    RumorHeader rumorHeader;
+    size_t rumorSize = 0;
+    size_t offset = 0;
+
+    datagram.Header.Id = GOSSIP_MESSAGE_TYPE_PUSH;
+    datagram.Header.Size = 0;
+
+    {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+
+        for (uint64_t messageId : MessageIds)
+        {
+            auto rumorIt = m_Rumors.find(messageId);
+
+            if (rumorIt == m_Rumors.end())
+            {
+                continue;
+            }
+
+            const Rumor& rumor = rumorIt->second;
+            rumorSize = sizeof(RumorHeader) + rumor.Payload.Header.Size;
+
+            if (rumorSize > maximumBodySize)
+            {
+                LOG("Rumor 0x%llx is too large to gossip!\n", (unsigned long long)messageId);
+                continue;
+            }
+
+            if (datagram.Body.size() + rumorSize > maximumBodySize)
+            {
+                datagram.Header.Size = datagram.Body.size();
+                datagrams.push_back(datagram);
+                datagram.Body.clear();
+            }
+
+            rumorHeader.MessageId = messageId;
+            rumorHeader.HopCount = rumor.HopCount + 1;
+            rumorHeader.Header = rumor.Payload.Header;
+
+            offset = datagram.Body.size();
+            datagram.Body.resize(offset + rumorSize);
+            std::memcpy(datagram.Body.data() + offset, &rumorHeader, sizeof(rumorHeader));
+            std::memcpy(datagram.Body.data() + offset + sizeof(rumorHeader),
+                        rumor.Payload.Body.data(),
+                        rumor.Payload.Header.Size);
+        }
+    }
+
+    if (!datagram.Body.empty())
+    {
+        datagram.Header.Size = datagram.Body.size();
+        datagrams.push_back(datagram);
+    }
+
+    EXIT_IF_TRUE(datagrams.empty() || Destinations.empty(),
+                 S_OK,
+                 Cleanup);
+
+    TRACE_IF_FAILED(m_UdpClient->Send(datagrams, Destinations, Port),
+                    Cleanup,
+                    "Failed to push rumors! 0x%x\n", ec);
+
+Cleanup:
+    return ec;
 }
 
 ERROR_CODE
-GossipProtocol::GetNextDeliveredMessage(Message* Message)
+GossipProtocol::SendPull(const std::string& Destination)
 /*++
 
 Routine Description:
 
-    Gets the next delivered message from the queue.
+    Asks a member to push back the rumors this node has not seen yet. The
+request lists the most recently seen message IDs that fit into a datagram.
 
 Arguments:
 
-    Message - The next delivered message.
+    Destination - The IP address of the member to pull from.
 
 Return Value:
 
@@ -338,19 +530,173 @@ Return Value:
 --*/
 {
     ERROR_CODE ec = S_OK;
-    
-    *Message = m_DeliveredMessages.Pop();
-    
+    const size_t maximumIdCount = (GOSSIP_MAX_DATAGRAM_SIZE - sizeof(MessageHeader) - sizeof(PullRequest)) / sizeof(uint64_t);
+    std::vector<std::pair<std::chrono::steady_clock::time_point, uint64_t>> seenMessages;
+    PullRequest pullRequest;
+    Message message;
+
+    {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+
+        for (const auto& seenMessage : m_SeenMessages)
+        {
+            seenMessages.emplace_back(seenMessage.second, seenMessage.first);
+        }
+    }
+
+    if (seenMessages.size() > maximumIdCount)
+    {
+        std::nth_element(seenMessages.begin(),
+                         seenMessages.begin() + maximumIdCount,
+                         seenMessages.end(),
+                         std::greater<>());
+        seenMessages.resize(maximumIdCount);
+    }
+
+    pullRequest.IpAddress = m_IpAddress;
+    pullRequest.Port = UDP_PORT;
+    pullRequest.Count = seenMessages.size();
+
+    message.Header.Id = GOSSIP_MESSAGE_TYPE_PULL;
+    message.Header.Size = sizeof(pullRequest) + seenMessages.size() * sizeof(uint64_t);
+    message.Body.resize(message.Header.Size);
+    std::memcpy(message.Body.data(), &pullRequest, sizeof(pullRequest));
+
+    for (size_t i = 0; i < seenMessages.size(); i++)
+    {
+        std::memcpy(message.Body.data() + sizeof(pullRequest) + i * sizeof(uint64_t),
+                    &seenMessages[i].second,
+                    sizeof(uint64_t));
+    }
+
+    TRACE_IF_FAILED(m_UdpClient->Send(message, Destination, UDP_PORT),
+                    Cleanup,
+                    "Failed to send pull request! 0x%x\n", ec);
+
+Cleanup:
     return ec;
 }
 
+std::vector<std::string>
+GossipProtocol::SelectGossipTargets(size_t Count)
+/*++
+
+Routine Description:
+
+    Selects random members of the multicast group. Must be called with the
+lock held.
+
+Arguments:
+
+    Count - The maximum number of members to select.
+
+Return Value:
+
+    The selected members.
+
+--*/
+{
+    std::vector<std::string> targets;
+
+    std::sample(m_MulticastGroup.begin(),
+                m_MulticastGroup.end(),
+                std::back_inserter(targets),
+                Count,
+                m_RandomEngine);
+
+    return targets;
+}
+
+uint32_t
+GossipProtocol::GetRoundCount() const
+/*++
+
+Routine Description:
+
+    Computes the number of rounds a new rumor is gossiped for, which grows
+logarithmically with the size of the group. Must be called with the lock held.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The number of rounds.
+
+--*/
+{
+    double groupSize = (double)m_MulticastGroup.size() + 1;
+
+    return GOSSIP_ROUND_MULTIPLIER * std::max(1, (int)std::ceil(std::log2(groupSize)));
+}
+
+void
+GossipProtocol::ExpireSeenMessages()
+/*++
+
+Routine Description:
+
+    Forgets IDs of messages first seen more than GOSSIP_SEEN_EXPIRY ago.
+Must be called with the lock held.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    auto expiry = std::chrono::steady_clock::now() - GOSSIP_SEEN_EXPIRY;
+
+    for (auto seenIt = m_SeenMessages.begin(); seenIt != m_SeenMessages.end();)
+    {
+        if (seenIt->second < expiry)
+        {
+            seenIt = m_SeenMessages.erase(seenIt);
+        }
+        else
+        {
+            seenIt++;
+        }
+    }
+}
+
+ERROR_CODE
+GossipProtocol::GetNextDeliveredMessage(Message* Message)
+/*++
+
+Routine Description:
+
+    Gets the next delivered message from the queue.
+
+Arguments:
+
+    Message - The next delivered message.
+
+Return Value:
+
+    S_OK on success,
+    E_ABORT once the protocol has stopped and every message was consumed.
+
+--*/
+{
+    return m_DeliveredMessages.Pop(Message);
+}
+
 ERROR_CODE
 GossipProtocol::Deliver(const Message& Message)
 /*++
 
 Routine Description:
 
-    Delivers the provided message to the above layer.
+    Delivers the provided message to the above layer. If the above layer
+falls behind, the message is dropped rather than stalling the receive
+thread, which also answers pulls; anti-entropy repairs the mappings it
+carried.
 
 Arguments:
 
@@ -358,13 +704,22 @@ Arguments:
 
 Return Value:
 
-    S_OK on success, error otherwise.
+    S_OK on success,
+    S_FALSE if the delivery queue was full and the message was dropped,
+    E_ABORT if the protocol was stopped.
 
 --*/
 {
     ERROR_CODE ec = S_OK;
     
-    m_DeliveredMessages.Push(Message);
+    ec = m_DeliveredMessages.Push(Message);
+
+    if (ec == S_FALSE)
+    {
+        m_DroppedMessageCount++;
+        LOG("Dropping message, the delivery queue is full! %llu dropped\n",
+            (unsigned long long)m_DroppedMessageCount);
+    }
     
     return ec;
 }
@@ -390,14 +745,176 @@ Return Value:
 {
     ERROR_CODE ec = S_OK;
     
-    TRACE_IF_FAILED(Deliver(Message),
-                    Cleanup,
-                    "Failed to deliver message! 0x%x\n", ec);
+    switch (Message.Header.Id)
+    {
+    case GOSSIP_MESSAGE_TYPE_PUSH:
+        TRACE_IF_FAILED(OnPush(Message),
+                        Cleanup,
+                        "Failed to handle push! 0x%x\n", ec);
+        break;
+    case GOSSIP_MESSAGE_TYPE_PULL:
+        TRACE_IF_FAILED(OnPull(Message),
+                        Cleanup,
+                        "Failed to handle pull! 0x%x\n", ec);
+        break;
+    default:
+        // Sent directly by a node that does not gossip
+        TRACE_IF_FAILED(Deliver(Message),
+                        Cleanup,
+                        "Failed to deliver message! 0x%x\n", ec);
+        break;
+    }
     
 Cleanup:
     return ec;
 }
 
+ERROR_CODE
+GossipProtocol::OnPush(const Message& Message)
+/*++
+
+Routine Description:
+
+    Handles a push. Delivers every rumor that was not seen before, starts
+spreading it and forwards it to random members right away.
+
+Arguments:
+
+    Message - The received push.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    std::vector<::Message> newMessages;
+    std::vector<uint64_t> newMessageIds;
+    std::vector<std::string> targets;
+    RumorHeader rumorHeader;
+    ::Message rumorMessage;
+    size_t offset = 0;
+    auto now = std::chrono::steady_clock::now();
+
+    {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+
+        while (offset + sizeof(RumorHeader) <= Message.Body.size())
+        {
+            std::memcpy(&rumorHeader, Message.Body.data() + offset, sizeof(rumorHeader));
+            offset += sizeof(rumorHeader);
+
+            EXIT_IF_TRUE(rumorHeader.Header.Size > Message.Body.size() - offset,
+                         E_INVALIDARG,
+                         Cleanup);
+
+            rumorMessage.Header = rumorHeader.Header;
+            rumorMessage.Body.assign(Message.Body.data() + offset,
+                                     rumorHeader.Header.Size);
+            offset += rumorHeader.Header.Size;
+
+            if (!m_SeenMessages.emplace(rumorHeader.MessageId, now).second)
+            {
+                continue;
+            }
+
+            newMessages.push_back(rumorMessage);
+
+            if (rumorHeader.HopCount < GOSSIP_MAX_HOPS)
+            {
+                m_Rumors[rumorHeader.MessageId] = Rumor{rumorHeader.HopCount, GetRoundCount(), rumorMessage};
+                newMessageIds.push_back(rumorHeader.MessageId);
+            }
+        }
+
+        targets = SelectGossipTargets(GOSSIP_FANOUT);
+    }
+
+Cleanup:
+    for (const ::Message& newMessage : newMessages)
+    {
+        Deliver(newMessage);
+    }
+
+    if (!newMessageIds.empty())
+    {
+        SendRumors(newMessageIds, targets, UDP_PORT);
+    }
+
+    return ec;
+}
+
+ERROR_CODE
+GossipProtocol::OnPull(const Message& Message)
+/*++
+
+Routine Description:
+
+    Handles a pull. Pushes back the rumors the requester has not seen.
+
+Arguments:
+
+    Message - The received pull.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    PullRequest pullRequest;
+    std::unordered_set<uint64_t> knownMessageIds;
+    std::vector<uint64_t> missingMessageIds;
+    uint64_t messageId = 0;
+    char ipAddress[INET_ADDRSTRLEN] = {0};
+
+    EXIT_IF_TRUE(Message.Body.size() < sizeof(pullRequest),
+                 E_INVALIDARG,
+                 Cleanup);
+
+    std::memcpy(&pullRequest, Message.Body.data(), sizeof(pullRequest));
+
+    EXIT_IF_TRUE(Message.Body.size() < sizeof(pullRequest) + pullRequest.Count * sizeof(uint64_t),
+                 E_INVALIDARG,
+                 Cleanup);
+
+    for (size_t i = 0; i < pullRequest.Count; i++)
+    {
+        std::memcpy(&messageId,
+                    Message.Body.data() + sizeof(pullRequest) + i * sizeof(uint64_t),
+                    sizeof(messageId));
+        knownMessageIds.insert(messageId);
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+
+        for (const auto& rumor : m_Rumors)
+        {
+            if (knownMessageIds.count(rumor.first) == 0)
+            {
+                missingMessageIds.push_back(rumor.first);
+            }
+        }
+    }
+
+    EXIT_IF_TRUE(missingMessageIds.empty(),
+                 S_OK,
+                 Cleanup);
+
+    EXIT_IF_NULL(inet_ntop(AF_INET, &pullRequest.IpAddress, ipAddress, sizeof(ipAddress)),
+                 E_INVALIDARG,
+                 Cleanup);
+
+    TRACE_IF_FAILED(SendRumors(missingMessageIds, {ipAddress}, pullRequest.Port),
+                    Cleanup,
+                    "Failed to answer pull request! 0x%x\n", ec);
+
+Cleanup:
+    return ec;
+}
 
 ERROR_CODE
 GossipProtocol::HandleIncomingMessages()
@@ -422,13 +939,21 @@ Return Value:
     
     while (true)
     {
-        TRACE_IF_FAILED(m_UdpServer->GetNextIncomingMessage(&message),
+        ec = m_UdpServer->GetNextIncomingMessage(&message);
+
+        // The server stopped
+        EXIT_IF_TRUE(ec == E_ABORT,
+                     S_OK,
+                     Cleanup);
+
+        TRACE_IF_FAILED(ec,
                         Cleanup,
                         "Failed to get incoming message from server! 0x%x\n", ec);
 
-        TRACE_IF_FAILED(OnReceive(message),
-                        Cleanup,
-                        "Failed to execute OnReceive event handler! 0x%x\n", ec);
+        if (FAILED(OnReceive(message)))
+        {
+            LOG("Dropping gossip message that failed to process!\n");
+        }
     }
 
 Cleanup:
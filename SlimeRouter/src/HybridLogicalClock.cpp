@@ -0,0 +1,171 @@
+/*++
+
+Module Name:
+
+    HybridLogicalClock.cpp
+
+Abstract:
+
+    Class implementation of a hybrid logical clock.
+
+--*/
+
+//
+// ---------------------------------------------------------------------- Includes
+//
+
+#include <chrono>
+#include <algorithm>
+
+#include "HybridLogicalClock.h"
+
+//
+// ---------------------------------------------------------------------- Definitions
+//
+
+
+
+//
+// ---------------------------------------------------------------------- Functions
+//
+
+HybridLogicalClock::HybridLogicalClock()
+/*++
+
+Routine Description:
+
+    Constructor for HybridLogicalClock.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+    :
+    m_Last(0)
+{
+
+}
+
+HybridLogicalClock::~HybridLogicalClock()
+/*++
+
+Routine Description:
+
+    Destructor for HybridLogicalClock.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+}
+
+uint64_t
+HybridLogicalClock::Now()
+/*++
+
+Routine Description:
+
+    Reads the clock. Follows the wall clock while it moves ahead of the last
+reading, and otherwise counts up from the last reading.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    A reading greater than every previous one.
+
+--*/
+{
+    m_Last = std::max(m_Last + 1, ReadWallClock() << HYBRID_LOGICAL_CLOCK_LOGICAL_BITS);
+
+    return m_Last;
+}
+
+ERROR_CODE
+HybridLogicalClock::Observe(uint64_t Timestamp)
+/*++
+
+Routine Description:
+
+    Moves the clock past a reading of another node, so that the next local
+reading is ordered after it.
+
+Arguments:
+
+    Timestamp - The reading observed.
+
+Return Value:
+
+    S_OK on success,
+    E_INVALIDARG if the reading is more than HYBRID_LOGICAL_CLOCK_MAX_OFFSET
+    ahead of the wall clock, in which case the clock is left alone.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+
+    EXIT_IF_TRUE(GetPhysicalTime(Timestamp) > ReadWallClock() + HYBRID_LOGICAL_CLOCK_MAX_OFFSET,
+                 E_INVALIDARG,
+                 Cleanup);
+
+    m_Last = std::max(m_Last, Timestamp);
+
+Cleanup:
+    return ec;
+}
+
+uint64_t
+HybridLogicalClock::GetPhysicalTime(uint64_t Timestamp)
+/*++
+
+Routine Description:
+
+    Gets the wall clock part of a reading.
+
+Arguments:
+
+    Timestamp - The reading.
+
+Return Value:
+
+    The wall clock time of the reading, in milliseconds since the epoch.
+
+--*/
+{
+    return Timestamp >> HYBRID_LOGICAL_CLOCK_LOGICAL_BITS;
+}
+
+uint64_t
+HybridLogicalClock::ReadWallClock()
+/*++
+
+Routine Description:
+
+    Reads the wall clock.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The wall clock time, in milliseconds since the epoch.
+
+--*/
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
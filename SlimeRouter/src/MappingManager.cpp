@@ -15,26 +15,36 @@ Abstract:
 //
 
 #include <cstring>
+#include <algorithm>
 
 #include "MappingManager.h"
 #include "IMembershipProtocol.h"
 #include "IMulticastProtocol.h"
+#include "AntiEntropyProtocol.h"
+#include "SnapshotProtocol.h"
+#include "MappingStore.h"
+#include "NetworkUtils.h"
 
 //
 // ---------------------------------------------------------------------- Definitions
 //
 
-#define CREATE_ADDRESS(address, ip, port) address = (uint64_t)port << 32 | ip
+#define MAPPING_TABLE_CAPACITY (1 << 16)
 
-#define GET_IP_ADDRESS(address) (uint32_t)(address & 0xFFFF)
-#define GET_PORT(address) (uint16_t)(address >> 32) & 0xFFFF
+// Number of mapping records that fit in a datagram of the multicast protocol
+#define MAPPING_RECORDS_PER_MESSAGE(protocol) ((protocol)->GetMaximumMessageSize() / sizeof(MappingRecord))
 
 //
 // ---------------------------------------------------------------------- Functions
 //
 
 MappingManager::MappingManager(std::unique_ptr<IMembershipProtocol> MembershipProtocol,
-                               std::unique_ptr<IMulticastProtocol> MulticastProtocol)
+                               std::unique_ptr<IMulticastProtocol> MulticastProtocol,
+                               std::unique_ptr<AntiEntropyProtocol> AntiEntropyProtocol,
+                               std::unique_ptr<SnapshotProtocol> SnapshotProtocol,
+                               std::unique_ptr<MappingStore> MappingStore,
+                               std::string MappingTablePath,
+                               std::chrono::milliseconds FlushDeadline)
 /*++
 
 Routine Description:
@@ -47,14 +57,35 @@ Arguments:
 
     MulticastProtocol - The multicast protocol to use to disseminate mappings.
 
+    AntiEntropyProtocol - The protocol repairing mappings that multicast
+                          failed to deliver, or nullptr.
+
+    SnapshotProtocol - The protocol bootstrapping the mapping table from
+                       peers and serving it to them, or nullptr.
+
+    MappingStore - The store persisting the mapping table across restarts,
+                   or nullptr.
+
+    MappingTablePath - The file to publish the mapping table in for SlimeSocket.
+
+    FlushDeadline - The longest a mapping update is held back to be coalesced
+                    with others before it is multicast.
+
 Return Value:
 
     None.
 
 --*/
     :
+    m_AddressLookup(MAPPING_TABLE_CAPACITY, std::move(MappingTablePath)),
     m_MembershipProtocol(std::move(MembershipProtocol)),
-    m_MulticastProtocol(std::move(MulticastProtocol))
+    m_MulticastProtocol(std::move(MulticastProtocol)),
+    m_AntiEntropyProtocol(std::move(AntiEntropyProtocol)),
+    m_SnapshotProtocol(std::move(SnapshotProtocol)),
+    m_MappingStore(std::move(MappingStore)),
+    m_IpAddress(0),
+    m_FlushDeadline(FlushDeadline),
+    m_ShouldStop(false)
 {
 }
 
@@ -98,12 +129,41 @@ Return Value:
 {
     ERROR_CODE ec = S_OK;
     
+    TRACE_IF_FAILED(m_AddressLookup.Init(),
+                    Cleanup,
+                    "Failed to initialize mapping table! 0x%x\n", ec);
+    
+    TRACE_IF_FAILED(NetworkUtils::GetIpAddress(&m_IpAddress),
+                    Cleanup,
+                    "Failed to get IP address! 0x%x\n", ec);
+    
+    // Restored before any protocol runs, so peers only fill in what changed
+    // while this node was down
+    if (m_MappingStore != nullptr)
+    {
+        TRACE_IF_FAILED(m_MappingStore->Init(m_AddressLookup),
+                        Cleanup,
+                        "Failed to restore mapping table! 0x%x\n", ec);
+    }
+    
     EXIT_IF_FAILED(m_MembershipProtocol->Init(*this),
                    Cleanup);
     
     EXIT_IF_FAILED(m_MulticastProtocol->Init(),
                    Cleanup);
     
+    if (m_AntiEntropyProtocol != nullptr)
+    {
+        EXIT_IF_FAILED(m_AntiEntropyProtocol->Init(m_AddressLookup),
+                       Cleanup);
+    }
+    
+    if (m_SnapshotProtocol != nullptr)
+    {
+        EXIT_IF_FAILED(m_SnapshotProtocol->Init(m_AddressLookup),
+                       Cleanup);
+    }
+    
 Cleanup:
     return ec;
 }
@@ -129,6 +189,20 @@ Return Value:
     ERROR_CODE ec = S_OK;
     
     m_IncomingMessageThread = std::thread([=] { HandleIncomingMessages(); });
+    m_FlushThread = std::thread([=] { FlushMappingRecords(); });
+    
+    if (m_MappingStore != nullptr)
+    {
+        EXIT_IF_FAILED(m_MappingStore->Start(),
+                       Cleanup);
+    }
+    
+    // Ready to bootstrap from the first member the membership protocol reports
+    if (m_SnapshotProtocol != nullptr)
+    {
+        EXIT_IF_FAILED(m_SnapshotProtocol->Start(),
+                       Cleanup);
+    }
     
     EXIT_IF_FAILED(m_MembershipProtocol->Start(),
                    Cleanup);
@@ -136,6 +210,12 @@ Return Value:
     EXIT_IF_FAILED(m_MulticastProtocol->Start(),
                    Cleanup);
     
+    if (m_AntiEntropyProtocol != nullptr)
+    {
+        EXIT_IF_FAILED(m_AntiEntropyProtocol->Start(),
+                       Cleanup);
+    }
+    
 Cleanup:
     return ec;
 }
@@ -160,6 +240,30 @@ Return Value:
 {
     ERROR_CODE ec = S_OK;
 
+    {
+        std::unique_lock<std::mutex> lock(m_PendingLock);
+        m_ShouldStop = true;
+    }
+    m_PendingCondition.notify_all();
+
+    // Sends whatever is still pending before the multicast protocol goes away
+    if (m_FlushThread.joinable())
+    {
+        m_FlushThread.join();
+    }
+
+    if (m_AntiEntropyProtocol != nullptr)
+    {
+        EXIT_IF_FAILED(m_AntiEntropyProtocol->Stop(),
+                       Cleanup);
+    }
+
+    if (m_SnapshotProtocol != nullptr)
+    {
+        EXIT_IF_FAILED(m_SnapshotProtocol->Stop(),
+                       Cleanup);
+    }
+
     EXIT_IF_FAILED(m_MulticastProtocol->Stop(),
                    Cleanup);
     
@@ -171,6 +275,13 @@ Return Value:
         m_IncomingMessageThread.join();
     }
     
+    // Nothing writes to the table anymore
+    if (m_MappingStore != nullptr)
+    {
+        EXIT_IF_FAILED(m_MappingStore->Stop(),
+                       Cleanup);
+    }
+    
 Cleanup:
     return ec;
 }
@@ -184,7 +295,9 @@ MappingManager::AddMapping(const AddressMapping& AddressMapping,
 
 Routine Description:
 
-    Adds the specified mapping to the data store.
+    Adds the specified mapping to the data store, replacing the mapping of
+    its virtual address if there is one. The write is versioned as made by
+    this node.
 
 Arguments:
 
@@ -194,19 +307,26 @@ Arguments:
 
 Return Value:
 
-    S_OK on success, error otherwise.
+    S_OK on success,
+    S_FALSE if the data store already holds the mapping,
+    error otherwise.
 
 --*/
 {
     ERROR_CODE ec = S_OK;
     uint64_t virtualAddress = 0;
-    Message multicastMessage;
+    MappingRecord record;
     
     CREATE_ADDRESS(virtualAddress,
                    AddressMapping.VirtualIpAddress,
                    AddressMapping.VirtualPort);
     
-    m_AddressLookup.insert({virtualAddress, AddressMapping});
+    TRACE_IF_FAILED(m_AddressLookup.Insert(virtualAddress, AddressMapping, m_IpAddress, &record),
+                    Cleanup,
+                    "Failed to insert mapping! 0x%x\n", ec);
+    EXIT_IF_TRUE(ec == S_FALSE,
+                 S_FALSE,
+                 Cleanup);
     
     LOG("Mapping <%u, %hu> -> <%u, %hu> added\n",
         AddressMapping.VirtualIpAddress,
@@ -216,11 +336,7 @@ Return Value:
     
     if (ShouldMulticast)
     {
-        multicastMessage.Header.Id = MESSAGE_TYPE_NEW_MAPPING;
-        multicastMessage.Header.Size = sizeof(AddressMapping);
-        multicastMessage.Body.resize(sizeof(AddressMapping));
-        std::memcpy(multicastMessage.Body.data(), &AddressMapping, sizeof(AddressMapping));
-        EXIT_IF_FAILED(m_MulticastProtocol->Multicast(multicastMessage),
+        EXIT_IF_FAILED(QueueMappingRecord(record),
                        Cleanup);
     }
     
@@ -235,7 +351,8 @@ MappingManager::RemoveMapping(const AddressMapping& AddressMapping,
 
 Routine Description:
 
-    Removes the specified mapping from the data store.
+    Removes the specified mapping from the data store. The write is
+    versioned as made by this node.
 
 Arguments:
 
@@ -245,37 +362,30 @@ Arguments:
 
 Return Value:
 
-    S_OK on success, error otherwise.
+    S_OK on success,
+    S_FALSE if the data store does not hold the mapping,
+    error otherwise.
 
 --*/
 {
     ERROR_CODE ec = S_OK;
     uint64_t virtualAddress = 0;
-    Message multicastMessage;
+    MappingRecord record;
     
     CREATE_ADDRESS(virtualAddress,
                    AddressMapping.VirtualIpAddress,
                    AddressMapping.VirtualPort);
     
-    auto mappingIt = m_AddressLookup.find(virtualAddress);
-    EXIT_IF_TRUE(mappingIt == m_AddressLookup.end(),
+    // Only removed if the table still maps it to the same host address
+    EXIT_IF_FAILED(m_AddressLookup.Remove(virtualAddress, AddressMapping, m_IpAddress, &record),
+                   Cleanup);
+    EXIT_IF_TRUE(ec == S_FALSE,
                  S_FALSE,
                  Cleanup);
     
-    // TODO: operator ==
-    // EXIT_IF_TRUE(AddressMapping != mappingIt->second,
-    //              S_FALSE,
-    //              Cleanup);
-    
-    m_AddressLookup.erase(mappingIt);
-    
     if (ShouldMulticast)
     {
-        multicastMessage.Header.Id = MESSAGE_TYPE_DELETE_MAPPING;
-        multicastMessage.Header.Size = sizeof(AddressMapping);
-        multicastMessage.Body.resize(sizeof(AddressMapping));
-        std::memcpy(multicastMessage.Body.data(), &AddressMapping, sizeof(AddressMapping));
-        EXIT_IF_FAILED(m_MulticastProtocol->Multicast(multicastMessage),
+        EXIT_IF_FAILED(QueueMappingRecord(record),
                        Cleanup);
     }
     
@@ -316,13 +426,12 @@ Return Value:
     
     CREATE_ADDRESS(virtualAddress, VirtualIpAddress, VirtualPort);
     
-    auto mappingIt = m_AddressLookup.find(virtualAddress);
-
-    EXIT_IF_TRUE(mappingIt == m_AddressLookup.end(),
+    EXIT_IF_FAILED(m_AddressLookup.Lookup(virtualAddress, &addressMapping),
+                   Cleanup);
+    EXIT_IF_TRUE(ec == S_FALSE,
                  S_FALSE,
                  Cleanup);
     
-    addressMapping = mappingIt->second;
     *HostIpAddress = addressMapping.HostIpAddress;
     *HostPort = addressMapping.HostPort;
 
@@ -330,6 +439,28 @@ Cleanup:
     return ec;
 }
 
+uint64_t
+MappingManager::GetMappingVersion() const
+/*++
+
+Routine Description:
+
+    Gets the version of the mappings, which changes whenever one is added or
+    removed.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The current mapping version.
+
+--*/
+{
+    return m_AddressLookup.GetVersion();
+}
+
 ERROR_CODE
 MappingManager::OnJoin(const std::string& IpAddress)
 /*++
@@ -353,6 +484,18 @@ Return Value:
     EXIT_IF_FAILED(m_MulticastProtocol->AddToMulticastGroup(IpAddress, 8080),
                    Cleanup);
     
+    if (m_AntiEntropyProtocol != nullptr)
+    {
+        EXIT_IF_FAILED(m_AntiEntropyProtocol->AddPeer(IpAddress),
+                       Cleanup);
+    }
+    
+    if (m_SnapshotProtocol != nullptr)
+    {
+        EXIT_IF_FAILED(m_SnapshotProtocol->AddPeer(IpAddress),
+                       Cleanup);
+    }
+    
 Cleanup:
     return ec;
 }
@@ -380,6 +523,12 @@ Return Value:
     EXIT_IF_FAILED(m_MulticastProtocol->RemoveFromMulticastGroup(IpAddress, 8080),
                    Cleanup);
     
+    if (m_AntiEntropyProtocol != nullptr)
+    {
+        EXIT_IF_FAILED(m_AntiEntropyProtocol->RemovePeer(IpAddress),
+                       Cleanup);
+    }
+    
 Cleanup:
     return ec;
 }
@@ -410,9 +559,19 @@ Return Value:
         EXIT_IF_FAILED(m_MulticastProtocol->GetNextDeliveredMessage(&message),
                        Cleanup);
         
+        // The protocol traces its own failures; a bad message from one peer
+        // must not stop delivery
+        if (IS_ANTI_ENTROPY_MESSAGE(message.Header.Id) && m_AntiEntropyProtocol != nullptr)
+        {
+            m_AntiEntropyProtocol->OnReceive(message);
+            continue;
+        }
+        
         LOG("Received message!\n");
-        EXIT_IF_FAILED(ProcessIncomingMessage(message),
-                       Cleanup);
+        if (FAILED(ProcessIncomingMessage(message)))
+        {
+            LOG("Dropping malformed mapping message 0x%x!\n", message.Header.Id);
+        }
     }
     
 Cleanup:
@@ -438,18 +597,13 @@ Return Value:
 --*/
 {
     ERROR_CODE ec = S_OK;
-    const AddressMapping* addressMapping = NULL;
     
+    // Mappings only travel as versioned records in batches. A bare mapping
+    // carries no version and would be stamped with ours, so it is rejected.
     switch (Message.Header.Id)
     {
-    case MESSAGE_TYPE_NEW_MAPPING:
-        addressMapping = reinterpret_cast<const AddressMapping*>(Message.Body.data());
-        EXIT_IF_FAILED(AddMapping(*addressMapping, false),
-                       Cleanup);
-        break;
-    case MESSAGE_TYPE_DELETE_MAPPING:
-        addressMapping = reinterpret_cast<const AddressMapping*>(Message.Body.data());
-        EXIT_IF_FAILED(RemoveMapping(*addressMapping, false),
+    case MESSAGE_TYPE_MAPPING_BATCH:
+        EXIT_IF_FAILED(ProcessMappingRecords(Message),
                        Cleanup);
         break;
     default:
@@ -460,3 +614,202 @@ Return Value:
 Cleanup:
     return ec;
 }
+
+ERROR_CODE
+MappingManager::ProcessMappingRecords(const Message& Message)
+/*++
+
+Routine Description:
+
+    Merges every record of a mapping batch into the table. Records older
+than those held are ignored, so batches may arrive in any order and any
+number of times. A record that fails to apply does not prevent the rest of
+the batch from being applied.
+
+Arguments:
+
+    Message - The mapping batch to process.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    ERROR_CODE recordEc = S_OK;
+    MappingRecord record;
+    
+    EXIT_IF_TRUE(Message.Body.size() % sizeof(MappingRecord) != 0,
+                 E_INVALIDARG,
+                 Cleanup);
+    
+    for (size_t offset = 0; offset < Message.Body.size(); offset += sizeof(MappingRecord))
+    {
+        std::memcpy(&record, Message.Body.data() + offset, sizeof(record));
+        
+        recordEc = m_AddressLookup.Merge(record);
+        
+        if (FAILED(recordEc))
+        {
+            LOG("Failed to apply mapping record of type %u! 0x%x\n", record.Type, recordEc);
+        }
+        else if (recordEc == S_OK)
+        {
+            LOG("Mapping <%u, %hu> -> <%u, %hu> %s\n",
+                record.Mapping.VirtualIpAddress,
+                record.Mapping.VirtualPort,
+                record.Mapping.HostIpAddress,
+                record.Mapping.HostPort,
+                record.Type == MESSAGE_TYPE_NEW_MAPPING ? "added" : "removed");
+        }
+    }
+    
+Cleanup:
+    return ec;
+}
+
+ERROR_CODE
+MappingManager::QueueMappingRecord(const MappingRecord& Record)
+/*++
+
+Routine Description:
+
+    Queues a mapping update to be multicast with the next batch. Wakes the
+flush thread when the batch starts, so it can arm the deadline, and when the
+batch fills a datagram, so it is sent right away.
+
+Arguments:
+
+    Record - The versioned record of the mapping that was added or removed.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    const size_t recordsPerMessage = MAPPING_RECORDS_PER_MESSAGE(m_MulticastProtocol);
+    bool shouldWake = false;
+    
+    {
+        std::unique_lock<std::mutex> lock(m_PendingLock);
+        
+        if (m_PendingRecords.empty())
+        {
+            m_FlushTime = std::chrono::steady_clock::now() + m_FlushDeadline;
+            shouldWake = true;
+        }
+        
+        m_PendingRecords.push_back(Record);
+        shouldWake = shouldWake || m_PendingRecords.size() >= recordsPerMessage;
+    }
+    
+    if (shouldWake)
+    {
+        m_PendingCondition.notify_one();
+    }
+    
+    return ec;
+}
+
+ERROR_CODE
+MappingManager::FlushMappingRecords()
+/*++
+
+Routine Description:
+
+    Multicasts pending mapping records once a datagram's worth is queued or
+the oldest record reaches the flush deadline, whichever comes first. Flushes
+the remaining records when the manager stops.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    const size_t recordsPerMessage = MAPPING_RECORDS_PER_MESSAGE(m_MulticastProtocol);
+    std::unique_lock<std::mutex> lock(m_PendingLock);
+    std::vector<MappingRecord> records;
+    
+    while (true)
+    {
+        m_PendingCondition.wait(lock, [=] { return m_ShouldStop || !m_PendingRecords.empty(); });
+        
+        m_PendingCondition.wait_until(lock, m_FlushTime, [=] {
+            return m_ShouldStop || m_PendingRecords.size() >= recordsPerMessage;
+        });
+        
+        if (m_PendingRecords.empty() && m_ShouldStop)
+        {
+            break;
+        }
+        
+        records.swap(m_PendingRecords);
+        lock.unlock();
+        
+        TRACE_IF_FAILED(MulticastMappingRecords(records),
+                        Resume,
+                        "Failed to multicast mapping records! 0x%x\n", ec);
+Resume:
+        records.clear();
+        lock.lock();
+        
+        // Records queued while multicasting start a new batch with a fresh deadline
+        if (!m_PendingRecords.empty())
+        {
+            m_FlushTime = std::chrono::steady_clock::now() + m_FlushDeadline;
+        }
+    }
+    
+    return ec;
+}
+
+ERROR_CODE
+MappingManager::MulticastMappingRecords(const std::vector<MappingRecord>& Records)
+/*++
+
+Routine Description:
+
+    Packs mapping records into as few mapping batches as the multicast
+protocol's datagram size allows and multicasts them.
+
+Arguments:
+
+    Records - The records to multicast, in order.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    const size_t recordsPerMessage = MAPPING_RECORDS_PER_MESSAGE(m_MulticastProtocol);
+    size_t recordCount = 0;
+    Message multicastMessage;
+    
+    multicastMessage.Header.Id = MESSAGE_TYPE_MAPPING_BATCH;
+    
+    for (size_t i = 0; i < Records.size(); i += recordCount)
+    {
+        recordCount = std::min(recordsPerMessage, Records.size() - i);
+        
+        multicastMessage.Header.Size = recordCount * sizeof(MappingRecord);
+        multicastMessage.Body.resize(multicastMessage.Header.Size);
+        std::memcpy(multicastMessage.Body.data(), &Records[i], multicastMessage.Header.Size);
+        
+        EXIT_IF_FAILED(m_MulticastProtocol->Multicast(multicastMessage),
+                       Cleanup);
+    }
+    
+Cleanup:
+    return ec;
+}
@@ -0,0 +1,694 @@
+/*++
+
+Module Name:
+
+    MappingStore.cpp
+
+Abstract:
+
+    Class implementation of a persistent store of the mapping table.
+
+--*/
+
+//
+// ---------------------------------------------------------------------- Includes
+//
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cerrno>
+#include <chrono>
+#include <vector>
+
+#include "MappingStore.h"
+#include "MappingTable.h"
+
+//
+// ---------------------------------------------------------------------- Definitions
+//
+
+#define MAPPING_STORE_CHECKPOINT_PERIOD std::chrono::seconds(30)
+
+// The number of logged records that triggers a checkpoint ahead of the period
+#define MAPPING_STORE_MAX_LOG_RECORDS 65536
+
+//
+// ---------------------------------------------------------------------- Functions
+//
+
+static
+uint64_t
+ComputeChecksum(const void* Data,
+                size_t Size)
+{
+    const uint8_t* bytes = static_cast<const uint8_t*>(Data);
+    uint64_t checksum = 0xCBF29CE484222325ULL;
+
+    for (size_t i = 0; i < Size; i++)
+    {
+        checksum ^= bytes[i];
+        checksum *= 0x100000001B3ULL;
+    }
+
+    return checksum;
+}
+
+static
+ERROR_CODE
+WriteAll(int Fd,
+         const void* Data,
+         size_t Size)
+{
+    ERROR_CODE ec = S_OK;
+    ssize_t bytesWritten = 0;
+    size_t totalBytes = 0;
+
+    while (totalBytes < Size)
+    {
+        bytesWritten = write(Fd, (const uint8_t*)Data + totalBytes, Size - totalBytes);
+        if (bytesWritten < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        EXIT_IF_TRUE(bytesWritten <= 0,
+                     E_FAIL,
+                     Cleanup);
+
+        totalBytes += bytesWritten;
+    }
+
+Cleanup:
+    return ec;
+}
+
+MappingStore::MappingStore(std::string Path)
+/*++
+
+Routine Description:
+
+    Constructor for MappingStore.
+
+Arguments:
+
+    Path - The prefix of the files of the store.
+
+Return Value:
+
+    None.
+
+--*/
+    :
+    m_MappingTable(nullptr),
+    m_SnapshotPath(Path + ".snapshot"),
+    m_LogPath(Path + ".log"),
+    m_OldLogPath(Path + ".log.old"),
+    m_LogFd(-1),
+    m_LogCount(0),
+    m_ShouldStop(false)
+{
+
+}
+
+MappingStore::~MappingStore()
+/*++
+
+Routine Description:
+
+    Destructor for MappingStore.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    Stop();
+
+    if (m_LogFd != -1)
+    {
+        close(m_LogFd);
+    }
+}
+
+ERROR_CODE
+MappingStore::Init(MappingTable& MappingTable)
+/*++
+
+Routine Description:
+
+    Loads the snapshot and replays the logs into the table, then attaches to
+the table to log its writes. A log left behind by an interrupted checkpoint
+is replayed before the current one.
+
+Arguments:
+
+    MappingTable - The mapping table to persist. Must be initialized.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    auto start = std::chrono::steady_clock::now();
+    uint32_t snapshotCount = 0;
+    uint32_t oldLogCount = 0;
+    uint32_t logCount = 0;
+
+    m_MappingTable = &MappingTable;
+
+    EXIT_IF_FAILED(LoadSnapshot(&snapshotCount),
+                   Cleanup);
+
+    EXIT_IF_FAILED(ReplayLog(m_OldLogPath, false, &oldLogCount),
+                   Cleanup);
+
+    EXIT_IF_FAILED(ReplayLog(m_LogPath, true, &logCount),
+                   Cleanup);
+
+    TRACE_IF_FAILED(OpenLog(),
+                    Cleanup,
+                    "Failed to open mapping log! 0x%x\n", errno);
+
+    // The next checkpoint folds in whatever was replayed
+    m_LogCount = oldLogCount + logCount;
+    m_MappingTable->SetStore(this);
+
+    LOG("Restored %u records from the snapshot and %u from the log in %lld us\n",
+        snapshotCount,
+        oldLogCount + logCount,
+        (long long)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+
+Cleanup:
+    return ec;
+}
+
+ERROR_CODE
+MappingStore::Start()
+/*++
+
+Routine Description:
+
+    Starts checkpointing the table.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+
+    m_CheckpointThread = std::thread([=] { PeriodicallyCheckpoint(); });
+
+    return ec;
+}
+
+ERROR_CODE
+MappingStore::Stop()
+/*++
+
+Routine Description:
+
+    Stops checkpointing and detaches from the table, taking a last checkpoint
+so that the next start has no log to replay.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+
+    {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        m_ShouldStop = true;
+    }
+    m_Condition.notify_all();
+
+    if (m_CheckpointThread.joinable())
+    {
+        m_CheckpointThread.join();
+    }
+
+    if (m_MappingTable != nullptr)
+    {
+        m_MappingTable->SetStore(nullptr);
+
+        EXIT_IF_FAILED(Checkpoint(),
+                       Cleanup);
+
+        m_MappingTable = nullptr;
+    }
+
+Cleanup:
+    return ec;
+}
+
+ERROR_CODE
+MappingStore::Append(const MappingRecord& Record)
+/*++
+
+Routine Description:
+
+    Appends a record applied to the table to the log. Wakes the checkpoint
+thread once the log grows past MAPPING_STORE_MAX_LOG_RECORDS.
+
+Arguments:
+
+    Record - The record.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    MappingStoreEntry entry = {};
+    bool shouldWake = false;
+
+    entry.Record = Record;
+    entry.Checksum = ComputeChecksum(&entry.Record, sizeof(entry.Record));
+
+    {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+
+        EXIT_IF_TRUE(m_LogFd == -1,
+                     E_FAIL,
+                     Cleanup);
+
+        TRACE_IF_FAILED(WriteAll(m_LogFd, &entry, sizeof(entry)),
+                        Cleanup,
+                        "Failed to append to mapping log! 0x%x\n", errno);
+
+        shouldWake = ++m_LogCount == MAPPING_STORE_MAX_LOG_RECORDS;
+    }
+
+    if (shouldWake)
+    {
+        m_Condition.notify_one();
+    }
+
+Cleanup:
+    return ec;
+}
+
+ERROR_CODE
+MappingStore::Checkpoint()
+/*++
+
+Routine Description:
+
+    Replaces the snapshot with one of the current table and drops the logs
+it covers. The log is moved aside before the table is read, so every record
+it holds is in the snapshot; records logged meanwhile go to a new log. If
+an old log is left over from an earlier failed checkpoint, the current log
+is kept instead and replayed on top of the snapshot.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    S_OK on success,
+    S_FALSE if nothing was logged since the last checkpoint,
+    error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+
+    {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+
+        EXIT_IF_TRUE(m_LogCount == 0 && access(m_OldLogPath.c_str(), F_OK) != 0,
+                     S_FALSE,
+                     Cleanup);
+
+        if (access(m_OldLogPath.c_str(), F_OK) != 0)
+        {
+            TRACE_IF_FAILED(rename(m_LogPath.c_str(), m_OldLogPath.c_str()),
+                            Cleanup,
+                            "Failed to rotate mapping log! 0x%x\n", errno);
+
+            close(m_LogFd);
+            m_LogFd = -1;
+
+            TRACE_IF_FAILED(OpenLog(),
+                            Cleanup,
+                            "Failed to open mapping log! 0x%x\n", errno);
+        }
+
+        m_LogCount = 0;
+    }
+
+    EXIT_IF_FAILED(WriteSnapshot(),
+                   Cleanup);
+
+    TRACE_IF_FAILED(unlink(m_OldLogPath.c_str()),
+                    Cleanup,
+                    "Failed to delete mapping log! 0x%x\n", errno);
+
+Cleanup:
+    return ec;
+}
+
+ERROR_CODE
+MappingStore::LoadSnapshot(uint32_t* RecordCount)
+/*++
+
+Routine Description:
+
+    Maps the snapshot and merges its records into the table. A missing
+snapshot is an empty one; a corrupted one is skipped, leaving its records to
+the logs and to peers.
+
+Arguments:
+
+    RecordCount - Receives the number of records of the snapshot.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    const MappingStoreHeader* header = nullptr;
+    const MappingRecord* records = nullptr;
+    void* region = MAP_FAILED;
+    struct stat status = {};
+    int fd = -1;
+
+    *RecordCount = 0;
+
+    fd = open(m_SnapshotPath.c_str(), O_RDONLY | O_CLOEXEC);
+    EXIT_IF_TRUE(fd == -1 && errno == ENOENT,
+                 S_OK,
+                 Cleanup);
+
+    TRACE_IF_FAILED(fd,
+                    Cleanup,
+                    "Failed to open mapping snapshot! 0x%x\n", errno);
+
+    TRACE_IF_FAILED(fstat(fd, &status),
+                    Cleanup,
+                    "Failed to stat mapping snapshot! 0x%x\n", errno);
+
+    EXIT_IF_TRUE(status.st_size < (off_t)sizeof(MappingStoreHeader),
+                 S_OK,
+                 Cleanup);
+
+    region = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    EXIT_IF_TRUE(region == MAP_FAILED,
+                 E_OUTOFMEMORY,
+                 Cleanup);
+
+    header = reinterpret_cast<const MappingStoreHeader*>(region);
+    records = reinterpret_cast<const MappingRecord*>(header + 1);
+
+    if (header->Magic != MAPPING_STORE_MAGIC ||
+        header->Version != MAPPING_STORE_VERSION ||
+        (size_t)status.st_size != sizeof(*header) + (size_t)header->RecordCount * sizeof(MappingRecord) ||
+        header->Checksum != ComputeChecksum(records, (size_t)header->RecordCount * sizeof(MappingRecord)))
+    {
+        LOG("Mapping snapshot %s is corrupted!\n", m_SnapshotPath.c_str());
+    }
+    else
+    {
+        for (uint32_t i = 0; i < header->RecordCount; i++)
+        {
+            m_MappingTable->Merge(records[i]);
+        }
+
+        *RecordCount = header->RecordCount;
+    }
+
+Cleanup:
+    if (region != MAP_FAILED)
+    {
+        munmap(region, status.st_size);
+    }
+
+    if (fd != -1)
+    {
+        close(fd);
+    }
+
+    return ec;
+}
+
+ERROR_CODE
+MappingStore::ReplayLog(const std::string& Path,
+                        bool ShouldRepair,
+                        uint32_t* RecordCount)
+/*++
+
+Routine Description:
+
+    Merges the records of a log into the table, up to the first torn or
+corrupted entry.
+
+Arguments:
+
+    Path - The log to replay. A missing log is an empty one.
+
+    ShouldRepair - Whether to truncate the log after its last intact entry,
+                   so that later appends are not hidden behind a torn one.
+
+    RecordCount - Receives the number of records replayed.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    const MappingStoreEntry* entries = nullptr;
+    void* region = MAP_FAILED;
+    struct stat status = {};
+    size_t entryCount = 0;
+    uint32_t i = 0;
+    int fd = -1;
+
+    *RecordCount = 0;
+
+    fd = open(Path.c_str(), O_RDWR | O_CLOEXEC);
+    EXIT_IF_TRUE(fd == -1 && errno == ENOENT,
+                 S_OK,
+                 Cleanup);
+
+    TRACE_IF_FAILED(fd,
+                    Cleanup,
+                    "Failed to open mapping log! 0x%x\n", errno);
+
+    TRACE_IF_FAILED(fstat(fd, &status),
+                    Cleanup,
+                    "Failed to stat mapping log! 0x%x\n", errno);
+
+    entryCount = status.st_size / sizeof(MappingStoreEntry);
+
+    if (entryCount != 0)
+    {
+        region = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        EXIT_IF_TRUE(region == MAP_FAILED,
+                     E_OUTOFMEMORY,
+                     Cleanup);
+
+        entries = reinterpret_cast<const MappingStoreEntry*>(region);
+    }
+
+    for (i = 0; i < entryCount; i++)
+    {
+        if (entries[i].Checksum != ComputeChecksum(&entries[i].Record, sizeof(entries[i].Record)))
+        {
+            break;
+        }
+
+        m_MappingTable->Merge(entries[i].Record);
+    }
+
+    *RecordCount = i;
+
+    if (ShouldRepair && (off_t)((size_t)i * sizeof(MappingStoreEntry)) != status.st_size)
+    {
+        LOG("Truncating mapping log %s after %u records\n", Path.c_str(), i);
+
+        TRACE_IF_FAILED(ftruncate(fd, (size_t)i * sizeof(MappingStoreEntry)),
+                        Cleanup,
+                        "Failed to truncate mapping log! 0x%x\n", errno);
+    }
+
+Cleanup:
+    if (region != MAP_FAILED)
+    {
+        munmap(region, status.st_size);
+    }
+
+    if (fd != -1)
+    {
+        close(fd);
+    }
+
+    return ec;
+}
+
+ERROR_CODE
+MappingStore::WriteSnapshot()
+/*++
+
+Routine Description:
+
+    Writes every record of the table to a new snapshot and atomically
+renames it into place, so a crash leaves either the old snapshot or the new
+one.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    const std::string temporaryPath = m_SnapshotPath + ".tmp";
+    std::vector<MappingRecord> records;
+    MappingStoreHeader header = {};
+    uint64_t version = 0;
+    int fd = -1;
+
+    EXIT_IF_FAILED(m_MappingTable->GetRecords(&records, &version),
+                   Cleanup);
+
+    header.Magic = MAPPING_STORE_MAGIC;
+    header.Version = MAPPING_STORE_VERSION;
+    header.RecordCount = records.size();
+    header.Checksum = ComputeChecksum(records.data(), records.size() * sizeof(MappingRecord));
+
+    fd = open(temporaryPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    TRACE_IF_FAILED(fd,
+                    Cleanup,
+                    "Failed to create mapping snapshot! 0x%x\n", errno);
+
+    TRACE_IF_FAILED(WriteAll(fd, &header, sizeof(header)),
+                    Cleanup,
+                    "Failed to write mapping snapshot! 0x%x\n", errno);
+
+    TRACE_IF_FAILED(WriteAll(fd, records.data(), records.size() * sizeof(MappingRecord)),
+                    Cleanup,
+                    "Failed to write mapping snapshot! 0x%x\n", errno);
+
+    // The old log is deleted once the snapshot is in place; it must not
+    // outlast the snapshot if the host goes down
+    TRACE_IF_FAILED(fsync(fd),
+                    Cleanup,
+                    "Failed to sync mapping snapshot! 0x%x\n", errno);
+
+    TRACE_IF_FAILED(rename(temporaryPath.c_str(), m_SnapshotPath.c_str()),
+                    Cleanup,
+                    "Failed to publish mapping snapshot! 0x%x\n", errno);
+
+Cleanup:
+    if (fd != -1)
+    {
+        close(fd);
+    }
+
+    return ec;
+}
+
+ERROR_CODE
+MappingStore::OpenLog()
+/*++
+
+Routine Description:
+
+    Opens the log for appending, creating it if needed. Must be called with
+the mutex held, or before the store is attached to the table.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+
+    m_LogFd = open(m_LogPath.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    EXIT_IF_FAILED(m_LogFd,
+                   Cleanup);
+
+    ec = S_OK;
+
+Cleanup:
+    return ec;
+}
+
+ERROR_CODE
+MappingStore::PeriodicallyCheckpoint()
+/*++
+
+Routine Description:
+
+    Takes a checkpoint every MAPPING_STORE_CHECKPOINT_PERIOD, or as soon as
+the log grows past MAPPING_STORE_MAX_LOG_RECORDS, whichever comes first.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    std::unique_lock<std::mutex> lock(m_Mutex);
+
+    while (!m_ShouldStop)
+    {
+        m_Condition.wait_for(lock,
+                             MAPPING_STORE_CHECKPOINT_PERIOD,
+                             [=] { return m_ShouldStop || m_LogCount >= MAPPING_STORE_MAX_LOG_RECORDS; });
+
+        if (m_ShouldStop)
+        {
+            break;
+        }
+
+        lock.unlock();
+        Checkpoint();
+        lock.lock();
+    }
+
+    return ec;
+}
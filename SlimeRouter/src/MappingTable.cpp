@@ -0,0 +1,1287 @@
+/*++
+
+Module Name:
+
+    MappingTable.cpp
+
+Abstract:
+
+    Class implementation of a concurrent, read-optimized mapping table.
+
+--*/
+
+//
+// ---------------------------------------------------------------------- Includes
+//
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+#include "MappingTable.h"
+#include "MappingStore.h"
+
+//
+// ---------------------------------------------------------------------- Definitions
+//
+
+#define MAPPING_TABLE_NOT_FOUND UINT32_MAX
+
+//
+// ---------------------------------------------------------------------- Functions
+//
+
+static
+uint64_t
+GetVirtualAddress(const MappingRecord& Record)
+{
+    uint64_t virtualAddress = 0;
+
+    CREATE_ADDRESS(virtualAddress,
+                   Record.Mapping.VirtualIpAddress,
+                   Record.Mapping.VirtualPort);
+
+    return virtualAddress;
+}
+
+static
+bool
+IsNewer(const RecordVersion& Left,
+        const RecordVersion& Right)
+{
+    return Left.Timestamp != Right.Timestamp ? Left.Timestamp > Right.Timestamp : Left.Origin > Right.Origin;
+}
+
+static
+bool
+IsExpiredTombstone(const MappingRecord& Record,
+                   uint64_t WallClock)
+{
+    return Record.Type == MESSAGE_TYPE_DELETE_MAPPING &&
+           HybridLogicalClock::GetPhysicalTime(Record.Version.Timestamp) + MAPPING_TABLE_TOMBSTONE_LIFETIME < WallClock;
+}
+
+MappingTable::MappingTable(uint32_t Capacity,
+                           std::string Path)
+/*++
+
+Routine Description:
+
+    Constructor for MappingTable.
+
+Arguments:
+
+    Capacity - The number of slots in the table. Rounded up to a power of two.
+               At most three quarters of the slots can hold live mappings.
+
+    Path - The file to publish the table in. An empty path keeps the table
+           private to this process.
+
+Return Value:
+
+    None.
+
+--*/
+    :
+    m_Header(nullptr),
+    m_Slots(nullptr),
+    m_Capacity(1),
+    m_Path(std::move(Path)),
+    m_RegionSize(0),
+    m_BucketSlots(0),
+    m_Store(nullptr)
+{
+    size_t digestCount = 0;
+
+    while (m_Capacity < Capacity)
+    {
+        m_Capacity <<= 1;
+    }
+
+    m_BucketSlots = std::min<uint32_t>(m_Capacity, MAPPING_TABLE_BUCKET_SLOTS);
+
+    // Build the levels of the digest tree from the buckets up
+    digestCount = m_Capacity / m_BucketSlots;
+    m_Digests.emplace_back(digestCount, 0);
+    m_Records.resize(digestCount);
+
+    while (digestCount > 1)
+    {
+        digestCount = (digestCount + MAPPING_TABLE_DIGEST_FANOUT - 1) / MAPPING_TABLE_DIGEST_FANOUT;
+        m_Digests.emplace(m_Digests.begin(), digestCount, 0);
+    }
+}
+
+MappingTable::~MappingTable()
+/*++
+
+Routine Description:
+
+    Destructor for MappingTable.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (m_Header != nullptr)
+    {
+        munmap(m_Header, m_RegionSize);
+    }
+}
+
+ERROR_CODE
+MappingTable::Init()
+/*++
+
+Routine Description:
+
+    Allocates the memory backing the table. If the table is published and a
+previous router left a table of the same layout at the path, that table is
+emptied in place, since running processes keep it mapped and would never see
+a replacement. Otherwise the file is fully initialized under a temporary
+name and then atomically renamed into place so that readers never map a
+partially initialized table.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    void* region = MAP_FAILED;
+    std::string temporaryPath = m_Path + ".tmp";
+    int fd = -1;
+
+    m_RegionSize = MAPPING_TABLE_SLOTS_OFFSET + (size_t)m_Capacity * sizeof(MappingTableSlot);
+
+    if (m_Path.empty())
+    {
+        region = mmap(NULL,
+                      m_RegionSize,
+                      PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS,
+                      -1,
+                      0);
+    }
+    else if (MapPublishedTable(&region) == S_OK)
+    {
+        m_Header = reinterpret_cast<MappingTableHeader*>(region);
+        m_Slots = MappingTableSlots(m_Header);
+        Reset();
+        goto Cleanup;
+    }
+    else
+    {
+        fd = open(temporaryPath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        TRACE_IF_FAILED(fd,
+                        Cleanup,
+                        "Failed to create mapping table file! 0x%x\n", errno);
+
+        TRACE_IF_FAILED(ftruncate(fd, m_RegionSize),
+                        Cleanup,
+                        "Failed to size mapping table file! 0x%x\n", errno);
+
+        region = mmap(NULL,
+                      m_RegionSize,
+                      PROT_READ | PROT_WRITE,
+                      MAP_SHARED,
+                      fd,
+                      0);
+    }
+
+    // Both kinds of mappings are zero-filled, which is an empty table
+    EXIT_IF_TRUE(region == MAP_FAILED,
+                 E_OUTOFMEMORY,
+                 Cleanup);
+
+    m_Header = reinterpret_cast<MappingTableHeader*>(region);
+    m_Slots = MappingTableSlots(m_Header);
+    m_Header->Magic = MAPPING_TABLE_MAGIC;
+    m_Header->Version = MAPPING_TABLE_VERSION;
+    m_Header->Capacity = m_Capacity;
+
+    if (!m_Path.empty())
+    {
+        TRACE_IF_FAILED(rename(temporaryPath.c_str(), m_Path.c_str()),
+                        Cleanup,
+                        "Failed to publish mapping table file! 0x%x\n", errno);
+    }
+
+Cleanup:
+    if (fd != -1)
+    {
+        close(fd);
+    }
+
+    return ec;
+}
+
+ERROR_CODE
+MappingTable::MapPublishedTable(void** Region)
+/*++
+
+Routine Description:
+
+    Maps the table a previous router published at the path, if it has the
+layout of this one.
+
+Arguments:
+
+    Region - Receives the mapped table.
+
+Return Value:
+
+    S_OK if the table was mapped,
+    S_FALSE if there is no table of the same layout to reuse.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    const MappingTableHeader* header = nullptr;
+    struct stat fileStat;
+    void* region = MAP_FAILED;
+    int fd = -1;
+
+    fd = open(m_Path.c_str(), O_RDWR | O_CLOEXEC);
+    EXIT_IF_TRUE(fd < 0,
+                 S_FALSE,
+                 Cleanup);
+
+    EXIT_IF_TRUE(fstat(fd, &fileStat) != 0 || (size_t)fileStat.st_size != m_RegionSize,
+                 S_FALSE,
+                 Cleanup);
+
+    region = mmap(NULL,
+                  m_RegionSize,
+                  PROT_READ | PROT_WRITE,
+                  MAP_SHARED,
+                  fd,
+                  0);
+    EXIT_IF_TRUE(region == MAP_FAILED,
+                 S_FALSE,
+                 Cleanup);
+
+    header = reinterpret_cast<const MappingTableHeader*>(region);
+    EXIT_IF_TRUE(header->Magic != MAPPING_TABLE_MAGIC ||
+                 header->Version != MAPPING_TABLE_VERSION ||
+                 header->Capacity != m_Capacity,
+                 S_FALSE,
+                 Cleanup);
+
+    *Region = region;
+
+Cleanup:
+    if (ec != S_OK && region != MAP_FAILED)
+    {
+        munmap(region, m_RegionSize);
+    }
+
+    if (fd != -1)
+    {
+        close(fd);
+    }
+
+    return ec;
+}
+
+void
+MappingTable::Reset()
+/*++
+
+Routine Description:
+
+    Empties a table a previous router left behind, under the sequence lock so
+that processes reading it retry rather than see it half emptied. The version
+carries on from the previous router's.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    // A router that died while writing left the sequence odd, which readers
+    // already treat as locked
+    uint64_t sequence = m_Header->Sequence.load(std::memory_order_relaxed) & ~1ULL;
+
+    m_Header->Sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    for (uint32_t i = 0; i < m_Capacity; i++)
+    {
+        m_Slots[i].Key.store(MAPPING_TABLE_EMPTY_KEY, std::memory_order_relaxed);
+        m_Slots[i].Value.store(0, std::memory_order_relaxed);
+    }
+
+    m_Header->Count = 0;
+    m_Header->Tombstones = 0;
+
+    EndWrite(sequence);
+}
+
+ERROR_CODE
+MappingTable::Insert(uint64_t VirtualAddress,
+                     const AddressMapping& AddressMapping,
+                     uint32_t Origin,
+                     MappingRecord* Record)
+/*++
+
+Routine Description:
+
+    Inserts a mapping made on this node into the table, replacing the
+mapping of the virtual address if there is one.
+
+Arguments:
+
+    VirtualAddress - The key of the mapping.
+
+    AddressMapping - The mapping to insert.
+
+    Origin - The IP address of this node, in network byte order.
+
+    Record - Receives the versioned record of the insertion.
+
+Return Value:
+
+    S_OK on success,
+    S_FALSE if the table already maps the virtual address to the same host
+    address,
+    error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    std::unique_lock<std::mutex> lock(m_WriterLock);
+    const MappingRecord* current = nullptr;
+    MappingRecord record = {};
+
+    EXIT_IF_NULL(m_Header,
+                 E_FAIL,
+                 Cleanup);
+
+    current = FindRecord(VirtualAddress);
+    EXIT_IF_TRUE(current != nullptr &&
+                 current->Type == MESSAGE_TYPE_NEW_MAPPING &&
+                 current->Mapping.HostIpAddress == AddressMapping.HostIpAddress &&
+                 current->Mapping.HostPort == AddressMapping.HostPort,
+                 S_FALSE,
+                 Cleanup);
+
+    record.Type = MESSAGE_TYPE_NEW_MAPPING;
+    record.Mapping = AddressMapping;
+    record.Version.Timestamp = m_Clock.Now();
+    record.Version.Origin = Origin;
+
+    EXIT_IF_FAILED(ApplyRecord(VirtualAddress, record),
+                   Cleanup);
+
+    *Record = record;
+
+Cleanup:
+    return ec;
+}
+
+ERROR_CODE
+MappingTable::Remove(uint64_t VirtualAddress,
+                     const AddressMapping& AddressMapping,
+                     uint32_t Origin,
+                     MappingRecord* Record)
+/*++
+
+Routine Description:
+
+    Removes a mapping on behalf of this node, leaving a tombstone in its
+place. The mapping is only removed if it still points at the same host
+address, so that removing a stale mapping cannot remove the one replacing it.
+
+Arguments:
+
+    VirtualAddress - The key of the mapping to remove.
+
+    AddressMapping - The mapping to remove.
+
+    Origin - The IP address of this node, in network byte order.
+
+    Record - Receives the versioned record of the removal.
+
+Return Value:
+
+    S_OK on success,
+    S_FALSE if the table does not hold the mapping,
+    error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    std::unique_lock<std::mutex> lock(m_WriterLock);
+    const MappingRecord* current = nullptr;
+    MappingRecord record = {};
+
+    EXIT_IF_NULL(m_Header,
+                 E_FAIL,
+                 Cleanup);
+
+    current = FindRecord(VirtualAddress);
+    EXIT_IF_TRUE(current == nullptr ||
+                 current->Type != MESSAGE_TYPE_NEW_MAPPING ||
+                 current->Mapping.HostIpAddress != AddressMapping.HostIpAddress ||
+                 current->Mapping.HostPort != AddressMapping.HostPort,
+                 S_FALSE,
+                 Cleanup);
+
+    record.Type = MESSAGE_TYPE_DELETE_MAPPING;
+    record.Mapping = AddressMapping;
+    record.Version.Timestamp = m_Clock.Now();
+    record.Version.Origin = Origin;
+
+    EXIT_IF_FAILED(ApplyRecord(VirtualAddress, record),
+                   Cleanup);
+
+    *Record = record;
+
+Cleanup:
+    return ec;
+}
+
+ERROR_CODE
+MappingTable::Merge(const MappingRecord& Record)
+/*++
+
+Routine Description:
+
+    Merges a record replicated from a node into the table. The record
+replaces the one held for its virtual address if its version is greater, and
+is ignored otherwise, so merging the same records in any order, any number of
+times, leaves the table in the same state.
+
+Arguments:
+
+    Record - The record to merge.
+
+Return Value:
+
+    S_OK if the record was applied,
+    S_FALSE if the table already holds it or a newer one,
+    E_INVALIDARG if the record is malformed or stamped more than
+    HYBRID_LOGICAL_CLOCK_MAX_OFFSET ahead of the wall clock,
+    error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    std::unique_lock<std::mutex> lock(m_WriterLock);
+
+    EXIT_IF_NULL(m_Header,
+                 E_FAIL,
+                 Cleanup);
+
+    EXIT_IF_TRUE(Record.Type != MESSAGE_TYPE_NEW_MAPPING &&
+                 Record.Type != MESSAGE_TYPE_DELETE_MAPPING,
+                 E_INVALIDARG,
+                 Cleanup);
+
+    // Whatever happens to the record, later writes of this node must be
+    // ordered after it. A record from too far in the future would pin every
+    // later version to its timestamp and never expire, so it is refused.
+    if (FAILED(m_Clock.Observe(Record.Version.Timestamp)))
+    {
+        LOG("Refusing mapping record from %u stamped %llu ms ahead!\n",
+            Record.Version.Origin,
+            (unsigned long long)(HybridLogicalClock::GetPhysicalTime(Record.Version.Timestamp) -
+                                 HybridLogicalClock::ReadWallClock()));
+        EXIT_IF_FAILED(E_INVALIDARG, Cleanup);
+    }
+
+    EXIT_IF_FAILED(ApplyRecord(GetVirtualAddress(Record), Record),
+                   Cleanup);
+
+Cleanup:
+    return ec;
+}
+
+ERROR_CODE
+MappingTable::ExpireTombstones()
+/*++
+
+Routine Description:
+
+    Drops the tombstones older than MAPPING_TABLE_TOMBSTONE_LIFETIME.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    S_OK on success,
+    S_FALSE if no tombstone expired,
+    error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_FALSE;
+    std::unique_lock<std::mutex> lock(m_WriterLock);
+    const uint64_t wallClock = HybridLogicalClock::ReadWallClock();
+
+    for (auto& records : m_Records)
+    {
+        for (size_t i = 0; i < records.size();)
+        {
+            if (!IsExpiredTombstone(records[i], wallClock))
+            {
+                i++;
+                continue;
+            }
+
+            UpdateDigests(GetVirtualAddress(records[i]), records[i]);
+
+            records[i] = records.back();
+            records.pop_back();
+            ec = S_OK;
+        }
+    }
+
+    return ec;
+}
+
+ERROR_CODE
+MappingTable::Lookup(uint64_t VirtualAddress,
+                     AddressMapping* AddressMapping) const
+/*++
+
+Routine Description:
+
+    Looks up the mapping of a virtual address. Never blocks; retries if a
+writer modified the table during the lookup.
+
+Arguments:
+
+    VirtualAddress - The key of the mapping.
+
+    AddressMapping - The mapping found. Only the host address is filled in.
+
+Return Value:
+
+    S_OK on success,
+    S_FALSE if there is no mapping for the virtual address,
+    error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    uint64_t hostAddress = 0;
+
+    EXIT_IF_NULL(m_Header,
+                 E_FAIL,
+                 Cleanup);
+
+    EXIT_IF_FAILED(MappingTableLookup(m_Header, VirtualAddress, &hostAddress),
+                   Cleanup);
+    EXIT_IF_TRUE(ec == S_FALSE,
+                 S_FALSE,
+                 Cleanup);
+
+    AddressMapping->HostIpAddress = GET_IP_ADDRESS(hostAddress);
+    AddressMapping->HostPort = GET_PORT(hostAddress);
+
+Cleanup:
+    return ec;
+}
+
+uint64_t
+MappingTable::GetVersion() const
+/*++
+
+Routine Description:
+
+    Gets the version of the table, which changes on every modification.
+Reading it before a lookup gives a version no newer than the lookup result.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The version of the table, or zero if the table is not initialized.
+
+--*/
+{
+    return m_Header != nullptr ? m_Header->Sequence.load(std::memory_order_acquire) : 0;
+}
+
+uint32_t
+MappingTable::GetDigestLevelCount() const
+/*++
+
+Routine Description:
+
+    Gets the number of levels of the digest tree. It only depends on the
+capacity of the table.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The number of levels, including the root and the buckets.
+
+--*/
+{
+    return m_Digests.size();
+}
+
+uint32_t
+MappingTable::GetDigestCount(uint32_t Level) const
+/*++
+
+Routine Description:
+
+    Gets the number of digests on a level of the digest tree. The children
+of digest i of a level are digests i * MAPPING_TABLE_DIGEST_FANOUT onwards of
+the level below.
+
+Arguments:
+
+    Level - The level, 0 being the root.
+
+Return Value:
+
+    The number of digests, or zero if there is no such level.
+
+--*/
+{
+    return Level < m_Digests.size() ? m_Digests[Level].size() : 0;
+}
+
+ERROR_CODE
+MappingTable::GetDigest(uint32_t Level,
+                        uint32_t Index,
+                        uint64_t* Digest)
+/*++
+
+Routine Description:
+
+    Gets a digest of the digest tree.
+
+Arguments:
+
+    Level - The level of the digest, 0 being the root.
+
+    Index - The index of the digest on its level.
+
+    Digest - Receives the digest.
+
+Return Value:
+
+    S_OK on success,
+    E_INVALIDARG if there is no such digest.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    std::unique_lock<std::mutex> lock(m_WriterLock);
+
+    EXIT_IF_TRUE(Index >= GetDigestCount(Level),
+                 E_INVALIDARG,
+                 Cleanup);
+
+    *Digest = m_Digests[Level][Index];
+
+Cleanup:
+    return ec;
+}
+
+ERROR_CODE
+MappingTable::GetBucket(uint32_t Bucket,
+                        std::vector<MappingRecord>* Records)
+/*++
+
+Routine Description:
+
+    Gets every record of a bucket, tombstones included.
+
+Arguments:
+
+    Bucket - The index of the bucket, which is its index on the last level of
+             the digest tree.
+
+    Records - Receives the records, appended to its contents.
+
+Return Value:
+
+    S_OK on success,
+    E_INVALIDARG if there is no such bucket.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    std::unique_lock<std::mutex> lock(m_WriterLock);
+
+    EXIT_IF_TRUE(Bucket >= m_Records.size(),
+                 E_INVALIDARG,
+                 Cleanup);
+
+    Records->insert(Records->end(), m_Records[Bucket].begin(), m_Records[Bucket].end());
+
+Cleanup:
+    return ec;
+}
+
+ERROR_CODE
+MappingTable::GetRecords(std::vector<MappingRecord>* Records,
+                         uint64_t* Version)
+/*++
+
+Routine Description:
+
+    Gets every record of the table at once, tombstones included, along with
+the version of the table they were read at.
+
+Arguments:
+
+    Records - Receives the records, replacing its contents.
+
+    Version - Receives the version of the table.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    std::unique_lock<std::mutex> lock(m_WriterLock);
+    size_t recordCount = 0;
+
+    EXIT_IF_NULL(m_Header,
+                 E_FAIL,
+                 Cleanup);
+
+    for (const auto& records : m_Records)
+    {
+        recordCount += records.size();
+    }
+
+    Records->clear();
+    Records->reserve(recordCount);
+
+    for (const auto& records : m_Records)
+    {
+        Records->insert(Records->end(), records.begin(), records.end());
+    }
+
+    *Version = m_Header->Sequence.load(std::memory_order_relaxed);
+
+Cleanup:
+    return ec;
+}
+
+void
+MappingTable::SetStore(MappingStore* Store)
+/*++
+
+Routine Description:
+
+    Attaches the store persisting the table. Every record applied from then
+on is appended to it, with the writer lock held so that the store sees the
+records in the order they were applied.
+
+Arguments:
+
+    Store - The store, or nullptr to detach it.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    std::unique_lock<std::mutex> lock(m_WriterLock);
+
+    m_Store = Store;
+}
+
+uint64_t
+MappingTable::BeginWrite()
+/*++
+
+Routine Description:
+
+    Enters a write section. Must be called with the writer lock held.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The sequence number to pass to EndWrite.
+
+--*/
+{
+    uint64_t sequence = m_Header->Sequence.load(std::memory_order_relaxed);
+
+    m_Header->Sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    return sequence;
+}
+
+void
+MappingTable::EndWrite(uint64_t Sequence)
+/*++
+
+Routine Description:
+
+    Leaves a write section, publishing the modifications to readers.
+
+Arguments:
+
+    Sequence - The sequence number returned by BeginWrite.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    m_Header->Sequence.store(Sequence + 2, std::memory_order_release);
+}
+
+uint32_t
+MappingTable::FindSlot(uint64_t VirtualAddress) const
+/*++
+
+Routine Description:
+
+    Finds the slot holding a virtual address. Must be called with the writer
+lock held.
+
+Arguments:
+
+    VirtualAddress - The key to find.
+
+Return Value:
+
+    The index of the slot, or MAPPING_TABLE_NOT_FOUND.
+
+--*/
+{
+    const uint32_t mask = m_Capacity - 1;
+    uint32_t index = MappingTableHash(VirtualAddress) & mask;
+    uint64_t key = 0;
+
+    for (uint32_t i = 0; i < m_Capacity; i++)
+    {
+        key = m_Slots[index].Key.load(std::memory_order_relaxed);
+
+        if (key == VirtualAddress)
+        {
+            return index;
+        }
+
+        if (key == MAPPING_TABLE_EMPTY_KEY)
+        {
+            break;
+        }
+
+        index = (index + 1) & mask;
+    }
+
+    return MAPPING_TABLE_NOT_FOUND;
+}
+
+MappingRecord*
+MappingTable::FindRecord(uint64_t VirtualAddress)
+/*++
+
+Routine Description:
+
+    Finds the record of a virtual address, live or deleted. Must be called
+with the writer lock held.
+
+Arguments:
+
+    VirtualAddress - The key to find.
+
+Return Value:
+
+    The record, or nullptr if there is none.
+
+--*/
+{
+    for (auto& record : m_Records[GetBucketIndex(VirtualAddress)])
+    {
+        if (GetVirtualAddress(record) == VirtualAddress)
+        {
+            return &record;
+        }
+    }
+
+    return nullptr;
+}
+
+ERROR_CODE
+MappingTable::ApplyRecord(uint64_t VirtualAddress,
+                          const MappingRecord& Record)
+/*++
+
+Routine Description:
+
+    Replaces the record of a virtual address if the new record is newer,
+updating the shared slots and the digest tree to match. Must be called with
+the writer lock held.
+
+Arguments:
+
+    VirtualAddress - The key of the record.
+
+    Record - The new record.
+
+Return Value:
+
+    S_OK if the record was applied,
+    S_FALSE if the table already holds it or a newer one,
+    error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    MappingRecord* current = nullptr;
+    std::vector<MappingRecord>* records = nullptr;
+    uint64_t hostAddress = 0;
+    bool isExpired = false;
+
+    EXIT_IF_TRUE(VirtualAddress == MAPPING_TABLE_EMPTY_KEY ||
+                 VirtualAddress == MAPPING_TABLE_TOMBSTONE_KEY,
+                 E_INVALIDARG,
+                 Cleanup);
+
+    current = FindRecord(VirtualAddress);
+    EXIT_IF_TRUE(current != nullptr && !IsNewer(Record.Version, current->Version),
+                 S_FALSE,
+                 Cleanup);
+
+    // The shared slots only hold live mappings
+    if (Record.Type == MESSAGE_TYPE_NEW_MAPPING)
+    {
+        CREATE_ADDRESS(hostAddress,
+                       Record.Mapping.HostIpAddress,
+                       Record.Mapping.HostPort);
+
+        EXIT_IF_FAILED(StoreSlot(VirtualAddress, hostAddress),
+                       Cleanup);
+    }
+    else
+    {
+        ClearSlot(VirtualAddress);
+    }
+
+    // A tombstone that would already have expired is not kept at all
+    isExpired = IsExpiredTombstone(Record, HybridLogicalClock::ReadWallClock());
+    records = &m_Records[GetBucketIndex(VirtualAddress)];
+
+    if (current != nullptr)
+    {
+        UpdateDigests(VirtualAddress, *current);
+
+        if (isExpired)
+        {
+            *current = records->back();
+            records->pop_back();
+        }
+        else
+        {
+            *current = Record;
+        }
+    }
+    else if (!isExpired)
+    {
+        records->push_back(Record);
+    }
+
+    if (!isExpired)
+    {
+        UpdateDigests(VirtualAddress, Record);
+    }
+
+    // Only logged once applied, in the order the table applied it
+    if (m_Store != nullptr)
+    {
+        m_Store->Append(Record);
+    }
+
+Cleanup:
+    return ec;
+}
+
+ERROR_CODE
+MappingTable::StoreSlot(uint64_t VirtualAddress,
+                        uint64_t HostAddress)
+/*++
+
+Routine Description:
+
+    Points the slot of a virtual address at a host address, taking a free
+slot if the virtual address has none. Must be called with the writer lock
+held.
+
+Arguments:
+
+    VirtualAddress - The key of the mapping.
+
+    HostAddress - The packed host address of the mapping.
+
+Return Value:
+
+    S_OK on success,
+    E_OUTOFMEMORY if the table is full.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    const uint32_t mask = m_Capacity - 1;
+    const uint32_t maximumCount = m_Capacity / 4 * 3;
+    uint64_t sequence = 0;
+    uint64_t key = 0;
+    uint32_t index = 0;
+
+    index = FindSlot(VirtualAddress);
+    if (index != MAPPING_TABLE_NOT_FOUND)
+    {
+        sequence = BeginWrite();
+        m_Slots[index].Value.store(HostAddress, std::memory_order_relaxed);
+        EndWrite(sequence);
+    }
+    else
+    {
+        EXIT_IF_TRUE(m_Header->Count >= maximumCount,
+                     E_OUTOFMEMORY,
+                     Cleanup);
+
+        sequence = BeginWrite();
+
+        if (m_Header->Count + m_Header->Tombstones >= maximumCount)
+        {
+            Compact();
+        }
+
+        // Take the first free slot, reusing tombstones along the probe sequence
+        index = MappingTableHash(VirtualAddress) & mask;
+        while (true)
+        {
+            key = m_Slots[index].Key.load(std::memory_order_relaxed);
+
+            if (key == MAPPING_TABLE_EMPTY_KEY || key == MAPPING_TABLE_TOMBSTONE_KEY)
+            {
+                break;
+            }
+
+            index = (index + 1) & mask;
+        }
+
+        if (key == MAPPING_TABLE_TOMBSTONE_KEY)
+        {
+            m_Header->Tombstones--;
+        }
+
+        m_Slots[index].Value.store(HostAddress, std::memory_order_relaxed);
+        m_Slots[index].Key.store(VirtualAddress, std::memory_order_relaxed);
+        m_Header->Count++;
+
+        EndWrite(sequence);
+    }
+
+Cleanup:
+    return ec;
+}
+
+void
+MappingTable::ClearSlot(uint64_t VirtualAddress)
+/*++
+
+Routine Description:
+
+    Frees the slot of a virtual address, if it has one. Must be called with
+the writer lock held.
+
+Arguments:
+
+    VirtualAddress - The key of the mapping.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    const uint32_t mask = m_Capacity - 1;
+    uint64_t sequence = 0;
+    uint32_t index = 0;
+    bool endsProbe = false;
+
+    index = FindSlot(VirtualAddress);
+    if (index == MAPPING_TABLE_NOT_FOUND)
+    {
+        return;
+    }
+
+    // A slot followed by an empty one ends every probe sequence running
+    // through it, so it can be emptied instead of leaving a tombstone.
+    endsProbe = m_Slots[(index + 1) & mask].Key.load(std::memory_order_relaxed) == MAPPING_TABLE_EMPTY_KEY;
+
+    sequence = BeginWrite();
+
+    m_Slots[index].Key.store(endsProbe ? MAPPING_TABLE_EMPTY_KEY : MAPPING_TABLE_TOMBSTONE_KEY,
+                             std::memory_order_relaxed);
+    m_Slots[index].Value.store(0, std::memory_order_relaxed);
+    m_Header->Count--;
+
+    if (!endsProbe)
+    {
+        m_Header->Tombstones++;
+    }
+
+    EndWrite(sequence);
+}
+
+void
+MappingTable::Compact()
+/*++
+
+Routine Description:
+
+    Rehashes the table in place to drop all tombstones. Must be called inside
+a write section.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    const uint32_t mask = m_Capacity - 1;
+    std::vector<std::pair<uint64_t, uint64_t>> mappings;
+    uint64_t key = 0;
+    uint32_t index = 0;
+
+    mappings.reserve(m_Header->Count);
+
+    for (uint32_t i = 0; i < m_Capacity; i++)
+    {
+        key = m_Slots[i].Key.load(std::memory_order_relaxed);
+
+        if (key != MAPPING_TABLE_EMPTY_KEY && key != MAPPING_TABLE_TOMBSTONE_KEY)
+        {
+            mappings.emplace_back(key, m_Slots[i].Value.load(std::memory_order_relaxed));
+        }
+
+        m_Slots[i].Key.store(MAPPING_TABLE_EMPTY_KEY, std::memory_order_relaxed);
+        m_Slots[i].Value.store(0, std::memory_order_relaxed);
+    }
+
+    for (const auto& mapping : mappings)
+    {
+        index = MappingTableHash(mapping.first) & mask;
+
+        while (m_Slots[index].Key.load(std::memory_order_relaxed) != MAPPING_TABLE_EMPTY_KEY)
+        {
+            index = (index + 1) & mask;
+        }
+
+        m_Slots[index].Value.store(mapping.second, std::memory_order_relaxed);
+        m_Slots[index].Key.store(mapping.first, std::memory_order_relaxed);
+    }
+
+    m_Header->Tombstones = 0;
+}
+
+uint32_t
+MappingTable::GetBucketIndex(uint64_t VirtualAddress) const
+/*++
+
+Routine Description:
+
+    Gets the bucket of a virtual address, which is the one containing its
+home slot.
+
+Arguments:
+
+    VirtualAddress - The key of the mapping.
+
+Return Value:
+
+    The index of the bucket.
+
+--*/
+{
+    return (MappingTableHash(VirtualAddress) & (m_Capacity - 1)) / m_BucketSlots;
+}
+
+void
+MappingTable::UpdateDigests(uint64_t VirtualAddress,
+                            const MappingRecord& Record)
+/*++
+
+Routine Description:
+
+    Adds a record to the digest tree, or removes it if it is already there,
+by toggling its hash into every digest from its bucket up to the root. The
+hash covers the version and type of the record, so replicas holding different
+versions of a mapping disagree. Must be called with the writer lock held.
+
+Arguments:
+
+    VirtualAddress - The key of the record.
+
+    Record - The record.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    uint64_t hostAddress = 0;
+    uint64_t hash = 0;
+    uint32_t index = GetBucketIndex(VirtualAddress);
+
+    CREATE_ADDRESS(hostAddress,
+                   Record.Mapping.HostIpAddress,
+                   Record.Mapping.HostPort);
+
+    hash = MappingTableHash(Record.Version.Timestamp ^ ((uint64_t)Record.Version.Origin << 32 | Record.Type));
+    hash = MappingTableHash(VirtualAddress ^ MappingTableHash(hostAddress ^ hash));
+
+    for (size_t level = m_Digests.size(); level-- > 0;)
+    {
+        m_Digests[level][index] ^= hash;
+        index /= MAPPING_TABLE_DIGEST_FANOUT;
+    }
+}
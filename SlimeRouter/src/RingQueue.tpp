@@ -0,0 +1,489 @@
+/*++
+
+Module Name:
+
+    RingQueue.tpp
+
+Abstract:
+
+    Class implementation of a bounded, lock-free ring queue.
+
+--*/
+
+//
+// ---------------------------------------------------------------------- Includes
+//
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <climits>
+#include <thread>
+
+#include "RingQueue.h"
+
+//
+// ---------------------------------------------------------------------- Definitions
+//
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RING_QUEUE_RELAX() __builtin_ia32_pause()
+#else
+#define RING_QUEUE_RELAX() std::atomic_signal_fence(std::memory_order_seq_cst)
+#endif
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+              "Futex words must be plain 32-bit integers");
+
+//
+// ---------------------------------------------------------------------- Functions
+//
+
+template<typename T, RingQueueProducers Producers>
+RingQueue<T, Producers>::RingQueue(size_t Capacity,
+                                   QueueFullPolicy FullPolicy)
+/*++
+
+Routine Description:
+
+    Constructor for RingQueue.
+
+Arguments:
+
+    Capacity - The number of slots, rounded up to a power of two.
+
+    FullPolicy - Whether Push waits or drops the item when the ring is full.
+
+Return Value:
+
+    None.
+
+--*/
+    :
+    m_Mask(0),
+    m_FullPolicy(FullPolicy),
+    m_SpinCount(std::thread::hardware_concurrency() > 1 ? RING_QUEUE_SPIN_COUNT : 0),
+    m_Tail(0),
+    m_PushEpoch(0),
+    m_ConsumerWaiting(0),
+    m_PopEpoch(0),
+    m_ProducersWaiting(0),
+    m_Head(0),
+    m_ShouldShutdown(false)
+{
+    size_t slotCount = 2;
+
+    while (slotCount < Capacity)
+    {
+        slotCount <<= 1;
+    }
+
+    m_Slots.reset(new Slot[slotCount]);
+    m_Mask = slotCount - 1;
+
+    for (size_t i = 0; i < slotCount; i++)
+    {
+        m_Slots[i].Sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+template<typename T, RingQueueProducers Producers>
+RingQueue<T, Producers>::~RingQueue()
+/*++
+
+Routine Description:
+
+    Destructor for RingQueue.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+}
+
+template<typename T, RingQueueProducers Producers>
+ERROR_CODE
+RingQueue<T, Producers>::Push(const T& Item)
+/*++
+
+Routine Description:
+
+    Pushes a copy of an element of type T onto the queue.
+
+Arguments:
+
+    Item - The item to push onto the queue.
+
+Return Value:
+
+    S_OK on success,
+    S_FALSE if the ring was full and the item was dropped,
+    E_ABORT if the queue was shut down.
+
+--*/
+{
+    return Emplace(Item);
+}
+
+template<typename T, RingQueueProducers Producers>
+ERROR_CODE
+RingQueue<T, Producers>::Push(T&& Item)
+/*++
+
+Routine Description:
+
+    Moves an element of type T onto the queue.
+
+Arguments:
+
+    Item - The item to push onto the queue.
+
+Return Value:
+
+    S_OK on success,
+    S_FALSE if the ring was full and the item was dropped,
+    E_ABORT if the queue was shut down.
+
+--*/
+{
+    return Emplace(std::move(Item));
+}
+
+template<typename T, RingQueueProducers Producers>
+template<typename U>
+ERROR_CODE
+RingQueue<T, Producers>::Emplace(U&& Item)
+/*++
+
+Routine Description:
+
+    Claims the next slot, applying the full policy if there is none, stores
+the item in it and publishes it to the consumer.
+
+Arguments:
+
+    Item - The item to add, copied or moved as given.
+
+Return Value:
+
+    S_OK on success,
+    S_FALSE if the ring was full and the item was dropped,
+    E_ABORT if the queue was shut down.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    uint64_t position = 0;
+    uint32_t observed = 0;
+    Slot* slot = nullptr;
+
+    EXIT_IF_TRUE(m_ShouldShutdown.load(std::memory_order_acquire),
+                 E_ABORT,
+                 Cleanup);
+
+    for (uint32_t spins = 0; !TryPush(&position); spins++)
+    {
+        EXIT_IF_TRUE(m_FullPolicy == QUEUE_FULL_DROP,
+                     S_FALSE,
+                     Cleanup);
+
+        EXIT_IF_TRUE(m_ShouldShutdown.load(std::memory_order_acquire),
+                     E_ABORT,
+                     Cleanup);
+
+        if (spins < m_SpinCount)
+        {
+            RING_QUEUE_RELAX();
+            continue;
+        }
+
+        // Announce the wait before checking one last time, so that the
+        // consumer either sees us waiting or we see the slot it freed
+        observed = m_PopEpoch.load(std::memory_order_acquire);
+        m_ProducersWaiting.store(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        if (TryPush(&position))
+        {
+            break;
+        }
+
+        if (!m_ShouldShutdown.load(std::memory_order_acquire))
+        {
+            FutexWait(&m_PopEpoch, observed);
+        }
+    }
+
+    // Once a slot is claimed the item is published even if shutdown began in
+    // the meantime; the consumer drains it with the rest
+    slot = &m_Slots[position & m_Mask];
+    slot->Item = std::forward<U>(Item);
+    slot->Sequence.store(position + 1, std::memory_order_release);
+
+    // Pairs with the fence in Pop: either the consumer sees the item before
+    // sleeping or we see it asleep
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if (m_ConsumerWaiting.load(std::memory_order_relaxed) != 0 &&
+        m_ConsumerWaiting.exchange(0, std::memory_order_relaxed) != 0)
+    {
+        m_PushEpoch.fetch_add(1, std::memory_order_release);
+        FutexWake(&m_PushEpoch, 1);
+    }
+
+Cleanup:
+    return ec;
+}
+
+template<typename T, RingQueueProducers Producers>
+bool
+RingQueue<T, Producers>::TryPush(uint64_t* Position)
+/*++
+
+Routine Description:
+
+    Claims the slot at the tail if it is free.
+
+Arguments:
+
+    Position - Receives the position of the claimed slot.
+
+Return Value:
+
+    true if a slot was claimed, false if the ring is full.
+
+--*/
+{
+    uint64_t tail = m_Tail.load(std::memory_order_relaxed);
+    int64_t difference = 0;
+
+    if (Producers == RING_QUEUE_SINGLE_PRODUCER)
+    {
+        if (m_Slots[tail & m_Mask].Sequence.load(std::memory_order_acquire) != tail)
+        {
+            return false;
+        }
+
+        m_Tail.store(tail + 1, std::memory_order_relaxed);
+        *Position = tail;
+        return true;
+    }
+
+    while (true)
+    {
+        difference = (int64_t)(m_Slots[tail & m_Mask].Sequence.load(std::memory_order_acquire) - tail);
+
+        if (difference < 0)
+        {
+            return false;
+        }
+
+        // Another producer claimed the slot first; retry at the new tail
+        if (difference > 0)
+        {
+            tail = m_Tail.load(std::memory_order_relaxed);
+            continue;
+        }
+
+        if (m_Tail.compare_exchange_weak(tail, tail + 1, std::memory_order_relaxed))
+        {
+            *Position = tail;
+            return true;
+        }
+    }
+}
+
+template<typename T, RingQueueProducers Producers>
+bool
+RingQueue<T, Producers>::TryPop(T* Item)
+/*++
+
+Routine Description:
+
+    Takes the item at the head if it has been published. Must only be called
+by the consumer.
+
+Arguments:
+
+    Item - Receives the item.
+
+Return Value:
+
+    true if an item was taken, false if the ring is empty.
+
+--*/
+{
+    Slot* slot = &m_Slots[m_Head & m_Mask];
+
+    if (slot->Sequence.load(std::memory_order_acquire) != m_Head + 1)
+    {
+        return false;
+    }
+
+    *Item = std::move(slot->Item);
+    slot->Sequence.store(m_Head + m_Mask + 1, std::memory_order_release);
+    m_Head++;
+
+    return true;
+}
+
+template<typename T, RingQueueProducers Producers>
+ERROR_CODE
+RingQueue<T, Producers>::Pop(T* Item)
+/*++
+
+Routine Description:
+
+    Pops an item from the queue. Blocks if the queue is empty. Only one
+thread may pop from a queue.
+
+Arguments:
+
+    Item - Receives the element that was popped from the queue.
+
+Return Value:
+
+    S_OK on success,
+    E_ABORT if the queue was shut down and is empty.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    uint32_t observed = 0;
+    uint32_t spins = 0;
+
+    while (!TryPop(Item))
+    {
+        if (spins++ < m_SpinCount)
+        {
+            RING_QUEUE_RELAX();
+            continue;
+        }
+
+        observed = m_PushEpoch.load(std::memory_order_acquire);
+        m_ConsumerWaiting.store(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        if (TryPop(Item))
+        {
+            break;
+        }
+
+        if (m_ShouldShutdown.load(std::memory_order_acquire))
+        {
+            ec = E_ABORT;
+            goto Cleanup;
+        }
+
+        FutexWait(&m_PushEpoch, observed);
+    }
+
+    // Producers only ever wait when the full policy tells them to, and then
+    // on a full ring. Waking them once a quarter of it has drained, rather
+    // than per slot, keeps them from thundering back for one slot each.
+    if (m_FullPolicy == QUEUE_FULL_BLOCK && (m_Head & (m_Mask >> 2)) == 0)
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        if (m_ProducersWaiting.load(std::memory_order_relaxed) != 0 &&
+            m_ProducersWaiting.exchange(0, std::memory_order_relaxed) != 0)
+        {
+            m_PopEpoch.fetch_add(1, std::memory_order_release);
+            FutexWake(&m_PopEpoch, INT_MAX);
+        }
+    }
+
+Cleanup:
+    return ec;
+}
+
+template<typename T, RingQueueProducers Producers>
+ERROR_CODE
+RingQueue<T, Producers>::RequestShutdown()
+/*++
+
+Routine Description:
+
+    Unblocks the consumer and all blocked producers. Items already published
+can still be popped; every push from now on fails.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+
+    m_ShouldShutdown.store(true, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    m_PushEpoch.fetch_add(1, std::memory_order_release);
+    FutexWake(&m_PushEpoch, INT_MAX);
+
+    m_PopEpoch.fetch_add(1, std::memory_order_release);
+    FutexWake(&m_PopEpoch, INT_MAX);
+
+    return ec;
+}
+
+template<typename T, RingQueueProducers Producers>
+void
+RingQueue<T, Producers>::FutexWait(std::atomic<uint32_t>* Epoch,
+                                   uint32_t Observed)
+/*++
+
+Routine Description:
+
+    Sleeps until the epoch is bumped. Returns right away if it already was.
+Spurious wake-ups are possible; callers check their condition again.
+
+Arguments:
+
+    Epoch - The futex word to wait on.
+
+    Observed - The value of the epoch when the caller last checked.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    syscall(SYS_futex, (uint32_t*)Epoch, FUTEX_WAIT_PRIVATE, Observed, nullptr, nullptr, 0);
+}
+
+template<typename T, RingQueueProducers Producers>
+void
+RingQueue<T, Producers>::FutexWake(std::atomic<uint32_t>* Epoch,
+                                   int Count)
+/*++
+
+Routine Description:
+
+    Wakes up threads sleeping on the epoch.
+
+Arguments:
+
+    Epoch - The futex word to wake waiters of.
+
+    Count - The maximum number of threads to wake.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    syscall(SYS_futex, (uint32_t*)Epoch, FUTEX_WAKE_PRIVATE, Count, nullptr, nullptr, 0);
+}
@@ -16,6 +16,8 @@ Abstract:
 
 #include <fcntl.h>
 #include <time.h>
+#include <algorithm>
+#include <random>
 
 #include "RouterServer.h"
 #include "NetworkUtils.h"
@@ -25,6 +27,11 @@ Abstract:
 // ---------------------------------------------------------------------- Definitions
 //
 
+// Number of host sockets kept ready for each client
+#define SOCKET_POOL_SIZE 32
+
+// Most host sockets handed over in a single response
+#define SOCKET_POOL_MAX_BATCH 64
 
 
 //
@@ -52,8 +59,13 @@ Return Value:
 --*/
     :
     UnixServer(Path),
-    m_MappingManager(std::move(MappingManager))
+    m_MappingManager(std::move(MappingManager)),
+    m_Epoch(0),
+    m_ShouldStop(false)
 {
+    std::random_device randomDevice;
+
+    m_Epoch = ((uint64_t)randomDevice() << 32) | randomDevice();
 }
 
 RouterServer::~RouterServer()
@@ -129,6 +141,8 @@ Return Value:
 {
     ERROR_CODE ec = S_OK;
     
+    m_RefillThread = std::thread([=] { RefillSocketPools(); });
+    
     TRACE_IF_FAILED(UnixServer::Start(),
                     Cleanup,
                     "Failed to start unix server! 0x%x\n", ec);
@@ -164,6 +178,26 @@ Return Value:
                     Cleanup,
                     "Failed to stop unix server! 0x%x\n", ec);
     
+    {
+        std::unique_lock<std::mutex> lock(m_SocketPoolsLock);
+        m_ShouldStop = true;
+    }
+    m_RefillCondition.notify_all();
+    
+    if (m_RefillThread.joinable())
+    {
+        m_RefillThread.join();
+    }
+    
+    for (auto& socketPool : m_SocketPools)
+    {
+        for (int hostSocket : socketPool.second)
+        {
+            close(hostSocket);
+        }
+    }
+    m_SocketPools.clear();
+    
     TRACE_IF_FAILED(m_MappingManager->Stop(),
                     Cleanup,
                     "Failed to stop mapping manager! 0x%x\n", ec);
@@ -174,12 +208,15 @@ Cleanup:
 
 ERROR_CODE
 RouterServer::OnMessage(int ClientSocket,
-                        const Message& Message)
+                        const Message& Message,
+                        const std::vector<int>& FileDescriptors)
 /*++
 
 Routine Description:
 
-    Processes an incoming message.
+    Processes an incoming message. Requests with a body of the wrong size or an
+unknown Id fail, which drops the connection, so that the client is never left
+waiting for a response.
 
 Arguments:
 
@@ -187,6 +224,8 @@ Arguments:
 
     Message - The incoming message.
 
+    FileDescriptors - The file descriptors sent with the message.
+
 Return Value:
 
     S_OK on success, error otherwise.
@@ -199,36 +238,72 @@ Return Value:
     {
     case REQUEST_TYPE_SOCKET:
     {
+        EXIT_IF_TRUE(Message.Body.size() != sizeof(SocketRequest),
+                     E_INVALIDARG,
+                     Cleanup);
         const SocketRequest* request = reinterpret_cast<const SocketRequest*>(Message.Body.data());
         EXIT_IF_FAILED(ProcessSocketRequest(ClientSocket,
+                                            Message.Header,
                                             *request),
                        Cleanup);
         break;
     }
-    case REQUEST_TYPE_BIND:
+    case REQUEST_TYPE_SOCKET_POOL:
     {
-        const BindRequest* request = reinterpret_cast<const BindRequest*>(Message.Body.data());
-        EXIT_IF_FAILED(ProcessBindRequest(ClientSocket,
-                                          *request),
+        EXIT_IF_TRUE(Message.Body.size() != sizeof(SocketPoolRequest),
+                     E_INVALIDARG,
+                     Cleanup);
+        const SocketPoolRequest* request = reinterpret_cast<const SocketPoolRequest*>(Message.Body.data());
+        EXIT_IF_FAILED(ProcessSocketPoolRequest(ClientSocket,
+                                                Message.Header,
+                                                *request),
                        Cleanup);
         break;
     }
-    case REQUEST_TYPE_ACCEPT:
+    case REQUEST_TYPE_BIND:
     {
-        const AcceptRequest* request = reinterpret_cast<const AcceptRequest*>(Message.Body.data());
-        EXIT_IF_FAILED(ProcessAcceptRequest(ClientSocket,
-                                            *request),
+        EXIT_IF_TRUE(Message.Body.size() != sizeof(BindRequest) ||
+                     FileDescriptors.size() != 1,
+                     E_INVALIDARG,
+                     Cleanup);
+        const BindRequest* request = reinterpret_cast<const BindRequest*>(Message.Body.data());
+        EXIT_IF_FAILED(ProcessBindRequest(ClientSocket,
+                                          Message.Header,
+                                          *request,
+                                          FileDescriptors[0]),
                        Cleanup);
         break;
     }
     case REQUEST_TYPE_CONNECT:
     {
+        EXIT_IF_TRUE(Message.Body.size() != sizeof(ConnectRequest) ||
+                     FileDescriptors.size() != 1,
+                     E_INVALIDARG,
+                     Cleanup);
         const ConnectRequest* request = reinterpret_cast<const ConnectRequest*>(Message.Body.data());
         EXIT_IF_FAILED(ProcessConnectRequest(ClientSocket,
-                                             *request),
+                                             Message.Header,
+                                             *request,
+                                             FileDescriptors[0]),
                        Cleanup);
         break;
     }
+    default:
+    {
+        // Every response starts with its status. The size the client expects
+        // is unknown, so the connection is dropped after answering.
+        int status = -EOPNOTSUPP;
+        LOG("Unknown request type %d!\n", Message.Header.Id);
+        TRACE_IF_FAILED(SendResponse(ClientSocket,
+                                     Message.Header,
+                                     &status,
+                                     sizeof(status),
+                                     nullptr,
+                                     0),
+                        Cleanup,
+                        "Failed to send response to client! 0x%x", ec);
+        EXIT_IF_FAILED(E_INVALIDARG, Cleanup);
+    }
     }
     
 Cleanup:
@@ -237,6 +312,7 @@ Cleanup:
 
 ERROR_CODE
 RouterServer::ProcessSocketRequest(int ClientSocket,
+                                   const MessageHeader& RequestHeader,
                                    const SocketRequest& SocketRequest)
 /*++
 
@@ -249,6 +325,8 @@ Arguments:
 
     ClientSocket - The socket used to communicate with the SlimeSocket client.
 
+    RequestHeader - The header of the request, echoed in the response.
+
     SocketRequest - The request sent by the SlimeSocket client.
 
 Return Value:
@@ -268,40 +346,44 @@ Return Value:
     {
         response.Status = -errno;
     }
-    else
-    {
-        TRACE_IF_FAILED(NetworkUtils::WriteFileDescriptorToUnixSocket(ClientSocket,
-                                                                      response.Status),
-                        Cleanup,
-                        "Failed to send file descriptor! 0x%x", ec);
-        close(response.Status);
-    }
     
-    TRACE_IF_FAILED(NetworkUtils::WriteAllToSocket(ClientSocket,
-                                                   &response,
-                                                   sizeof(response)),
+    TRACE_IF_FAILED(SendResponse(ClientSocket,
+                                 RequestHeader,
+                                 &response,
+                                 sizeof(response),
+                                 &response.Status,
+                                 response.Status < 0 ? 0 : 1),
                     Cleanup,
                     "Failed to send response to client! 0x%x", ec);
     
 Cleanup:
+    if (response.Status >= 0)
+    {
+        close(response.Status);
+    }
+    
     return ec;
 }
 
 ERROR_CODE
-RouterServer::ProcessBindRequest(int ClientSocket,
-                                 const BindRequest& BindRequest)
+RouterServer::ProcessSocketPoolRequest(int ClientSocket,
+                                       const MessageHeader& RequestHeader,
+                                       const SocketPoolRequest& SocketPoolRequest)
 /*++
 
 Routine Description:
 
-    Processes an incoming bind request. Binds the host socket to an used port
-and multicasts the new mapping.
+    Processes an incoming socket pool request. Hands over a batch of host
+sockets taken from the client's pool, creating any the pool is short of, and
+schedules the pool to be refilled in the background.
 
 Arguments:
 
     ClientSocket - The socket used to communicate with the SlimeSocket client.
 
-    BindRequest - The request sent by the SlimeSocket client.
+    RequestHeader - The header of the request, echoed in the response.
+
+    SocketPoolRequest - The request sent by the SlimeSocket client.
 
 Return Value:
 
@@ -310,75 +392,84 @@ Return Value:
 --*/
 {
     ERROR_CODE ec = S_OK;
-    BindResponse response = {0};
-    int hostSocket = 0;
-    struct sockaddr_in hostAddress;
-    socklen_t hostAddressLength = 0;
-    AddressMapping addressMapping;
+    SocketPoolResponse response = {0, 0};
+    const size_t count = std::min<size_t>(SocketPoolRequest.Count, SOCKET_POOL_MAX_BATCH);
+    std::vector<int> hostSockets;
+    int hostSocket = -1;
     
-    // Get file descriptor
-    TRACE_IF_FAILED(NetworkUtils::ReadFileDescriptorFromUnixSocket(ClientSocket,
-                                                                   &hostSocket),
-                    Cleanup,
-                    "Failed to receive file descriptor! 0x%x", ec);
-
-    // Perform bind
-    hostAddress.sin_family = AF_INET;
-    hostAddress.sin_port = 0;
-    TRACE_IF_FAILED(NetworkUtils::GetIpAddress(&hostAddress.sin_addr.s_addr),
-                    Cleanup,
-                    "Failed to get IP address! 0x%x", ec);
-
-    response.Status = bind(hostSocket,
-                           (struct sockaddr*)&hostAddress,
-                           sizeof(hostAddress));
+    hostSockets.reserve(count);
     
-
-    if (response.Status < 0)
     {
-        response.Status = -errno;
+        std::unique_lock<std::mutex> lock(m_SocketPoolsLock);
+        std::vector<int>& socketPool = m_SocketPools[ClientSocket];
+        
+        while (hostSockets.size() < count && !socketPool.empty())
+        {
+            hostSockets.push_back(socketPool.back());
+            socketPool.pop_back();
+        }
+        
+        if (std::find(m_PendingRefills.begin(), m_PendingRefills.end(), ClientSocket) == m_PendingRefills.end())
+        {
+            m_PendingRefills.push_back(ClientSocket);
+        }
     }
+    m_RefillCondition.notify_one();
     
-    // Send response to client
-    TRACE_IF_FAILED(NetworkUtils::WriteAllToSocket(ClientSocket,
-                                                   &response,
-                                                   sizeof(response)),
-                    Cleanup,
-                    "Failed to send response to client! 0x%x", ec);
+    while (hostSockets.size() < count)
+    {
+        hostSocket = socket(AF_INET, SOCK_STREAM, 0);
+        if (hostSocket < 0)
+        {
+            break;
+        }
+        
+        hostSockets.push_back(hostSocket);
+    }
     
-    // Find port and create mapping
-    hostAddressLength = sizeof(hostAddress);
-    TRACE_IF_FAILED(getsockname(hostSocket,
-                                (struct sockaddr*)&hostAddress,
-                                &hostAddressLength),
-                    Cleanup,
-                    "Failed to get socket information! 0x%x", errno);
+    response.Status = hostSockets.empty() && count != 0 ? -errno : 0;
+    response.Count = hostSockets.size();
     
-    addressMapping.VirtualIpAddress = BindRequest.VirtualIpAddress;
-    addressMapping.VirtualPort = BindRequest.VirtualPort;
-    addressMapping.HostIpAddress = hostAddress.sin_addr.s_addr;
-    addressMapping.HostPort = hostAddress.sin_port;
+    TRACE_IF_FAILED(SendResponse(ClientSocket,
+                                 RequestHeader,
+                                 &response,
+                                 sizeof(response),
+                                 hostSockets.data(),
+                                 hostSockets.size()),
+                    Cleanup,
+                    "Failed to send response to client! 0x%x", ec);
     
-    m_MappingManager->AddMapping(addressMapping,
-                                 true);
 Cleanup:
+    // The client holds its own references now
+    for (int pooledSocket : hostSockets)
+    {
+        close(pooledSocket);
+    }
+    
     return ec;
 }
 
 ERROR_CODE
-RouterServer::ProcessAcceptRequest(int ClientSocket,
-                                   const AcceptRequest& AcceptRequest)
+RouterServer::ProcessBindRequest(int ClientSocket,
+                                 const MessageHeader& RequestHeader,
+                                 const BindRequest& BindRequest,
+                                 int HostSocket)
 /*++
 
 Routine Description:
 
-    Processes an incoming accept request. 
+    Processes an incoming bind request. Binds the host socket to an used port
+and multicasts the new mapping.
 
 Arguments:
 
     ClientSocket - The socket used to communicate with the SlimeSocket client.
 
-    AcceptRequest - The request sent by the SlimeSocket client.
+    RequestHeader - The header of the request, echoed in the response.
+
+    BindRequest - The request sent by the SlimeSocket client.
+
+    HostSocket - The host socket sent with the request.
 
 Return Value:
 
@@ -387,41 +478,54 @@ Return Value:
 --*/
 {
     ERROR_CODE ec = S_OK;
-    AcceptResponse response = {0};
-    int hostSocket = 0;
-    int originalFlags = 0;
+    BindResponse response = {0};
+    struct sockaddr_in hostAddress;
+    socklen_t hostAddressLength = 0;
+    AddressMapping addressMapping;
     
-    TRACE_IF_FAILED(NetworkUtils::ReadFileDescriptorFromUnixSocket(ClientSocket,
-                                                                   &hostSocket),
+    // Perform bind
+    hostAddress.sin_family = AF_INET;
+    hostAddress.sin_port = 0;
+    TRACE_IF_FAILED(NetworkUtils::GetIpAddress(&hostAddress.sin_addr.s_addr),
                     Cleanup,
-                    "Failed to receive file descriptor 0x%x", ec);
-    
-    originalFlags = fcntl(hostSocket, F_GETFL);
-    fcntl(hostSocket, F_SETFL, originalFlags & ~O_NONBLOCK);
-
-    response.Status = accept4(hostSocket,
-                              NULL,
-                              NULL,
-                              AcceptRequest.Flags);
+                    "Failed to get IP address! 0x%x", ec);
 
-    fcntl(hostSocket, F_SETFL, originalFlags);
+    response.Status = bind(HostSocket,
+                           (struct sockaddr*)&hostAddress,
+                           sizeof(hostAddress));
     
+
     if (response.Status < 0)
     {
         response.Status = -errno;
     }
     else
     {
-        TRACE_IF_FAILED(NetworkUtils::WriteFileDescriptorToUnixSocket(ClientSocket,
-                                                                      response.Status),
+        // Publish the mapping before responding, so that the client can be
+        // connected to as soon as it returns from bind
+        hostAddressLength = sizeof(hostAddress);
+        TRACE_IF_FAILED(getsockname(HostSocket,
+                                    (struct sockaddr*)&hostAddress,
+                                    &hostAddressLength),
                         Cleanup,
-                        "Failed to send file descriptor 0x%x!", ec);
-        close(response.Status);
+                        "Failed to get socket information! 0x%x", errno);
+        
+        addressMapping.VirtualIpAddress = BindRequest.VirtualIpAddress;
+        addressMapping.VirtualPort = BindRequest.VirtualPort;
+        addressMapping.HostIpAddress = hostAddress.sin_addr.s_addr;
+        addressMapping.HostPort = hostAddress.sin_port;
+        
+        m_MappingManager->AddMapping(addressMapping,
+                                     true);
     }
     
-    TRACE_IF_FAILED(NetworkUtils::WriteAllToSocket(ClientSocket,
-                                                   &response,
-                                                   sizeof(response)),
+    // Send response to client
+    TRACE_IF_FAILED(SendResponse(ClientSocket,
+                                 RequestHeader,
+                                 &response,
+                                 sizeof(response),
+                                 nullptr,
+                                 0),
                     Cleanup,
                     "Failed to send response to client! 0x%x", ec);
     
@@ -431,17 +535,23 @@ Cleanup:
 
 ERROR_CODE
 RouterServer::ProcessConnectRequest(int ClientSocket,
-                                    const ConnectRequest& ConnectRequest)
+                                    const MessageHeader& RequestHeader,
+                                    const ConnectRequest& ConnectRequest,
+                                    int HostSocket)
 /*++
 
 Routine Description:
 
-    Processes an incoming connect request.
+    Processes an incoming connect request. The connect is started without
+    blocking; the response carries -EINPROGRESS while the handshake is still
+    underway.
 
 Arguments:
 
     ConnectRequest - The connect request to process.
 
+    HostSocket - The host socket sent with the request.
+
 Return Value:
 
     S_OK on success, error otherwise.
@@ -449,19 +559,19 @@ Return Value:
 --*/
 {
     ERROR_CODE ec = S_OK;
-    ConnectResponse response = {0};
-    int hostSocket = 0;
+    ConnectResponse response = {};
     struct sockaddr_in hostAddress;
+    int flags = 0;
 #ifdef MEASURE
     struct timespec start;
 	struct timespec end;
     double elapsed_time = 0;
 #endif
     
-    TRACE_IF_FAILED(NetworkUtils::ReadFileDescriptorFromUnixSocket(ClientSocket,
-                                                                   &hostSocket),
-                    Cleanup,
-                    "Failed to receive file descriptor! 0x%x", ec);
+    // Read before the lookup so that a mapping changing in between makes the
+    // client's cached resolution look stale rather than current
+    response.MappingVersion = m_MappingManager->GetMappingVersion();
+    response.RouterEpoch = m_Epoch;
 
     TRACE_IF_FAILED(m_MappingManager->PerformLookup(ConnectRequest.VirtualIpAddress,
                                                     ConnectRequest.VirtualPort,
@@ -470,33 +580,170 @@ Return Value:
                     Cleanup,
                     "Failed to perform mapping lookup! 0x%x", ec);
     
+    if (ec == S_FALSE)
+    {
+        // Not an overlay service; let the client fall back to a regular connect
+        response.Status = -ENETUNREACH;
+        goto Respond;
+    }
 
     hostAddress.sin_family = AF_INET;
+    response.HostIpAddress = hostAddress.sin_addr.s_addr;
+    response.HostPort = hostAddress.sin_port;
 #ifdef MEASURE   
 	clock_gettime(CLOCK_MONOTONIC, &start);
 #endif    
     
-    response.Status = connect(hostSocket,
+    // Only start the handshake here and reply right away. The client owns
+    // the descriptor and observes completion itself, so a slow or silent
+    // peer never ties up a worker thread.
+    flags = fcntl(HostSocket, F_GETFL);
+    fcntl(HostSocket, F_SETFL, flags | O_NONBLOCK);
+
+    response.Status = connect(HostSocket,
                               (struct sockaddr*)&hostAddress,
                               sizeof(hostAddress));
+    if (response.Status < 0)
+    {
+        response.Status = -errno;
+    }
+
+    // The descriptor is shared with the client, so hand it back with the
+    // blocking mode the application chose
+    fcntl(HostSocket, F_SETFL, flags);
 
 #ifdef MEASURE
     clock_gettime(CLOCK_MONOTONIC, &end);
     elapsed_time = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec -	start.tv_nsec)/1.0e9;
     LOG("Connection setup time: %lf seconds\n", elapsed_time);
 #endif
-    
-    if (response.Status < 0)
-    {
-        response.Status = -errno;
-    }
 
-    TRACE_IF_FAILED(NetworkUtils::WriteAllToSocket(ClientSocket,
-                                                   &response,
-                                                   sizeof(response)),
+Respond:
+    TRACE_IF_FAILED(SendResponse(ClientSocket,
+                                 RequestHeader,
+                                 &response,
+                                 sizeof(response),
+                                 nullptr,
+                                 0),
                     Cleanup,
                     "Failed to send response to client! 0x%x", ec);
     
 Cleanup:
     return ec;
 }
+
+void
+RouterServer::OnDisconnect(int ClientSocket)
+/*++
+
+Routine Description:
+
+    Releases the socket pool of a client that disconnected.
+
+Arguments:
+
+    ClientSocket - The socket used to communicate with the SlimeSocket client.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    std::vector<int> socketPool;
+    
+    {
+        std::unique_lock<std::mutex> lock(m_SocketPoolsLock);
+        auto socketPoolIt = m_SocketPools.find(ClientSocket);
+        
+        if (socketPoolIt != m_SocketPools.end())
+        {
+            socketPool.swap(socketPoolIt->second);
+            m_SocketPools.erase(socketPoolIt);
+        }
+    }
+    
+    for (int hostSocket : socketPool)
+    {
+        close(hostSocket);
+    }
+}
+
+ERROR_CODE
+RouterServer::RefillSocketPools()
+/*++
+
+Routine Description:
+
+    Tops the socket pools of clients that drew from them back up to
+SOCKET_POOL_SIZE, off the request path.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    std::unique_lock<std::mutex> lock(m_SocketPoolsLock);
+    std::vector<int> hostSockets;
+    size_t missingCount = 0;
+    int clientSocket = -1;
+    int hostSocket = -1;
+    
+    while (true)
+    {
+        m_RefillCondition.wait(lock, [=] { return m_ShouldStop || !m_PendingRefills.empty(); });
+        
+        if (m_ShouldStop)
+        {
+            break;
+        }
+        
+        clientSocket = m_PendingRefills.back();
+        m_PendingRefills.pop_back();
+        
+        auto socketPoolIt = m_SocketPools.find(clientSocket);
+        if (socketPoolIt == m_SocketPools.end() || socketPoolIt->second.size() >= SOCKET_POOL_SIZE)
+        {
+            continue;
+        }
+        
+        missingCount = SOCKET_POOL_SIZE - socketPoolIt->second.size();
+        lock.unlock();
+        
+        for (size_t i = 0; i < missingCount; i++)
+        {
+            hostSocket = socket(AF_INET, SOCK_STREAM, 0);
+            if (hostSocket < 0)
+            {
+                LOG("Failed to create pooled socket! 0x%x\n", errno);
+                break;
+            }
+            
+            hostSockets.push_back(hostSocket);
+        }
+        
+        lock.lock();
+        
+        // The client may have disconnected in the meantime
+        socketPoolIt = m_SocketPools.find(clientSocket);
+        if (socketPoolIt != m_SocketPools.end())
+        {
+            socketPoolIt->second.insert(socketPoolIt->second.end(), hostSockets.begin(), hostSockets.end());
+            hostSockets.clear();
+        }
+        
+        for (int unusedSocket : hostSockets)
+        {
+            close(unusedSocket);
+        }
+        hostSockets.clear();
+    }
+    
+    return ec;
+}
@@ -0,0 +1,685 @@
+/*++
+
+Module Name:
+
+    SnapshotProtocol.cpp
+
+Abstract:
+
+    Class implementation of a snapshot protocol bootstrapping the mapping
+    table of a joining node.
+
+--*/
+
+//
+// ---------------------------------------------------------------------- Includes
+//
+
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+#include <netinet/tcp.h>
+
+#include "SnapshotProtocol.h"
+#include "MappingTable.h"
+#include "NetworkUtils.h"
+
+//
+// ---------------------------------------------------------------------- Definitions
+//
+
+#define SNAPSHOT_BACKLOG 16
+
+// The number of records per chunk, about 64KB
+#define SNAPSHOT_CHUNK_RECORDS 2048
+
+// How long a transfer may stall in either direction before it is abandoned
+#define SNAPSHOT_TIMEOUT_SECONDS 2
+
+//
+// ---------------------------------------------------------------------- Functions
+//
+
+static
+uint64_t
+ComputeChecksum(const void* Data,
+                size_t Size)
+{
+    const uint8_t* bytes = static_cast<const uint8_t*>(Data);
+    uint64_t checksum = 0xCBF29CE484222325ULL;
+
+    for (size_t i = 0; i < Size; i++)
+    {
+        checksum ^= bytes[i];
+        checksum *= 0x100000001B3ULL;
+    }
+
+    return checksum;
+}
+
+static
+ERROR_CODE
+SetSocketTimeouts(int Socket)
+{
+    ERROR_CODE ec = S_OK;
+    struct timeval timeout = {};
+
+    timeout.tv_sec = SNAPSHOT_TIMEOUT_SECONDS;
+
+    EXIT_IF_FAILED(setsockopt(Socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)),
+                   Cleanup);
+
+    // Also bounds connect
+    EXIT_IF_FAILED(setsockopt(Socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)),
+                   Cleanup);
+
+Cleanup:
+    return ec;
+}
+
+static
+ERROR_CODE
+SendMessage(int Socket,
+            int Id,
+            const void* Data,
+            size_t Size)
+{
+    ERROR_CODE ec = S_OK;
+    MessageHeader messageHeader;
+    struct iovec vectors[2];
+    struct msghdr message = {};
+    ssize_t bytesWritten = 0;
+    size_t totalBytes = 0;
+    size_t offset = 0;
+
+    messageHeader.Id = Id;
+    messageHeader.Size = Size;
+
+    vectors[0].iov_base = &messageHeader;
+    vectors[0].iov_len = sizeof(messageHeader);
+    vectors[1].iov_base = const_cast<void*>(Data);
+    vectors[1].iov_len = Size;
+
+    message.msg_iov = vectors;
+    message.msg_iovlen = Size != 0 ? 2 : 1;
+
+    // Header and body usually go out in one segment; only a partial write
+    // falls back to writing the rest piece by piece
+    bytesWritten = sendmsg(Socket, &message, MSG_NOSIGNAL);
+    EXIT_IF_TRUE(bytesWritten < 0,
+                 E_FAIL,
+                 Cleanup);
+
+    totalBytes = bytesWritten;
+
+    if (totalBytes < sizeof(messageHeader))
+    {
+        offset = sizeof(messageHeader) - totalBytes;
+        EXIT_IF_TRUE(NetworkUtils::WriteAllToSocket(Socket, (uint8_t*)&messageHeader + totalBytes, offset) != (int)offset,
+                     E_FAIL,
+                     Cleanup);
+        totalBytes = sizeof(messageHeader);
+    }
+
+    offset = totalBytes - sizeof(messageHeader);
+    EXIT_IF_TRUE(NetworkUtils::WriteAllToSocket(Socket, (const uint8_t*)Data + offset, Size - offset) != (int)(Size - offset),
+                 E_FAIL,
+                 Cleanup);
+
+Cleanup:
+    return ec;
+}
+
+SnapshotProtocol::SnapshotProtocol(uint16_t Port)
+/*++
+
+Routine Description:
+
+    Constructor for SnapshotProtocol.
+
+Arguments:
+
+    Port - The TCP port snapshots are served on, by this node and its peers.
+
+Return Value:
+
+    None.
+
+--*/
+    :
+    m_MappingTable(nullptr),
+    m_Port(Port),
+    m_ServerSocket(-1),
+    m_IsBootstrapped(false),
+    m_ShouldStop(false)
+{
+}
+
+SnapshotProtocol::~SnapshotProtocol()
+/*++
+
+Routine Description:
+
+    Destructor for SnapshotProtocol.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    Stop();
+
+    if (m_ServerSocket != -1)
+    {
+        close(m_ServerSocket);
+    }
+}
+
+ERROR_CODE
+SnapshotProtocol::Init(MappingTable& MappingTable)
+/*++
+
+Routine Description:
+
+    Initializes the SnapshotProtocol instance and binds the snapshot server.
+
+Arguments:
+
+    MappingTable - The mapping table to serve and bootstrap.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    struct sockaddr_in serverAddress = {};
+    int reuseAddress = 1;
+
+    m_MappingTable = &MappingTable;
+
+    m_ServerSocket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    TRACE_IF_FAILED(m_ServerSocket,
+                    Cleanup,
+                    "Failed to create snapshot server socket! 0x%x\n", errno);
+
+    // A restarted router must not wait for connections of its previous run
+    // to leave TIME_WAIT
+    TRACE_IF_FAILED(setsockopt(m_ServerSocket, SOL_SOCKET, SO_REUSEADDR, &reuseAddress, sizeof(reuseAddress)),
+                    Cleanup,
+                    "Failed to set SO_REUSEADDR! 0x%x\n", errno);
+
+    serverAddress.sin_family = AF_INET;
+    serverAddress.sin_addr.s_addr = INADDR_ANY;
+    serverAddress.sin_port = htons(m_Port);
+
+    TRACE_IF_FAILED(bind(m_ServerSocket,
+                         (const struct sockaddr*)&serverAddress,
+                         sizeof(serverAddress)),
+                    Cleanup,
+                    "Failed to bind snapshot server! 0x%x\n", errno);
+
+    TRACE_IF_FAILED(listen(m_ServerSocket, SNAPSHOT_BACKLOG),
+                    Cleanup,
+                    "Failed to listen on snapshot server! 0x%x\n", errno);
+
+Cleanup:
+    return ec;
+}
+
+ERROR_CODE
+SnapshotProtocol::Start()
+/*++
+
+Routine Description:
+
+    Starts serving snapshots and bootstrapping from members as they join.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+
+    m_ServerThread = std::thread([=] { ServeSnapshots(); });
+    m_BootstrapThread = std::thread([=] { Bootstrap(); });
+
+    return ec;
+}
+
+ERROR_CODE
+SnapshotProtocol::Stop()
+/*++
+
+Routine Description:
+
+    Stops serving snapshots and abandons bootstrapping. A transfer in flight
+ends within SNAPSHOT_TIMEOUT_SECONDS.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+
+    {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        m_ShouldStop = true;
+    }
+
+    m_Condition.notify_all();
+
+    // Wakes up the server thread blocked in accept
+    if (m_ServerSocket != -1)
+    {
+        shutdown(m_ServerSocket, SHUT_RDWR);
+    }
+
+    if (m_ServerThread.joinable())
+    {
+        m_ServerThread.join();
+    }
+
+    if (m_BootstrapThread.joinable())
+    {
+        m_BootstrapThread.join();
+    }
+
+    return ec;
+}
+
+ERROR_CODE
+SnapshotProtocol::AddPeer(const std::string& IpAddress)
+/*++
+
+Routine Description:
+
+    Offers a member to bootstrap from. Ignored once a snapshot was applied.
+
+Arguments:
+
+    IpAddress - The IP address of the member.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+
+    {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+
+        EXIT_IF_TRUE(m_IsBootstrapped,
+                     S_OK,
+                     Cleanup);
+
+        m_Peers.push_back(IpAddress);
+    }
+
+    m_Condition.notify_one();
+
+Cleanup:
+    return ec;
+}
+
+ERROR_CODE
+SnapshotProtocol::ServeSnapshots()
+/*++
+
+Routine Description:
+
+    Accepts snapshot requests and answers them one at a time until the
+protocol stops. Transfers take milliseconds, so serving them in turn keeps
+concurrent joiners from piling copies of the table up in memory.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    int clientSocket = -1;
+
+    while (true)
+    {
+        clientSocket = accept4(m_ServerSocket, NULL, NULL, SOCK_CLOEXEC);
+
+        if (clientSocket < 0)
+        {
+            {
+                std::unique_lock<std::mutex> lock(m_Mutex);
+
+                EXIT_IF_TRUE(m_ShouldStop,
+                             S_OK,
+                             Cleanup);
+            }
+
+            if (errno != EINTR && errno != ECONNABORTED)
+            {
+                LOG("Failed to accept snapshot request! 0x%x\n", errno);
+                EXIT_IF_FAILED(E_FAIL, Cleanup);
+            }
+
+            continue;
+        }
+
+        TRACE_IF_FAILED(SendSnapshot(clientSocket),
+                        Resume,
+                        "Failed to send snapshot! 0x%x\n", ec);
+Resume:
+        close(clientSocket);
+    }
+
+Cleanup:
+    return ec;
+}
+
+ERROR_CODE
+SnapshotProtocol::SendSnapshot(int Socket)
+/*++
+
+Routine Description:
+
+    Answers a snapshot request with every record of the table, tombstones
+included, taken at a single version and sent in checksummed chunks.
+
+Arguments:
+
+    Socket - The connection the request arrives on.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    std::vector<MappingRecord> records;
+    std::vector<uint8_t> chunkBuffer;
+    SnapshotHeader snapshotHeader;
+    SnapshotChunk snapshotChunk;
+    size_t recordCount = 0;
+    size_t requestSize = 0;
+
+    EXIT_IF_FAILED(SetSocketTimeouts(Socket),
+                   Cleanup);
+
+    EXIT_IF_FAILED(ReceiveMessage(Socket, SNAPSHOT_MESSAGE_TYPE_REQUEST, NULL, 0, &requestSize),
+                   Cleanup);
+
+    EXIT_IF_FAILED(m_MappingTable->GetRecords(&records, &snapshotHeader.Version),
+                   Cleanup);
+
+    snapshotHeader.RecordCount = records.size();
+    snapshotHeader.ChunkCount = (records.size() + SNAPSHOT_CHUNK_RECORDS - 1) / SNAPSHOT_CHUNK_RECORDS;
+
+    EXIT_IF_FAILED(SendMessage(Socket, SNAPSHOT_MESSAGE_TYPE_HEADER, &snapshotHeader, sizeof(snapshotHeader)),
+                   Cleanup);
+
+    for (uint32_t i = 0; i < snapshotHeader.ChunkCount; i++)
+    {
+        recordCount = std::min<size_t>(SNAPSHOT_CHUNK_RECORDS, records.size() - (size_t)i * SNAPSHOT_CHUNK_RECORDS);
+
+        snapshotChunk.Index = i;
+        snapshotChunk.RecordCount = recordCount;
+        snapshotChunk.Checksum = ComputeChecksum(&records[(size_t)i * SNAPSHOT_CHUNK_RECORDS],
+                                                 recordCount * sizeof(MappingRecord));
+
+        chunkBuffer.resize(sizeof(snapshotChunk) + recordCount * sizeof(MappingRecord));
+        std::memcpy(chunkBuffer.data(), &snapshotChunk, sizeof(snapshotChunk));
+        std::memcpy(chunkBuffer.data() + sizeof(snapshotChunk),
+                    &records[(size_t)i * SNAPSHOT_CHUNK_RECORDS],
+                    recordCount * sizeof(MappingRecord));
+
+        EXIT_IF_FAILED(SendMessage(Socket, SNAPSHOT_MESSAGE_TYPE_CHUNK, chunkBuffer.data(), chunkBuffer.size()),
+                       Cleanup);
+    }
+
+Cleanup:
+    return ec;
+}
+
+ERROR_CODE
+SnapshotProtocol::Bootstrap()
+/*++
+
+Routine Description:
+
+    Fetches a snapshot from members as they are offered, one at a time,
+until one transfer succeeds or the protocol stops.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    std::string peer;
+
+    while (!m_IsBootstrapped)
+    {
+        m_Condition.wait(lock, [=] { return m_ShouldStop || !m_Peers.empty(); });
+
+        if (m_ShouldStop)
+        {
+            break;
+        }
+
+        peer = m_Peers.front();
+        m_Peers.erase(m_Peers.begin());
+
+        lock.unlock();
+        ec = ReceiveSnapshot(peer);
+        lock.lock();
+
+        if (FAILED(ec))
+        {
+            LOG("Failed to bootstrap from %s! 0x%x\n", peer.c_str(), ec);
+            continue;
+        }
+
+        m_IsBootstrapped = true;
+        m_Peers.clear();
+    }
+
+    return ec;
+}
+
+ERROR_CODE
+SnapshotProtocol::ReceiveSnapshot(const std::string& IpAddress)
+/*++
+
+Routine Description:
+
+    Fetches a snapshot from a member and merges its records into the table.
+Chunks received before a failure stay applied; they were intact.
+
+Arguments:
+
+    IpAddress - The IP address of the member.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    const size_t maximumChunkSize = sizeof(SnapshotChunk) + SNAPSHOT_CHUNK_RECORDS * sizeof(MappingRecord);
+    auto start = std::chrono::steady_clock::now();
+    struct sockaddr_in peerAddress = {};
+    std::vector<uint8_t> chunkBuffer(maximumChunkSize);
+    SnapshotHeader snapshotHeader;
+    SnapshotChunk snapshotChunk;
+    MappingRecord record;
+    size_t messageSize = 0;
+    uint32_t appliedCount = 0;
+    int nodelay = 1;
+    int socketFd = -1;
+
+    peerAddress.sin_family = AF_INET;
+    peerAddress.sin_port = htons(m_Port);
+
+    EXIT_IF_TRUE(inet_pton(AF_INET, IpAddress.c_str(), &peerAddress.sin_addr) != 1,
+                 E_INVALIDARG,
+                 Cleanup);
+
+    socketFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    EXIT_IF_FAILED(socketFd,
+                   Cleanup);
+
+    EXIT_IF_FAILED(SetSocketTimeouts(socketFd),
+                   Cleanup);
+
+    // The request is the only thing sent; do not hold it back
+    EXIT_IF_FAILED(setsockopt(socketFd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)),
+                   Cleanup);
+
+    TRACE_IF_FAILED(connect(socketFd, (const struct sockaddr*)&peerAddress, sizeof(peerAddress)),
+                    Cleanup,
+                    "Failed to connect to snapshot server! 0x%x\n", errno);
+
+    EXIT_IF_FAILED(SendMessage(socketFd, SNAPSHOT_MESSAGE_TYPE_REQUEST, NULL, 0),
+                   Cleanup);
+
+    EXIT_IF_FAILED(ReceiveMessage(socketFd, SNAPSHOT_MESSAGE_TYPE_HEADER, &snapshotHeader, sizeof(snapshotHeader), &messageSize),
+                   Cleanup);
+    EXIT_IF_TRUE(messageSize != sizeof(snapshotHeader),
+                 E_INVALIDARG,
+                 Cleanup);
+
+    for (uint32_t i = 0; i < snapshotHeader.ChunkCount; i++)
+    {
+        EXIT_IF_FAILED(ReceiveMessage(socketFd, SNAPSHOT_MESSAGE_TYPE_CHUNK, chunkBuffer.data(), maximumChunkSize, &messageSize),
+                       Cleanup);
+        EXIT_IF_TRUE(messageSize < sizeof(snapshotChunk),
+                     E_INVALIDARG,
+                     Cleanup);
+
+        std::memcpy(&snapshotChunk, chunkBuffer.data(), sizeof(snapshotChunk));
+
+        EXIT_IF_TRUE(snapshotChunk.Index != i ||
+                     messageSize != sizeof(snapshotChunk) + (size_t)snapshotChunk.RecordCount * sizeof(MappingRecord),
+                     E_INVALIDARG,
+                     Cleanup);
+
+        if (snapshotChunk.Checksum != ComputeChecksum(chunkBuffer.data() + sizeof(snapshotChunk),
+                                                      snapshotChunk.RecordCount * sizeof(MappingRecord)))
+        {
+            LOG("Snapshot chunk %u from %s is corrupted!\n", i, IpAddress.c_str());
+            EXIT_IF_FAILED(E_FAIL, Cleanup);
+        }
+
+        for (uint32_t j = 0; j < snapshotChunk.RecordCount; j++)
+        {
+            std::memcpy(&record,
+                        chunkBuffer.data() + sizeof(snapshotChunk) + j * sizeof(MappingRecord),
+                        sizeof(record));
+
+            // Records gossip delivered in the meantime win if they are newer
+            if (m_MappingTable->Merge(record) == S_OK)
+            {
+                appliedCount++;
+            }
+        }
+    }
+
+    LOG("Bootstrapped %u of %u records from %s at version %llu in %lld us\n",
+        appliedCount,
+        snapshotHeader.RecordCount,
+        IpAddress.c_str(),
+        (unsigned long long)snapshotHeader.Version,
+        (long long)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+
+Cleanup:
+    if (socketFd != -1)
+    {
+        close(socketFd);
+    }
+
+    return ec;
+}
+
+ERROR_CODE
+SnapshotProtocol::ReceiveMessage(int Socket,
+                                 int Id,
+                                 void* Data,
+                                 size_t MaximumSize,
+                                 size_t* Size)
+/*++
+
+Routine Description:
+
+    Reads a framed message of the expected type.
+
+Arguments:
+
+    Socket - The connection to read from.
+
+    Id - The expected message type.
+
+    Data - Receives the body of the message.
+
+    MaximumSize - The size of Data. Larger messages are rejected.
+
+    Size - Receives the size of the body.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    MessageHeader messageHeader;
+
+    EXIT_IF_TRUE(NetworkUtils::ReadAllFromSocket(Socket, &messageHeader, sizeof(messageHeader)) != sizeof(messageHeader),
+                 E_FAIL,
+                 Cleanup);
+
+    EXIT_IF_TRUE(messageHeader.Version != MESSAGE_VERSION ||
+                 messageHeader.Id != Id ||
+                 messageHeader.Size > MaximumSize,
+                 E_INVALIDARG,
+                 Cleanup);
+
+    EXIT_IF_TRUE(NetworkUtils::ReadAllFromSocket(Socket, Data, messageHeader.Size) != (int)messageHeader.Size,
+                 E_FAIL,
+                 Cleanup);
+
+    *Size = messageHeader.Size;
+
+Cleanup:
+    return ec;
+}
@@ -0,0 +1,1119 @@
+/*++
+
+Module Name:
+
+    SwimProtocol.cpp
+
+Abstract:
+
+    Class implementation of a SWIM membership protocol.
+
+--*/
+
+//
+// ---------------------------------------------------------------------- Includes
+//
+
+#include <cstring>
+#include <algorithm>
+
+#include "SwimProtocol.h"
+#include "UdpClient.h"
+#include "UdpServer.h"
+#include "NetworkUtils.h"
+
+//
+// ---------------------------------------------------------------------- Definitions
+//
+
+#define UDP_PORT 8080
+
+#define SWIM_PROTOCOL_PERIOD std::chrono::milliseconds(500)
+#define SWIM_ACK_TIMEOUT std::chrono::milliseconds(150)
+
+// Members asked to ping a target that did not answer directly
+#define SWIM_INDIRECT_PROBES 3
+
+// A suspicion lasts this many protocol periods times the logarithm of the
+// cluster size before the member is declared dead
+#define SWIM_SUSPICION_MULTIPLIER 4
+
+// An update is piggybacked this many times the logarithm of the cluster size
+#define SWIM_RETRANSMIT_MULTIPLIER 3
+
+#define SWIM_MAX_UPDATES_PER_MESSAGE 32
+
+// How long dead members are remembered, so that stale updates about them
+// cannot bring them back
+#define SWIM_DEAD_MEMBER_RETENTION std::chrono::seconds(60)
+
+//
+// ---------------------------------------------------------------------- Functions
+//
+
+static
+std::string
+FormatIpAddress(uint32_t IpAddress)
+{
+    char ipAddress[INET_ADDRSTRLEN] = {};
+
+    inet_ntop(AF_INET, &IpAddress, ipAddress, sizeof(ipAddress));
+
+    return ipAddress;
+}
+
+SwimProtocol::SwimProtocol(std::unique_ptr<UdpClient> UdpClient,
+                           std::shared_ptr<UdpServer> UdpServer,
+                           std::unique_ptr<IMembershipProtocol> SeedProtocol,
+                           std::vector<std::string> SeedNodes)
+/*++
+
+Routine Description:
+
+    Constructor for SwimProtocol.
+
+Arguments:
+
+    UdpClient - The client to send membership messages with.
+
+    UdpServer - The server membership messages arrive on, shared with the
+                multicast protocol.
+
+    SeedProtocol - A protocol reporting nodes to probe, or nullptr.
+
+    SeedNodes - The IP addresses of nodes to probe from the start.
+
+Return Value:
+
+    None.
+
+--*/
+    :
+    m_UdpClient(std::move(UdpClient)),
+    m_UdpServer(std::move(UdpServer)),
+    m_SeedProtocol(std::move(SeedProtocol)),
+    m_SeedNodes(std::move(SeedNodes)),
+    m_MembershipManager(nullptr),
+    m_ProbeIndex(0),
+    m_IpAddress(0),
+    m_Incarnation(0),
+    m_NextSequenceNumber(0),
+    m_ProbeSequenceNumber(0),
+    m_IsProbeAcked(false),
+    m_RandomEngine(std::random_device{}()),
+    m_ShouldStop(false)
+{
+}
+
+SwimProtocol::~SwimProtocol()
+/*++
+
+Routine Description:
+
+    Destructor for SwimProtocol.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    Stop();
+}
+
+ERROR_CODE
+SwimProtocol::Init(IMembershipManager& MembershipManager)
+/*++
+
+Routine Description:
+
+    Initializes the SwimProtocol instance.
+
+Arguments:
+
+    MembershipManager - The manager to report members joining and leaving to.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+
+    m_MembershipManager = &MembershipManager;
+
+    TRACE_IF_FAILED(NetworkUtils::GetIpAddress(&m_IpAddress),
+                    Cleanup,
+                    "Failed to get IP address! 0x%x\n", ec);
+
+    // Others may still remember this node from a previous run; starting
+    // from the clock outranks whatever incarnation they last saw
+    m_Incarnation = (uint32_t)std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+
+    m_NextSequenceNumber = m_RandomEngine();
+
+    TRACE_IF_FAILED(m_UdpClient->Init(),
+                    Cleanup,
+                    "Failed to initialize UDP client! 0x%x\n", ec);
+
+    if (m_SeedProtocol != nullptr)
+    {
+        TRACE_IF_FAILED(m_SeedProtocol->Init(*this),
+                        Cleanup,
+                        "Failed to initialize seed protocol! 0x%x\n", ec);
+    }
+
+Cleanup:
+    return ec;
+}
+
+ERROR_CODE
+SwimProtocol::Start()
+/*++
+
+Routine Description:
+
+    Starts probing members and answering probes, and adds the seed nodes.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+
+    {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+
+        // Announces this node to whoever it pings first
+        QueueUpdate(m_IpAddress, m_Incarnation, SWIM_MEMBER_ALIVE);
+    }
+
+    m_IncomingMessageThread = std::thread([=] { HandleIncomingMessages(); });
+    m_ProbeThread = std::thread([=] { ProbeMembers(); });
+
+    for (const std::string& seedNode : m_SeedNodes)
+    {
+        TRACE_IF_FAILED(OnJoin(seedNode),
+                        Cleanup,
+                        "Failed to add seed node %s! 0x%x\n", seedNode.c_str(), ec);
+    }
+
+    if (m_SeedProtocol != nullptr)
+    {
+        TRACE_IF_FAILED(m_SeedProtocol->Start(),
+                        Cleanup,
+                        "Failed to start seed protocol! 0x%x\n", ec);
+    }
+
+Cleanup:
+    return ec;
+}
+
+ERROR_CODE
+SwimProtocol::Stop()
+/*++
+
+Routine Description:
+
+    Announces that this node leaves to a few members and stops the protocol.
+The incoming message thread exits once the UDP server stops.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    std::vector<uint32_t> leaveTargets;
+
+    {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+
+        if (!m_ShouldStop && m_ProbeThread.joinable())
+        {
+            // Only the leave matters now
+            m_Updates.clear();
+            QueueUpdate(m_IpAddress, m_Incarnation, SWIM_MEMBER_DEAD);
+            leaveTargets = SelectRandomMembers(SWIM_INDIRECT_PROBES, m_IpAddress);
+        }
+
+        m_ShouldStop = true;
+    }
+
+    m_Condition.notify_all();
+
+    if (m_ProbeThread.joinable())
+    {
+        m_ProbeThread.join();
+    }
+
+    for (uint32_t leaveTarget : leaveTargets)
+    {
+        SendMessage(SWIM_MESSAGE_TYPE_PING, leaveTarget, 0, leaveTarget);
+    }
+
+    if (m_SeedProtocol != nullptr)
+    {
+        TRACE_IF_FAILED(m_SeedProtocol->Stop(),
+                        Cleanup,
+                        "Failed to stop seed protocol! 0x%x\n", ec);
+    }
+
+    if (m_IncomingMessageThread.joinable())
+    {
+        m_IncomingMessageThread.join();
+    }
+
+Cleanup:
+    return ec;
+}
+
+ERROR_CODE
+SwimProtocol::OnJoin(const std::string& IpAddress)
+/*++
+
+Routine Description:
+
+    Adds a node reported by the seed protocol. Its incarnation is unknown
+until it speaks for itself, so nodes already known are left as they are.
+
+Arguments:
+
+    IpAddress - The IP address of the node.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    uint32_t ipAddress = 0;
+    std::vector<MembershipChange> changes;
+
+    EXIT_IF_TRUE(inet_pton(AF_INET, IpAddress.c_str(), &ipAddress) != 1,
+                 E_INVALIDARG,
+                 Cleanup);
+
+    EXIT_IF_TRUE(ipAddress == m_IpAddress,
+                 S_OK,
+                 Cleanup);
+
+    {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+
+        if (m_Members.count(ipAddress) == 0)
+        {
+            SetMemberState(ipAddress, 0, SWIM_MEMBER_ALIVE, &changes);
+        }
+    }
+
+    ReportChanges(changes);
+
+Cleanup:
+    return ec;
+}
+
+ERROR_CODE
+SwimProtocol::OnLeave(const std::string& IpAddress)
+/*++
+
+Routine Description:
+
+    Declares a node reported gone by the seed protocol dead.
+
+Arguments:
+
+    IpAddress - The IP address of the node.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    uint32_t ipAddress = 0;
+    std::vector<MembershipChange> changes;
+
+    EXIT_IF_TRUE(inet_pton(AF_INET, IpAddress.c_str(), &ipAddress) != 1,
+                 E_INVALIDARG,
+                 Cleanup);
+
+    {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        auto memberIt = m_Members.find(ipAddress);
+
+        if (memberIt != m_Members.end() && memberIt->second.State != SWIM_MEMBER_DEAD)
+        {
+            SetMemberState(ipAddress, memberIt->second.Incarnation, SWIM_MEMBER_DEAD, &changes);
+        }
+    }
+
+    ReportChanges(changes);
+
+Cleanup:
+    return ec;
+}
+
+ERROR_CODE
+SwimProtocol::HandleIncomingMessages()
+/*++
+
+Routine Description:
+
+    Handles membership messages until the UDP server stops.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    Message message;
+
+    while (true)
+    {
+        ec = m_UdpServer->GetNextMembershipMessage(&message);
+
+        // The server stopped
+        EXIT_IF_TRUE(ec == E_ABORT,
+                     S_OK,
+                     Cleanup);
+
+        TRACE_IF_FAILED(ec,
+                        Cleanup,
+                        "Failed to get membership message from server! 0x%x\n", ec);
+
+        if (FAILED(OnReceive(message)))
+        {
+            LOG("Dropping malformed membership message!\n");
+        }
+    }
+
+Cleanup:
+    return ec;
+}
+
+ERROR_CODE
+SwimProtocol::OnReceive(const Message& Message)
+/*++
+
+Routine Description:
+
+    Applies the updates piggybacked on a membership message, then answers a
+ping, relays a ping request or completes a probe.
+
+Arguments:
+
+    Message - The membership message.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    SwimHeader header;
+    SwimUpdate update;
+    Relay relay = {};
+    bool shouldRelay = false;
+    uint32_t relaySequenceNumber = 0;
+    std::vector<MembershipChange> changes;
+
+    EXIT_IF_TRUE(Message.Body.size() < sizeof(header),
+                 E_INVALIDARG,
+                 Cleanup);
+
+    std::memcpy(&header, Message.Body.data(), sizeof(header));
+
+    EXIT_IF_TRUE(Message.Body.size() < sizeof(header) + (size_t)header.UpdateCount * sizeof(SwimUpdate),
+                 E_INVALIDARG,
+                 Cleanup);
+
+    EXIT_IF_TRUE(header.SourceIpAddress == m_IpAddress,
+                 S_OK,
+                 Cleanup);
+
+    {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+
+        ApplyUpdate({header.SourceIpAddress, header.SourceIncarnation, SWIM_MEMBER_ALIVE}, &changes);
+
+        for (size_t i = 0; i < header.UpdateCount; i++)
+        {
+            std::memcpy(&update,
+                        Message.Body.data() + sizeof(header) + i * sizeof(SwimUpdate),
+                        sizeof(update));
+            ApplyUpdate(update, &changes);
+        }
+
+        if (Message.Header.Id == SWIM_MESSAGE_TYPE_ACK)
+        {
+            auto relayIt = m_Relays.find(header.SequenceNumber);
+
+            if (header.SequenceNumber == m_ProbeSequenceNumber)
+            {
+                m_IsProbeAcked = true;
+                m_Condition.notify_all();
+            }
+            else if (relayIt != m_Relays.end())
+            {
+                relay = relayIt->second;
+                shouldRelay = true;
+                m_Relays.erase(relayIt);
+            }
+        }
+        else if (Message.Header.Id == SWIM_MESSAGE_TYPE_PING_REQUEST)
+        {
+            relaySequenceNumber = m_NextSequenceNumber++;
+            m_Relays[relaySequenceNumber] = Relay{header.SourceIpAddress,
+                                                  header.SequenceNumber,
+                                                  std::chrono::steady_clock::now() + SWIM_PROTOCOL_PERIOD};
+        }
+    }
+
+    ReportChanges(changes);
+
+    switch (Message.Header.Id)
+    {
+    case SWIM_MESSAGE_TYPE_PING:
+        EXIT_IF_FAILED(SendMessage(SWIM_MESSAGE_TYPE_ACK,
+                                   header.SourceIpAddress,
+                                   header.SequenceNumber,
+                                   m_IpAddress),
+                       Cleanup);
+        break;
+    case SWIM_MESSAGE_TYPE_PING_REQUEST:
+        EXIT_IF_FAILED(SendMessage(SWIM_MESSAGE_TYPE_PING,
+                                   header.TargetIpAddress,
+                                   relaySequenceNumber,
+                                   header.TargetIpAddress),
+                       Cleanup);
+        break;
+    case SWIM_MESSAGE_TYPE_ACK:
+        if (shouldRelay)
+        {
+            EXIT_IF_FAILED(SendMessage(SWIM_MESSAGE_TYPE_ACK,
+                                       relay.RequesterIpAddress,
+                                       relay.SequenceNumber,
+                                       header.TargetIpAddress),
+                           Cleanup);
+        }
+        break;
+    default:
+        break;
+    }
+
+Cleanup:
+    return ec;
+}
+
+ERROR_CODE
+SwimProtocol::ProbeMembers()
+/*++
+
+Routine Description:
+
+    Probes one member per protocol period and expires suspicions, until the
+protocol stops.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    std::chrono::steady_clock::time_point deadline;
+    std::vector<MembershipChange> changes;
+    uint32_t target = 0;
+    bool hasTarget = false;
+
+    while (!m_ShouldStop)
+    {
+        deadline = std::chrono::steady_clock::now() + SWIM_PROTOCOL_PERIOD;
+
+        changes.clear();
+        ExpireMembers(&changes);
+        hasTarget = SelectProbeTarget(&target);
+
+        lock.unlock();
+
+        ReportChanges(changes);
+
+        if (hasTarget)
+        {
+            ProbeMember(target, deadline);
+        }
+
+        lock.lock();
+
+        m_Condition.wait_until(lock, deadline, [=] { return m_ShouldStop; });
+    }
+
+    return ec;
+}
+
+ERROR_CODE
+SwimProtocol::ProbeMember(uint32_t Target,
+                          std::chrono::steady_clock::time_point Deadline)
+/*++
+
+Routine Description:
+
+    Pings a member, asks others to ping it if it does not answer within the
+ack timeout, and suspects it if there is still no answer by the end of the
+protocol period.
+
+Arguments:
+
+    Target - The member to probe.
+
+    Deadline - The end of the protocol period.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    std::vector<uint32_t> helpers;
+    std::vector<MembershipChange> changes;
+    uint32_t sequenceNumber = 0;
+    auto isDone = [=] { return m_IsProbeAcked || m_ShouldStop; };
+
+    sequenceNumber = m_NextSequenceNumber++;
+    m_ProbeSequenceNumber = sequenceNumber;
+    m_IsProbeAcked = false;
+
+    lock.unlock();
+
+    TRACE_IF_FAILED(SendMessage(SWIM_MESSAGE_TYPE_PING, Target, sequenceNumber, Target),
+                    Cleanup,
+                    "Failed to ping member! 0x%x\n", ec);
+
+    lock.lock();
+
+    EXIT_IF_TRUE(m_Condition.wait_for(lock, SWIM_ACK_TIMEOUT, isDone),
+                 S_OK,
+                 Cleanup);
+
+    helpers = SelectRandomMembers(SWIM_INDIRECT_PROBES, Target);
+
+    lock.unlock();
+
+    for (uint32_t helper : helpers)
+    {
+        SendMessage(SWIM_MESSAGE_TYPE_PING_REQUEST, helper, sequenceNumber, Target);
+    }
+
+    lock.lock();
+
+    EXIT_IF_TRUE(m_Condition.wait_until(lock, Deadline, isDone),
+                 S_OK,
+                 Cleanup);
+
+    {
+        auto memberIt = m_Members.find(Target);
+
+        if (memberIt != m_Members.end() && memberIt->second.State == SWIM_MEMBER_ALIVE)
+        {
+            LOG("Suspecting member %s\n", FormatIpAddress(Target).c_str());
+            SetMemberState(Target, memberIt->second.Incarnation, SWIM_MEMBER_SUSPECT, &changes);
+        }
+    }
+
+Cleanup:
+    return ec;
+}
+
+ERROR_CODE
+SwimProtocol::SendMessage(SwimMessageType Type,
+                          uint32_t Destination,
+                          uint32_t SequenceNumber,
+                          uint32_t Target)
+/*++
+
+Routine Description:
+
+    Sends a membership message with as many pending updates piggybacked as
+fit, least transmitted first.
+
+Arguments:
+
+    Type - The type of the message.
+
+    Destination - The IP address of the member to send to.
+
+    SequenceNumber - The sequence number of the probe.
+
+    Target - The target of the probe.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    Message message;
+    SwimHeader header = {};
+    std::vector<Dissemination*> pending;
+    std::vector<uint32_t> transmitted;
+    size_t updateCount = 0;
+
+    {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+
+        for (auto& update : m_Updates)
+        {
+            pending.push_back(&update.second);
+        }
+
+        updateCount = std::min<size_t>(pending.size(), SWIM_MAX_UPDATES_PER_MESSAGE);
+
+        std::partial_sort(pending.begin(),
+                          pending.begin() + updateCount,
+                          pending.end(),
+                          [](const Dissemination* Left, const Dissemination* Right)
+                          {
+                              return Left->TransmissionsLeft > Right->TransmissionsLeft;
+                          });
+
+        header.SourceIpAddress = m_IpAddress;
+        header.SourceIncarnation = m_Incarnation;
+        header.SequenceNumber = SequenceNumber;
+        header.TargetIpAddress = Target;
+        header.UpdateCount = updateCount;
+
+        message.Body.resize(sizeof(header) + updateCount * sizeof(SwimUpdate));
+        std::memcpy(message.Body.data(), &header, sizeof(header));
+
+        for (size_t i = 0; i < updateCount; i++)
+        {
+            std::memcpy(message.Body.data() + sizeof(header) + i * sizeof(SwimUpdate),
+                        &pending[i]->Update,
+                        sizeof(SwimUpdate));
+
+            if (--pending[i]->TransmissionsLeft == 0)
+            {
+                transmitted.push_back(pending[i]->Update.IpAddress);
+            }
+        }
+
+        for (uint32_t ipAddress : transmitted)
+        {
+            m_Updates.erase(ipAddress);
+        }
+    }
+
+    message.Header.Id = Type;
+    message.Header.Size = message.Body.size();
+
+    TRACE_IF_FAILED(m_UdpClient->Send(message, FormatIpAddress(Destination), UDP_PORT),
+                    Cleanup,
+                    "Failed to send membership message! 0x%x\n", ec);
+
+Cleanup:
+    return ec;
+}
+
+void
+SwimProtocol::ApplyUpdate(const SwimUpdate& Update,
+                          std::vector<MembershipChange>* Changes)
+/*++
+
+Routine Description:
+
+    Applies an update if it supersedes what is known about the member. A
+higher incarnation always wins; at the same incarnation, suspect beats
+alive and dead beats both. Suspicions of this node are refuted by raising
+its incarnation. Must be called with the lock held.
+
+Arguments:
+
+    Update - The update.
+
+    Changes - Receives the change to report, if any.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    bool isNewer = false;
+    auto memberIt = m_Members.find(Update.IpAddress);
+
+    if (Update.State > SWIM_MEMBER_DEAD)
+    {
+        return;
+    }
+
+    if (Update.IpAddress == m_IpAddress)
+    {
+        if (Update.State != SWIM_MEMBER_ALIVE && Update.Incarnation >= m_Incarnation && !m_ShouldStop)
+        {
+            m_Incarnation = Update.Incarnation + 1;
+            QueueUpdate(m_IpAddress, m_Incarnation, SWIM_MEMBER_ALIVE);
+        }
+
+        return;
+    }
+
+    if (memberIt == m_Members.end())
+    {
+        isNewer = true;
+    }
+    else
+    {
+        const Member& member = memberIt->second;
+
+        switch (Update.State)
+        {
+        case SWIM_MEMBER_ALIVE:
+            isNewer = Update.Incarnation > member.Incarnation;
+            break;
+        case SWIM_MEMBER_SUSPECT:
+            isNewer = Update.Incarnation > member.Incarnation ||
+                      (Update.Incarnation == member.Incarnation && member.State == SWIM_MEMBER_ALIVE);
+            break;
+        case SWIM_MEMBER_DEAD:
+            isNewer = Update.Incarnation >= member.Incarnation && member.State != SWIM_MEMBER_DEAD;
+            break;
+        }
+    }
+
+    if (isNewer)
+    {
+        SetMemberState(Update.IpAddress, Update.Incarnation, (SwimMemberState)Update.State, Changes);
+    }
+}
+
+void
+SwimProtocol::SetMemberState(uint32_t IpAddress,
+                             uint32_t Incarnation,
+                             SwimMemberState State,
+                             std::vector<MembershipChange>* Changes)
+/*++
+
+Routine Description:
+
+    Records the state of a member, queues it for dissemination and notes a
+change to report if the member joined or left. Must be called with the lock
+held.
+
+Arguments:
+
+    IpAddress - The IP address of the member.
+
+    Incarnation - The incarnation the state holds for.
+
+    State - The new state.
+
+    Changes - Receives the change to report, if any.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    auto memberIt = m_Members.find(IpAddress);
+    const bool wasMember = memberIt != m_Members.end() && memberIt->second.State != SWIM_MEMBER_DEAD;
+    const bool isMember = State != SWIM_MEMBER_DEAD;
+    std::uniform_int_distribution<size_t> position(0, m_ProbeOrder.size());
+
+    m_Members[IpAddress] = Member{Incarnation, State, std::chrono::steady_clock::now()};
+
+    QueueUpdate(IpAddress, Incarnation, State);
+
+    if (wasMember == isMember)
+    {
+        return;
+    }
+
+    // New members join the current round at a random position, so that
+    // every member is still probed once per round
+    if (isMember && std::find(m_ProbeOrder.begin(), m_ProbeOrder.end(), IpAddress) == m_ProbeOrder.end())
+    {
+        m_ProbeOrder.insert(m_ProbeOrder.begin() + std::max(position(m_RandomEngine), m_ProbeIndex),
+                            IpAddress);
+    }
+
+    Changes->push_back(MembershipChange{IpAddress, isMember});
+}
+
+void
+SwimProtocol::QueueUpdate(uint32_t IpAddress,
+                          uint32_t Incarnation,
+                          SwimMemberState State)
+/*++
+
+Routine Description:
+
+    Queues an update for piggybacking, replacing any older one about the
+same member. Must be called with the lock held.
+
+Arguments:
+
+    IpAddress - The IP address of the member.
+
+    Incarnation - The incarnation the state holds for.
+
+    State - The state of the member.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    m_Updates[IpAddress] = Dissemination{SwimUpdate{IpAddress, Incarnation, (uint32_t)State},
+                                         SWIM_RETRANSMIT_MULTIPLIER * GetClusterLogarithm()};
+}
+
+void
+SwimProtocol::ExpireMembers(std::vector<MembershipChange>* Changes)
+/*++
+
+Routine Description:
+
+    Declares members dead whose suspicion timed out, forgets members that
+have been dead long enough, and drops relays that were never answered. Must
+be called with the lock held.
+
+Arguments:
+
+    Changes - Receives the changes to report.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    const auto suspicionTimeout = SWIM_PROTOCOL_PERIOD * SWIM_SUSPICION_MULTIPLIER * GetClusterLogarithm();
+    std::vector<uint32_t> expiredSuspects;
+
+    for (auto memberIt = m_Members.begin(); memberIt != m_Members.end();)
+    {
+        const Member& member = memberIt->second;
+
+        if (member.State == SWIM_MEMBER_DEAD && now - member.StateChangeTime >= SWIM_DEAD_MEMBER_RETENTION)
+        {
+            memberIt = m_Members.erase(memberIt);
+            continue;
+        }
+
+        if (member.State == SWIM_MEMBER_SUSPECT && now - member.StateChangeTime >= suspicionTimeout)
+        {
+            expiredSuspects.push_back(memberIt->first);
+        }
+
+        ++memberIt;
+    }
+
+    for (uint32_t ipAddress : expiredSuspects)
+    {
+        LOG("Member %s is dead\n", FormatIpAddress(ipAddress).c_str());
+        SetMemberState(ipAddress, m_Members[ipAddress].Incarnation, SWIM_MEMBER_DEAD, Changes);
+    }
+
+    for (auto relayIt = m_Relays.begin(); relayIt != m_Relays.end();)
+    {
+        relayIt = now >= relayIt->second.Expiry ? m_Relays.erase(relayIt) : std::next(relayIt);
+    }
+}
+
+bool
+SwimProtocol::SelectProbeTarget(uint32_t* Target)
+/*++
+
+Routine Description:
+
+    Picks the next member to probe. Members are probed in a random order
+that is reshuffled after every round, which bounds the time until a failed
+member is first probed. Must be called with the lock held.
+
+Arguments:
+
+    Target - Receives the member to probe.
+
+Return Value:
+
+    true if there is a member to probe, false otherwise.
+
+--*/
+{
+    for (int pass = 0; pass < 2; pass++)
+    {
+        while (m_ProbeIndex < m_ProbeOrder.size())
+        {
+            auto memberIt = m_Members.find(m_ProbeOrder[m_ProbeIndex++]);
+
+            if (memberIt != m_Members.end() && memberIt->second.State != SWIM_MEMBER_DEAD)
+            {
+                *Target = memberIt->first;
+                return true;
+            }
+        }
+
+        m_ProbeOrder.clear();
+        m_ProbeIndex = 0;
+
+        for (const auto& member : m_Members)
+        {
+            if (member.second.State != SWIM_MEMBER_DEAD)
+            {
+                m_ProbeOrder.push_back(member.first);
+            }
+        }
+
+        std::shuffle(m_ProbeOrder.begin(), m_ProbeOrder.end(), m_RandomEngine);
+    }
+
+    return false;
+}
+
+std::vector<uint32_t>
+SwimProtocol::SelectRandomMembers(size_t Count,
+                                  uint32_t Excluded)
+/*++
+
+Routine Description:
+
+    Picks up to Count random members that are not dead. Must be called with
+the lock held.
+
+Arguments:
+
+    Count - The number of members to pick.
+
+    Excluded - A member not to pick.
+
+Return Value:
+
+    The members picked.
+
+--*/
+{
+    std::vector<uint32_t> members;
+
+    for (const auto& member : m_Members)
+    {
+        if (member.first != Excluded && member.second.State != SWIM_MEMBER_DEAD)
+        {
+            members.push_back(member.first);
+        }
+    }
+
+    std::shuffle(members.begin(), members.end(), m_RandomEngine);
+
+    if (members.size() > Count)
+    {
+        members.resize(Count);
+    }
+
+    return members;
+}
+
+uint32_t
+SwimProtocol::GetClusterLogarithm() const
+/*++
+
+Routine Description:
+
+    Gets the base 2 logarithm of the number of nodes, rounded up. Must be
+called with the lock held.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The logarithm, at least 1.
+
+--*/
+{
+    uint32_t logarithm = 1;
+
+    // Counts this node too
+    while ((1ULL << logarithm) < m_Members.size() + 1)
+    {
+        logarithm++;
+    }
+
+    return logarithm;
+}
+
+void
+SwimProtocol::ReportChanges(const std::vector<MembershipChange>& Changes)
+/*++
+
+Routine Description:
+
+    Tells the membership manager about members that joined or left. Must be
+called without the lock held.
+
+Arguments:
+
+    Changes - The changes to report.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    std::string ipAddress;
+
+    for (const MembershipChange& change : Changes)
+    {
+        ipAddress = FormatIpAddress(change.IpAddress);
+
+        if (change.IsMember)
+        {
+            LOG("Member %s joined\n", ipAddress.c_str());
+            m_MembershipManager->OnJoin(ipAddress);
+        }
+        else
+        {
+            LOG("Member %s left\n", ipAddress.c_str());
+            m_MembershipManager->OnLeave(ipAddress);
+        }
+    }
+}
@@ -17,6 +17,7 @@ Abstract:
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <cstring>
+#include <algorithm>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -26,7 +27,7 @@ Abstract:
 // ---------------------------------------------------------------------- Definitions
 //
 
-#define MAX_MESSAGE_SIZE 1000
+#define UDP_BATCH_SIZE 64
 
 //
 // ---------------------------------------------------------------------- Functions
@@ -128,27 +129,133 @@ Return Value:
 {
     ERROR_CODE ec = S_OK;
     struct sockaddr_in serverAddress;
-    char message[MAX_MESSAGE_SIZE] = {0};
+    struct iovec vectors[2];
+    struct msghdr header;
 
     serverAddress.sin_family = AF_INET;
     serverAddress.sin_port = htons(Port);
     
-    inet_pton(AF_INET,
-              IpAddress.c_str(),
-              &serverAddress.sin_addr);
-
-    memcpy(message, &Message.Header, sizeof(Message.Header));
-    memcpy(message + sizeof(Message.Header), Message.Body.data(), Message.Header.Size);
-
-    TRACE_IF_FAILED(sendto(m_ClientSocket,
-                           message,
-                           Message.Header.Size + sizeof(Message.Header),
-                           MSG_CONFIRM,
-                           (struct sockaddr*)&serverAddress,
-                           sizeof(serverAddress)),
+    EXIT_IF_TRUE(inet_pton(AF_INET,
+                           IpAddress.c_str(),
+                           &serverAddress.sin_addr) != 1,
+                 E_INVALIDARG,
+                 Cleanup);
+
+    // Gather the header and the body straight from the message
+    vectors[0].iov_base = (void*)&Message.Header;
+    vectors[0].iov_len = sizeof(Message.Header);
+    vectors[1].iov_base = (void*)Message.Body.data();
+    vectors[1].iov_len = Message.Header.Size;
+
+    std::memset(&header, 0, sizeof(header));
+    header.msg_name = &serverAddress;
+    header.msg_namelen = sizeof(serverAddress);
+    header.msg_iov = vectors;
+    header.msg_iovlen = 2;
+
+    TRACE_IF_FAILED(sendmsg(m_ClientSocket,
+                            &header,
+                            MSG_CONFIRM),
                     Cleanup,
                     "Failed to send datagram to server! 0x%x\n", errno);
-    LOG("Sent datagram!\n");
+Cleanup:
+    return ec;
+}
+
+ERROR_CODE
+UdpClient::Send(const std::vector<Message>& Messages,
+                const std::vector<std::string>& IpAddresses,
+                const uint16_t Port)
+/*++
+
+Routine Description:
+
+    Sends every message to every UDP server at the given IP addresses and port,
+submitting up to UDP_BATCH_SIZE datagrams per system call.
+
+Arguments:
+
+    Messages - The messages to send.
+
+    IpAddresses - The IP addresses to send to.
+
+    Port - The port to send to.
+
+Return Value:
+
+    S_OK on success, error otherwise. A datagram that fails to send does not
+    stop the rest from being sent.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    std::vector<struct sockaddr_in> serverAddresses(IpAddresses.size());
+    std::vector<struct iovec> vectors(Messages.size() * 2);
+    std::vector<struct mmsghdr> headers(Messages.size() * IpAddresses.size());
+    size_t datagramsSent = 0;
+    int batchSent = 0;
+
+    for (size_t i = 0; i < IpAddresses.size(); i++)
+    {
+        serverAddresses[i].sin_family = AF_INET;
+        serverAddresses[i].sin_port = htons(Port);
+
+        EXIT_IF_TRUE(inet_pton(AF_INET,
+                               IpAddresses[i].c_str(),
+                               &serverAddresses[i].sin_addr) != 1,
+                     E_INVALIDARG,
+                     Cleanup);
+    }
+
+    for (size_t i = 0; i < Messages.size(); i++)
+    {
+        vectors[2 * i].iov_base = (void*)&Messages[i].Header;
+        vectors[2 * i].iov_len = sizeof(Messages[i].Header);
+        vectors[2 * i + 1].iov_base = (void*)Messages[i].Body.data();
+        vectors[2 * i + 1].iov_len = Messages[i].Header.Size;
+
+        for (size_t j = 0; j < IpAddresses.size(); j++)
+        {
+            struct mmsghdr& header = headers[i * IpAddresses.size() + j];
+
+            std::memset(&header, 0, sizeof(header));
+            header.msg_hdr.msg_name = &serverAddresses[j];
+            header.msg_hdr.msg_namelen = sizeof(serverAddresses[j]);
+            header.msg_hdr.msg_iov = &vectors[2 * i];
+            header.msg_hdr.msg_iovlen = 2;
+        }
+    }
+
+    while (datagramsSent < headers.size())
+    {
+        batchSent = sendmmsg(m_ClientSocket,
+                             headers.data() + datagramsSent,
+                             std::min<size_t>(headers.size() - datagramsSent, UDP_BATCH_SIZE),
+                             MSG_CONFIRM);
+
+        if (batchSent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (batchSent < 0)
+        {
+            //
+            // Skip the datagram that failed, e.g. to an unreachable peer, so that
+            // the rest of the batch still reaches the other servers.
+            //
+
+            LOG("Failed to send datagram to server %s! 0x%x\n",
+                IpAddresses[datagramsSent % IpAddresses.size()].c_str(),
+                errno);
+            ec = E_FAIL;
+            datagramsSent += 1;
+            continue;
+        }
+
+        datagramsSent += batchSent;
+    }
+
 Cleanup:
     return ec;
 }
@@ -27,7 +27,13 @@ Abstract:
 // ---------------------------------------------------------------------- Definitions
 //
 
-#define MESSAGE_BUFFER_SIZE 1024
+#define MESSAGE_BUFFER_SIZE 2048
+#define UDP_BATCH_SIZE 64
+
+// Datagrams arriving while this many are still waiting for a consumer are
+// dropped, as the socket would have done, rather than queued without bound
+#define UDP_INCOMING_QUEUE_CAPACITY 16384
+#define UDP_MEMBERSHIP_QUEUE_CAPACITY 1024
 
 //
 // ---------------------------------------------------------------------- Functions
@@ -50,7 +56,11 @@ Return Value:
 
 --*/
     :
-    m_Port(Port)
+    m_ServerSocket(-1),
+    m_Port(Port),
+    m_ShouldStop(false),
+    m_IncomingMessages(UDP_INCOMING_QUEUE_CAPACITY, QUEUE_FULL_DROP),
+    m_MembershipMessages(UDP_MEMBERSHIP_QUEUE_CAPACITY, QUEUE_FULL_DROP)
 {
 }
 
@@ -108,6 +118,20 @@ Return Value:
                         sizeof(serverAddress)),
                    Cleanup);
 
+    m_ReceiveBuffers.resize(UDP_BATCH_SIZE * MESSAGE_BUFFER_SIZE);
+    m_ReceiveVectors.resize(UDP_BATCH_SIZE);
+    m_ReceiveHeaders.resize(UDP_BATCH_SIZE);
+
+    for (size_t i = 0; i < UDP_BATCH_SIZE; i++)
+    {
+        m_ReceiveVectors[i].iov_base = m_ReceiveBuffers.data() + i * MESSAGE_BUFFER_SIZE;
+        m_ReceiveVectors[i].iov_len = MESSAGE_BUFFER_SIZE;
+
+        std::memset(&m_ReceiveHeaders[i], 0, sizeof(m_ReceiveHeaders[i]));
+        m_ReceiveHeaders[i].msg_hdr.msg_iov = &m_ReceiveVectors[i];
+        m_ReceiveHeaders[i].msg_hdr.msg_iovlen = 1;
+    }
+
 Cleanup:
     return ec;
 }
@@ -158,10 +182,22 @@ Return Value:
 {
     ERROR_CODE ec = 0;
     
+    m_ShouldStop = true;
+
+    // Wakes up the listening thread, which then sees the stop request
+    if (m_ServerSocket != -1)
+    {
+        shutdown(m_ServerSocket, SHUT_RD);
+    }
+    
     if (m_ServerThread.joinable())
     {
         m_ServerThread.join();
     }
+
+    // Wakes up consumers waiting for a message that is never coming
+    m_IncomingMessages.RequestShutdown();
+    m_MembershipMessages.RequestShutdown();
     
     return ec;
 }
@@ -180,15 +216,35 @@ Arguments:
 
 Return Value:
 
-    S_OK on success, error otherwise.
+    S_OK on success,
+    E_ABORT once the server has stopped and every message was consumed.
 
 --*/
 {
-    ERROR_CODE ec = S_OK;
-    
-    *Message = m_IncomingMessages.Pop();
-    
-    return ec;
+    return m_IncomingMessages.Pop(Message);
+}
+
+ERROR_CODE
+UdpServer::GetNextMembershipMessage(Message* Message)
+/*++
+
+Routine Description:
+
+    Gets the next incoming membership message, which are queued apart from
+the others.
+
+Arguments:
+
+    Message - The message to populate.
+
+Return Value:
+
+    S_OK on success,
+    E_ABORT once the server has stopped and every message was consumed.
+
+--*/
+{
+    return m_MembershipMessages.Pop(Message);
 }
 
 
@@ -198,7 +254,8 @@ UdpServer::Listen()
 
 Routine Description:
 
-    Starts listening for incoming UDP packets.
+    Starts listening for incoming UDP packets. Drains up to UDP_BATCH_SIZE
+datagrams per system call into the receive buffer ring.
 
 Arguments:
 
@@ -211,34 +268,71 @@ Return Value:
 --*/
 {
     ERROR_CODE ec = S_OK;
-    struct sockaddr_in clientAddress;
-    char rawMessage[MESSAGE_BUFFER_SIZE] = {0};
-    socklen_t addressLength = 0;
-    ssize_t bytesRead = 0;
+    int datagramCount = 0;
+    const uint8_t* rawMessage = nullptr;
+    size_t bytesRead = 0;
     Message message;
     
-    addressLength = sizeof(clientAddress);
-    
     while (1)
     {
-        bytesRead = recvfrom(m_ServerSocket,
-                             rawMessage,
-                             MESSAGE_BUFFER_SIZE,
-                             MSG_WAITALL,
-                             (struct sockaddr*)&clientAddress,
-                             &addressLength);
-        TRACE_IF_FAILED(bytesRead, Cleanup, "Failed to receive datagram from client! 0x%x\n", errno);
+        // Block for the first datagram, then take whatever else is queued
+        datagramCount = recvmmsg(m_ServerSocket,
+                                 m_ReceiveHeaders.data(),
+                                 UDP_BATCH_SIZE,
+                                 MSG_WAITFORONE,
+                                 NULL);
+
+        if (datagramCount < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        TRACE_IF_FAILED(datagramCount, Cleanup, "Failed to receive datagrams from clients! 0x%x\n", errno);
+
+        EXIT_IF_TRUE(m_ShouldStop,
+                     S_OK,
+                     Cleanup);
         
-        std::memcpy(&message.Header, rawMessage, sizeof(message.Header));
-        message.Body.resize(message.Header.Size);
-        std::memcpy(message.Body.data(),
-                    rawMessage + sizeof(message.Header),
-                    message.Header.Size);
-        
-        m_IncomingMessages.Push(message);
+        for (int i = 0; i < datagramCount; i++)
+        {
+            rawMessage = (const uint8_t*)m_ReceiveVectors[i].iov_base;
+            bytesRead = m_ReceiveHeaders[i].msg_len;
+
+            if (bytesRead < sizeof(message.Header))
+            {
+                continue;
+            }
+
+            std::memcpy(&message.Header, rawMessage, sizeof(message.Header));
+
+            if (message.Header.Version != MESSAGE_VERSION)
+            {
+                continue;
+            }
+
+            if (message.Header.Size > bytesRead - sizeof(message.Header))
+            {
+                LOG("Dropping truncated datagram!\n");
+                continue;
+            }
+
+            message.Body.assign(rawMessage + sizeof(message.Header),
+                                message.Header.Size);
+
+            if (IS_MEMBERSHIP_MESSAGE(message.Header.Id))
+            {
+                if (m_MembershipMessages.Push(std::move(message)) == S_FALSE)
+                {
+                    LOG("Dropping datagram, the membership queue is full!\n");
+                }
+            }
+            else if (m_IncomingMessages.Push(std::move(message)) == S_FALSE)
+            {
+                LOG("Dropping datagram, the incoming queue is full!\n");
+            }
+        }
     }
 
 Cleanup:
     return ec;
 }
-
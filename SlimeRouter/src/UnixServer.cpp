@@ -8,6 +8,25 @@ Abstract:
 
     Class implementation of a unix domain socket server.
 
+    Connections are multiplexed on a single edge-triggered epoll instance
+    that is shared by a fixed pool of worker threads. Every connection is
+    registered with EPOLLONESHOT so that at most one worker reads from it
+    at a time. Once that worker has framed a complete message it takes it
+    off the connection and re-arms it before invoking OnMessage, so the
+    following requests of the same client are read and processed by other
+    workers in the meantime. Responses carry the ID of their request and may
+    therefore be sent in any order.
+
+    A connection is reference counted by the workers using it and is only
+    closed once the last of them is done, so its socket number cannot be
+    reused while a response is still pending.
+
+    File descriptors sent with a request are collected while it is framed
+    and handed to OnMessage together with it. Client sockets are left in
+    blocking mode so that handlers can write responses in one go; the
+    framing reads below use MSG_DONTWAIT instead so that a partial header or
+    body never blocks a worker.
+
 --*/
 
 //
@@ -17,6 +36,8 @@ Abstract:
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 #include <cstring>
 
@@ -27,7 +48,13 @@ Abstract:
 // ---------------------------------------------------------------------- Definitions
 //
 
+#define UNIX_SERVER_WORKER_COUNT 4
+#define UNIX_SERVER_BACKLOG 128
+#define UNIX_SERVER_MAX_EVENTS 64
+#define UNIX_SERVER_MAX_MESSAGE_SIZE 4096
+#define UNIX_SERVER_MAX_FILE_DESCRIPTORS 4
 
+#define CONNECTION_EVENTS (EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT)
 
 //
 // ---------------------------------------------------------------------- Functions
@@ -42,7 +69,7 @@ Routine Description:
 
 Arguments:
 
-    None.
+    Path - Unix domain socket path to run the server on.
 
 Return Value:
 
@@ -51,7 +78,9 @@ Return Value:
 --*/
     :
     m_Path(Path),
-    m_ServerSocket(0)
+    m_ServerSocket(-1),
+    m_EpollFd(-1),
+    m_StopEvent(-1)
 {
 }
 
@@ -73,6 +102,26 @@ Return Value:
 --*/
 {
     Stop();
+
+    for (auto& connection : m_Connections)
+    {
+        close(connection.first);
+    }
+
+    if (m_ServerSocket != -1)
+    {
+        close(m_ServerSocket);
+    }
+
+    if (m_StopEvent != -1)
+    {
+        close(m_StopEvent);
+    }
+
+    if (m_EpollFd != -1)
+    {
+        close(m_EpollFd);
+    }
 }
 
 ERROR_CODE
@@ -95,27 +144,51 @@ Return Value:
 {
     ERROR_CODE ec = S_OK;
     struct sockaddr_un addr;
-    
-    m_ServerSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct epoll_event event;
+
+    m_ServerSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     TRACE_IF_FAILED(m_ServerSocket,
                     Cleanup,
-                    "Failed to create server socket! 0x%x\n", ec);
+                    "Failed to create server socket! 0x%x\n", errno);
 
     addr.sun_family = AF_UNIX;
     std::strcpy(addr.sun_path, m_Path.c_str());
-    
+
     unlink(m_Path.c_str());
-    
+
     TRACE_IF_FAILED(bind(m_ServerSocket,
                          (const sockaddr*)&addr,
                          sizeof(addr.sun_family) + strlen(addr.sun_path)),
                     Cleanup,
-                    "Failed to bind server socket! 0x%x\n", ec);
+                    "Failed to bind server socket! 0x%x\n", errno);
 
-    TRACE_IF_FAILED(listen(m_ServerSocket, 128),
+    TRACE_IF_FAILED(listen(m_ServerSocket, UNIX_SERVER_BACKLOG),
                     Cleanup,
-                    "Failed to listen server socket! 0x%x\n", ec);
-    
+                    "Failed to listen server socket! 0x%x\n", errno);
+
+    m_EpollFd = epoll_create1(EPOLL_CLOEXEC);
+    TRACE_IF_FAILED(m_EpollFd,
+                    Cleanup,
+                    "Failed to create epoll instance! 0x%x\n", errno);
+
+    m_StopEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    TRACE_IF_FAILED(m_StopEvent,
+                    Cleanup,
+                    "Failed to create stop event! 0x%x\n", errno);
+
+    // The stop event is level-triggered so that it wakes up every worker
+    event.events = EPOLLIN;
+    event.data.fd = m_StopEvent;
+    TRACE_IF_FAILED(epoll_ctl(m_EpollFd, EPOLL_CTL_ADD, m_StopEvent, &event),
+                    Cleanup,
+                    "Failed to register stop event! 0x%x\n", errno);
+
+    event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+    event.data.fd = m_ServerSocket;
+    TRACE_IF_FAILED(epoll_ctl(m_EpollFd, EPOLL_CTL_ADD, m_ServerSocket, &event),
+                    Cleanup,
+                    "Failed to register server socket! 0x%x\n", errno);
+
 Cleanup:
     return ec;
 }
@@ -138,9 +211,12 @@ Return Value:
 
 --*/
 {
-    ERROR_CODE ec = 0;
- 
-    m_ServerThread = std::thread([=] { Listen(); });
+    ERROR_CODE ec = S_OK;
+
+    for (int i = 0; i < UNIX_SERVER_WORKER_COUNT; i++)
+    {
+        m_WorkerThreads.emplace_back([=] { ProcessEvents(); });
+    }
 
     return ec;
 }
@@ -159,28 +235,42 @@ Arguments:
 
 Return Value:
 
-    None.
+    S_OK on success, error otherwise.
 
 --*/
 {
-    ERROR_CODE ec = 0;
-    
-    if (m_ServerThread.joinable())
+    ERROR_CODE ec = S_OK;
+    uint64_t value = 1;
+
+    if (m_StopEvent != -1)
+    {
+        TRACE_IF_FAILED(write(m_StopEvent, &value, sizeof(value)),
+                        Cleanup,
+                        "Failed to signal stop event! 0x%x\n", errno);
+    }
+
+    for (std::thread& workerThread : m_WorkerThreads)
     {
-        m_ServerThread.join();
+        if (workerThread.joinable())
+        {
+            workerThread.join();
+        }
     }
-    
+
+    m_WorkerThreads.clear();
+
+Cleanup:
     return ec;
 }
 
-
 ERROR_CODE
-UnixServer::Listen()
+UnixServer::ProcessEvents()
 /*++
 
 Routine Description:
 
-    Starts listening for incoming connections.
+    Worker loop. Waits for events on the epoll instance and dispatches them
+until the stop event is signaled.
 
 Arguments:
 
@@ -192,23 +282,119 @@ Return Value:
 
 --*/
 {
-    ERROR_CODE ec = 0;
-    int clientSocket = 0;
- 
-    while (1)
+    ERROR_CODE ec = S_OK;
+    struct epoll_event events[UNIX_SERVER_MAX_EVENTS];
+    int eventCount = 0;
+
+    while (true)
     {
-        clientSocket = accept(m_ServerSocket, NULL, NULL);
+        eventCount = epoll_wait(m_EpollFd, events, UNIX_SERVER_MAX_EVENTS, -1);
+
+        if (eventCount < 0 && errno == EINTR)
+        {
+            continue;
+        }
 
-        TRACE_IF_FAILED(clientSocket,
+        TRACE_IF_FAILED(eventCount,
                         Cleanup,
-                        "Failed to accept new connection! 0x%x\n", errno);
-        
+                        "Failed to wait for events! 0x%x\n", errno);
+
+        for (int i = 0; i < eventCount; i++)
+        {
+            if (events[i].data.fd == m_StopEvent)
+            {
+                goto Cleanup;
+            }
+            else if (events[i].data.fd == m_ServerSocket)
+            {
+                AcceptConnections();
+            }
+            else
+            {
+                HandleIncomingConnection(events[i].data.fd);
+            }
+        }
+    }
+
+Cleanup:
+    return ec;
+}
+
+ERROR_CODE
+UnixServer::AcceptConnections()
+/*++
+
+Routine Description:
+
+    Accepts all pending connections and registers them with the epoll instance.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    int clientSocket = -1;
+    Connection* connection = nullptr;
+    struct epoll_event event;
+
+    while (true)
+    {
+        clientSocket = accept4(m_ServerSocket, NULL, NULL, SOCK_CLOEXEC);
+
+        if (clientSocket < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                LOG("Failed to accept new connection! 0x%x\n", errno);
+            }
+
+            break;
+        }
+
         LOG("new connection!\n");
 
-        std::thread incomingMessageThread([=]{ HandleIncomingConnection(clientSocket); });
-        incomingMessageThread.detach();
+        {
+            std::unique_lock<std::mutex> lock(m_ConnectionsLock);
+            std::unique_ptr<Connection>& newConnection = m_Connections[clientSocket];
+
+            newConnection = std::make_unique<Connection>();
+            newConnection->Socket = clientSocket;
+
+            // Held until the connection is registered, so that a failure
+            // below can still close it
+            newConnection->References = 1;
+            connection = newConnection.get();
+        }
+
+        event.events = CONNECTION_EVENTS;
+        event.data.fd = clientSocket;
+
+        if (epoll_ctl(m_EpollFd, EPOLL_CTL_ADD, clientSocket, &event) < 0)
+        {
+            LOG("Failed to register client socket! 0x%x\n", errno);
+            CloseConnection(*connection);
+        }
+
+        ReleaseConnection(connection);
     }
 
+    event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+    event.data.fd = m_ServerSocket;
+    TRACE_IF_FAILED(epoll_ctl(m_EpollFd, EPOLL_CTL_MOD, m_ServerSocket, &event),
+                    Cleanup,
+                    "Failed to re-arm server socket! 0x%x\n", errno);
+
 Cleanup:
     return ec;
 }
@@ -219,7 +405,9 @@ UnixServer::HandleIncomingConnection(int ClientSocket)
 
 Routine Description:
 
-    Handles an incoming connection.
+    Handles a readiness notification on a connection. Reads until a message is
+complete or the socket would block, re-arms the connection and then processes
+the message, if any.
 
 Arguments:
 
@@ -232,28 +420,417 @@ Return Value:
 --*/
 {
     ERROR_CODE ec = S_OK;
+    Connection* connection = nullptr;
     Message message;
-    
-    while (1)
-	{
-		EXIT_IF_TRUE(NetworkUtils::ReadAllFromSocket(ClientSocket,
-                                                     &message.Header,
-                                                     sizeof(MessageHeader)) == 0,
-                     S_OK,
+    std::vector<int> fileDescriptors;
+    bool hasMessage = false;
+    struct epoll_event event;
+
+    // EPOLLONESHOT guarantees that no other worker reads from this connection
+    // until it is re-armed
+    connection = AcquireConnection(ClientSocket);
+    EXIT_IF_NULL(connection,
+                 E_FAIL,
+                 Cleanup);
+
+    ec = ReadMessage(*connection);
+    if (FAILED(ec))
+    {
+        CloseConnection(*connection);
+        goto Release;
+    }
+
+    if (ec == S_OK)
+    {
+        // Take the message off the connection so that the next one can be
+        // framed while this one is processed
+        hasMessage = true;
+        message = std::move(connection->CurrentMessage);
+        fileDescriptors.swap(connection->FileDescriptors);
+        connection->CurrentMessage = Message();
+        connection->BytesRead = 0;
+    }
+
+    event.events = CONNECTION_EVENTS;
+    event.data.fd = ClientSocket;
+    if (epoll_ctl(m_EpollFd, EPOLL_CTL_MOD, ClientSocket, &event) < 0)
+    {
+        LOG("Failed to re-arm client socket! 0x%x\n", errno);
+        CloseConnection(*connection);
+    }
+
+    if (hasMessage)
+    {
+        // The client may be waiting for a response that will never come
+        if (FAILED(OnMessage(ClientSocket, message, fileDescriptors)))
+        {
+            CloseConnection(*connection);
+        }
+
+        for (int fileDescriptor : fileDescriptors)
+        {
+            close(fileDescriptor);
+        }
+    }
+
+Release:
+    ReleaseConnection(connection);
+    ec = S_OK;
+
+Cleanup:
+    return ec;
+}
+
+ERROR_CODE
+UnixServer::ReadMessage(Connection& Connection)
+/*++
+
+Routine Description:
+
+    Continues reading the current message of a connection without blocking.
+Never reads past the end of the message. File descriptors sent with SCM_RIGHTS
+along with the message are collected on the connection.
+
+Arguments:
+
+    Connection - The connection to read from.
+
+Return Value:
+
+    S_OK if a complete message is available,
+    S_FALSE if the socket would block before the message is complete,
+    error if the connection was closed or the message is malformed.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    const size_t headerSize = sizeof(MessageHeader);
+    size_t messageSize = headerSize;
+    union
+    {
+        struct cmsghdr Header;
+        char Buffer[CMSG_SPACE(UNIX_SERVER_MAX_FILE_DESCRIPTORS * sizeof(int))];
+    } control;
+    struct cmsghdr* controlHeader = nullptr;
+    struct msghdr header;
+    struct iovec vector;
+    const int* fileDescriptors = nullptr;
+    size_t fileDescriptorCount = 0;
+    ssize_t bytesRead = 0;
+
+    if (Connection.BytesRead >= headerSize)
+    {
+        messageSize = headerSize + Connection.CurrentMessage.Header.Size;
+    }
+
+    while (Connection.BytesRead < messageSize)
+    {
+        if (Connection.BytesRead < headerSize)
+        {
+            vector.iov_base = (uint8_t*)&Connection.CurrentMessage.Header + Connection.BytesRead;
+            vector.iov_len = headerSize - Connection.BytesRead;
+        }
+        else
+        {
+            vector.iov_base = Connection.CurrentMessage.Body.data() + (Connection.BytesRead - headerSize);
+            vector.iov_len = messageSize - Connection.BytesRead;
+        }
+
+        std::memset(&header, 0, sizeof(header));
+        header.msg_iov = &vector;
+        header.msg_iovlen = 1;
+        header.msg_control = control.Buffer;
+        header.msg_controllen = sizeof(control.Buffer);
+
+        bytesRead = recvmsg(Connection.Socket,
+                            &header,
+                            MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+
+        if (bytesRead == 0)
+        {
+            EXIT_IF_FAILED(E_FAIL, Cleanup);
+        }
+        else if (bytesRead < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            EXIT_IF_TRUE(errno == EAGAIN || errno == EWOULDBLOCK,
+                         S_FALSE,
+                         Cleanup);
+
+            TRACE_IF_FAILED(E_FAIL,
+                            Cleanup,
+                            "Failed to read from socket! 0x%x\n", errno);
+        }
+
+        for (controlHeader = CMSG_FIRSTHDR(&header);
+             controlHeader != nullptr;
+             controlHeader = CMSG_NXTHDR(&header, controlHeader))
+        {
+            if (controlHeader->cmsg_level == SOL_SOCKET && controlHeader->cmsg_type == SCM_RIGHTS)
+            {
+                fileDescriptors = (const int*)CMSG_DATA(controlHeader);
+                fileDescriptorCount = (controlHeader->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                Connection.FileDescriptors.insert(Connection.FileDescriptors.end(),
+                                                  fileDescriptors,
+                                                  fileDescriptors + fileDescriptorCount);
+            }
+        }
+
+        // Descriptors beyond UNIX_SERVER_MAX_FILE_DESCRIPTORS were discarded
+        EXIT_IF_TRUE(header.msg_flags & MSG_CTRUNC,
+                     E_INVALIDARG,
                      Cleanup);
 
-        message.Body.resize(message.Header.Size);
-        
-        EXIT_IF_TRUE(NetworkUtils::ReadAllFromSocket(ClientSocket,
-                                                     message.Body.data(),
-                                                     message.Header.Size) == 0,
-                     S_OK,
+        Connection.BytesRead += bytesRead;
+
+        if (Connection.BytesRead >= headerSize)
+        {
+            EXIT_IF_TRUE(Connection.CurrentMessage.Header.Version != MESSAGE_VERSION,
+                         E_INVALIDARG,
+                         Cleanup);
+
+            EXIT_IF_TRUE(Connection.CurrentMessage.Header.Size > UNIX_SERVER_MAX_MESSAGE_SIZE,
+                         E_INVALIDARG,
+                         Cleanup);
+
+            messageSize = headerSize + Connection.CurrentMessage.Header.Size;
+            Connection.CurrentMessage.Body.resize(Connection.CurrentMessage.Header.Size);
+        }
+    }
+
+Cleanup:
+    return ec;
+}
+
+ERROR_CODE
+UnixServer::SendResponse(int ClientSocket,
+                         const MessageHeader& RequestHeader,
+                         const void* Body,
+                         size_t Size,
+                         const int* FileDescriptors,
+                         size_t FileDescriptorCount)
+/*++
+
+Routine Description:
+
+    Sends the response to a request, together with any file descriptors, in a
+single message. Safe to call from several workers at once.
+
+Arguments:
+
+    ClientSocket - The socket used to communicate with the SlimeSocket client.
+
+    RequestHeader - The header of the request being answered.
+
+    Body - The body of the response.
+
+    Size - The size of the body.
+
+    FileDescriptors - The file descriptors to send along with the response.
+
+    FileDescriptorCount - The number of file descriptors.
+
+Return Value:
+
+    S_OK on success, error otherwise.
+
+--*/
+{
+    ERROR_CODE ec = S_OK;
+    Connection* connection = nullptr;
+    MessageHeader header;
+    struct iovec vectors[2];
+
+    {
+        // The caller holds a reference, so the connection stays registered
+        std::unique_lock<std::mutex> lock(m_ConnectionsLock);
+        auto connectionIt = m_Connections.find(ClientSocket);
+        EXIT_IF_TRUE(connectionIt == m_Connections.end(),
+                     E_FAIL,
                      Cleanup);
-        
-        OnMessage(ClientSocket, message);
-	}
-    
-    
+        connection = connectionIt->second.get();
+    }
+
+    header.Flags = MESSAGE_FLAG_RESPONSE;
+    header.Id = RequestHeader.Id;
+    header.Size = Size;
+    header.RequestId = RequestHeader.RequestId;
+
+    vectors[0].iov_base = &header;
+    vectors[0].iov_len = sizeof(header);
+    vectors[1].iov_base = const_cast<void*>(Body);
+    vectors[1].iov_len = Size;
+
+    {
+        std::unique_lock<std::mutex> lock(connection->WriteLock);
+        EXIT_IF_FAILED(NetworkUtils::WriteToUnixSocket(ClientSocket,
+                                                       vectors,
+                                                       Size != 0 ? 2 : 1,
+                                                       FileDescriptors,
+                                                       FileDescriptorCount),
+                       Cleanup);
+    }
+
 Cleanup:
     return ec;
 }
+
+UnixServer::Connection*
+UnixServer::AcquireConnection(int ClientSocket)
+/*++
+
+Routine Description:
+
+    Takes a reference on a connection that is not being closed.
+
+Arguments:
+
+    ClientSocket - The socket used to communicate with the SlimeSocket client.
+
+Return Value:
+
+    The connection, or nullptr if it is unknown or being closed.
+
+--*/
+{
+    std::unique_lock<std::mutex> lock(m_ConnectionsLock);
+    auto connectionIt = m_Connections.find(ClientSocket);
+
+    if (connectionIt == m_Connections.end() || connectionIt->second->IsClosing)
+    {
+        return nullptr;
+    }
+
+    connectionIt->second->References++;
+
+    return connectionIt->second.get();
+}
+
+void
+UnixServer::ReleaseConnection(Connection* Connection)
+/*++
+
+Routine Description:
+
+    Drops a reference on a connection. The last reference to a connection that
+is being closed closes it.
+
+Arguments:
+
+    Connection - The connection to release.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    std::unique_ptr<UnixServer::Connection> closedConnection;
+
+    {
+        std::unique_lock<std::mutex> lock(m_ConnectionsLock);
+
+        if (--Connection->References == 0 && Connection->IsClosing)
+        {
+            auto connectionIt = m_Connections.find(Connection->Socket);
+            closedConnection = std::move(connectionIt->second);
+            m_Connections.erase(connectionIt);
+        }
+    }
+
+    if (closedConnection)
+    {
+        CloseFileDescriptors(*closedConnection);
+
+        // Runs before the socket is closed so that its number cannot be reused yet
+        OnDisconnect(closedConnection->Socket);
+
+        close(closedConnection->Socket);
+    }
+}
+
+void
+UnixServer::CloseConnection(Connection& Connection)
+/*++
+
+Routine Description:
+
+    Unregisters a connection from the epoll instance. It is closed once every
+worker holding a reference to it has released it.
+
+Arguments:
+
+    Connection - The connection to close. The caller must hold a reference.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    {
+        std::unique_lock<std::mutex> lock(m_ConnectionsLock);
+
+        if (Connection.IsClosing)
+        {
+            return;
+        }
+
+        Connection.IsClosing = true;
+    }
+
+    epoll_ctl(m_EpollFd, EPOLL_CTL_DEL, Connection.Socket, NULL);
+}
+
+void
+UnixServer::CloseFileDescriptors(Connection& Connection)
+/*++
+
+Routine Description:
+
+    Closes the file descriptors received with the current message of a
+connection.
+
+Arguments:
+
+    Connection - The connection whose file descriptors to close.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    for (int fileDescriptor : Connection.FileDescriptors)
+    {
+        close(fileDescriptor);
+    }
+
+    Connection.FileDescriptors.clear();
+}
+
+void
+UnixServer::OnDisconnect(int ClientSocket)
+/*++
+
+Routine Description:
+
+    Called when a client disconnects, before its socket is closed. Lets
+derived servers release per-client state.
+
+Arguments:
+
+    ClientSocket - The socket used to communicate with the SlimeSocket client.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    UNREFERENCED_PARAMETER(ClientSocket);
+}
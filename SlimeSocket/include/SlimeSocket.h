@@ -18,6 +18,7 @@ Abstract:
 
 #include "Error.h"
 #include "Message.h"
+#include "types.h"
 
 //
 // ---------------------------------------------------------------------- Definitions
@@ -35,9 +36,37 @@ void unload_socket_library(void);
 
 void getenv_options(void);
 
-ERROR_CODE connect_to_router();
+ERROR_CODE connect_to_router(int* router_socket);
 
-ERROR_CODE _send_message(const MessageHeader& message_header, char* body, size_t body_size);
+int get_router_socket(void);
+
+ERROR_CODE map_mapping_table();
+
+bool lookup_socket(int fd, socket_info_t* socket_info);
+
+ERROR_CODE store_socket(int fd, const socket_info_t& socket_info);
+
+bool erase_socket(int fd, socket_info_t* socket_info);
+
+ERROR_CODE refill_socket_stash(void);
+
+void discard_socket_stash(void);
+
+void reset_after_fork(void);
+
+ERROR_CODE lookup_resolution(uint64_t virtual_address, uint64_t* host_address);
+
+void store_resolution(uint64_t virtual_address, uint64_t host_address, bool is_negative, uint64_t epoch, uint64_t version);
+
+void erase_resolution(uint64_t virtual_address);
+
+ERROR_CODE open_local_listener(int socket, int host_socket, int backlog);
+
+bool find_local_listener(int socket, int* local_socket);
+
+void retire_local_listener(int socket);
+
+void close_local_listener(int socket);
 
 ERROR_CODE _socket(int domain, int type, int protocol, int* overlay_socket, int* host_socket);
 
@@ -51,14 +80,23 @@ int listen(int socket, int backlog);
 
 int accept(int socket, struct sockaddr *addr, socklen_t *addrlen);
 
-ERROR_CODE _send_message(const MessageHeader& message_header, void* body, size_t body_size);
+ERROR_CODE _send_message(MessageHeader& message_header, void* body, size_t body_size, const int* fds = NULL, size_t fd_count = 0);
 
-ERROR_CODE _accept4(int socket, struct sockaddr *addr, socklen_t *addrlen, int flags, int* client_socket);
+ERROR_CODE _receive_response(const MessageHeader& request_header, void* body, size_t body_size,
+                             int* fds, size_t max_fd_count, size_t* fd_count, int flags);
+
+int _accept_local(int host_socket, int local_socket, struct sockaddr *addr, socklen_t *addrlen, int flags);
 
 int accept4(int socket, struct sockaddr *addr, socklen_t *addrlen, int flags);
 
-int _connect(int socket, const struct sockaddr_in *addr, socklen_t addrlen);
+int _wait_for_connect(int socket);
+
+ERROR_CODE _connect_local(int socket, const socket_info_t& socket_info, uint16_t host_port);
+
+int _connect(int socket, const struct sockaddr_in *addr, socklen_t addrlen, int *connect_error);
 
 int connect(int socket, const struct sockaddr *addr, socklen_t addrlen);
 
+int setsockopt(int socket, int level, int optname, const void *optval, socklen_t optlen);
+
 int close(int socket);
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <pthread.h>
+#include <stdint.h>
+#include <atomic>
 
 typedef enum SOCKET_FUNCTION_CALL
 {
@@ -41,3 +43,34 @@ typedef struct
     int host_socket;
     bool is_normal;
 } socket_info_t;
+
+// A virtual address resolved by the router. Negative entries remember
+// destinations that are not overlay services.
+typedef struct
+{
+    uint64_t virtual_address;
+    uint64_t host_address;
+    uint64_t epoch;
+    uint64_t version;
+    uint64_t expires;
+    bool is_negative;
+} resolution_entry_t;
+
+// An overlay listener that co-located clients can also reach over AF_UNIX.
+// local_socket is -1 if the local path could not be offered.
+typedef struct
+{
+    int socket;
+    int local_socket;
+
+    // Set once the name is unlinked; connections already queued remain
+    bool is_retired;
+} local_listener_t;
+
+// fd-indexed table of managed sockets. Each slot packs a socket_info_t into a
+// single word so that it can be read with one atomic load; zero is empty.
+typedef struct
+{
+    size_t size;
+    std::atomic<uint64_t>* slots;
+} socket_table_t;
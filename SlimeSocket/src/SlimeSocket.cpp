@@ -3,6 +3,7 @@
 #include <sys/un.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <poll.h>
 #include <stdarg.h>
 #include <dlfcn.h>
 #include <unistd.h>
@@ -18,20 +19,81 @@
 #include <ifaddrs.h>
 #include <errno.h>
 #include <time.h>
-#include <unordered_map>
+#include <sys/resource.h>
+#include <algorithm>
+#include <new>
+#include <vector>
 
 #include "SlimeSocket.h"
 #include "Message.h"
 #include "types.h"
 #include "NetworkUtils.h"
+#include "MappingTableLayout.h"
 
 static const char *router_path = "/slime/SlimeRouter.sock";
+static const char *mapping_table_path = "/slime/SlimeRouter.map";
 static struct socket_calls socket_library;
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 static uint32_t prefix_ip = 0;
 static uint32_t prefix_mask = 0;
-static int32_t router_socket = 0;
-static std::unordered_map<int, socket_info_t> socket_lookup;
+static const MappingTableHeader* mapping_table = NULL;
+
+// Managed sockets by application descriptor. Lookups are lock-free; updates
+// serialize on socket_table_lock, which also covers growing the table. A grown
+// table is published RCU-style: threads still reading the old one keep doing
+// so safely because retired tables are never freed.
+#define SOCKET_TABLE_MINIMUM_SIZE 1024
+#define SOCKET_TABLE_MAXIMUM_INITIAL_SIZE 65536
+static std::atomic<socket_table_t*> socket_table(NULL);
+static pthread_mutex_t socket_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Resolutions handed out by the router, for processes that cannot map the
+// mapping table. Entries are direct-mapped by virtual address and tagged with
+// the router's epoch and mapping version, so a newer version or a restarted
+// router seen in any connect response retires all of them at once. The router
+// never calls back into the process, so a change is otherwise only noticed
+// when a connect through an entry fails or the entry expires. Negative entries
+// remember destinations that are not overlay services and expire quickly, so
+// a service bound later becomes reachable soon.
+#define RESOLUTION_CACHE_SIZE 256
+#define RESOLUTION_TTL_NS (5ULL * 1000000000ULL)
+#define NEGATIVE_RESOLUTION_TTL_NS (250ULL * 1000000ULL)
+static resolution_entry_t resolution_cache[RESOLUTION_CACHE_SIZE];
+static uint64_t resolution_epoch = 0;
+static uint64_t resolution_version = 0;
+static pthread_mutex_t resolution_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Connections between containers on the same host skip the host TCP/IP stack
+// when SLIME_LOCAL_PATH is set. Every overlay listener that accepts in
+// blocking mode then also listens on an AF_UNIX socket in the router's
+// directory, named after its host port, and a client resolving to this host
+// connects there instead. Non-blocking listeners are only woken by their own
+// descriptor, so they do not offer the local path. Connected sockets are
+// AF_UNIX, so the option is off by default.
+#define LOCAL_PATH_VARIABLE "SLIME_LOCAL_PATH"
+static bool local_path_enabled = false;
+static std::vector<local_listener_t> local_listeners;
+static pthread_mutex_t local_listener_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Every thread talks to the router over a connection of its own, so requests
+// from concurrent threads neither interleave on the wire nor queue behind one
+// another. Connected on first use and closed when the thread exits.
+typedef struct router_channel {
+    int socket;
+
+    ~router_channel() {
+        if (socket >= 0) {
+            socket_library.close(socket);
+        }
+    }
+} router_channel_t;
+static thread_local router_channel_t router_channel = {-1};
+static thread_local uint32_t next_request_id = 0;
+
+// Host sockets handed over by the router ahead of time, so that most socket()
+// calls need no round trip. Refilled SOCKET_STASH_BATCH at a time.
+#define SOCKET_STASH_BATCH 16
+static std::vector<int> socket_stash;
 
 __attribute__((constructor))
 int main(void) { 
@@ -47,9 +109,15 @@ int main(void) {
 
     getenv_options();
     
-    TRACE_IF_FAILED(connect_to_router(),
-                    Cleanup,
-                    "Failed to connect to router! 0x%x", ec);
+    if (get_router_socket() < 0) {
+        LOG("Router is unavailable. Threads will retry on their first request.\n");
+    }
+    
+    if (FAILED(map_mapping_table())) {
+        LOG("Mapping table is unavailable. Resolving addresses through the router.\n");
+    }
+
+    pthread_atfork(NULL, NULL, reset_after_fork);
     
 Cleanup:
     pthread_mutex_unlock(&mutex);
@@ -74,6 +142,19 @@ static inline bool is_on_overlay(const struct sockaddr_in* addr) {
 }
 
 void getenv_options(void) {
+    const char* path = getenv("SLIME_ROUTER_PATH");
+    if (path && *path) {
+        router_path = path;
+    }
+    path = getenv("SLIME_MAPPING_TABLE_PATH");
+    if (path && *path) {
+        mapping_table_path = path;
+    }
+    NetworkUtils::SetPreferredInterface(getenv("SLIME_HOST_INTERFACE"));
+
+    const char* local_path = getenv(LOCAL_PATH_VARIABLE);
+    local_path_enabled = local_path != NULL && *local_path && strcmp(local_path, "0") != 0;
+
     const char* prefix = getenv("VNET_PREFIX");
     if (prefix) {
         uint8_t a, b, c, d, bits;
@@ -113,13 +194,13 @@ void unload_socket_library(void) {
     // TODO: unload socket library
 }
 
-ERROR_CODE connect_to_router() {
+ERROR_CODE connect_to_router(int* router_socket) {
     ERROR_CODE ec = S_OK;
     int address_length = 0;
     struct sockaddr_un server_address;
     
-    router_socket = socket_library.socket(AF_UNIX, SOCK_STREAM, 0);
-    TRACE_IF_FAILED(router_socket,
+    *router_socket = socket_library.socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    TRACE_IF_FAILED(*router_socket,
                     Cleanup,
                     "Failed to create unix socket! 0x%x\n", errno);
                     
@@ -128,24 +209,489 @@ ERROR_CODE connect_to_router() {
     strcpy(server_address.sun_path, router_path);
     address_length = sizeof(server_address.sun_family) + strlen(server_address.sun_path);
     
-    TRACE_IF_FAILED(socket_library.connect(router_socket,
+    TRACE_IF_FAILED(socket_library.connect(*router_socket,
                                            (struct sockaddr*)&server_address,
                                            address_length),
                     Cleanup,
                     "Failed to connect to router! 0x%x\n", errno);
                     
 Cleanup:
+    if (FAILED(ec) && *router_socket >= 0) {
+        socket_library.close(*router_socket);
+        *router_socket = -1;
+    }
     return ec;
 }
 
+int get_router_socket(void) {
+    if (router_channel.socket < 0) {
+        connect_to_router(&router_channel.socket);
+    }
+    return router_channel.socket;
+}
+
+ERROR_CODE map_mapping_table() {
+    ERROR_CODE ec = S_OK;
+    int fd = -1;
+    struct stat file_stat;
+    void* region = MAP_FAILED;
+    const MappingTableHeader* header = NULL;
+
+    fd = open(mapping_table_path, O_RDONLY | O_CLOEXEC);
+    EXIT_IF_TRUE(fd < 0, E_FAIL, Cleanup);
+
+    TRACE_IF_FAILED(fstat(fd, &file_stat),
+                    Cleanup,
+                    "Failed to stat mapping table! 0x%x\n", errno);
+    EXIT_IF_TRUE((size_t)file_stat.st_size < MAPPING_TABLE_SLOTS_OFFSET, E_FAIL, Cleanup);
+
+    region = mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    EXIT_IF_TRUE(region == MAP_FAILED, E_FAIL, Cleanup);
+
+    header = (const MappingTableHeader*)region;
+    if (header->Magic != MAPPING_TABLE_MAGIC ||
+        header->Version != MAPPING_TABLE_VERSION ||
+        header->Capacity == 0 ||
+        MAPPING_TABLE_SLOTS_OFFSET + (size_t)header->Capacity * sizeof(MappingTableSlot) > (size_t)file_stat.st_size) {
+        LOG("Mapping table has an unexpected layout!\n");
+        munmap(region, file_stat.st_size);
+        EXIT_IF_FAILED(E_FAIL, Cleanup);
+    }
+
+    mapping_table = header;
+
+Cleanup:
+    if (fd >= 0) {
+        socket_library.close(fd);
+    }
+    return ec;
+}
+
+// Both descriptors are stored off by one so that an empty slot reads as zero
+static inline uint64_t pack_socket_info(const socket_info_t& socket_info) {
+    return ((uint64_t)(uint32_t)(socket_info.overlay_socket + 1) << 32) |
+           (uint32_t)(socket_info.host_socket + 1);
+}
+
+static inline void unpack_socket_info(uint64_t slot, socket_info_t* socket_info) {
+    socket_info->overlay_socket = (int)(uint32_t)(slot >> 32) - 1;
+    socket_info->host_socket = (int)(uint32_t)slot - 1;
+    socket_info->is_normal = socket_info->host_socket < 0;
+}
+
+static socket_table_t* create_socket_table(size_t size, const socket_table_t* old_table) {
+    socket_table_t* table = new (std::nothrow) socket_table_t;
+    if (table == NULL) {
+        return NULL;
+    }
+
+    table->size = size;
+    table->slots = new (std::nothrow) std::atomic<uint64_t>[size]();
+    if (table->slots == NULL) {
+        delete table;
+        return NULL;
+    }
+
+    for (size_t i = 0; old_table != NULL && i < old_table->size; i++) {
+        table->slots[i].store(old_table->slots[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+    return table;
+}
+
+static size_t get_initial_socket_table_size(void) {
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY) {
+        return SOCKET_TABLE_MAXIMUM_INITIAL_SIZE;
+    }
+    if (limit.rlim_cur < SOCKET_TABLE_MINIMUM_SIZE) {
+        return SOCKET_TABLE_MINIMUM_SIZE;
+    }
+    if (limit.rlim_cur > SOCKET_TABLE_MAXIMUM_INITIAL_SIZE) {
+        return SOCKET_TABLE_MAXIMUM_INITIAL_SIZE;
+    }
+    return limit.rlim_cur;
+}
+
+bool lookup_socket(int fd, socket_info_t* socket_info) {
+    const socket_table_t* table = socket_table.load(std::memory_order_acquire);
+    uint64_t slot = 0;
+
+    if (fd < 0 || table == NULL || (size_t)fd >= table->size) {
+        return false;
+    }
+
+    slot = table->slots[fd].load(std::memory_order_acquire);
+    if (slot == 0) {
+        return false;
+    }
+
+    unpack_socket_info(slot, socket_info);
+    return true;
+}
+
+ERROR_CODE store_socket(int fd, const socket_info_t& socket_info) {
+    ERROR_CODE ec = S_OK;
+    socket_table_t* table = NULL;
+    socket_table_t* grown_table = NULL;
+
+    EXIT_IF_TRUE(fd < 0, E_INVALIDARG, Cleanup);
+
+    pthread_mutex_lock(&socket_table_lock);
+
+    table = socket_table.load(std::memory_order_relaxed);
+    if (table == NULL || (size_t)fd >= table->size) {
+        grown_table = create_socket_table(table == NULL ? std::max(get_initial_socket_table_size(), (size_t)fd + 1)
+                                                        : std::max(table->size * 2, (size_t)fd + 1),
+                                          table);
+        if (grown_table == NULL) {
+            pthread_mutex_unlock(&socket_table_lock);
+            EXIT_IF_FAILED(E_OUTOFMEMORY, Cleanup);
+        }
+
+        // The old table is retired, not freed, as lookups may still be on it
+        socket_table.store(grown_table, std::memory_order_release);
+        table = grown_table;
+    }
+
+    table->slots[fd].store(pack_socket_info(socket_info), std::memory_order_release);
+
+    pthread_mutex_unlock(&socket_table_lock);
+
+Cleanup:
+    return ec;
+}
+
+bool erase_socket(int fd, socket_info_t* socket_info) {
+    socket_table_t* table = NULL;
+    uint64_t slot = 0;
+
+    if (fd < 0) {
+        return false;
+    }
+
+    pthread_mutex_lock(&socket_table_lock);
+    table = socket_table.load(std::memory_order_relaxed);
+    if (table != NULL && (size_t)fd < table->size) {
+        slot = table->slots[fd].exchange(0, std::memory_order_acq_rel);
+    }
+    pthread_mutex_unlock(&socket_table_lock);
+
+    if (slot == 0) {
+        return false;
+    }
+
+    unpack_socket_info(slot, socket_info);
+    return true;
+}
+
+ERROR_CODE refill_socket_stash(void) {
+    ERROR_CODE ec = S_OK;
+    SocketPoolRequest pool_request;
+    SocketPoolResponse pool_response;
+    MessageHeader message_header;
+    int host_sockets[SOCKET_STASH_BATCH];
+    size_t host_socket_count = 0;
+
+    message_header.Id = REQUEST_TYPE_SOCKET_POOL;
+    message_header.Size = sizeof(pool_request);
+    pool_request.Count = SOCKET_STASH_BATCH;
+
+    TRACE_IF_FAILED(_send_message(message_header, &pool_request, sizeof(pool_request)),
+                    Cleanup,
+                    "Failed to send socket pool request! 0x%x\n", errno);
+
+    // Stashed sockets must not leak into exec'd programs; cleared on hand out
+    TRACE_IF_FAILED(_receive_response(message_header,
+                                      &pool_response,
+                                      sizeof(pool_response),
+                                      host_sockets,
+                                      SOCKET_STASH_BATCH,
+                                      &host_socket_count,
+                                      MSG_CMSG_CLOEXEC),
+                    Cleanup,
+                    "Failed to read socket pool response! 0x%x\n", ec);
+
+    socket_stash.insert(socket_stash.end(), host_sockets, host_sockets + host_socket_count);
+
+    TRACE_IF_FAILED(pool_response.Status, Cleanup, "Router failed to create sockets! 0x%x\n", ec);
+    EXIT_IF_TRUE(socket_stash.empty(), E_FAIL, Cleanup);
+
+Cleanup:
+    return ec;
+}
+
+void discard_socket_stash(void) {
+    for (int host_socket : socket_stash) {
+        socket_library.close(host_socket);
+    }
+    socket_stash.clear();
+}
+
+void reset_after_fork(void) {
+    // A forked child must not hand out the same host sockets as its parent
+    discard_socket_stash();
+
+    // nor read responses meant for it off a shared connection
+    if (router_channel.socket >= 0) {
+        socket_library.close(router_channel.socket);
+        router_channel.socket = -1;
+    }
+}
+
+static inline uint64_t get_monotonic_time(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static inline resolution_entry_t* get_resolution_entry(uint64_t virtual_address) {
+    return &resolution_cache[MappingTableHash(virtual_address) & (RESOLUTION_CACHE_SIZE - 1)];
+}
+
+// Mirrors MappingTableLookup: S_OK with the host address if the destination
+// is a known overlay service, S_FALSE if it is known not to be one, and
+// E_FAIL if only the router can tell.
+ERROR_CODE lookup_resolution(uint64_t virtual_address, uint64_t* host_address) {
+    ERROR_CODE ec = E_FAIL;
+    resolution_entry_t* entry = get_resolution_entry(virtual_address);
+    uint64_t now = get_monotonic_time();
+
+    pthread_mutex_lock(&resolution_cache_lock);
+    if (entry->virtual_address == virtual_address &&
+        entry->epoch == resolution_epoch &&
+        entry->version == resolution_version &&
+        entry->expires > now) {
+        *host_address = entry->host_address;
+        ec = entry->is_negative ? S_FALSE : S_OK;
+    }
+    pthread_mutex_unlock(&resolution_cache_lock);
+
+    return ec;
+}
+
+void store_resolution(uint64_t virtual_address, uint64_t host_address, bool is_negative, uint64_t epoch, uint64_t version) {
+    resolution_entry_t* entry = get_resolution_entry(virtual_address);
+    uint64_t now = get_monotonic_time();
+
+    pthread_mutex_lock(&resolution_cache_lock);
+
+    // A restarted router starts its versions over, so a new epoch retires
+    // every entry whatever its version. Within an epoch versions only move
+    // forward. A response older than what another thread has already seen
+    // may describe a mapping that is gone.
+    if (epoch != resolution_epoch) {
+        resolution_epoch = epoch;
+        resolution_version = version;
+    } else if (version > resolution_version) {
+        resolution_version = version;
+    }
+    if (version == resolution_version) {
+        entry->virtual_address = virtual_address;
+        entry->host_address = host_address;
+        entry->epoch = epoch;
+        entry->version = version;
+        entry->expires = now + (is_negative ? NEGATIVE_RESOLUTION_TTL_NS : RESOLUTION_TTL_NS);
+        entry->is_negative = is_negative;
+    }
+
+    pthread_mutex_unlock(&resolution_cache_lock);
+}
+
+void erase_resolution(uint64_t virtual_address) {
+    resolution_entry_t* entry = get_resolution_entry(virtual_address);
+
+    pthread_mutex_lock(&resolution_cache_lock);
+    if (entry->virtual_address == virtual_address) {
+        entry->expires = 0;
+    }
+    pthread_mutex_unlock(&resolution_cache_lock);
+}
+
+static void get_local_path(uint16_t host_port, struct sockaddr_un* address) {
+    const char* separator = strrchr(router_path, '/');
+    int directory_length = separator != NULL ? (int)(separator - router_path) : 1;
+    const char* directory = separator != NULL ? router_path : ".";
+
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    snprintf(address->sun_path, sizeof(address->sun_path), "%.*s/SlimeLocal.%u.sock",
+             directory_length, directory, ntohs(host_port));
+}
+
+static bool is_local_host(uint32_t host_ip_address) {
+    uint32_t local_ip_address = 0;
+
+    return SUCCEEDED(NetworkUtils::GetIpAddress(&local_ip_address)) &&
+           local_ip_address == host_ip_address;
+}
+
+ERROR_CODE open_local_listener(int socket, int host_socket, int backlog) {
+    ERROR_CODE ec = S_OK;
+    local_listener_t listener = { socket, -1, false };
+    struct sockaddr_in host_addr;
+    socklen_t host_addr_length = sizeof(host_addr);
+    struct sockaddr_un address;
+    int probe = -1;
+
+    TRACE_IF_FAILED(socket_library.getsockname(host_socket, (struct sockaddr*)&host_addr, &host_addr_length),
+                    Cleanup,
+                    "Failed to get host socket address! 0x%x\n", errno);
+
+    get_local_path(host_addr.sin_port, &address);
+
+    // Non-blocking regardless of the application's choice so that accept can
+    // check it without getting stuck
+    listener.local_socket = socket_library.socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    EXIT_IF_TRUE(listener.local_socket < 0, E_FAIL, Cleanup);
+
+    if (socket_library.bind(listener.local_socket, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        EXIT_IF_TRUE(errno != EADDRINUSE, E_FAIL, Cleanup);
+
+        // Only take the name over from a listener that is gone. A live one
+        // shares the host port with us through SO_REUSEPORT and keeps it.
+        probe = socket_library.socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        EXIT_IF_TRUE(probe < 0, E_FAIL, Cleanup);
+        EXIT_IF_TRUE(socket_library.connect(probe, (struct sockaddr*)&address, sizeof(address)) == 0 ||
+                     errno != ECONNREFUSED,
+                     E_FAIL,
+                     Cleanup);
+
+        unlink(address.sun_path);
+        TRACE_IF_FAILED(socket_library.bind(listener.local_socket, (struct sockaddr*)&address, sizeof(address)),
+                        Cleanup,
+                        "Failed to bind local listener! 0x%x\n", errno);
+    }
+
+    TRACE_IF_FAILED(socket_library.listen(listener.local_socket, backlog),
+                    Cleanup,
+                    "Failed to listen on local listener! 0x%x\n", errno);
+
+Cleanup:
+    if (probe >= 0) {
+        socket_library.close(probe);
+    }
+    if (FAILED(ec) && listener.local_socket >= 0) {
+        socket_library.close(listener.local_socket);
+        listener.local_socket = -1;
+    }
+
+    // Remembered even on failure, e.g. when another process sharing the port
+    // holds the name, so that accept does not try again every time
+    pthread_mutex_lock(&local_listener_lock);
+    local_listeners.push_back(listener);
+    pthread_mutex_unlock(&local_listener_lock);
+
+    return ec;
+}
+
+bool find_local_listener(int socket, int* local_socket) {
+    bool found = false;
+
+    pthread_mutex_lock(&local_listener_lock);
+    for (const local_listener_t& listener : local_listeners) {
+        if (listener.socket == socket) {
+            *local_socket = listener.local_socket;
+            found = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&local_listener_lock);
+
+    return found;
+}
+
+static void unlink_local_listener(int local_socket) {
+    struct sockaddr_un address;
+    socklen_t address_length = sizeof(address);
+
+    if (socket_library.getsockname(local_socket, (struct sockaddr*)&address, &address_length) == 0 &&
+        address_length > offsetof(struct sockaddr_un, sun_path)) {
+        unlink(address.sun_path);
+    }
+}
+
+// Stops co-located clients from connecting to a listener that went
+// non-blocking. They fall back to TCP, while connections already queued are
+// still accepted.
+void retire_local_listener(int socket) {
+    pthread_mutex_lock(&local_listener_lock);
+    for (local_listener_t& listener : local_listeners) {
+        if (listener.socket == socket) {
+            if (listener.local_socket >= 0 && !listener.is_retired) {
+                unlink_local_listener(listener.local_socket);
+            }
+            listener.is_retired = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&local_listener_lock);
+}
+
+void close_local_listener(int socket) {
+    local_listener_t listener = { -1, -1, false };
+
+    pthread_mutex_lock(&local_listener_lock);
+    for (size_t i = 0; i < local_listeners.size(); i++) {
+        if (local_listeners[i].socket == socket) {
+            listener = local_listeners[i];
+            local_listeners[i] = local_listeners.back();
+            local_listeners.pop_back();
+            break;
+        }
+    }
+    pthread_mutex_unlock(&local_listener_lock);
+
+    if (listener.local_socket < 0) {
+        return;
+    }
+
+    // A retired name may already belong to another listener on the port
+    if (!listener.is_retired) {
+        unlink_local_listener(listener.local_socket);
+    }
+    socket_library.close(listener.local_socket);
+}
+
+static inline bool is_poolable(int domain, int type, int protocol) {
+    return domain == AF_INET &&
+           (type & ~(SOCK_NONBLOCK | SOCK_CLOEXEC)) == SOCK_STREAM &&
+           (protocol == 0 || protocol == IPPROTO_TCP);
+}
+
 ERROR_CODE _socket(int domain, int type, int protocol, int* overlay_socket, int* host_socket) {
     ERROR_CODE ec = S_OK;
     SocketRequest socket_request;
     SocketResponse socket_response;
     MessageHeader message_header;
+    size_t host_socket_count = 0;
     
     *overlay_socket = socket_library.socket(domain, type, protocol);
 
+    if (is_poolable(domain, type, protocol)) {
+        pthread_mutex_lock(&mutex);
+        if (socket_stash.empty()) {
+            ec = refill_socket_stash();
+        }
+        if (SUCCEEDED(ec)) {
+            *host_socket = socket_stash.back();
+            socket_stash.pop_back();
+        }
+        pthread_mutex_unlock(&mutex);
+
+        TRACE_IF_FAILED(ec, Cleanup, "Failed to take a pooled socket! 0x%x\n", ec);
+
+        // Pooled sockets are created without flags, apply the requested ones
+        if (type & SOCK_NONBLOCK) {
+            socket_library.fcntl(*host_socket, F_SETFL, socket_library.fcntl(*host_socket, F_GETFL) | O_NONBLOCK);
+        }
+        if (!(type & SOCK_CLOEXEC)) {
+            socket_library.fcntl(*host_socket, F_SETFD, 0);
+        }
+        goto Cleanup;
+    }
+
     message_header.Id = REQUEST_TYPE_SOCKET;
     message_header.Size = sizeof(socket_request);
     socket_request.Domain = domain;
@@ -156,17 +702,18 @@ ERROR_CODE _socket(int domain, int type, int protocol, int* overlay_socket, int*
                     Cleanup,
                     "Failed to send socket request! 0x%x\n", errno);
     
-    TRACE_IF_FAILED(NetworkUtils::ReadFileDescriptorFromUnixSocket(router_socket, host_socket),
+    TRACE_IF_FAILED(_receive_response(message_header,
+                                      &socket_response,
+                                      sizeof(socket_response),
+                                      host_socket,
+                                      1,
+                                      &host_socket_count,
+                                      0),
                     Cleanup,
-                    "Failed to read file descriptor from socket! 0x%x\n", ec);
-    
-    TRACE_IF_FAILED(NetworkUtils::ReadAllFromSocket(router_socket,
-                                                    &socket_response,
-                                                    sizeof(socket_response)),
-                    Cleanup,
-                    "Failed to read from socket! 0x%x\n", errno);
+                    "Failed to read from socket! 0x%x\n", ec);
     
     TRACE_IF_FAILED(socket_response.Status, Cleanup, "Router failed to create socket! 0x%x\n", ec);
+    EXIT_IF_TRUE(host_socket_count != 1, E_FAIL, Cleanup);
 
 Cleanup:
     return ec;
@@ -176,13 +723,24 @@ int socket(int domain, int type, int protocol) {
     LOG("socket called\n");
     int overlay_socket = 0;
     int host_socket = 0;
+
+    // Only IP sockets can be routed over the overlay
+    if (domain != AF_INET && domain != AF_INET6) {
+        return socket_library.socket(domain, type, protocol);
+    }
     
     if (FAILED(_socket(domain, type, protocol, &overlay_socket, &host_socket))) {
-        socket_lookup.insert({overlay_socket, {overlay_socket, -1, true}});
-        return socket_library.socket(domain, type, protocol);
+        if (overlay_socket < 0) {
+            return overlay_socket;
+        }
+        store_socket(overlay_socket, {overlay_socket, -1, true});
+        return overlay_socket;
     }
 
-    socket_lookup.insert({overlay_socket, {overlay_socket, host_socket, false}});
+    if (FAILED(store_socket(overlay_socket, {overlay_socket, host_socket, false}))) {
+        // Untracked, the socket behaves like a regular one
+        socket_library.close(host_socket);
+    }
     return overlay_socket;
 }
 
@@ -191,7 +749,9 @@ ERROR_CODE _bind(int socket, struct sockaddr_in *addr, socklen_t addrlen) {
     BindRequest bind_request;
     BindResponse bind_response;
     MessageHeader message_header;
-    const socket_info_t& socket_info = socket_lookup.at(socket);
+    socket_info_t socket_info;
+
+    EXIT_IF_TRUE(!lookup_socket(socket, &socket_info) || socket_info.is_normal, E_FAIL, Cleanup);
     
     TRACE_IF_FAILED(socket_library.bind(socket_info.overlay_socket, (struct sockaddr*)addr, addrlen),
                     Cleanup,
@@ -213,20 +773,13 @@ ERROR_CODE _bind(int socket, struct sockaddr_in *addr, socklen_t addrlen) {
     message_header.Size = sizeof(bind_request);
     bind_request.VirtualIpAddress = addr->sin_addr.s_addr;
     bind_request.VirtualPort = addr->sin_port;
-    TRACE_IF_FAILED(_send_message(message_header, &bind_request, sizeof(bind_request)),
+    TRACE_IF_FAILED(_send_message(message_header, &bind_request, sizeof(bind_request), &socket_info.host_socket, 1),
                     Cleanup,
                     "Failed to send bind reqeuest! 0x%x\n", errno);
     
-    TRACE_IF_FAILED(NetworkUtils::WriteFileDescriptorToUnixSocket(router_socket,
-                                                                  socket_info.host_socket),
-                    Cleanup,
-                    "Failed to send file descriptor! 0x%x\n", ec);
-    
-    TRACE_IF_FAILED(NetworkUtils::ReadAllFromSocket(router_socket,
-                                                    &bind_response,
-                                                    sizeof(bind_response)),
+    TRACE_IF_FAILED(_receive_response(message_header, &bind_response, sizeof(bind_response), NULL, 0, NULL, 0),
                     Cleanup,
-                    "Failed to read from socket! 0x%x\n", errno);
+                    "Failed to read from socket! 0x%x\n", ec);
     
     TRACE_IF_FAILED(bind_response.Status, Cleanup, "Router failed to bind socket! 0x%x\n", ec);
 
@@ -247,128 +800,384 @@ int bind(int socket, const struct sockaddr *addr, socklen_t addrlen) {
     return ec;
 }
 
+// Until the host socket takes it over, the application's descriptor is the
+// overlay socket, so that is where flags it set with fcntl live
+static void copy_status_flags(int socket, int host_socket) {
+    socket_library.fcntl(host_socket, F_SETFL, socket_library.fcntl(socket, F_GETFL));
+}
+
+// Moves the host socket onto the application's descriptor and the overlay
+// socket onto a duplicate. The host socket must already carry the status
+// flags of the application's descriptor; its descriptor flags are kept.
+static void take_over_descriptor(int socket, socket_info_t* socket_info) {
+    int descriptor_flags = socket_library.fcntl(socket, F_GETFD);
+
+    socket_info->overlay_socket = dup(socket_info->overlay_socket);
+    dup2(socket_info->host_socket, socket);
+    socket_library.fcntl(socket, F_SETFD, descriptor_flags);
+    socket_library.close(socket_info->host_socket);
+    socket_info->host_socket = socket;
+    store_socket(socket, *socket_info);
+}
+
 int listen(int socket, int backlog) {
     LOG("listen called\n");
-    const socket_info_t& socket_info = socket_lookup.at(socket);
+    socket_info_t socket_info;
 
-    if (socket_info.is_normal) {
+    if (!lookup_socket(socket, &socket_info) || socket_info.is_normal) {
         return socket_library.listen(socket, backlog);
     }
 
-    return socket_library.listen(socket_info.host_socket, backlog);
+    if (socket_library.listen(socket_info.host_socket, backlog) < 0) {
+        return -1;
+    }
+
+    // Applications poll and set flags on their own descriptor, which must
+    // therefore be the listening socket
+    if (socket != socket_info.host_socket) {
+        copy_status_flags(socket, socket_info.host_socket);
+        take_over_descriptor(socket, &socket_info);
+    }
+
+    return 0;
 }
 
 int accept(int socket, struct sockaddr *addr, socklen_t *addrlen) {
     return accept4(socket, addr, addrlen, 0);
 }
 
-ERROR_CODE _send_message(const MessageHeader& message_header, void* body, size_t body_size) {
+ERROR_CODE _send_message(MessageHeader& message_header, void* body, size_t body_size, const int* fds, size_t fd_count) {
     ERROR_CODE ec = S_OK;
+    struct iovec vectors[2];
 
-    TRACE_IF_FAILED(NetworkUtils::WriteAllToSocket(router_socket,
-                                                   &message_header,
-                                                   sizeof(message_header)),
-                    Cleanup,
-                    "Failed to write request header! 0x%x\n", errno);
-                                   
-    TRACE_IF_FAILED(NetworkUtils::WriteAllToSocket(router_socket,
-                                                   body,
-                                                   body_size),
+    message_header.RequestId = ++next_request_id;
+
+    // Header, body and descriptors go out in a single sendmsg
+    vectors[0].iov_base = (void*)&message_header;
+    vectors[0].iov_len = sizeof(message_header);
+    vectors[1].iov_base = body;
+    vectors[1].iov_len = body_size;
+
+    TRACE_IF_FAILED(NetworkUtils::WriteToUnixSocket(get_router_socket(),
+                                                    vectors,
+                                                    2,
+                                                    fds,
+                                                    fd_count),
                     Cleanup,
-                    "Failed to write request body! 0x%x\n", errno);
+                    "Failed to write request! 0x%x\n", errno);
 Cleanup:
     return ec;
 }
 
-ERROR_CODE
-_accept4(int socket, struct sockaddr *addr, socklen_t *addrlen, int flags, int* client_socket) {
-    UNREFERENCED_PARAMETER(addr);
-    UNREFERENCED_PARAMETER(addrlen);
-    
+ERROR_CODE _receive_response(const MessageHeader& request_header, void* body, size_t body_size,
+                             int* fds, size_t max_fd_count, size_t* fd_count, int flags) {
     ERROR_CODE ec = S_OK;
-    MessageHeader message_header;
-    AcceptRequest accept_request;
-    AcceptResponse accept_response;
-    const socket_info_t& socket_info = socket_lookup.at(socket);
-
-    message_header.Id = REQUEST_TYPE_ACCEPT;
-    message_header.Size = sizeof(accept_request);
-    accept_request.Flags = flags;
-    TRACE_IF_FAILED(_send_message(message_header, &accept_request, sizeof(accept_request)),
-                    Cleanup,
-                    "Failed to send accept request! 0x%x\n", errno);
-    
-    TRACE_IF_FAILED(NetworkUtils::WriteFileDescriptorToUnixSocket(router_socket,
-                                                                 socket_info.host_socket),
-                    Cleanup,
-                    "Failed to send file descriptor! 0x%x\n", ec);
+    MessageHeader response_header;
+    struct iovec vectors[2];
+    int unused_fd = -1;
+    size_t received_fd_count = 0;
 
-    TRACE_IF_FAILED(NetworkUtils::ReadFileDescriptorFromUnixSocket(router_socket,
-                                                                   client_socket),
-                    Cleanup,
-                    "Failed to receive file descriptor! 0x%x\n", ec);
-    
-    TRACE_IF_FAILED(NetworkUtils::ReadAllFromSocket(router_socket,
-                                                    &accept_response,
-                                                    sizeof(accept_response)),
+    // The router sends header, body and descriptors in a single sendmsg, so
+    // they are normally read back in a single recvmsg
+    vectors[0].iov_base = &response_header;
+    vectors[0].iov_len = sizeof(response_header);
+    vectors[1].iov_base = body;
+    vectors[1].iov_len = body_size;
+
+    TRACE_IF_FAILED(NetworkUtils::ReadFromUnixSocket(router_channel.socket,
+                                                     vectors,
+                                                     2,
+                                                     fds != NULL ? fds : &unused_fd,
+                                                     max_fd_count,
+                                                     &received_fd_count,
+                                                     flags),
                     Cleanup,
-                    "Failed to read from socket! 0x%x\n", errno);
-    
-    TRACE_IF_FAILED(accept_response.Status, Cleanup, "Router failed to accept socket! 0x%x\n", ec);
-    
+                    "Failed to read response! 0x%x\n", ec);
+
+    // The channel carries one request at a time, so anything but the answer
+    // to it means the stream is out of sync
+    EXIT_IF_TRUE(response_header.Version != MESSAGE_VERSION ||
+                 !(response_header.Flags & MESSAGE_FLAG_RESPONSE) ||
+                 response_header.RequestId != request_header.RequestId ||
+                 response_header.Size != body_size,
+                 E_FAIL,
+                 Cleanup);
+
 Cleanup:
+    if (FAILED(ec)) {
+        for (size_t i = 0; i < received_fd_count; i++) {
+            socket_library.close(fds[i]);
+        }
+        received_fd_count = 0;
+
+        // Start over on a fresh connection with the next request
+        if (router_channel.socket >= 0) {
+            socket_library.close(router_channel.socket);
+            router_channel.socket = -1;
+        }
+    }
+    if (fd_count != NULL) {
+        *fd_count = received_fd_count;
+    }
     return ec;
 }
 
+int _accept_local(int host_socket, int local_socket, struct sockaddr *addr, socklen_t *addrlen, int flags) {
+    struct pollfd poll_fds[2];
+    struct sockaddr_in peer_addr;
+    bool is_nonblocking = socket_library.fcntl(host_socket, F_GETFL) & O_NONBLOCK;
+    int accepted = -1;
+
+    poll_fds[0].fd = host_socket;
+    poll_fds[0].events = POLLIN;
+    poll_fds[1].fd = local_socket;
+    poll_fds[1].events = POLLIN;
+
+    for (;;) {
+        accepted = socket_library.accept4(local_socket, NULL, NULL, flags);
+        if (accepted >= 0) {
+            break;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1;
+        }
+        if (is_nonblocking) {
+            return socket_library.accept4(host_socket, addr, addrlen, flags);
+        }
+
+        // Wait for whichever listener gets a connection first. Like a
+        // blocking accept, a signal interrupts the wait with EINTR.
+        poll_fds[0].revents = 0;
+        poll_fds[1].revents = 0;
+        if (poll(poll_fds, 2, -1) < 0) {
+            return -1;
+        }
+        if (poll_fds[0].revents != 0) {
+            return socket_library.accept4(host_socket, addr, addrlen, flags);
+        }
+    }
+
+    // The peer is on this host but has no address of its own on an AF_UNIX
+    // connection, so report the host address
+    if (addr != NULL && addrlen != NULL) {
+        memset(&peer_addr, 0, sizeof(peer_addr));
+        peer_addr.sin_family = AF_INET;
+        NetworkUtils::GetIpAddress(&peer_addr.sin_addr.s_addr);
+        memcpy(addr, &peer_addr, std::min((size_t)*addrlen, sizeof(peer_addr)));
+        *addrlen = sizeof(peer_addr);
+    }
+
+    return accepted;
+}
+
 int accept4(int socket, struct sockaddr *addr, socklen_t *addrlen, int flags) {
     LOG("accept called\n");
+    socket_info_t socket_info;
+    int local_socket = -1;
 
-    int client_socket = 0;
-    
-    if (FAILED(_accept4(socket, addr, addrlen, flags, &client_socket))) {
-        // TODO: update socket_lookup
+    // listen() moved the host socket onto the application's descriptor, so
+    // connections are accepted on it directly. The router is not involved and
+    // the socket keeps the blocking mode the application chose.
+    if (!lookup_socket(socket, &socket_info) || socket_info.is_normal) {
         return socket_library.accept4(socket, addr, addrlen, flags);
     }
-    
-    // TODO: update socket_lookup    
-    return client_socket;
+
+    if (local_path_enabled) {
+        if (socket_library.fcntl(socket, F_GETFL) & O_NONBLOCK) {
+            retire_local_listener(socket);
+        } else if (!find_local_listener(socket, &local_socket) &&
+                   FAILED(open_local_listener(socket, socket_info.host_socket, SOMAXCONN))) {
+            // Remote clients keep using the host socket, so failing to offer
+            // the local path only costs co-located clients their shortcut
+            LOG("Failed to open local listener! 0x%x\n", errno);
+        }
+
+        if (find_local_listener(socket, &local_socket) && local_socket >= 0) {
+            return _accept_local(socket_info.host_socket, local_socket, addr, addrlen, flags);
+        }
+    }
+
+    // TODO: track accepted sockets
+    return socket_library.accept4(socket_info.host_socket, addr, addrlen, flags);
+}
+
+int _wait_for_connect(int socket) {
+    struct pollfd poll_fd;
+    int connect_error = 0;
+    socklen_t length = sizeof(connect_error);
+
+    // Blocking sockets expect connect() to return once the handshake is
+    // over, so wait for it here and report how it went
+    poll_fd.fd = socket;
+    poll_fd.events = POLLOUT;
+    poll_fd.revents = 0;
+
+    while (poll(&poll_fd, 1, -1) < 0) {
+        if (errno != EINTR) {
+            return errno;
+        }
+    }
+
+    if (socket_library.getsockopt(socket, SOL_SOCKET, SO_ERROR, &connect_error, &length) < 0) {
+        return errno;
+    }
+
+    return connect_error;
 }
 
-int _connect(int socket, const struct sockaddr_in *addr, socklen_t addrlen) {
+ERROR_CODE _connect_local(int socket, const socket_info_t& socket_info, uint16_t host_port) {
+    ERROR_CODE ec = S_OK;
+    struct sockaddr_un address;
+    int status_flags = socket_library.fcntl(socket, F_GETFL);
+    int descriptor_flags = socket_library.fcntl(socket, F_GETFD);
+    int local_socket = -1;
+    socket_info_t erased_info;
+
+    get_local_path(host_port, &address);
+
+    local_socket = socket_library.socket(AF_UNIX, SOCK_STREAM, 0);
+    EXIT_IF_TRUE(local_socket < 0, E_FAIL, Cleanup);
+
+    // Fails unless the listener is in a process that offers the local path
+    EXIT_IF_TRUE(socket_library.connect(local_socket, (struct sockaddr*)&address, sizeof(address)) < 0,
+                 E_FAIL,
+                 Cleanup);
+
+    // The AF_UNIX socket takes over the application's descriptor, with the
+    // flags the application gave it. Neither the overlay nor the host socket
+    // is needed anymore, so the descriptor stops being a managed socket.
+    erase_socket(socket, &erased_info);
+    dup2(local_socket, socket);
+    socket_library.fcntl(socket, F_SETFL, status_flags);
+    socket_library.fcntl(socket, F_SETFD, descriptor_flags);
+
+    if (socket_info.host_socket != socket) {
+        socket_library.close(socket_info.host_socket);
+    }
+    if (socket_info.overlay_socket != socket) {
+        socket_library.close(socket_info.overlay_socket);
+    }
+
+Cleanup:
+    if (local_socket >= 0) {
+        socket_library.close(local_socket);
+    }
+    return ec;
+}
+
+int _connect(int socket, const struct sockaddr_in *addr, socklen_t addrlen, int *connect_error) {
     UNREFERENCED_PARAMETER(addrlen);
     
     ERROR_CODE ec = S_OK;
     ConnectRequest connect_request;
     ConnectResponse connect_response;
     MessageHeader message_header;
-    socket_info_t& socket_info = socket_lookup.at(socket);
+    socket_info_t socket_info;
+    uint64_t virtual_address = 0;
+    uint64_t host_address = 0;
+    struct sockaddr_in host_addr;
+    bool in_progress = false;
+    bool is_cached = false;
+
+    *connect_error = 0;
+
+    EXIT_IF_TRUE(!lookup_socket(socket, &socket_info) || socket_info.is_normal, E_FAIL, Cleanup);
+    
+    CREATE_ADDRESS(virtual_address, addr->sin_addr.s_addr, addr->sin_port);
+
+    // Whether the handshake blocks depends on the host socket, so it gets
+    // the blocking mode the application set on its descriptor
+    if (socket != socket_info.host_socket) {
+        copy_status_flags(socket, socket_info.host_socket);
+    }
+
+    if (mapping_table != NULL) {
+        ec = MappingTableLookup(mapping_table, virtual_address, &host_address);
+    } else {
+        ec = lookup_resolution(virtual_address, &host_address);
+        is_cached = true;
+    }
+
+    // Not an overlay service, let the caller fall back to a regular connect
+    EXIT_IF_TRUE(ec == S_FALSE, E_FAIL, Cleanup);
+
+    if (ec == S_OK) {
+        // A service on this host is reached without the host TCP/IP stack
+        if (local_path_enabled &&
+            is_local_host(GET_IP_ADDRESS(host_address)) &&
+            SUCCEEDED(_connect_local(socket, socket_info, GET_PORT(host_address)))) {
+            goto Cleanup;
+        }
+
+        memset(&host_addr, 0, sizeof(host_addr));
+        host_addr.sin_family = AF_INET;
+        host_addr.sin_addr.s_addr = GET_IP_ADDRESS(host_address);
+        host_addr.sin_port = GET_PORT(host_address);
+
+        // The host socket lives in the host namespace, so it can be
+        // connected right here without involving the router. It carries
+        // the application's blocking mode, so this only returns
+        // EINPROGRESS to applications that asked for it.
+        if (socket_library.connect(socket_info.host_socket,
+                                   (struct sockaddr*)&host_addr,
+                                   sizeof(host_addr)) == 0) {
+            goto Connected;
+        }
+        if (errno == EINPROGRESS) {
+            in_progress = true;
+            goto Connected;
+        }
+        EXIT_IF_TRUE(!is_cached, E_FAIL, Cleanup);
+
+        // The service may have moved without this process seeing a newer
+        // version yet, so forget where it was and ask the router
+        erase_resolution(virtual_address);
+    }
+
+    // Nothing usable locally, ask the router instead
+    ec = S_OK;
     
     message_header.Id = REQUEST_TYPE_CONNECT;
     message_header.Size = sizeof(connect_request);
     connect_request.VirtualIpAddress = addr->sin_addr.s_addr;
     connect_request.VirtualPort = addr->sin_port;
     
-    TRACE_IF_FAILED(_send_message(message_header, &connect_request, sizeof(connect_request)),
+    TRACE_IF_FAILED(_send_message(message_header, &connect_request, sizeof(connect_request), &socket_info.host_socket, 1),
                     Cleanup,
                     "Failed to send connect request! 0x%x\n", errno);
     
-    TRACE_IF_FAILED(NetworkUtils::WriteFileDescriptorToUnixSocket(router_socket, socket_info.host_socket),
-                    Cleanup,
-                    "Failed to send file descriptor! 0x%x\n", ec);
-    
-    TRACE_IF_FAILED(NetworkUtils::ReadAllFromSocket(router_socket,
-                                                    &connect_response,
-                                                    sizeof(connect_response)),
+    TRACE_IF_FAILED(_receive_response(message_header, &connect_response, sizeof(connect_response), NULL, 0, NULL, 0),
                     Cleanup,
-                    "Failed to read from socket! 0x%x\n", errno);
+                    "Failed to read from socket! 0x%x\n", ec);
+
+    if (mapping_table == NULL) {
+        if (connect_response.Status == -ENETUNREACH) {
+            store_resolution(virtual_address, 0, true, connect_response.RouterEpoch, connect_response.MappingVersion);
+        } else {
+            CREATE_ADDRESS(host_address, connect_response.HostIpAddress, connect_response.HostPort);
+            store_resolution(virtual_address, host_address, false, connect_response.RouterEpoch, connect_response.MappingVersion);
+        }
+    }
     
-    TRACE_IF_FAILED(connect_response.Status, Cleanup, "Router failed to connect socket! 0x%x\n", ec);
+    // The router only starts the handshake; the descriptor it was started
+    // on is ours, so completion is observed here
+    if (connect_response.Status == -EINPROGRESS) {
+        in_progress = true;
+    } else {
+        TRACE_IF_FAILED(connect_response.Status, Cleanup, "Router failed to connect socket! 0x%x\n", ec);
+    }
 
+Connected:
     if (socket != socket_info.host_socket) {
-        socket_info.overlay_socket = dup(socket_info.overlay_socket);
-        dup2(socket_info.host_socket, socket);
-        socket_library.close(socket_info.host_socket);
-        socket_info.host_socket = socket;
+        take_over_descriptor(socket, &socket_info);
+    }
+
+    if (in_progress) {
+        if (socket_library.fcntl(socket, F_GETFL) & O_NONBLOCK) {
+            *connect_error = EINPROGRESS;
+        } else {
+            *connect_error = _wait_for_connect(socket);
+        }
     }
 Cleanup:
     return ec;
@@ -384,10 +1193,19 @@ int connect(int socket, const struct sockaddr *addr, socklen_t addrlen) {
     clock_gettime(CLOCK_MONOTONIC, &start);
 #endif
 
-    if (FAILED(_connect(socket, (const struct sockaddr_in*)addr, addrlen))) {
+    int connect_error = 0;
+
+    if (FAILED(_connect(socket, (const struct sockaddr_in*)addr, addrlen, &connect_error))) {
         return socket_library.connect(socket, addr, addrlen);
     }
 
+    // From here on the socket is the host socket. A failed or unfinished
+    // handshake is reported on it rather than retried as a regular connect.
+    if (connect_error != 0) {
+        errno = connect_error;
+        return -1;
+    }
+
 #ifdef MEASURE
     clock_gettime(CLOCK_MONOTONIC, &end);    
     elapsed_time = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec -	start.tv_nsec)/1.0e9;
@@ -400,15 +1218,53 @@ int connect(int socket, const struct sockaddr *addr, socklen_t addrlen) {
 /* int getpeername(int socket, struct sockaddr *addr, socklen_t *addrlen) { } */
 /* int getsockname(int socket, struct sockaddr *addr, socklen_t *addrlen) { } */
 /* int getsockopt(int socket, int level, int optname, void *optval, socklen_t *optlen) { } */
-/* int setsockopt(int socket, int level, int optname, const void *optval, socklen_t optlen) { } */
 /* int fcntl(int socket, int cmd, ... /1* arg *1/) { } */
 
+int setsockopt(int socket, int level, int optname, const void *optval, socklen_t optlen) {
+    int domain = 0;
+    socklen_t length = sizeof(domain);
+    int error = 0;
+
+    if (socket_library.setsockopt(socket, level, optname, optval, optlen) == 0) {
+        return 0;
+    }
+
+    // Sockets on the local path are AF_UNIX, where TCP options such as
+    // TCP_NODELAY do not apply. Accept them as the TCP socket would have.
+    error = errno;
+    if (local_path_enabled &&
+        level == IPPROTO_TCP &&
+        (error == EOPNOTSUPP || error == ENOPROTOOPT) &&
+        socket_library.getsockopt(socket, SOL_SOCKET, SO_DOMAIN, &domain, &length) == 0 &&
+        domain == AF_UNIX) {
+        return 0;
+    }
+
+    errno = error;
+    return -1;
+}
+
 int close(int socket) {
     LOG("close called\n");
-    socket_info_t socket_info = socket_lookup.at(socket);
-    if (socket_info.is_normal) {
+    socket_info_t socket_info;
+
+    if (local_path_enabled) {
+        close_local_listener(socket);
+    }
+
+    if (!erase_socket(socket, &socket_info)) {
         return socket_library.close(socket);
     }
 
-    return socket_library.close(socket_info.host_socket);
+    // After connect the host socket takes over the application's descriptor
+    // and the overlay socket is kept on a duplicate, so close whichever of
+    // the two is not the application's descriptor as well.
+    if (socket_info.host_socket >= 0 && socket_info.host_socket != socket) {
+        socket_library.close(socket_info.host_socket);
+    }
+    if (socket_info.overlay_socket != socket) {
+        socket_library.close(socket_info.overlay_socket);
+    }
+
+    return socket_library.close(socket);
 }